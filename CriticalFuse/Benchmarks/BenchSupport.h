@@ -0,0 +1,107 @@
+#ifndef BENCH_SUPPORT_H
+#define BENCH_SUPPORT_H
+
+#include "Tests/TestSupport.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>      // For open
+#include <unistd.h>     // For pwrite, fsync
+
+/**
+ * Shared scaffolding of the benchmarks in Benchmarks/: timing, plus the loaders and synthetic
+ * files of Tests/TestSupport.h. Correctness is covered by the tests; a benchmark only checks
+ * that what it times returned the right bytes and exits with 1 if not.
+ */
+
+inline double elapsedMs(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+ * @brief Runs fn runs times and returns its fastest run in milliseconds.
+ */
+template <typename Fn>
+double bestOfMs(int runs, Fn fn) {
+    double best = 0;
+    for (int run = 0; run < runs; ++run) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        double ms = elapsedMs(start);
+        if (run == 0 || ms < best) {
+            best = ms;
+        }
+    }
+    return best;
+}
+
+// Removes the streams of the split file at basePath, so the next write creates it anew
+inline void removeStreams(const std::string& basePath) {
+    for (const char* suffix : {".mapping", ".crit", ".noncrit", ".parity"}) {
+        std::remove((basePath + suffix).c_str());
+    }
+}
+
+// Latencies of single requests, reported as percentiles
+struct Latencies {
+    std::vector<double> micros;
+
+    void add(std::chrono::steady_clock::time_point start) {
+        micros.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    double percentile(unsigned p) {
+        std::sort(micros.begin(), micros.end());
+        return micros[std::min(micros.size() - 1, micros.size() * p / 100)];
+    }
+
+    void print(const char* label) {
+        std::cout << "  " << label << ": p50 " << percentile(50) << " us, p95 " << percentile(95) << " us, p99 "
+                  << percentile(99) << " us" << std::endl;
+    }
+};
+
+/**
+ * Keeps a disk busy while it exists: a thread rewrites a file at path in 4 MiB pieces of data,
+ * fsyncing each, and the file is removed when the load stops.
+ */
+class DiskLoad {
+public:
+    DiskLoad(const std::string& path, const std::vector<char>& data) : path(path) {
+        writer = std::thread([this, &data]() {
+            const size_t pieceSize = 4 * 1024 * 1024;
+            int busy = open(this->path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            for (size_t round = 0; busy >= 0 && !stop; ++round) {
+                size_t offset = (round * pieceSize) % data.size();
+                if (pwrite(busy, data.data() + offset, std::min(pieceSize, data.size() - offset), offset) < 0 ||
+                    fsync(busy) == -1) {
+                    break;
+                }
+            }
+            if (busy >= 0) {
+                close(busy);
+            }
+            unlink(this->path.c_str());
+        });
+    }
+    DiskLoad(const DiskLoad&) = delete;
+    DiskLoad& operator=(const DiskLoad&) = delete;
+
+    ~DiskLoad() {
+        stop = true;
+        writer.join();
+    }
+
+private:
+    std::string path;
+    std::atomic<bool> stop{false};
+    std::thread writer;
+};
+
+#endif // BENCH_SUPPORT_H
@@ -0,0 +1,110 @@
+// Times the CRC32C implementations (table-driven, SSE4.2, SSE4.2 with PCLMULQDQ) on the
+// 4 KiB blocks the .crit stream is checksummed in, then the
+// cost of verifying critical reads: a synthetic PNG whose one palette chunk holds nearly all
+// of its bytes, all critical, is read whole and in 128 KiB requests through its mapping with
+// the checksums and again without them. Tests/ChecksumTest checks the implementations agree
+// and that corrupted blocks fail their reads.
+//
+// Usage: ./ChecksumBench [MiB]
+// Defaults to a 64 MiB file. The split streams are written to /tmp.
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/PngFile.h"
+#include "Utilities/BlockChecksums.h"
+#include "Utilities/Crc32c.h"
+
+#include <algorithm>
+
+namespace {
+
+const char* const BASE_PATH = "/tmp/ChecksumBench.png";
+const char* const UNVERIFIED_BASE_PATH = "/tmp/ChecksumBench.unverified.png";
+const size_t REQUEST_SIZE = 128 * 1024;
+const size_t CACHED_SIZE = 1024 * 1024; // checksummed over and over, so memory bandwidth does not cap it
+const int RUNS = 5;
+
+// Checksums the first CACHED_SIZE bytes over and over with each implementation, in MB/s
+void compareImplementations(const std::vector<char>& data) {
+    size_t cached = std::min(CACHED_SIZE, data.size());
+    size_t rounds = data.size() / cached;
+    for (const Crc32cImpl& implementation : availableCrc32c()) {
+        uint32_t sink = 0;
+        double best = bestOfMs(RUNS, [&] {
+            for (size_t round = 0; round < rounds; ++round) {
+                for (size_t offset = 0; offset + BlockChecksums::BLOCK_SIZE <= cached;
+                     offset += BlockChecksums::BLOCK_SIZE) {
+                    sink ^= implementation.compute(0, data.data() + offset, BlockChecksums::BLOCK_SIZE);
+                }
+            }
+        });
+        std::cout << "  " << implementation.name << ": " << rounds * cached / (best * 1000.0) << " MB/s"
+                  << (sink == 1 ? " " : "") << std::endl;
+    }
+}
+
+// Best of RUNS for reading the whole file in requestSize requests, in MB/s
+double measureReads(const char* mappingPath, const std::vector<char>& data, size_t requestSize) {
+    std::vector<char> buffer(data.size());
+    bool ok = true;
+    double best = bestOfMs(RUNS, [&] {
+        for (size_t offset = 0; ok && offset < data.size(); offset += requestSize) {
+            size_t size = std::min(requestSize, data.size() - offset);
+            PngFileHandler handler;
+            ok = handler.readFile(mappingPath, buffer.data() + offset, size, offset) == ResultCode::SUCCESS;
+        }
+    });
+    if (!ok || buffer != data) {
+        return -1;
+    }
+    return data.size() / (best * 1000.0);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t mebibytes = argc > 1 ? std::atoi(argv[1]) : 64;
+    std::mt19937 rng(45);
+    std::vector<char> data = syntheticPng(0, mebibytes * 1024 * 1024, 0, rng);
+
+    std::cout << "CRC32C of 4 KiB blocks" << std::endl;
+    compareImplementations(data);
+
+    std::string mappingPath = std::string(BASE_PATH) + ".mapping";
+    std::string unverifiedMappingPath = std::string(UNVERIFIED_BASE_PATH) + ".mapping";
+    PngFileHandler writer;
+    if (writer.writeFile(mappingPath.c_str(), data.data(), data.size(), 0) != ResultCode::SUCCESS) {
+        std::cerr << "Failed to split the PNG" << std::endl;
+        return 1;
+    }
+
+    // The same streams through a mapping without the checksum line, as written before checksums
+    std::ifstream in(mappingPath, std::ios::binary);
+    std::string mapping((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t line = mapping.find("@CRC32C ");
+    if (line == std::string::npos) {
+        std::cerr << "Mapping has no checksums" << std::endl;
+        return 1;
+    }
+    mapping.erase(line, mapping.find('\n', line) + 1 - line);
+    std::ofstream(unverifiedMappingPath, std::ios::binary) << mapping;
+    for (const char* suffix : {".crit", ".noncrit"}) {
+        std::string from = std::string(BASE_PATH) + suffix;
+        std::string to = std::string(UNVERIFIED_BASE_PATH) + suffix;
+        std::ifstream source(from, std::ios::binary);
+        std::ofstream(to, std::ios::binary) << source.rdbuf();
+    }
+
+    std::cout << "critical reads (" << data.size() << " bytes)" << std::endl;
+    for (size_t requestSize : {data.size(), REQUEST_SIZE}) {
+        double verified = measureReads(mappingPath.c_str(), data, requestSize);
+        double unverified = measureReads(unverifiedMappingPath.c_str(), data, requestSize);
+        if (verified < 0 || unverified < 0) {
+            std::cerr << "read returned wrong data" << std::endl;
+            return 1;
+        }
+        std::cout << "  " << (requestSize == data.size() ? std::string("whole file") : std::to_string(requestSize / 1024) + " KiB requests")
+                  << ": " << unverified << " MB/s unverified, " << verified << " MB/s verified ("
+                  << 100.0 * (unverified - verified) / unverified << "% slower)" << std::endl;
+    }
+    return 0;
+}
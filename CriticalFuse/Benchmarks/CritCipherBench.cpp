@@ -0,0 +1,101 @@
+// Measures what encrypting only the .crit stream costs: the AES-256-GCM throughput of
+// BlockCipher, then full writes and reads of PNGs with a few KiB of critical bytes, with and
+// without a mount key, against the time it would take to encrypt every byte of those files.
+// Tests/CritCipherTest checks writes into sealed blocks and failed keys and seals.
+//
+// Usage: ./CritCipherBench [files] [MiB per file]
+// Defaults to 64 files of 4 MiB. The split streams are written to /tmp.
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/PngFile.h"
+#include "Utilities/BlockCipher.h"
+#include "Utilities/StorageContext.h"
+
+namespace {
+
+const char* const BASE_PATH = "/tmp/CritCipherBench.png";
+const char* const MAPPING_PATH = "/tmp/CritCipherBench.png.mapping";
+const size_t IDAT_SIZE = 64 * 1024;
+const size_t SEAL_SIZE = 64 * 1024 * 1024;
+
+// Seconds to write the PNG as a new file and read it back, not to patch the previous one
+double roundTrip(const std::vector<char>& data, std::vector<char>& buffer) {
+    removeStreams(BASE_PATH);
+    auto start = std::chrono::steady_clock::now();
+    PngFileHandler writer;
+    PngFileHandler reader;
+    if (writer.writeFile(MAPPING_PATH, data.data(), data.size(), 0) != ResultCode::SUCCESS ||
+        reader.readFile(MAPPING_PATH, buffer.data(), buffer.size(), 0) != ResultCode::SUCCESS || buffer != data) {
+        std::cerr << "Round trip failed" << std::endl;
+        std::exit(1);
+    }
+    return secondsSince(start);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t files = argc > 1 ? std::atoi(argv[1]) : 64;
+    size_t mebibytes = argc > 2 ? std::atoi(argv[2]) : 4;
+    if (!BlockCipher::supported()) {
+        std::cerr << "Built without libcrypto" << std::endl;
+        return 1;
+    }
+    MountKey key;
+    std::mt19937 rng(49);
+    for (unsigned char& byte : key.bytes) {
+        byte = static_cast<unsigned char>(rng());
+    }
+
+    // Raw throughput, sealing a stream in one piece and opening it block run by block run
+    getStorageContext().critKey = &key;
+    std::vector<char> plain(SEAL_SIZE);
+    for (char& byte : plain) {
+        byte = static_cast<char>(rng());
+    }
+    std::vector<char> sealed;
+    sealed.reserve(SEAL_SIZE);
+    BlockCipher cipher;
+    auto start = std::chrono::steady_clock::now();
+    if (!cipher.begin() || !cipher.seal({{plain.data(), plain.size()}}, sealed) || !cipher.finish(sealed)) {
+        std::cerr << "Sealing failed" << std::endl;
+        return 1;
+    }
+    double sealSeconds = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    if (!cipher.open(0, sealed.data(), sealed.size()) || sealed != plain) {
+        std::cerr << "Opening failed" << std::endl;
+        return 1;
+    }
+    double openSeconds = secondsSince(start);
+    double gib = SEAL_SIZE / (1024.0 * 1024 * 1024);
+    std::cout << "AES-256-GCM in " << BlockCipher::BLOCK_SIZE << " byte blocks: seal " << gib / sealSeconds
+              << " GiB/s, open " << gib / openSeconds << " GiB/s" << std::endl;
+
+    // A PNG whose critical bytes are its headers and palette, a few KiB
+    std::vector<char> data = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    putPngChunk(data, "IHDR", 13, rng);
+    putPngChunk(data, "PLTE", 768, rng);
+    putPngChunk(data, "tEXt", 2048, rng);
+    while (data.size() < mebibytes * 1024 * 1024) {
+        putPngChunk(data, "IDAT", IDAT_SIZE, rng);
+    }
+    putPngChunk(data, "IEND", 0, rng);
+
+    // Alternates between the two, so both see the same state of the page cache and the disk
+    std::vector<char> buffer(data.size());
+    double seconds[2] = {0, 0};
+    for (size_t i = 0; i < 2 * files; ++i) {
+        bool keyed = i % 2 == 1;
+        getStorageContext().critKey = keyed ? &key : nullptr;
+        seconds[keyed] += roundTrip(data, buffer);
+    }
+    double wholeFile = static_cast<double>(data.size()) / SEAL_SIZE * (sealSeconds + openSeconds);
+
+    std::cout << files << " write+read round trips of a " << data.size() << " byte PNG" << std::endl;
+    std::cout << "  clear:           " << seconds[0] / files * 1e6 << " us per file" << std::endl;
+    std::cout << "  .crit encrypted: " << seconds[1] / files * 1e6 << " us per file" << std::endl;
+    std::cout << "  encrypting every byte would add about " << wholeFile * 1e6 << " us per file" << std::endl;
+    removeStreams(BASE_PATH);
+    return 0;
+}
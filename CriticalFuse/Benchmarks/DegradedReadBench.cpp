@@ -0,0 +1,88 @@
+// Times 128 KiB reads of a PNG whose IDAT chunks, its .noncrit stream, have to come from a
+// disk another thread keeps busy with fsynced writes, with and without a .noncrit latency
+// budget. The .noncrit stream is dropped from the page cache (POSIX_FADV_DONTNEED) before each
+// read. Each byte read must match the file or be a zero standing in for pixel data;
+// Tests/DegradedReadTest checks which bytes degraded reads may lose.
+//
+// Usage: ./DegradedReadBench [budget us] [MiB]
+// Defaults to a 500 us budget and a 64 MiB file. The split streams are written to /tmp.
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/PngFile.h"
+#include "Utilities/Metrics.h"
+#include "Utilities/StorageContext.h"
+
+#include <fcntl.h>      // For open, posix_fadvise
+#include <unistd.h>     // For close
+
+namespace {
+
+const char* const MAPPING_PATH = "/tmp/DegradedReadBench.png.mapping";
+const char* const NONCRIT_PATH = "/tmp/DegradedReadBench.png.noncrit";
+const char* const BUSY_PATH = "/tmp/DegradedReadBench.busy";
+const size_t READ_SIZE = 128 * 1024; // FUSE's default max_read
+const size_t IDAT_SIZE = 64 * 1024;
+const size_t READS = 1000;
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    unsigned budget = argc > 1 ? std::atoi(argv[1]) : 500;
+    size_t mebibytes = argc > 2 ? std::atoi(argv[2]) : 64;
+    if (budget == 0) {
+        std::cerr << "The budget must be at least 1 us" << std::endl;
+        return 1;
+    }
+
+    std::mt19937 rng(48);
+    std::vector<char> data = syntheticPng(mebibytes * 1024 * 1024, 768, IDAT_SIZE, rng);
+    {
+        PngFileHandler writer;
+        if (writer.writeFile(MAPPING_PATH, data.data(), data.size(), 0) != ResultCode::SUCCESS) {
+            std::cerr << "Failed to split the PNG" << std::endl;
+            return 1;
+        }
+    }
+    int noncrit = open(NONCRIT_PATH, O_RDONLY);
+    getStorageContext().noncritBudgetUs = budget;
+
+    // Alternates between blocking and degradable reads, so both see the same disk load
+    Latencies latencies[2];
+    std::vector<char> buffer(READ_SIZE);
+    std::mt19937_64 offsets(48);
+    uint64_t degradedBefore = getMetrics().degradedReads;
+    bool exact = true;
+    {
+        DiskLoad load(BUSY_PATH, data);
+        for (size_t i = 0; i < 2 * READS; ++i) {
+            bool degradable = i % 2 == 1;
+            size_t offset = offsets() % (data.size() - READ_SIZE);
+            posix_fadvise(noncrit, 0, 0, POSIX_FADV_DONTNEED);
+            auto start = std::chrono::steady_clock::now();
+            PngFileHandler reader;
+            if (reader.readFile(MAPPING_PATH, buffer.data(), READ_SIZE, offset, degradable) != ResultCode::SUCCESS) {
+                std::cerr << "Read failed at " << offset << std::endl;
+                return 1;
+            }
+            latencies[degradable].add(start);
+            for (size_t j = 0; j < READ_SIZE; ++j) {
+                if (buffer[j] != data[offset + j] && (!degradable || buffer[j] != 0)) {
+                    exact = false;
+                }
+            }
+        }
+    }
+    close(noncrit);
+
+    if (!exact) {
+        std::cerr << "A read returned wrong bytes" << std::endl;
+        return 1;
+    }
+    std::cout << "128 KiB reads of a " << data.size() << " byte PNG, .noncrit uncached, disk busy with fsynced writes"
+              << std::endl;
+    latencies[0].print("blocking");
+    latencies[1].print("degradable");
+    std::cout << "  " << getMetrics().degradedReads - degradedBefore << " .noncrit extent reads of " << READS
+              << " requests degraded with a " << budget << " us budget" << std::endl;
+    return 0;
+}
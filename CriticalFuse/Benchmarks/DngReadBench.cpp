@@ -0,0 +1,62 @@
+// Maps a synthetic tiled DNG (raw image in tiles in a SubIFD, a preview strip in IFD0 and a
+// JPEG thumbnail in IFD1, like camera DNGs), then times large reads of it with and without
+// the worker pool fetching the pieces concurrently. Tests/DngTest checks the mapping and reads.
+//
+// Usage: ./DngReadBench [threads] [megapixels]
+// Defaults to 4 threads and a 24 megapixel 16-bit image. The split streams are written to /tmp.
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/DngFile.h"
+#include "Utilities/StorageContext.h"
+#include "Utilities/ThreadPool.h"
+
+namespace {
+
+const char* const MAPPING_PATH = "/tmp/DngReadBench.dng.mapping";
+const size_t TILE_BYTES = 256 * 256 * 2; // 256x256 tiles of 16-bit samples
+const size_t PREVIEW_BYTES = 1024 * 1024;
+const size_t THUMBNAIL_BYTES = 16 * 1024;
+const int RUNS = 5;
+
+// Reads the whole file in one request, best of RUNS
+bool measure(const char* label, const std::vector<char>& data) {
+    std::vector<char> buffer(data.size());
+    bool ok = true;
+    double best = bestOfMs(RUNS, [&] {
+        DngFileHandler handler;
+        ok = ok && handler.readFile(MAPPING_PATH, buffer.data(), buffer.size(), 0) == ResultCode::SUCCESS;
+    });
+    if (!ok || buffer != data) {
+        std::cerr << label << ": read returned wrong data" << std::endl;
+        return false;
+    }
+    std::cout << "  " << label << ": " << best << " ms, " << data.size() / (best * 1000.0) << " MB/s" << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    unsigned threads = argc > 1 ? std::atoi(argv[1]) : 4;
+    size_t megapixels = argc > 2 ? std::atoi(argv[2]) : 24;
+    size_t tiles = megapixels * 1000000 / (256 * 256) + 1;
+    std::mt19937 rng(42);
+    std::vector<char> data = syntheticDng(tiles, TILE_BYTES, PREVIEW_BYTES, THUMBNAIL_BYTES, rng);
+
+    DngFileHandler writer;
+    if (writer.writeFile(MAPPING_PATH, data.data(), data.size(), 0) != ResultCode::SUCCESS) {
+        std::cerr << "Failed to split the synthetic DNG" << std::endl;
+        return 1;
+    }
+    std::cout << "synthetic DNG (" << data.size() << " bytes, " << tiles << " tiles, "
+              << writer.getFileMap().size() << " extents)" << std::endl;
+
+    if (!measure("serial", data)) {
+        return 1;
+    }
+    ThreadPool pool(threads > 0 ? threads - 1 : 0);
+    getStorageContext().workers = &pool;
+    bool ok = measure((std::to_string(pool.concurrency()) + " threads").c_str(), data);
+    getStorageContext().workers = nullptr;
+    return ok ? 0 : 1;
+}
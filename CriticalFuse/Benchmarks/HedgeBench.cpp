@@ -0,0 +1,111 @@
+// Times 4 KiB critical reads through a ReplicaSet against plain preads of the primary: first
+// from the page cache, where hedging must cost nothing, then uncached while another thread
+// keeps the primary's disk busy with fsynced writes, where the replica should cut the tail.
+// The stream is dropped from the cache (POSIX_FADV_DONTNEED) before each uncached read.
+// Tests/ReplicaTest checks what the replicas hold and serve.
+//
+// Usage: ./HedgeBench [primary root] [replica root] [MiB]
+// Defaults to /tmp/HedgeBench and /dev/shm/HedgeBench, a replica in memory standing in for an
+// idle second disk, and a 64 MiB stream.
+
+#include "Benchmarks/BenchSupport.h"
+#include "Utilities/Metrics.h"
+#include "Utilities/ReplicaSet.h"
+
+#include <fcntl.h>      // For open, posix_fadvise
+#include <sys/stat.h>   // For mkdir
+#include <unistd.h>     // For pread, pwrite, fsync
+
+namespace {
+
+const size_t BLOCK_SIZE = 4096;
+const size_t CACHED_READS = 200000;
+const size_t UNCACHED_READS = 2000;
+
+// Alternates between the two ways of reading, so both see the same disk load
+template <typename Plain, typename Hedged>
+void measure(int fd, size_t blocks, size_t reads, bool evict, Plain plain, Hedged hedged, Latencies& plainLatencies,
+             Latencies& hedgedLatencies) {
+    std::mt19937_64 rng(47);
+    std::vector<char> buffer(BLOCK_SIZE);
+    for (size_t i = 0; i < 2 * reads; ++i) {
+        off_t offset = (rng() % blocks) * BLOCK_SIZE;
+        if (evict) {
+            // The whole file: the page cache may hold it in folios larger than a block
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        auto start = std::chrono::steady_clock::now();
+        bool ok = (i % 2 == 0) ? plain(buffer.data(), offset) : hedged(buffer.data(), offset);
+        if (!ok) {
+            std::cerr << "Read failed at " << offset << std::endl;
+            std::exit(1);
+        }
+        (i % 2 == 0 ? plainLatencies : hedgedLatencies).add(start);
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string primaryRoot = argc > 1 ? argv[1] : "/tmp/HedgeBench";
+    std::string replicaRoot = argc > 2 ? argv[2] : "/dev/shm/HedgeBench";
+    size_t mebibytes = argc > 3 ? std::atoi(argv[3]) : 64;
+    mkdir(primaryRoot.c_str(), 0755);
+
+    ReplicaSet replicas(primaryRoot, {replicaRoot}, 95, std::chrono::microseconds(2000));
+    if (!replicas.open()) {
+        return 1;
+    }
+    std::string path = primaryRoot + "/bench.png.crit";
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::perror("Failed to create stream");
+        return 1;
+    }
+    size_t length = mebibytes * 1024 * 1024;
+    std::vector<char> data(length);
+    std::mt19937 rng(42);
+    for (char& byte : data) {
+        byte = static_cast<char>(rng());
+    }
+    if (pwrite(fd, data.data(), length, 0) != static_cast<ssize_t>(length) || fsync(fd) == -1 ||
+        !replicas.mirror(fd, path, 0, length, length)) {
+        std::cerr << "Failed to write the stream and its replica" << std::endl;
+        return 1;
+    }
+    size_t blocks = length / BLOCK_SIZE;
+
+    auto plain = [fd](char* buffer, off_t offset) {
+        return pread(fd, buffer, BLOCK_SIZE, offset) == static_cast<ssize_t>(BLOCK_SIZE);
+    };
+    auto hedged = [fd, &path, &replicas](char* buffer, off_t offset) {
+        return replicas.read(fd, path, buffer, BLOCK_SIZE, offset);
+    };
+
+    std::cout << "4 KiB reads of a " << mebibytes << " MiB stream, cached" << std::endl;
+    Latencies cachedPlain;
+    Latencies cachedHedged;
+    measure(fd, blocks, CACHED_READS, false, plain, hedged, cachedPlain, cachedHedged);
+    cachedPlain.print("pread");
+    cachedHedged.print("replica set");
+
+    std::cout << "uncached, primary disk busy with fsynced writes" << std::endl;
+    uint64_t hedgedBefore = getMetrics().hedgedReads;
+    uint64_t winsBefore = getMetrics().hedgeWins;
+    Latencies uncachedPlain;
+    Latencies uncachedHedged;
+    {
+        DiskLoad load(primaryRoot + "/busy", data);
+        measure(fd, blocks, UNCACHED_READS, true, plain, hedged, uncachedPlain, uncachedHedged);
+    }
+    uncachedPlain.print("pread");
+    uncachedHedged.print("replica set");
+    std::cout << "  hedged " << getMetrics().hedgedReads - hedgedBefore << " of " << UNCACHED_READS
+              << " reads, replica answered first " << getMetrics().hedgeWins - winsBefore << " times, deadline now "
+              << std::chrono::duration<double, std::micro>(replicas.deadline()).count() << " us" << std::endl;
+
+    close(fd);
+    replicas.remove(path);
+    unlink(path.c_str());
+    return 0;
+}
@@ -0,0 +1,112 @@
+// Benchmarks building mappings with many extents: createMapping of a text file (an extent every
+// 5 bytes) and of a padded BMP (two extents per row), and inserting the resulting extents one by
+// one with addToFileMap versus in bulk with MappingBuilder. Then times the first read of the
+// split text file through a text mapping and through a paged mapping index (written to /tmp).
+// Tests/MappingIndexTest checks what the index loads and reads.
+//
+// Usage: ./MappingBench [text size in MiB]
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/BmpFile.h"
+#include "FileHandlers/MappingBuilder.h"
+#include "FileHandlers/TextFile.h"
+#include "Utilities/StorageContext.h"
+
+#include <cstring>
+
+namespace {
+
+// Re-inserts the extents of a finished mapping both ways and checks the results agree
+bool compareInsertion(const char* label, const FileMap& reference) {
+    const int runs = 5;
+    size_t perExtent = 0;
+    double addMs = bestOfMs(runs, [&] {
+        TextFileHandler handler;
+        for (const auto& [range, mapped] : reference) {
+            handler.addToFileMap(range.getStart(), range.getEnd(), mapped.first.getStart(), mapped.first.getEnd(),
+                                 mapped.second);
+        }
+        perExtent = handler.getFileMap().size();
+    });
+    size_t bulk = 0;
+    double builderMs = bestOfMs(runs, [&] {
+        TextFileHandler handler;
+        MappingBuilder builder;
+        builder.reserve(reference.size());
+        for (const auto& [range, mapped] : reference) {
+            builder.append(range.getStart(), range.getEnd(), mapped.first.getStart(), mapped.first.getEnd(),
+                           mapped.second);
+        }
+        builder.finalize(handler.getFileMap());
+        bulk = handler.getFileMap().size();
+    });
+    if (perExtent != reference.size() || bulk != reference.size()) {
+        std::cerr << label << ": insertion lost extents" << std::endl;
+        return false;
+    }
+    std::cout << "  addToFileMap: " << addMs << " ms, MappingBuilder: " << builderMs << " ms" << std::endl;
+    return true;
+}
+
+template <typename Handler>
+bool run(const char* label, const std::vector<char>& data) {
+    Handler handler;
+    double mappingMs = bestOfMs(5, [&] {
+        handler.getFileMap().clear();
+        handler.createMapping(data.data(), data.size());
+    });
+    std::cout << label << " (" << data.size() << " bytes, " << handler.getFileMap().size() << " extents)" << std::endl;
+    std::cout << "  createMapping: " << mappingMs << " ms" << std::endl;
+    return compareInsertion(label, handler.getFileMap());
+}
+
+// One read of a few bytes from the middle of the file, as the first request after open
+bool timeFirstRead(const char* label, const char* mappingPath, const std::vector<char>& data) {
+    char buffer[100];
+    size_t offset = data.size() / 2;
+    bool ok = false;
+    double ms = bestOfMs(5, [&] {
+        TextFileHandler handler;
+        ok = handler.readFile(mappingPath, buffer, sizeof(buffer), offset) == ResultCode::SUCCESS &&
+             std::memcmp(buffer, data.data() + offset, sizeof(buffer)) == 0;
+    });
+    if (!ok) {
+        std::cerr << label << ": first read returned wrong data" << std::endl;
+        return false;
+    }
+    std::cout << "  first read, " << label << ": " << ms << " ms" << std::endl;
+    return true;
+}
+
+// Splits the text file with each mapping format and compares the cost of its first read
+bool compareFirstRead(const std::vector<char>& text) {
+    const char* textMapping = "/tmp/MappingBench.txt.mapping";
+    const char* indexMapping = "/tmp/MappingBenchIndex.txt.mapping";
+    TextFileHandler writer;
+    getStorageContext().mappingIndexThreshold = 0;
+    bool written = writer.writeFile(textMapping, text.data(), text.size(), 0) == ResultCode::SUCCESS;
+    getStorageContext().mappingIndexThreshold = 1;
+    written = written && writer.writeFile(indexMapping, text.data(), text.size(), 0) == ResultCode::SUCCESS;
+    getStorageContext().mappingIndexThreshold = 0;
+    if (!written) {
+        std::cerr << "Failed to split the text file" << std::endl;
+        return false;
+    }
+    return timeFirstRead("text mapping", textMapping, text) && timeFirstRead("paged index", indexMapping, text);
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t textMiB = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 8;
+    std::vector<char> text(textMiB << 20, 'a');
+    for (size_t i = 0; i < text.size(); ++i) {
+        text[i] = static_cast<char>('a' + i % 26);
+    }
+    std::mt19937 rng(40);
+    if (!run<TextFileHandler>("text", text) || !compareFirstRead(text) ||
+        !run<BmpFileHandler>("bmp 4001x3000", syntheticBmp(4001, 3000, rng))) {
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,85 @@
+// Benchmarks the JPEG marker scanners over a corpus of JPEG files and checks that every
+// implementation finds the same markers in each; Tests/MarkerScanTest cross-checks them.
+//
+// Usage: ./MarkerScanBench [file.jpg ...]
+// Without arguments the sample JPEGs are used, plus a synthetic 24 megapixel scan.
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/JpegFile.h"
+#include "Utilities/MarkerScan.h"
+
+namespace {
+
+struct Corpus {
+    std::string name;
+    std::vector<char> data;
+};
+
+// Visits every marker like the handler does: a marker ends the scan, the next one starts after it
+size_t countMarkers(MarkerScanner scan, const std::vector<char>& data, uint64_t& checksum) {
+    size_t count = 0;
+    size_t offset = 0;
+    while (offset < data.size()) {
+        offset += scan(data.data() + offset, data.size() - offset);
+        if (offset >= data.size()) {
+            break;
+        }
+        count++;
+        checksum = checksum * 31 + offset;
+        offset += 2;
+    }
+    return count;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::vector<Corpus> corpus;
+    for (int i = 1; i < argc; ++i) {
+        corpus.push_back({argv[i], loadFile(argv[i])});
+    }
+    if (corpus.empty()) {
+        corpus.push_back({"jpeg_sample.jpg", loadFile("jpeg_sample.jpg")});
+        corpus.push_back({"high_res.jpg", loadFile("high_res.jpg")});
+        std::mt19937 rng(34);
+        corpus.push_back({"synthetic 24MP", syntheticJpeg(24u << 20, rng)});
+    }
+
+    std::vector<MarkerScanImpl> scanners = availableMarkerScanners();
+
+    const int runs = 5;
+    for (const Corpus& file : corpus) {
+        if (file.data.empty()) {
+            std::cerr << "Skipping empty or missing " << file.name << std::endl;
+            continue;
+        }
+        std::cout << file.name << " (" << file.data.size() << " bytes)" << std::endl;
+
+        size_t expectedCount = 0;
+        uint64_t expectedChecksum = 0;
+        for (size_t i = 0; i < scanners.size(); ++i) {
+            size_t count = 0;
+            uint64_t checksum = 0;
+            double ms = bestOfMs(runs, [&] {
+                checksum = 0;
+                count = countMarkers(scanners[i].scan, file.data, checksum);
+            });
+            if (i == 0) {
+                expectedCount = count;
+                expectedChecksum = checksum;
+            } else if (count != expectedCount || checksum != expectedChecksum) {
+                std::cerr << scanners[i].name << " found different markers" << std::endl;
+                return 1;
+            }
+            std::cout << "  " << scanners[i].name << ": " << ms << " ms, "
+                      << file.data.size() / (ms * 1000.0) << " MB/s, " << count << " markers" << std::endl;
+        }
+
+        double mappingMs = bestOfMs(runs, [&] {
+            JpegFileHandler handler;
+            handler.createMapping(file.data.data(), file.data.size());
+        });
+        std::cout << "  createMapping: " << mappingMs << " ms" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Measures what compressing the .noncrit stream saves and costs: for each codec the build has,
+// the size of the stream file, a full write, a full read and random small reads of a BMP whose
+// pixel data compresses about as well as a photograph's smooth regions. Tests/NoncritCompressTest
+// checks reads and writes through the block index.
+//
+// Usage: ./NoncritCompressBench [MiB] [small reads]
+// Defaults to a 32 MiB image and 10000 reads of 4 KiB. The split streams are written to /tmp.
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/BmpFile.h"
+#include "Utilities/BlockCompressor.h"
+#include "Utilities/StorageContext.h"
+
+#include <cstring>
+#include <sys/stat.h>
+
+namespace {
+
+const char* const BASE_PATH = "/tmp/NoncritCompressBench.bmp";
+const char* const MAPPING_PATH = "/tmp/NoncritCompressBench.bmp.mapping";
+const char* const NONCRIT_PATH = "/tmp/NoncritCompressBench.bmp.noncrit";
+const size_t BMP_HEADERS_SIZE = 54;
+const size_t WIDTH = 2048;
+const size_t SMALL_READ = 4096;
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    size_t mebibytes = argc > 1 ? std::atoi(argv[1]) : 32;
+    size_t reads = argc > 2 ? std::atoi(argv[2]) : 10000;
+    std::mt19937 rng(50);
+    std::vector<char> data = syntheticBmp(WIDTH, mebibytes * 1024 * 1024 / (WIDTH * 3), rng);
+    std::vector<char> buffer(data.size());
+    std::vector<size_t> offsets(reads);
+    for (size_t& offset : offsets) {
+        offset = rng() % (data.size() - SMALL_READ);
+    }
+
+    std::cout << "A " << data.size() << " byte BMP, " << reads << " reads of " << SMALL_READ << " bytes" << std::endl;
+    const struct {
+        const char* name;
+        NoncritCodec codec;
+    } codecs[] = {{"none", NoncritCodec::NONE}, {"lz4", NoncritCodec::LZ4}, {"zstd", NoncritCodec::ZSTD}};
+    for (const auto& entry : codecs) {
+        if (entry.codec != NoncritCodec::NONE && !BlockCompressor::supported(entry.codec)) {
+            std::cout << "  " << entry.name << ": not in this build" << std::endl;
+            continue;
+        }
+        getStorageContext().noncritCodec = entry.codec;
+        removeStreams(BASE_PATH);
+
+        auto start = std::chrono::steady_clock::now();
+        BmpFileHandler writer;
+        if (writer.writeFile(MAPPING_PATH, data.data(), data.size(), 0) != ResultCode::SUCCESS) {
+            std::cerr << "Write failed" << std::endl;
+            return 1;
+        }
+        double writeSeconds = secondsSince(start);
+
+        start = std::chrono::steady_clock::now();
+        BmpFileHandler reader;
+        if (reader.readFile(MAPPING_PATH, buffer.data(), buffer.size(), 0) != ResultCode::SUCCESS || buffer != data) {
+            std::cerr << "Read failed" << std::endl;
+            return 1;
+        }
+        double readSeconds = secondsSince(start);
+
+        // One handler per read, as FUSE opens one per request
+        start = std::chrono::steady_clock::now();
+        for (size_t offset : offsets) {
+            BmpFileHandler smallReader;
+            if (smallReader.readFile(MAPPING_PATH, buffer.data(), SMALL_READ, offset) != ResultCode::SUCCESS ||
+                std::memcmp(buffer.data(), &data[offset], SMALL_READ) != 0) {
+                std::cerr << "Small read failed" << std::endl;
+                return 1;
+            }
+        }
+        double smallSeconds = secondsSince(start);
+
+        struct stat st;
+        if (stat(NONCRIT_PATH, &st) == -1) {
+            std::perror("Failed to stat .noncrit");
+            return 1;
+        }
+        double mib = data.size() / (1024.0 * 1024);
+        std::cout << "  " << entry.name << ": .noncrit " << st.st_size << " bytes ("
+                  << 100.0 * st.st_size / (data.size() - BMP_HEADERS_SIZE) << "%), write " << mib / writeSeconds
+                  << " MiB/s, read " << mib / readSeconds << " MiB/s, small read " << smallSeconds / reads * 1e6
+                  << " us" << std::endl;
+    }
+    removeStreams(BASE_PATH);
+    return 0;
+}
@@ -0,0 +1,133 @@
+// Times Reed-Solomon encoding and decoding of 4 KiB shards with every GF(2^8) kernel the CPU
+// can run (the 64 KiB product table, SSSE3 and AVX2 nibble lookups), after checking that they
+// agree, then the cost of keeping a .parity sidecar: a synthetic PNG whose one palette chunk
+// holds nearly all of its bytes, all critical, is split with and without parity.
+// Tests/ParityTest checks the rebuilt blocks and reads of damaged streams.
+//
+// Usage: ./ParityBench [data shards] [parity shards] [MiB]
+// Defaults to 8+2 and a 64 MiB file. The split streams are written to /tmp.
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/PngFile.h"
+#include "Utilities/BlockChecksums.h"
+#include "Utilities/ReedSolomon.h"
+#include "Utilities/StorageContext.h"
+
+#include <algorithm>
+
+namespace {
+
+const char* const MAPPING_PATH = "/tmp/ParityBench.png.mapping";
+const size_t SHARD_SIZE = BlockChecksums::BLOCK_SIZE;
+const size_t STRIPES = 32; // small enough to stay in cache, so the kernels are measured, not memory
+const size_t STRIPE_ROUNDS = 200;
+const int RUNS = 5;
+
+struct Stripes {
+    unsigned dataShards;
+    unsigned parityShards;
+    std::vector<uint8_t> bytes; // STRIPES stripes of dataShards + parityShards shards
+
+    uint8_t* shard(size_t stripe, unsigned index) {
+        return &bytes[(stripe * (dataShards + parityShards) + index) * SHARD_SIZE];
+    }
+};
+
+// Best of RUNS in GB/s of data shards, or -1 if the decoded shards are wrong
+double measure(const ReedSolomon& code, Stripes& stripes, bool decode) {
+    unsigned k = stripes.dataShards;
+    unsigned m = stripes.parityShards;
+    std::vector<const uint8_t*> data(k);
+    std::vector<uint8_t*> parity(m);
+    std::vector<uint8_t*> shards(k + m);
+    std::vector<unsigned> erased;
+    for (unsigned j = 0; j < std::min(k, m); ++j) {
+        erased.push_back(j * k / std::min(k, m)); // lost data shards spread over the stripe
+    }
+    std::vector<uint8_t> original = stripes.bytes;
+
+    double best = bestOfMs(RUNS, [&] {
+        for (size_t round = 0; round < STRIPE_ROUNDS; ++round) {
+            for (size_t s = 0; s < STRIPES; ++s) {
+                for (unsigned j = 0; j < k + m; ++j) {
+                    shards[j] = stripes.shard(s, j);
+                }
+                if (decode) {
+                    code.reconstruct(shards.data(), erased, SHARD_SIZE);
+                } else {
+                    std::copy(shards.begin(), shards.begin() + k, data.begin());
+                    std::copy(shards.begin() + k, shards.end(), parity.begin());
+                    code.encode(data.data(), parity.data(), SHARD_SIZE);
+                }
+            }
+        }
+    });
+    if (stripes.bytes != original) {
+        return -1;
+    }
+    return STRIPE_ROUNDS * STRIPES * k * SHARD_SIZE / (best * 1e6);
+}
+
+// Best of RUNS for splitting the whole file, in ms
+double measureWrite(const std::vector<char>& data) {
+    bool ok = true;
+    double best = bestOfMs(RUNS, [&] {
+        PngFileHandler writer;
+        ok = ok && writer.writeFile(MAPPING_PATH, data.data(), data.size(), 0) == ResultCode::SUCCESS;
+    });
+    return ok ? best : -1;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    unsigned dataShards = argc > 1 ? std::atoi(argv[1]) : 8;
+    unsigned parityShards = argc > 2 ? std::atoi(argv[2]) : 2;
+    size_t mebibytes = argc > 3 ? std::atoi(argv[3]) : 64;
+    if (dataShards == 0 || parityShards == 0 || dataShards + parityShards > ReedSolomon::MAX_SHARDS) {
+        std::cerr << "Stripes hold 2 to " << ReedSolomon::MAX_SHARDS << " shards" << std::endl;
+        return 1;
+    }
+
+    Stripes stripes{dataShards, parityShards, std::vector<uint8_t>(STRIPES * (dataShards + parityShards) * SHARD_SIZE)};
+    std::mt19937 rng(46);
+    for (uint8_t& byte : stripes.bytes) {
+        byte = static_cast<uint8_t>(rng());
+    }
+
+    // Every kernel encodes the same parity; then each one decodes it back below
+    std::vector<GfMulAddImpl> implementations = availableGfMulAdd();
+    ReedSolomon reference(dataShards, parityShards, implementations[0].compute);
+    measure(reference, stripes, false);
+    std::vector<uint8_t> encoded = stripes.bytes;
+
+    std::cout << dataShards << "+" << parityShards << " Reed-Solomon, 4 KiB shards (GB/s of data)" << std::endl;
+    for (const GfMulAddImpl& implementation : implementations) {
+        ReedSolomon code(dataShards, parityShards, implementation.compute);
+        double encode = measure(code, stripes, false);
+        if (stripes.bytes != encoded) {
+            std::cerr << implementation.name << " encodes different parity than " << implementations[0].name << std::endl;
+            return 1;
+        }
+        double decode = measure(code, stripes, true);
+        if (decode < 0) {
+            std::cerr << implementation.name << " decoded wrong data" << std::endl;
+            return 1;
+        }
+        std::cout << "  " << implementation.name << ": encode " << encode << ", decode " << decode << std::endl;
+    }
+
+    std::vector<char> data = syntheticPng(0, mebibytes * 1024 * 1024, 0, rng);
+
+    double plain = measureWrite(data);
+    getStorageContext().parityStripe = dataShards;
+    getStorageContext().parityShards = parityShards;
+    double withParity = measureWrite(data);
+    if (plain < 0 || withParity < 0) {
+        std::cerr << "Failed to split the PNG" << std::endl;
+        return 1;
+    }
+    std::cout << "splitting " << data.size() << " critical bytes: " << plain << " ms without parity, "
+              << withParity << " ms with " << dataShards << "+" << parityShards << " parity" << std::endl;
+    return 0;
+}
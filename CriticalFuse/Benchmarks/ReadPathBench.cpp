@@ -0,0 +1,72 @@
+// Benchmarks split-file reads the way CriticalFUSE serves them (a fresh handler per request that
+// loads the mapping and reads through it) and counts their heap allocations, with and without
+// the per-thread request arena. Tests/RequestArenaTest checks what the arena reads.
+//
+// Usage: ./ReadPathBench [file.jpg]
+// Without an argument high_res.jpg is used. The split streams are written to /tmp.
+
+#include "Benchmarks/BenchSupport.h"
+#include "FileHandlers/JpegFile.h"
+#include "Utilities/Metrics.h"
+#include "Utilities/RequestArena.h"
+
+#include <cstring>
+
+namespace {
+
+const char* const MAPPING_PATH = "/tmp/ReadPathBench.jpg.mapping";
+const size_t READ_SIZE = 128 * 1024; // FUSE's default max_read
+const int READS = 20000;
+
+// Reads the file in READ_SIZE requests, wrapping around, and reports time and allocations per read
+bool measure(const char* label, bool useArena, const std::vector<char>& data) {
+    std::vector<char> buffer(READ_SIZE);
+    uint64_t allocations = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < READS; ++i) {
+        size_t offset = (static_cast<size_t>(i) * READ_SIZE) % data.size();
+        size_t size = std::min(READ_SIZE, data.size() - offset);
+        uint64_t before = threadAllocationCount();
+        ResultCode result;
+        if (useArena) {
+            RequestScope scope;
+            result = makeRequestObject<JpegFileHandler>()->readFile(MAPPING_PATH, buffer.data(), size, offset);
+        } else {
+            JpegFileHandler handler;
+            result = handler.readFile(MAPPING_PATH, buffer.data(), size, offset);
+        }
+        allocations += threadAllocationCount() - before;
+        if (result != ResultCode::SUCCESS || std::memcmp(buffer.data(), data.data() + offset, size) != 0) {
+            std::cerr << label << ": read at " << offset << " returned wrong data" << std::endl;
+            return false;
+        }
+    }
+    std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "  " << label << ": " << elapsed.count() / READS << " us/read, "
+              << static_cast<double>(allocations) / READS << " allocations/read" << std::endl;
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string path = argc > 1 ? argv[1] : "high_res.jpg";
+    std::vector<char> data = loadFile(path);
+    if (data.empty()) {
+        std::cerr << "Empty or missing " << path << std::endl;
+        return 1;
+    }
+
+    JpegFileHandler writer;
+    if (writer.writeFile(MAPPING_PATH, data.data(), data.size(), 0) != ResultCode::SUCCESS) {
+        std::cerr << "Failed to split " << path << std::endl;
+        return 1;
+    }
+    std::cout << path << " (" << data.size() << " bytes, " << writer.getFileMap().size() << " extents)" << std::endl;
+
+    if (!measure("heap", false, data) || !measure("arena", true, data)) {
+        return 1;
+    }
+    std::cout << "  arena overflow: " << getMetrics().arenaOverflowBytes.load() << " bytes" << std::endl;
+    return 0;
+}
@@ -11,10 +11,13 @@
 #include <dirent.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stddef.h>
 #include <memory>
 #include <string>
 #include <map>
 #include <iostream>
+#include <typeinfo>
+#include <vector>
 
 #include "../FileHandlers/AbstractFile.h"
 #include "../FileHandlers/TextFile.h"
@@ -23,10 +26,79 @@
 #include "../FileHandlers/PngFile.h"
 #include "../FileHandlers/BmpFile.h"
 #include "../FileHandlers/JpegFile.h"
+#include "../FileHandlers/Mp4File.h"
+#include "../Utilities/StorageContext.h"
+#include "../Utilities/SegmentStore.h"
+#include "../Utilities/IntentLog.h"
+#include "../Utilities/SyncCoalescer.h"
+#include "../Utilities/ThreadPool.h"
+#include "../Utilities/TemplateStore.h"
+#include "../Utilities/RequestArena.h"
+#include "../Utilities/Metrics.h"
+#include "../Utilities/ReedSolomon.h"
+#include "../Utilities/ReplicaSet.h"
+#include "../Utilities/BlockCipher.h"
+#include "../Utilities/BlockCompressor.h"
 
 #define BACKING_DIR_REL "./storage"
+#define INTENT_LOG_NAME ".intent.log"
+
+// fi->fh of an open split file; pass-through files keep their backing fd there instead
+#define SPLIT_FILE_FH ((uint64_t) -1)
+
+// Read-only file with the request path counters (see Metrics.h), not stored in the backing directory
+#define STATS_PATH "/.stats"
+
+// Largest chunk copy_file_range reassembles in memory when it cannot clone streams
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024)
 static char backing_dir_abs[PATH_MAX];
 
+// Mount options (-o name=value)
+struct criticalfs_config {
+    size_t small_file_threshold; // pack files up to this size into shared segments, 0 disables packing
+    int wal;                     // commit split-file updates through the write-ahead intent log
+    int relaxed_noncrit;         // fsync skips fdatasync of .noncrit streams
+    unsigned write_threads;      // threads splitting, writing and reading one large file, 1 keeps it on the request thread
+    size_t mapping_index;        // store mappings with at least this many extents as a paged index, 0 disables
+    int mapping_templates;       // store identical image layouts once and reference them from the mappings
+    unsigned parity;             // Reed-Solomon parity blocks per stripe of .crit, 0 disables
+    unsigned parity_stripe;      // .crit blocks per parity stripe
+    char *crit_replicas;         // ':'-separated roots that each hold a copy of every .crit stream
+    unsigned hedge_percentile;   // latency percentile after which critical reads go to a replica too
+    unsigned hedge_delay_us;     // hedging deadline until enough reads were timed
+    unsigned noncrit_budget_us;  // .noncrit reads slower than this, or failing, return zeros; 0 disables
+    char *crit_key;              // file with the key .crit streams are encrypted under
+    char *noncrit_compress;      // codec .noncrit streams are compressed with, "lz4" or "zstd"
+};
+static struct criticalfs_config config;
+
+#define CRITICALFS_OPT(t, p) { t, offsetof(struct criticalfs_config, p), 1 }
+static const struct fuse_opt criticalfs_opts[] = {
+    CRITICALFS_OPT("small_file_threshold=%zu", small_file_threshold),
+    CRITICALFS_OPT("wal", wal),
+    CRITICALFS_OPT("relaxed_noncrit", relaxed_noncrit),
+    CRITICALFS_OPT("write_threads=%u", write_threads),
+    CRITICALFS_OPT("mapping_index=%zu", mapping_index),
+    CRITICALFS_OPT("mapping_templates", mapping_templates),
+    CRITICALFS_OPT("parity=%u", parity),
+    CRITICALFS_OPT("parity_stripe=%u", parity_stripe),
+    CRITICALFS_OPT("crit_replicas=%s", crit_replicas),
+    CRITICALFS_OPT("hedge_percentile=%u", hedge_percentile),
+    CRITICALFS_OPT("hedge_delay_us=%u", hedge_delay_us),
+    CRITICALFS_OPT("noncrit_budget_us=%u", noncrit_budget_us),
+    CRITICALFS_OPT("crit_key=%s", crit_key),
+    CRITICALFS_OPT("noncrit_compress=%s", noncrit_compress),
+    FUSE_OPT_END
+};
+
+static std::unique_ptr<SegmentStore> segment_store;
+static std::unique_ptr<IntentLog> intent_log;
+static std::unique_ptr<ThreadPool> write_pool;
+static std::unique_ptr<TemplateStore> template_store;
+static std::unique_ptr<ReplicaSet> replica_set;
+static MountKey crit_key;
+static SyncCoalescer fsync_coalescer;
+
 // FUSE attribute flags
 #define FUSE_SET_ATTR_MODE  (1 << 0)
 #define FUSE_SET_ATTR_UID   (1 << 1)
@@ -44,8 +116,28 @@ static void fullpath(char fpath[PATH_MAX], const char *path) {
     }
 }
 
-// Helper to get file handler based on file type
-static std::unique_ptr<AbstractFileHandler> getFileHandler(const char* path) {
+// Helper to build the path of one of a split file's backing files, e.g. ".mapping"
+static void streampath(char spath[PATH_MAX], const char *fpath, const char *suffix) {
+    snprintf(spath, PATH_MAX, "%s%s", fpath, suffix);
+}
+
+// Helper to hide the store's own bookkeeping directories from listings
+static bool is_internal_entry(const char *name) {
+    return strcmp(name, ".segments") == 0 || strcmp(name, INTENT_LOG_NAME) == 0 ||
+           strcmp(name, ".templates") == 0;
+}
+
+// Helper to get the backing fd of an open pass-through file, -1 if the caller has to open one
+static int passthrough_fd(struct fuse_file_info *fi) {
+    if (!fi || fi->fh == SPLIT_FILE_FH) {
+        return -1;
+    }
+    return (int) fi->fh;
+}
+
+// Helper to get file handler based on file type. The handler lives in the request arena, so
+// it must not outlive the RequestScope of the operation that created it.
+static RequestPtr<AbstractFileHandler> getFileHandler(const char* path) {
     // Get file extension
     const char* ext = strrchr(path, '.');
     if (!ext) {
@@ -53,27 +145,34 @@ static std::unique_ptr<AbstractFileHandler> getFileHandler(const char* path) {
         return nullptr;
     }
     
-    // Convert extension to lowercase for comparison
-    std::string ext_lower(ext + 1);
-    for (char& c : ext_lower) {
-        c = std::tolower(c);
+    // Convert extension to lowercase for comparison (no supported extension is longer than 4)
+    char ext_lower[8];
+    size_t ext_len = strlen(ext + 1);
+    if (ext_len >= sizeof(ext_lower)) {
+        return nullptr;
+    }
+    for (size_t i = 0; i <= ext_len; ++i) {
+        ext_lower[i] = std::tolower(ext[1 + i]);
     }
     std::cout << "File extension: " << ext_lower << std::endl;
     // Only handle specific file types
-    if (ext_lower == "txt") {
-        return std::make_unique<TextFileHandler>();
+    if (strcmp(ext_lower, "txt") == 0) {
+        return makeRequestObject<TextFileHandler>();
+    }
+    else if (strcmp(ext_lower, "dng") == 0) {
+        return makeRequestObject<DngFileHandler>();
     }
-    else if (ext_lower == "dng") {
-        return std::make_unique<DngFileHandler>();
+    else if (strcmp(ext_lower, "png") == 0) {
+        return makeRequestObject<PngFileHandler>();
     }
-    else if (ext_lower == "png") {
-        return std::make_unique<PngFileHandler>();
+    else if (strcmp(ext_lower, "bmp") == 0) {
+        return makeRequestObject<BmpFileHandler>();
     }
-    else if (ext_lower == "bmp") {
-        return std::make_unique<BmpFileHandler>();
+    else if (strcmp(ext_lower, "jpeg") == 0 || strcmp(ext_lower, "jpg") == 0) {
+        return makeRequestObject<JpegFileHandler>();
     }
-    else if (ext_lower == "jpeg" || ext_lower == "jpg") {
-        return std::make_unique<JpegFileHandler>();
+    else if (strcmp(ext_lower, "mp4") == 0 || strcmp(ext_lower, "mov") == 0) {
+        return makeRequestObject<Mp4FileHandler>();
     }
     
     // Unsupported file type, treat as regular file
@@ -105,32 +204,53 @@ static int update_times(const char* path, struct stat* stbuf, int to_set) {
 // FUSE operations
 static int criticalfs_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi) {
     (void) fi;
+    RequestScope scope; // handlers and mappings of this request live in the thread's arena
     char fpath[PATH_MAX];
     fullpath(fpath, path);
 
+    if (strcmp(path, STATS_PATH) == 0) {
+        memset(stbuf, 0, sizeof(struct stat));
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = getMetrics().render().size();
+        return 0;
+    }
+
     // Check for mapping file first
-    std::string mappingPath = std::string(fpath) + ".mapping";
-    if (access(mappingPath.c_str(), F_OK) == 0) {
+    char mappingPath[PATH_MAX];
+    streampath(mappingPath, fpath, ".mapping");
+    if (access(mappingPath, F_OK) == 0) {
         // It's a critical file, get its size from the mapping
         auto handler = getFileHandler(path);
         if (!handler) {
             // Not a supported file type, treat as regular file
             return -ENOENT;
         }
-        if (handler->loadMapFromFile(mappingPath.c_str()) != ResultCode::SUCCESS) {
+        uint64_t totalSize = 0;
+        uint64_t storedBytes = 0;
+        if (handler->getMappingSize(mappingPath, totalSize, storedBytes) != ResultCode::SUCCESS) {
             return -errno;
         }
 
         memset(stbuf, 0, sizeof(struct stat));
         stbuf->st_mode = S_IFREG | 0644;
         stbuf->st_nlink = 1;
+        stbuf->st_size = totalSize;
 
-        // Calculate total size from mapping
-        int totalSize = 0;
-        for (const auto& [range, _] : handler->getFileMap()) {
-            totalSize = std::max(totalSize, range.getEnd() + 1);
+        // Holes take no space: report what the streams really occupy
+        struct stat streamSt;
+        bool haveStreams = false;
+        for (const char *suffix : {".crit", ".noncrit", ".parity"}) {
+            char streamPath[PATH_MAX];
+            streampath(streamPath, fpath, suffix);
+            if (stat(streamPath, &streamSt) == 0) {
+                stbuf->st_blocks += streamSt.st_blocks;
+                haveStreams = true;
+            }
+        }
+        if (!haveStreams) {
+            stbuf->st_blocks = (storedBytes + 511) / 512; // packed into a segment
         }
-        stbuf->st_size = totalSize;
         return 0;
     }
 
@@ -164,8 +284,8 @@ static int criticalfs_readdir(const char *path, void *buf, fuse_fill_dir_t fille
         const char *name = de->d_name;
         
         // Skip system entries and mapping/critical files
-        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 ||
-            strstr(name, ".crit") || strstr(name, ".noncrit")) {
+        if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0 || is_internal_entry(name) ||
+            strstr(name, ".crit") || strstr(name, ".noncrit") || strstr(name, ".parity")) {
             continue;
         }
 
@@ -192,58 +312,113 @@ static int criticalfs_readdir(const char *path, void *buf, fuse_fill_dir_t fille
 }
 
 static int criticalfs_open(const char *path, struct fuse_file_info *fi) {
-    (void) path;
-    (void) fi;
+    if (strcmp(path, STATS_PATH) == 0) {
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EACCES;
+        }
+        fi->fh = SPLIT_FILE_FH; // nothing to close
+        fi->direct_io = 1;      // the size reported by getattr changes between reads
+        return 0;
+    }
+
+    char fpath[PATH_MAX];
+    fullpath(fpath, path);
+
+    // Split files are reassembled per request, there is nothing to keep open
+    char mappingPath[PATH_MAX];
+    streampath(mappingPath, fpath, ".mapping");
+    if (access(mappingPath, F_OK) == 0) {
+        fi->fh = SPLIT_FILE_FH;
+        return 0;
+    }
+
+    int fd = open(fpath, fi->flags);
+    if (fd == -1) {
+        return -errno;
+    }
+    fi->fh = fd;
     return 0;
 }
 
-static int criticalfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    (void) fi;
+// degradable lets slow .noncrit reads of split files return zeros, for bytes going to a reader only
+static int read_path(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi, bool degradable) {
+    if (strcmp(path, STATS_PATH) == 0) {
+        std::string stats = getMetrics().render();
+        if (offset >= (off_t) stats.size()) {
+            return 0;
+        }
+        size = std::min(size, stats.size() - offset);
+        memcpy(buf, stats.data() + offset, size);
+        return size;
+    }
+
+    RequestScope scope;
     char fpath[PATH_MAX];
     fullpath(fpath, path);
 
     // Check if this is a critical file
-    std::string mappingPath = std::string(fpath) + ".mapping";
-    if (access(mappingPath.c_str(), F_OK) == 0) {
+    char mappingPath[PATH_MAX];
+    streampath(mappingPath, fpath, ".mapping");
+    if (access(mappingPath, F_OK) == 0) {
         auto handler = getFileHandler(path);
         if (!handler) {
             // Not a supported file type, treat as regular file
             return -ENOENT;
         }
-        if (handler->readFile(mappingPath.c_str(), buf, size, offset) != ResultCode::SUCCESS) {
+        uint64_t allocationsBefore = threadAllocationCount();
+        ResultCode result = handler->readFile(mappingPath, buf, size, offset, degradable);
+        getMetrics().splitReads++;
+        getMetrics().splitReadAllocations += threadAllocationCount() - allocationsBefore;
+        if (result != ResultCode::SUCCESS) {
             return -errno;
         }
         return size;
     }
 
     // Not a critical file, read directly
-    int fd = open(fpath, O_RDONLY);
+    int fd = passthrough_fd(fi);
+    bool opened = false;
     if (fd == -1) {
-        return -errno;
+        fd = open(fpath, O_RDONLY);
+        if (fd == -1) {
+            return -errno;
+        }
+        opened = true;
     }
 
     int res = pread(fd, buf, size, offset);
-    close(fd);
     if (res == -1) {
-        return -errno;
+        res = -errno;
+    }
+    if (opened) {
+        close(fd);
     }
     return res;
 }
 
+static int criticalfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    return read_path(path, buf, size, offset, fi, true);
+}
+
 static int criticalfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
-    (void) fi;
+    RequestScope scope;
     char fpath[PATH_MAX];
     fullpath(fpath, path);
 
     // Check if this is a critical file
-    std::string mappingPath = std::string(fpath) + ".mapping";
-    if (access(mappingPath.c_str(), F_OK) == 0) {
+    char mappingPath[PATH_MAX];
+    streampath(mappingPath, fpath, ".mapping");
+    if (access(mappingPath, F_OK) == 0) {
         auto handler = getFileHandler(path);
         if (!handler) {
             // Not a supported file type, treat as regular file
             return -ENOENT;
         }
-        if (handler->writeFile(mappingPath.c_str(), buf, size, offset) != ResultCode::SUCCESS) {
+        uint64_t allocationsBefore = threadAllocationCount();
+        ResultCode result = handler->writeFile(mappingPath, buf, size, offset);
+        getMetrics().splitWrites++;
+        getMetrics().splitWriteAllocations += threadAllocationCount() - allocationsBefore;
+        if (result != ResultCode::SUCCESS) {
             return -errno;
         }
         std::cout << "Wrote " << size << " bytes to file: " << path << std::endl;
@@ -256,37 +431,47 @@ static int criticalfs_write(const char *path, const char *buf, size_t size, off_
     }
     std::cout << "Not a critical file, writing directly" << std::endl;
     // Not a critical file, write directly
-    int fd = open(fpath, O_WRONLY);
+    int fd = passthrough_fd(fi);
+    bool opened = false;
     if (fd == -1) {
-        return -errno;
+        fd = open(fpath, O_WRONLY);
+        if (fd == -1) {
+            return -errno;
+        }
+        opened = true;
     }
 
     int res = pwrite(fd, buf, size, offset);
-    close(fd);
     if (res == -1) {
-        return -errno;
+        res = -errno;
+    }
+    if (opened) {
+        close(fd);
     }
     return res;
 }
 
 static int criticalfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    RequestScope scope;
     char fpath[PATH_MAX];
     fullpath(fpath, path);
 
     // Only create mapping for supported file types
     auto handler = getFileHandler(path);
     if (handler) {
-        std::string mappingPath = std::string(fpath) + ".mapping";
+        char mappingPath[PATH_MAX];
+        streampath(mappingPath, fpath, ".mapping");
         if (handler->createMapping("", 0) != ResultCode::SUCCESS) {
             unlink(fpath); // Clean up the created file
             return -errno;
         }
-        if (handler->saveMapToFile(mappingPath.c_str()) != ResultCode::SUCCESS) {
+        if (handler->saveMapToFile(mappingPath) != ResultCode::SUCCESS) {
             unlink(fpath); // Clean up the created file
             return -errno;
         }
         std::cout << "Created mapping file: " << mappingPath << std::endl;
 
+        fi->fh = SPLIT_FILE_FH;
         return 0;
     }
     std::cout << "Not a critical file, creating normally" << std::endl;
@@ -295,27 +480,112 @@ static int criticalfs_create(const char *path, mode_t mode, struct fuse_file_inf
     if (fd == -1) {
         return -errno;
     }
-    close(fd);
+    fi->fh = fd;
 
     return 0;
 }
 
+static int criticalfs_flush(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    // Split files are written through on every write, nothing is buffered here
+    int fd = passthrough_fd(fi);
+    if (fd == -1) {
+        return 0;
+    }
+
+    // Report deferred write errors of the backing file without closing it (flush may be called
+    // several times for one open, e.g. after dup)
+    int res = close(dup(fd));
+    if (res == -1) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int criticalfs_release(const char *path, struct fuse_file_info *fi) {
+    (void) path;
+    int fd = passthrough_fd(fi);
+    if (fd != -1) {
+        close(fd);
+    }
+    return 0;
+}
+
+static int criticalfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    char fpath[PATH_MAX];
+    fullpath(fpath, path);
+
+    char mappingPath[PATH_MAX];
+    streampath(mappingPath, fpath, ".mapping");
+    if (access(mappingPath, F_OK) == 0) {
+        // With the intent log, every write was durable by the time it returned
+        if (intent_log) {
+            return 0;
+        }
+
+        // .crit, .noncrit and .mapping are synced together; concurrent fsyncs of the same file
+        // share one round of syncing
+        std::string basePath(fpath);
+        std::string key = basePath + (datasync ? "#data" : "#full");
+        bool ok = fsync_coalescer.sync(key, [&basePath, datasync]() {
+            return AbstractFileHandler::syncStreams(basePath, datasync != 0) == ResultCode::SUCCESS;
+        });
+        return ok ? 0 : -EIO;
+    }
+
+    int fd = passthrough_fd(fi);
+    bool opened = false;
+    if (fd == -1) {
+        fd = open(fpath, O_WRONLY);
+        if (fd == -1) {
+            return -errno;
+        }
+        opened = true;
+    }
+
+    int res = datasync ? fdatasync(fd) : fsync(fd);
+    if (res == -1) {
+        res = -errno;
+    }
+    if (opened) {
+        close(fd);
+    }
+    return res;
+}
+
 static int criticalfs_unlink(const char *path) {
+    RequestScope scope;
     char fpath[PATH_MAX];
     fullpath(fpath, path);
 
     // Check if this is a critical file
     auto handler = getFileHandler(path);
     if (handler) {
-        std::string mappingPath = std::string(fpath) + ".mapping";
-        if (access(mappingPath.c_str(), F_OK) == 0) {
+        char mappingPath[PATH_MAX];
+        streampath(mappingPath, fpath, ".mapping");
+        if (access(mappingPath, F_OK) == 0) {
+            // Logged updates of the file must not be replayed after it is gone
+            if (intent_log && !intent_log->checkpointIfDirty(fpath)) {
+                return -EIO;
+            }
             // It's a critical file, remove the mapping and data files
-            unlink(mappingPath.c_str());
-            std::string critPath = std::string(fpath) + ".crit";
-            std::string noncritPath = std::string(fpath) + ".noncrit";
-            unlink(critPath.c_str());
-            unlink(noncritPath.c_str());
+            unlink(mappingPath);
+            char critPath[PATH_MAX];
+            streampath(critPath, fpath, ".crit");
+            char noncritPath[PATH_MAX];
+            streampath(noncritPath, fpath, ".noncrit");
+            char parityPath[PATH_MAX];
+            streampath(parityPath, fpath, ".parity");
+            unlink(critPath);
+            unlink(noncritPath);
+            unlink(parityPath);
+            if (replica_set) {
+                replica_set->remove(critPath);
+            }
             unlink(fpath);
+            if (segment_store) {
+                segment_store->remove(fpath);
+            }
         }
         return 0;
 
@@ -357,16 +627,38 @@ static int criticalfs_rename(const char *from, const char *to, unsigned int flag
     fullpath(to_path, to);
 
     // Handle critical file components
-    std::string fromMapping = std::string(from_path) + ".mapping";
-    std::string fromCrit = std::string(from_path) + ".crit";
-    std::string fromNoncrit = std::string(from_path) + ".noncrit";
-    std::string toMapping = std::string(to_path) + ".mapping";
-    std::string toCrit = std::string(to_path) + ".crit";
-    std::string toNoncrit = std::string(to_path) + ".noncrit";
+    char fromMapping[PATH_MAX];
+    streampath(fromMapping, from_path, ".mapping");
+    char fromCrit[PATH_MAX];
+    streampath(fromCrit, from_path, ".crit");
+    char fromNoncrit[PATH_MAX];
+    streampath(fromNoncrit, from_path, ".noncrit");
+    char fromParity[PATH_MAX];
+    streampath(fromParity, from_path, ".parity");
+    char toMapping[PATH_MAX];
+    streampath(toMapping, to_path, ".mapping");
+    char toCrit[PATH_MAX];
+    streampath(toCrit, to_path, ".crit");
+    char toNoncrit[PATH_MAX];
+    streampath(toNoncrit, to_path, ".noncrit");
+    char toParity[PATH_MAX];
+    streampath(toParity, to_path, ".parity");
 
-    rename(fromMapping.c_str(), toMapping.c_str());
-    rename(fromCrit.c_str(), toCrit.c_str());
-    rename(fromNoncrit.c_str(), toNoncrit.c_str());
+    // Replaying logged updates of either path would recreate the source or overwrite the target
+    if (intent_log && (!intent_log->checkpointIfDirty(from_path) || !intent_log->checkpointIfDirty(to_path))) {
+        return -EIO;
+    }
+
+    rename(fromMapping, toMapping);
+    rename(fromCrit, toCrit);
+    rename(fromNoncrit, toNoncrit);
+    rename(fromParity, toParity);
+    if (replica_set) {
+        replica_set->rename(fromCrit, toCrit);
+    }
+    if (segment_store) {
+        segment_store->rename(from_path, to_path);
+    }
 
     // Rename the main file
     int res = rename(from_path, to_path);
@@ -382,8 +674,9 @@ static int criticalfs_truncate(const char *path, off_t size, struct fuse_file_in
     fullpath(fpath, path);
 
     // Check if this is a critical file
-    std::string mappingPath = std::string(fpath) + ".mapping";
-    if (access(mappingPath.c_str(), F_OK) == 0) {
+    char mappingPath[PATH_MAX];
+    streampath(mappingPath, fpath, ".mapping");
+    if (access(mappingPath, F_OK) == 0) {
         // For critical files, we'll allow truncate to 0 (which is what happens when moving to trash)
         if (size == 0) {
             return 0;
@@ -399,6 +692,175 @@ static int criticalfs_truncate(const char *path, off_t size, struct fuse_file_in
     return 0;
 }
 
+static int criticalfs_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi) {
+    RequestScope scope;
+    char fpath[PATH_MAX];
+    fullpath(fpath, path);
+
+    char mappingPath[PATH_MAX];
+    streampath(mappingPath, fpath, ".mapping");
+    if (access(mappingPath, F_OK) == 0) {
+        // Punching holes or collapsing ranges would shift bytes between the streams
+        if (mode & ~FALLOC_FL_KEEP_SIZE) {
+            return -EOPNOTSUPP;
+        }
+        auto handler = getFileHandler(path);
+        if (!handler) {
+            return -ENOENT;
+        }
+        if (handler->allocateFile(mappingPath, offset, length, mode & FALLOC_FL_KEEP_SIZE) != ResultCode::SUCCESS) {
+            return errno ? -errno : -EIO;
+        }
+        return 0;
+    }
+
+    int fd = passthrough_fd(fi);
+    bool opened = false;
+    if (fd == -1) {
+        fd = open(fpath, O_WRONLY);
+        if (fd == -1) {
+            return -errno;
+        }
+        opened = true;
+    }
+
+    int res = fallocate(fd, mode, offset, length);
+    if (res == -1) {
+        res = -errno;
+    }
+    if (opened) {
+        close(fd);
+    }
+    return res;
+}
+
+static off_t criticalfs_lseek(const char *path, off_t off, int whence, struct fuse_file_info *fi) {
+    RequestScope scope;
+    char fpath[PATH_MAX];
+    fullpath(fpath, path);
+
+    char mappingPath[PATH_MAX];
+    streampath(mappingPath, fpath, ".mapping");
+    if (access(mappingPath, F_OK) == 0) {
+        if (whence != SEEK_DATA && whence != SEEK_HOLE) {
+            return -EINVAL; // the kernel resolves the other modes itself
+        }
+        auto handler = getFileHandler(path);
+        if (!handler) {
+            return -ENOENT;
+        }
+        off_t res = handler->seekData(mappingPath, off, whence);
+        if (res == -1) {
+            return -errno;
+        }
+        return res;
+    }
+
+    int fd = passthrough_fd(fi);
+    bool opened = false;
+    if (fd == -1) {
+        fd = open(fpath, O_RDONLY);
+        if (fd == -1) {
+            return -errno;
+        }
+        opened = true;
+    }
+
+    off_t res = lseek(fd, off, whence);
+    if (res == -1) {
+        res = -errno;
+    }
+    if (opened) {
+        close(fd);
+    }
+    return res;
+}
+
+static ssize_t criticalfs_copy_file_range(const char *path_in, struct fuse_file_info *fi_in, off_t offset_in,
+                                          const char *path_out, struct fuse_file_info *fi_out, off_t offset_out,
+                                          size_t size, int flags) {
+    RequestScope scope;
+    char fpath_in[PATH_MAX], fpath_out[PATH_MAX];
+    fullpath(fpath_in, path_in);
+    fullpath(fpath_out, path_out);
+
+    char mappingIn[PATH_MAX];
+    streampath(mappingIn, fpath_in, ".mapping");
+    char mappingOut[PATH_MAX];
+    streampath(mappingOut, fpath_out, ".mapping");
+    bool splitIn = access(mappingIn, F_OK) == 0;
+    bool splitOut = access(mappingOut, F_OK) == 0;
+
+    // Full-file copy between files of the same type: copy the streams and the mapping as they are
+    if (splitIn && splitOut && offset_in == 0 && offset_out == 0) {
+        auto handlerIn = getFileHandler(path_in);
+        auto handlerOut = getFileHandler(path_out);
+        if (handlerIn && handlerOut && typeid(*handlerIn) == typeid(*handlerOut) &&
+            handlerIn->loadMapFromFile(mappingIn) == ResultCode::SUCCESS &&
+            handlerOut->loadMapFromFile(mappingOut) == ResultCode::SUCCESS) {
+            size_t sizeIn = handlerIn->getFileSize();
+            // Cloning would drop destination bytes past the source's end
+            if (size >= sizeIn && handlerOut->getFileSize() <= sizeIn) {
+                if (AbstractFileHandler::cloneStreams(fpath_in, fpath_out) != ResultCode::SUCCESS) {
+                    return -EIO;
+                }
+                return sizeIn;
+            }
+        }
+    }
+
+    // Plain files on both sides: let the backing filesystem copy
+    if (!splitIn && !splitOut) {
+        int fdIn = passthrough_fd(fi_in);
+        int fdOut = passthrough_fd(fi_out);
+        if (fdIn != -1 && fdOut != -1) {
+            ssize_t res = copy_file_range(fdIn, &offset_in, fdOut, &offset_out, size, flags);
+            return res == -1 ? -errno : res;
+        }
+    }
+
+    // Anything else is reassembled and re-split, one bounded chunk per call (short copies are allowed)
+    size_t chunk = std::min(size, (size_t) COPY_CHUNK_SIZE);
+    std::vector<char> buffer(chunk);
+    // The copy is stored, so it must not be built from degraded reads
+    int bytesRead = read_path(path_in, buffer.data(), chunk, offset_in, fi_in, false);
+    if (bytesRead <= 0) {
+        return bytesRead;
+    }
+    return criticalfs_write(path_out, buffer.data(), bytesRead, offset_out, fi_out);
+}
+
+static void *criticalfs_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    (void) conn;
+    (void) cfg;
+    // Background threads must be started here, after fuse_main has daemonized
+    if (segment_store) {
+        segment_store->startCompactor();
+    }
+    if (intent_log) {
+        intent_log->startCheckpointer();
+    }
+    if (config.write_threads > 1) {
+        // The request thread is one of them
+        write_pool = std::make_unique<ThreadPool>(config.write_threads - 1);
+        getStorageContext().workers = write_pool.get();
+    }
+    return NULL;
+}
+
+static void criticalfs_destroy(void *private_data) {
+    (void) private_data;
+    if (intent_log) {
+        intent_log->stopCheckpointer();
+        intent_log->checkpoint();
+    }
+    if (segment_store) {
+        segment_store->stopCompactor();
+    }
+    getStorageContext().workers = nullptr;
+    write_pool.reset();
+}
+
 // static int criticalfs_chmod(const char *path, mode_t mode, struct fuse_file_info *fi) {
 //     (void) fi;
 //     char fpath[PATH_MAX];
@@ -406,7 +868,7 @@ static int criticalfs_truncate(const char *path, off_t size, struct fuse_file_in
 
 //     // Check if this is a critical file
 //     std::string mappingPath = std::string(fpath) + ".mapping";
-//     bool is_critical = (access(mappingPath.c_str(), F_OK) == 0);
+//     bool is_critical = (access(mappingPath, F_OK) == 0);
 
 //     if (is_critical) {
 //         return 0;  // Don't allow mode changes for critical files
@@ -426,7 +888,7 @@ static int criticalfs_truncate(const char *path, off_t size, struct fuse_file_in
 
 //     // Check if this is a critical file
 //     std::string mappingPath = std::string(fpath) + ".mapping";
-//     bool is_critical = (access(mappingPath.c_str(), F_OK) == 0);
+//     bool is_critical = (access(mappingPath, F_OK) == 0);
 
 //     if (is_critical) {
 //         return 0;  // Don't allow ownership changes for critical files
@@ -456,18 +918,21 @@ static const struct fuse_operations criticalfs_oper = {
     .read        = criticalfs_read,
     .write       = criticalfs_write,
     // .statfs      = ...,
-    // .flush       = ...,
-    // .release     = ...,
-    // .fsync       = ...,
+    .flush       = criticalfs_flush,
+    .release     = criticalfs_release,
+    .fsync       = criticalfs_fsync,
     // ... xattr functions ...
     // .opendir     = ...,
     .readdir     = criticalfs_readdir,
     // .releasedir  = ...,
     // .fsyncdir    = ...,
-    // .init        = ...,
-    // .destroy     = ...,
+    .init        = criticalfs_init,
+    .destroy     = criticalfs_destroy,
     // .access      = ...,
     .create      = criticalfs_create,
+    .fallocate   = criticalfs_fallocate,
+    .copy_file_range = criticalfs_copy_file_range,
+    .lseek       = criticalfs_lseek,
     // ... other fields ...
 };
 
@@ -493,5 +958,135 @@ int main(int argc, char *argv[]) {
     }
 
     fprintf(stderr, "Using backing directory: %s\n", backing_dir_abs);
-    return fuse_main(argc, argv, &criticalfs_oper, NULL);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    config.write_threads = std::max(1u, std::thread::hardware_concurrency());
+    config.parity_stripe = getStorageContext().parityStripe;
+    config.hedge_percentile = 95;
+    config.hedge_delay_us = 2000;
+    if (fuse_opt_parse(&args, &config, criticalfs_opts, NULL) == -1) {
+        return 1;
+    }
+
+    if (config.small_file_threshold > 0) {
+        segment_store = std::make_unique<SegmentStore>(backing_dir_abs, config.small_file_threshold);
+        if (!segment_store->open()) {
+            fprintf(stderr, "Error: failed to open segment store\n");
+            return 1;
+        }
+        getStorageContext().segmentStore = segment_store.get();
+        fprintf(stderr, "Packing files up to %zu bytes into segments\n", config.small_file_threshold);
+    }
+
+    if (config.relaxed_noncrit) {
+        getStorageContext().durability = DurabilityPolicy::RELAXED_NONCRIT;
+        fprintf(stderr, "Relaxed durability: .noncrit streams are not synced\n");
+    }
+
+    if (config.mapping_templates) {
+        template_store = std::make_unique<TemplateStore>(backing_dir_abs);
+        if (!template_store->open()) {
+            fprintf(stderr, "Error: failed to open template store\n");
+            return 1;
+        }
+        getStorageContext().templateStore = template_store.get();
+        fprintf(stderr, "Sharing mapping templates of identical layouts\n");
+    }
+
+    // Before the intent log, whose replay writes the replicas too
+    if (config.crit_replicas && config.crit_replicas[0]) {
+        std::vector<std::string> roots;
+        std::string list = config.crit_replicas;
+        for (size_t start = 0; start <= list.size();) {
+            size_t end = std::min(list.find(':', start), list.size());
+            if (end > start) {
+                roots.push_back(list.substr(start, end - start));
+            }
+            start = end + 1;
+        }
+        replica_set = std::make_unique<ReplicaSet>(backing_dir_abs, roots, config.hedge_percentile,
+                                                   std::chrono::microseconds(config.hedge_delay_us));
+        if (roots.empty() || !replica_set->open()) {
+            fprintf(stderr, "Error: failed to open .crit replica roots\n");
+            return 1;
+        }
+        getStorageContext().replicas = replica_set.get();
+        fprintf(stderr, "Keeping %zu replicas of .crit streams, hedging reads after p%u\n", roots.size(),
+                config.hedge_percentile);
+    }
+
+    if (config.crit_key && config.crit_key[0]) {
+        if (!BlockCipher::supported()) {
+            fprintf(stderr, "Error: crit_key needs a build with libcrypto\n");
+            return 1;
+        }
+        if (!crit_key.load(config.crit_key)) {
+            fprintf(stderr, "Error: failed to load .crit key\n");
+            return 1;
+        }
+        getStorageContext().critKey = &crit_key;
+        fprintf(stderr, "Encrypting .crit streams with AES-256-GCM under %s\n", config.crit_key);
+    }
+
+    if (config.noncrit_compress && config.noncrit_compress[0]) {
+        NoncritCodec codec;
+        if (!BlockCompressor::parseCodec(config.noncrit_compress, codec)) {
+            fprintf(stderr, "Error: noncrit_compress must be lz4 or zstd\n");
+            return 1;
+        }
+        if (!BlockCompressor::supported(codec)) {
+            fprintf(stderr, "Error: this build has no %s support\n", config.noncrit_compress);
+            return 1;
+        }
+        getStorageContext().noncritCodec = codec;
+        fprintf(stderr, "Compressing .noncrit streams with %s in %zu KiB blocks\n", config.noncrit_compress,
+                BlockCompressor::BLOCK_SIZE / 1024);
+    }
+
+    // Set before the intent log replays, which rebuilds the .parity sidecars of the files it touches
+    if (config.parity > 0) {
+        if (config.parity_stripe == 0 || config.parity_stripe + config.parity > ReedSolomon::MAX_SHARDS) {
+            fprintf(stderr, "Error: parity stripes hold at most %u blocks\n", ReedSolomon::MAX_SHARDS);
+            return 1;
+        }
+        getStorageContext().parityShards = config.parity;
+        getStorageContext().parityStripe = config.parity_stripe;
+        fprintf(stderr, "Protecting .crit streams with %u+%u Reed-Solomon parity\n", config.parity_stripe, config.parity);
+    }
+
+    if (config.wal) {
+        std::string logPath = std::string(backing_dir_abs) + "/" + INTENT_LOG_NAME;
+        intent_log = std::make_unique<IntentLog>(logPath,
+            [](const IntentLog::Intent& update) {
+                return AbstractFileHandler::persistStreams(update) == ResultCode::SUCCESS;
+            },
+            [](const std::string& basePath) {
+                return AbstractFileHandler::syncStreams(basePath) == ResultCode::SUCCESS;
+            });
+        // Replays whatever a previous run left in the log before serving any request
+        if (!intent_log->open()) {
+            fprintf(stderr, "Error: failed to open intent log\n");
+            return 1;
+        }
+        getStorageContext().intentLog = intent_log.get();
+        fprintf(stderr, "Committing updates through intent log: %s\n", logPath.c_str());
+    }
+
+    if (config.write_threads > 1) {
+        fprintf(stderr, "Splitting large files on %u threads\n", config.write_threads);
+    }
+
+    if (config.noncrit_budget_us > 0) {
+        getStorageContext().noncritBudgetUs = config.noncrit_budget_us;
+        fprintf(stderr, "Non-critical reads slower than %u us return zeros\n", config.noncrit_budget_us);
+    }
+
+    if (config.mapping_index > 0) {
+        getStorageContext().mappingIndexThreshold = config.mapping_index;
+        fprintf(stderr, "Storing mappings of %zu or more extents as a paged index\n", config.mapping_index);
+    }
+
+    int ret = fuse_main(args.argc, args.argv, &criticalfs_oper, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
 } 
\ No newline at end of file
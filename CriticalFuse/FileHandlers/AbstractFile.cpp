@@ -1,28 +1,508 @@
 #include "AbstractFile.h"
+#include "StreamReader.h"
+#include "MappingBuilder.h"
+#include "MappingIndex.h"
+#include "../Utilities/StorageContext.h"
+#include "../Utilities/SegmentStore.h"
+#include "../Utilities/IntentLog.h"
+#include "../Utilities/ThreadPool.h"
+#include "../Utilities/ScatterWrite.h"
+#include "../Utilities/RequestArena.h"
+#include "../Utilities/TemplateStore.h"
+#include "../Utilities/Metrics.h"
+#include "../Utilities/StreamParity.h"
+#include "../Utilities/ReplicaSet.h"
+#include "../Utilities/StreamFile.h"
 
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <stdexcept>
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <algorithm>
+#include <functional>
+#include <charconv>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <fcntl.h>      // For open
 #include <unistd.h>     // For close, read, lseek
 #include <sys/types.h>  // For off_t, ssize_t
+#include <sys/stat.h>   // For fstat
+#include <sys/ioctl.h>  // For ioctl
+#include <linux/fs.h>   // For FICLONE
 
 
 
 
-std::map<Range, std::pair<Range, CriticalType>>& AbstractFileHandler::getFileMap() {
+namespace {
+
+// Granularity of hole detection, matches the page size of the backing filesystem
+const size_t HOLE_BLOCK_SIZE = 4096;
+
+// Files up to this size are merged and split in memory; larger ones are processed in windows
+// of this size (a multiple of HOLE_BLOCK_SIZE, so hole blocks never straddle two windows)
+const size_t WRITE_WINDOW_SIZE = 8 * 1024 * 1024;
+
+// Suffix of the stream files a windowed write builds before they replace the live ones
+const char* const STAGED_SUFFIX = ".staged";
+
+// Dead bytes a stream may carry beyond its live ones before a tail rewrite gives way to a full one
+const size_t TAIL_REWRITE_SLACK = 1024 * 1024;
+
+// Bytes copied from the merged source to a stream per write when rewriting a tail
+const size_t TAIL_COPY_BLOCK = 1024 * 1024;
+
+// Whether a compressed .noncrit stream holds more dead bytes, left by blocks that moved, than
+// live ones, so the next write should rewrite it in full
+bool needsCompaction(const BlockCompressor& compressor) {
+    return compressor.storedLength() > 2 * compressor.liveBytes() + TAIL_REWRITE_SLACK;
+}
+
+// Smallest share of a buffer worth handing to another thread
+const size_t PARALLEL_SLICE_MIN = 1024 * 1024;
+
+// Runs task(0) ... task(count - 1) on the mount's worker pool, or one after the other without one
+void runParallel(size_t count, const std::function<void(size_t)>& task) {
+    ThreadPool* workers = getStorageContext().workers;
+    if (workers) {
+        workers->parallelFor(count, task);
+        return;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        task(i);
+    }
+}
+
+// Number of slices to split size bytes of work into: one per thread, unless that makes them too small
+size_t sliceCount(size_t size) {
+    ThreadPool* workers = getStorageContext().workers;
+    if (!workers) {
+        return 1;
+    }
+    return std::max<size_t>(1, std::min<size_t>(workers->concurrency(), size / PARALLEL_SLICE_MIN));
+}
+
+bool isZeroBlock(const char* data, size_t size) {
+    return size == 0 || (data[0] == 0 && std::memcmp(data, data + 1, size - 1) == 0);
+}
+
+// Appends the all-zero blocks of data, which starts at logical offset base, to holes,
+// merging neighbours into one hole
+void findZeroBlocks(const char* data, size_t size, size_t base, std::vector<std::pair<size_t, size_t>>& holes) {
+    for (size_t blockStart = 0; blockStart < size; blockStart += HOLE_BLOCK_SIZE) {
+        size_t blockSize = std::min(HOLE_BLOCK_SIZE, size - blockStart);
+        if (!isZeroBlock(data + blockStart, blockSize)) {
+            continue;
+        }
+        size_t start = base + blockStart;
+        if (!holes.empty() && holes.back().second + 1 == start) {
+            holes.back().second = start + blockSize - 1;
+        } else {
+            holes.emplace_back(start, start + blockSize - 1);
+        }
+    }
+}
+
+// findZeroBlocks split across the worker pool, in slices of whole hole blocks
+void findZeroBlocksParallel(const char* data, size_t size, size_t base, std::vector<std::pair<size_t, size_t>>& holes) {
+    size_t slices = sliceCount(size);
+    size_t blocks = (size + HOLE_BLOCK_SIZE - 1) / HOLE_BLOCK_SIZE;
+    size_t sliceSize = (blocks + slices - 1) / slices * HOLE_BLOCK_SIZE;
+    std::vector<std::vector<std::pair<size_t, size_t>>> found(slices);
+    runParallel(slices, [&](size_t slice) {
+        size_t from = std::min(size, slice * sliceSize);
+        size_t to = std::min(size, from + sliceSize);
+        findZeroBlocks(data + from, to - from, base + from, found[slice]);
+    });
+
+    // Holes may continue across slice boundaries
+    for (const auto& sliceHoles : found) {
+        for (const auto& hole : sliceHoles) {
+            if (!holes.empty() && holes.back().second + 1 == hole.first) {
+                holes.back().second = hole.second;
+            } else {
+                holes.push_back(hole);
+            }
+        }
+    }
+}
+
+bool writeAll(int fd, const char* data, size_t size, off_t offset) {
+    size_t written = 0;
+    while (written < size) {
+        ssize_t res = pwrite(fd, data + written, size - written, offset + written);
+        if (res < 0) {
+            return false;
+        }
+        written += res;
+    }
+    return true;
+}
+
+// Reserves the final size of a stream file up front, so the filesystem can hand out one
+// contiguous extent instead of growing the file append by append
+bool reserveStreamFile(int fd, size_t size) {
+    if (size > 0 && fallocate(fd, 0, 0, size) == -1 && errno != EOPNOTSUPP && errno != ENOSYS) {
+        std::perror("fallocate failed");
+        return false;
+    }
+    return true;
+}
+
+const char* typeName(CriticalType type) {
+    switch (type) {
+        case CriticalType::CRITICAL_DATA: return "CRITICAL_DATA";
+        case CriticalType::NON_CRITICAL_DATA: return "NON_CRITICAL_DATA";
+        case CriticalType::HOLE_DATA: return "HOLE_DATA";
+    }
+    return "UNKNOWN";
+}
+
+// Appends the bytes [start, start + length) of data to a stream's pieces, extending the last
+// piece when they are contiguous with it
+void addStreamPiece(std::vector<struct iovec>& pieces, const char* data, size_t start, size_t length) {
+    char* base = const_cast<char*>(data) + start;
+    if (!pieces.empty() && static_cast<char*>(pieces.back().iov_base) + pieces.back().iov_len == base) {
+        pieces.back().iov_len += length;
+        return;
+    }
+    pieces.push_back({base, length});
+}
+
+// Recreates a stream file with its final size reserved up front, written from its pieces
+bool writeStreamFile(const std::string& path, const std::vector<struct iovec>& pieces, size_t size) {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        std::perror(("Failed to open " + path + " for writing").c_str());
+        return false;
+    }
+
+    if (!reserveStreamFile(fd, size)) {
+        close(fd);
+        return false;
+    }
+    if (!pwritevAll(fd, pieces, 0)) {
+        std::perror(("Failed to write " + path).c_str());
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+    return true;
+}
+
+// Serializes the writes a stream file held as intent log patches: offset and length as u64,
+// then the bytes
+std::vector<char> encodePatches(const StreamFile& file) {
+    std::vector<char> out;
+    for (const auto& [offset, bytes] : file.heldWrites()) {
+        uint64_t header[2] = {offset, bytes.size()};
+        const char* raw = reinterpret_cast<const char*>(header);
+        out.insert(out.end(), raw, raw + sizeof(header));
+        out.insert(out.end(), bytes.begin(), bytes.end());
+    }
+    return out;
+}
+
+// Writes logged patches to their stream file; [from, to) is set to the range they cover
+bool applyPatches(int fd, const std::vector<struct iovec>& pieces, uint64_t& from, uint64_t& to) {
+    std::string patches;
+    for (const struct iovec& piece : pieces) {
+        patches.append(static_cast<const char*>(piece.iov_base), piece.iov_len);
+    }
+    from = UINT64_MAX;
+    to = 0;
+    for (size_t pos = 0; pos < patches.size();) {
+        uint64_t header[2];
+        if (patches.size() - pos < sizeof(header)) {
+            std::cerr << "Truncated stream patch in intent\n";
+            return false;
+        }
+        std::memcpy(header, patches.data() + pos, sizeof(header));
+        pos += sizeof(header);
+        if (header[1] > patches.size() - pos) {
+            std::cerr << "Truncated stream patch in intent\n";
+            return false;
+        }
+        if (!writeAll(fd, patches.data() + pos, header[1], header[0])) {
+            std::perror("Failed to patch stream file");
+            return false;
+        }
+        from = std::min(from, header[0]);
+        to = std::max(to, header[0] + header[1]);
+        pos += header[1];
+    }
+    return true;
+}
+
+// Makes dst a copy of src: a reflink where the backing filesystem supports it, otherwise an
+// in-kernel copy_file_range, so the bytes never pass through this process
+bool cloneBackingFile(const std::string& src, const std::string& dst) {
+    int fdIn = open(src.c_str(), O_RDONLY);
+    if (fdIn < 0) {
+        std::perror(("Failed to open " + src).c_str());
+        return false;
+    }
+    int fdOut = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fdOut < 0) {
+        std::perror(("Failed to open " + dst + " for writing").c_str());
+        close(fdIn);
+        return false;
+    }
+
+    bool ok = ioctl(fdOut, FICLONE, fdIn) == 0;
+    if (!ok) {
+        struct stat st;
+        ok = fstat(fdIn, &st) == 0;
+        off_t remaining = ok ? st.st_size : 0;
+        while (ok && remaining > 0) {
+            ssize_t copied = copy_file_range(fdIn, NULL, fdOut, NULL, remaining, 0);
+            if (copied <= 0) {
+                std::perror(("copy_file_range failed for " + dst).c_str());
+                ok = false;
+                break;
+            }
+            remaining -= copied;
+        }
+    }
+
+    close(fdIn);
+    close(fdOut);
+    return ok;
+}
+
+// Brings the .parity sidecar and the replicas of the .crit stream up to date after [from, to)
+// of it changed and it grew or shrank to length; removes the sidecar if parity is disabled
+bool updateRedundancy(int fdCrit, const std::string& basePath, uint64_t from, uint64_t to, uint64_t length,
+                      bool parity = true) {
+    const StorageContext& context = getStorageContext();
+    bool ok = !parity || StreamParity::update(fdCrit, basePath + ".parity", from, to, length, context.parityStripe,
+                                              context.parityShards);
+    if (context.replicas && !context.replicas->mirror(fdCrit, basePath + ".crit", from, to, length)) {
+        std::cerr << "Failed to update replicas of " << basePath << ".crit\n";
+        ok = false;
+    }
+    return ok;
+}
+
+// Recomputes the whole .parity sidecar and copies the replicas after the .crit stream was
+// rewritten; without parity a sidecar cloned along with the stream is left alone
+bool rebuildRedundancy(const std::string& basePath, bool parity = true) {
+    const StorageContext& context = getStorageContext();
+    if (!context.replicas && (!parity || context.parityShards == 0)) {
+        return !parity || updateRedundancy(-1, basePath, 0, 0, 0);
+    }
+    std::string critPath = basePath + ".crit";
+    int fd = open(critPath.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) == -1) {
+        std::perror(("Failed to open " + critPath + " for parity and replicas").c_str());
+        if (fd >= 0) close(fd);
+        return false;
+    }
+    bool ok = updateRedundancy(fd, basePath, 0, st.st_size, st.st_size, parity);
+    close(fd);
+    return ok;
+}
+
+// The file as it looks after a write: the existing content, read through its old mapping,
+// with the written buffer laid over it
+class MergedSource : public ByteSource {
+public:
+    MergedSource(StreamReader& oldStreams, const FileMap& oldMap, size_t oldSize,
+                 const char* buffer, size_t size, size_t offset)
+        : oldStreams(oldStreams), oldMap(oldMap), oldSize(oldSize), buffer(buffer), writeSize(size), writeOffset(offset) {}
+
+    uint64_t size() const override {
+        return std::max(oldSize, writeOffset + writeSize);
+    }
+
+    bool read(uint64_t pos, size_t length, char* out) override {
+        if (pos > size() || length > size() - pos) {
+            return false;
+        }
+        if (length == 0) {
+            return true;
+        }
+        size_t existing = pos < oldSize ? std::min<size_t>(length, oldSize - pos) : 0;
+        if (existing > 0 && !oldStreams.read(oldMap, out, existing, pos)) {
+            std::cerr << "Failed to reconstruct existing data\n";
+            return false;
+        }
+        std::memset(out + existing, 0, length - existing);
+
+        uint64_t from = std::max<uint64_t>(pos, writeOffset);
+        uint64_t to = std::min<uint64_t>(pos + length, writeOffset + writeSize);
+        if (from < to && buffer) {
+            std::memcpy(out + (from - pos), buffer + (from - writeOffset), to - from);
+        } else if (from < to) {
+            std::memset(out + (from - pos), 0, to - from);
+        }
+        return true;
+    }
+
+private:
+    StreamReader& oldStreams;
+    const FileMap& oldMap;
+    size_t oldSize;
+    const char* buffer;
+    size_t writeSize;
+    size_t writeOffset;
+};
+
+// [start, end] of a mapping with its type; -1 for bytes no extent covers
+struct Piece {
+    int64_t start;
+    int64_t end;
+    int type;
+};
+
+std::vector<Piece> piecesOf(const FileMap& fileMap, int64_t size) {
+    std::vector<Piece> pieces;
+    int64_t pos = 0;
+    for (const auto& [range, mappedPair] : fileMap) {
+        if (range.getStart() > pos) {
+            pieces.push_back({pos, range.getStart() - 1, -1});
+        }
+        pieces.push_back({range.getStart(), range.getEnd(), static_cast<int>(mappedPair.second)});
+        pos = range.getEnd() + 1;
+    }
+    if (pos < size) {
+        pieces.push_back({pos, size - 1, -1});
+    }
+    return pieces;
+}
+
+// Whether newMap classifies every byte of the file like oldMap does. Holes of oldMap may be
+// classified as anything as long as [writeStart, writeEnd] leaves them alone: they are still zero.
+bool sameClassification(const FileMap& oldMap, const FileMap& newMap,
+                        int64_t size, int64_t writeStart, int64_t writeEnd) {
+    std::vector<Piece> before = piecesOf(oldMap, size);
+    std::vector<Piece> after = piecesOf(newMap, size);
+    size_t i = 0;
+    size_t j = 0;
+    while (i < before.size() && j < after.size()) {
+        int64_t start = std::max(before[i].start, after[j].start);
+        int64_t end = std::min(before[i].end, after[j].end);
+        if (before[i].type != after[j].type) {
+            bool untouchedHole = before[i].type == static_cast<int>(CriticalType::HOLE_DATA) &&
+                                 (end < writeStart || start > writeEnd);
+            if (!untouchedHole) {
+                return false;
+            }
+        }
+        if (before[i].end == end) i++;
+        if (after[j].end == end) j++;
+    }
+    return i == before.size() && j == after.size();
+}
+
+// Parses "start-end" at pos and advances pos past it
+bool parseRange(const char*& pos, const char* end, int64_t& rangeStart, int64_t& rangeEnd) {
+    std::from_chars_result result = std::from_chars(pos, end, rangeStart);
+    if (result.ec != std::errc() || result.ptr == end || *result.ptr != '-') {
+        return false;
+    }
+    result = std::from_chars(result.ptr + 1, end, rangeEnd);
+    if (result.ec != std::errc()) {
+        return false;
+    }
+    pos = result.ptr;
+    return true;
+}
+
+struct ParsedExtent {
+    int64_t origStart;
+    int64_t origEnd;
+    int64_t mappedStart;
+    int64_t mappedEnd;
+    CriticalType type;
+};
+
+// Parses an extent line: "origStart-origEnd mappedStart-mappedEnd TYPE"
+bool parseExtentLine(std::string_view line, ParsedExtent& extent) {
+    const char* pos = line.data();
+    const char* lineEnd = line.data() + line.size();
+    bool parsed = parseRange(pos, lineEnd, extent.origStart, extent.origEnd) && pos < lineEnd && *pos++ == ' ' &&
+                  parseRange(pos, lineEnd, extent.mappedStart, extent.mappedEnd) && pos < lineEnd && *pos++ == ' ';
+    if (!parsed) {
+        return false;
+    }
+
+    // Parse critical type
+    std::string_view typeStr(pos, lineEnd - pos);
+    if (typeStr == "CRITICAL_DATA") {
+        extent.type = CriticalType::CRITICAL_DATA;
+    } else if (typeStr == "NON_CRITICAL_DATA") {
+        extent.type = CriticalType::NON_CRITICAL_DATA;
+    } else if (typeStr == "HOLE_DATA") {
+        extent.type = CriticalType::HOLE_DATA;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+using MappingTemplate = std::vector<ParsedExtent>;
+
+// Extent list of a mapping template, read and parsed once per process: templates are
+// immutable and named by their contents, so a cached one never goes stale
+std::shared_ptr<const MappingTemplate> loadTemplate(uint64_t id) {
+    static std::mutex mutex;
+    static std::unordered_map<uint64_t, std::shared_ptr<const MappingTemplate>> cache;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = cache.find(id);
+        if (it != cache.end()) {
+            return it->second;
+        }
+    }
+
+    TemplateStore* templateStore = getStorageContext().templateStore;
+    std::string contents;
+    if (!templateStore || !templateStore->get(id, contents)) {
+        std::cerr << "Missing mapping template " << std::hex << id << std::dec << std::endl;
+        return nullptr;
+    }
+    auto parsed = std::make_shared<MappingTemplate>();
+    std::string_view text(contents);
+    while (!text.empty()) {
+        size_t lineEnd = text.find('\n');
+        std::string_view line = text.substr(0, lineEnd);
+        text.remove_prefix(lineEnd == std::string_view::npos ? text.size() : lineEnd + 1);
+        ParsedExtent extent;
+        if (!parseExtentLine(line, extent)) {
+            std::cerr << "Malformed line in mapping template: " << line << std::endl;
+            return nullptr;
+        }
+        parsed->push_back(extent);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    return cache.emplace(id, std::move(parsed)).first->second;
+}
+
+} // namespace
+
+AbstractFileHandler::AbstractFileHandler()
+    : fileMap(requestResource()), critChecksums(requestResource()), critCipher(requestResource()),
+      noncritCompressor(requestResource()) {}
+
+FileMap& AbstractFileHandler::getFileMap() {
     return fileMap;
 }
 
-ResultCode AbstractFileHandler::setFileMap(const std::map<Range, std::pair<Range, CriticalType>>& newFileMap) {
+ResultCode AbstractFileHandler::setFileMap(const FileMap& newFileMap) {
     fileMap = newFileMap;
     return ResultCode::SUCCESS;
 }
 
 
-ResultCode AbstractFileHandler::addToFileMap(int origStart, int origEnd, int mappedStart, int mappedEnd, CriticalType type) {
+ResultCode AbstractFileHandler::addToFileMap(int64_t origStart, int64_t origEnd, int64_t mappedStart, int64_t mappedEnd, CriticalType type) {
     try {
         Range originalRange(origStart, origEnd);
         Range mappedRange(mappedStart, mappedEnd);
@@ -35,161 +515,262 @@ ResultCode AbstractFileHandler::addToFileMap(int origStart, int origEnd, int map
 }
 
 ResultCode AbstractFileHandler::loadMapFromFile(const char* mappingPath) {
+    return loadMapping(mappingPath, 0, INT64_MAX);
+}
 
-    std::ifstream inFile(mappingPath);
-    if (!inFile.is_open()) {
+ResultCode AbstractFileHandler::loadMapping(const char* mappingPath, int64_t first, int64_t last) {
+    // Read with plain syscalls into request memory: this runs on every read of a split file
+    int fd = open(mappingPath, O_RDONLY);
+    if (fd < 0) {
         std::cerr << "Failed to open mapping file: " << mappingPath << std::endl;
         return ResultCode::FAILURE;
     }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        std::perror("fstat failed");
+        close(fd);
+        return ResultCode::FAILURE;
+    }
 
-    std::string line;
-
-    while (std::getline(inFile, line)) {
-        std::istringstream iss(line);
-        std::string originalRangeStr, mappedRangeStr, typeStr;
+    critChecksums.clear(); // unless the mapping records them
+    critCipher.clear();
+    noncritCompressor.clear();
 
-        if (!(iss >> originalRangeStr >> mappedRangeStr >> typeStr)) {
-            std::cerr << "Malformed line: " << line << std::endl;
+    // Paged index: only the pages leading to [first, last] are read
+    char magic[8];
+    ssize_t magicRead = pread(fd, magic, sizeof(magic), 0);
+    if (magicRead > 0 && isMappingIndex(magic, magicRead)) {
+        MappingIndexReader index;
+        std::pmr::vector<char> annotations(requestResource());
+        bool loaded = index.open(fd) && index.loadRange(first, last, fileMap) && index.readAnnotations(annotations);
+        close(fd);
+        if (!loaded) {
+            std::cerr << "Failed to load mapping index: " << mappingPath << std::endl;
             return ResultCode::FAILURE;
         }
+        return loadAnnotationLines(std::string_view(annotations.data(), annotations.size()));
+    }
 
-        // Parse original range
-        int origStart, origEnd;
-        size_t dashPos = originalRangeStr.find('-');
-        if (dashPos == std::string::npos) return ResultCode::FAILURE;
-        origStart = std::stoi(originalRangeStr.substr(0, dashPos));
-        origEnd = std::stoi(originalRangeStr.substr(dashPos + 1));
+    std::pmr::vector<char> contents(st.st_size, requestResource());
+    size_t loaded = 0;
+    while (loaded < contents.size()) {
+        ssize_t bytesRead = pread(fd, contents.data() + loaded, contents.size() - loaded, loaded);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            break; // truncated concurrently, parse what was read
+        }
+        loaded += bytesRead;
+    }
+    close(fd);
 
-        // Parse mapped range
-        int mappedStart, mappedEnd;
-        dashPos = mappedRangeStr.find('-');
-        if (dashPos == std::string::npos) return ResultCode::FAILURE;
-        mappedStart = std::stoi(mappedRangeStr.substr(0, dashPos));
-        mappedEnd = std::stoi(mappedRangeStr.substr(dashPos + 1));
+    // Extent lines were written in logical order (serializeMap), so they are appended in bulk
+    std::string_view text(contents.data(), loaded);
+    MappingBuilder extents(fileMap.get_allocator().resource());
+    extents.reserve(std::count(text.begin(), text.end(), '\n'));
+    while (!text.empty()) {
+        size_t lineEnd = text.find('\n');
+        std::string_view line = text.substr(0, lineEnd);
+        text.remove_prefix(lineEnd == std::string_view::npos ? text.size() : lineEnd + 1);
+        if (line.empty()) {
+            continue;
+        }
 
-        // Parse critical type
-        CriticalType type;
-        if (typeStr == "CRITICAL_DATA") {
-            type = CriticalType::CRITICAL_DATA;
-        } else if (typeStr == "NON_CRITICAL_DATA") {
-            type = CriticalType::NON_CRITICAL_DATA;
-        } else {
-            std::cerr << "Unknown CriticalType: " << typeStr << std::endl;
-            return ResultCode::FAILURE;
+        if (line[0] == '@') {
+            if (loadMappingAnnotation(line.substr(1)) != ResultCode::SUCCESS) {
+                std::cerr << "Malformed annotation: " << line << std::endl;
+                return ResultCode::FAILURE;
+            }
+            continue;
+        }
+
+        // A layout shared with other files: its extents are kept in the template store
+        if (line[0] == '&') {
+            uint64_t id = 0;
+            std::from_chars_result result = std::from_chars(line.data() + 1, line.data() + line.size(), id, 16);
+            std::shared_ptr<const MappingTemplate> shared;
+            if (result.ec != std::errc() || result.ptr != line.data() + line.size() || !(shared = loadTemplate(id))) {
+                std::cerr << "Failed to load mapping template: " << line << std::endl;
+                return ResultCode::FAILURE;
+            }
+            extents.reserve(extents.size() + shared->size());
+            for (const ParsedExtent& extent : *shared) {
+                extents.append(extent.origStart, extent.origEnd, extent.mappedStart, extent.mappedEnd, extent.type);
+            }
+            continue;
         }
 
-        
-        if(addToFileMap(origStart, origEnd, mappedStart, mappedEnd, type) != ResultCode::SUCCESS)
-        {        
-            std::cerr << "Failed to add line to file map: " << line << std::endl;
+        ParsedExtent extent;
+        if (!parseExtentLine(line, extent)) {
+            std::cerr << "Malformed line: " << line << std::endl;
             return ResultCode::FAILURE;
         }
+        extents.append(extent.origStart, extent.origEnd, extent.mappedStart, extent.mappedEnd, extent.type);
     }
 
-    inFile.close();
+    fileMap.clear();
+    if (extents.finalize(fileMap) != ResultCode::SUCCESS) {
+        std::cerr << "Invalid extents in mapping file: " << mappingPath << std::endl;
+        return ResultCode::FAILURE;
+    }
     return ResultCode::SUCCESS;
 }
 
-ResultCode AbstractFileHandler::saveMapToFile(const char* mappingPath) {
+ResultCode AbstractFileHandler::loadAnnotationLines(std::string_view lines) {
+    while (!lines.empty()) {
+        size_t lineEnd = lines.find('\n');
+        std::string_view line = lines.substr(0, lineEnd);
+        lines.remove_prefix(lineEnd == std::string_view::npos ? lines.size() : lineEnd + 1);
+        if (line.empty()) {
+            continue;
+        }
+        if (line[0] != '@' || loadMappingAnnotation(line.substr(1)) != ResultCode::SUCCESS) {
+            std::cerr << "Malformed annotation: " << line << std::endl;
+            return ResultCode::FAILURE;
+        }
+    }
+    return ResultCode::SUCCESS;
+}
 
-    std::ofstream outFile(mappingPath, std::ios::binary | std::ios::trunc);
-    if (!outFile.is_open()) {
-        std::cerr << "Failed to open file for writing: " << mappingPath << std::endl;
+ResultCode AbstractFileHandler::getMappingSize(const char* mappingPath, uint64_t& logicalSize, uint64_t& storedBytes) {
+    // A paged index records both in its header
+    int fd = open(mappingPath, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "Failed to open mapping file: " << mappingPath << std::endl;
         return ResultCode::FAILURE;
     }
-
-    for (const auto& entry : fileMap) {
-        const Range& original_range = entry.first;
-        const Range& mapped_range = entry.second.first;
-        CriticalType type = entry.second.second;
-
-        outFile << original_range.getStart() << '-' << original_range.getEnd() << ' '
-                << mapped_range.getStart() << '-' << mapped_range.getEnd() << ' '
-                << (type == CriticalType::CRITICAL_DATA ? "CRITICAL_DATA" : "NON_CRITICAL_DATA") << '\n';
+    char magic[8];
+    ssize_t magicRead = pread(fd, magic, sizeof(magic), 0);
+    if (magicRead > 0 && isMappingIndex(magic, magicRead)) {
+        MappingIndexReader index;
+        bool opened = index.open(fd);
+        close(fd);
+        if (!opened) {
+            return ResultCode::FAILURE;
+        }
+        logicalSize = index.logicalSize();
+        storedBytes = index.storedBytes();
+        return ResultCode::SUCCESS;
     }
+    close(fd);
 
-    outFile.close();
+    if (loadMapFromFile(mappingPath) != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
+    }
+    logicalSize = getFileSize();
+    storedBytes = 0;
+    for (const auto& [range, mappedPair] : fileMap) {
+        if (mappedPair.second != CriticalType::HOLE_DATA) {
+            storedBytes += range.getEnd() - range.getStart() + 1;
+        }
+    }
     return ResultCode::SUCCESS;
 }
 
-ResultCode AbstractFileHandler::readFile(const char* mappingPath, char* buffer, size_t size, off_t offset) {
-    // Load the mapping
-    if (loadMapFromFile(mappingPath) != ResultCode::SUCCESS) {
-        std::cerr << "Failed to load file map from: " << mappingPath << std::endl;
-        return ResultCode::FAILURE;
+std::string AbstractFileHandler::serializeMap() const {
+    // Mappings too large to parse on every request are stored as a paged index
+    size_t indexThreshold = getStorageContext().mappingIndexThreshold;
+    if (indexThreshold > 0 && fileMap.size() >= indexThreshold) {
+        return buildMappingIndex(fileMap, serializeMappingAnnotations());
     }
 
-    std::memset(buffer, 0, size);  // zero-initialize output buffer
+    std::ostringstream out;
+    for (const auto& entry : fileMap) {
+        const Range& original_range = entry.first;
+        const Range& mapped_range = entry.second.first;
+        CriticalType type = entry.second.second;
 
-    // Derive base path by removing ".mapping" suffix
-    std::string basePath(mappingPath);
-    const std::string mappingSuffix = ".mapping";
-    if (basePath.size() <= mappingSuffix.size() || basePath.substr(basePath.size() - mappingSuffix.size()) != mappingSuffix) {
-        std::cerr << "Invalid mappingPath: missing .mapping suffix\n";
-        return ResultCode::FAILURE;
+        out << original_range.getStart() << '-' << original_range.getEnd() << ' '
+            << mapped_range.getStart() << '-' << mapped_range.getEnd() << ' '
+            << typeName(type) << '\n';
     }
-    basePath = basePath.substr(0, basePath.size() - mappingSuffix.size());
 
-    // Create paths for critical and non-critical data
-    std::string criticalPath = basePath + ".crit";
-    std::string nonCriticalPath = basePath + ".noncrit";
+    // Layouts shared by many files are stored once and referenced by id; annotations stay per file
+    TemplateStore* templateStore = getStorageContext().templateStore;
+    uint64_t id;
+    if (templateStore && usesMappingTemplates() && fileMap.size() > 1 && templateStore->put(out.str(), id)) {
+        char reference[20];
+        snprintf(reference, sizeof(reference), "&%016llx\n", static_cast<unsigned long long>(id));
+        return reference + serializeMappingAnnotations();
+    }
+    out << serializeMappingAnnotations();
+    return out.str();
+}
+
+std::string AbstractFileHandler::serializeAnnotations() const {
+    return "";
+}
 
-    int fdCrit = open(criticalPath.c_str(), O_RDONLY);
-    int fdNonCrit = open(nonCriticalPath.c_str(), O_RDONLY);
+std::string AbstractFileHandler::serializeMappingAnnotations() const {
+    return serializeAnnotations() + critChecksums.serialize() + critCipher.serialize() + noncritCompressor.serialize();
+}
 
-    if (fdCrit < 0 || fdNonCrit < 0) {
-        std::perror("Failed to open critical or non-critical data file");
-        if (fdCrit >= 0) close(fdCrit);
-        if (fdNonCrit >= 0) close(fdNonCrit);
+ResultCode AbstractFileHandler::loadMappingAnnotation(std::string_view annotation) {
+    bool handled = false;
+    if (!critChecksums.load(annotation, handled) || (!handled && !critCipher.load(annotation, handled)) ||
+        (!handled && !noncritCompressor.load(annotation, handled))) {
         return ResultCode::FAILURE;
     }
+    return handled ? ResultCode::SUCCESS : loadAnnotation(annotation);
+}
 
-    off_t readEnd = offset + size - 1;
-    bool readSuccess = true;
+ResultCode AbstractFileHandler::loadAnnotation(std::string_view annotation) {
+    (void) annotation;
+    return ResultCode::SUCCESS;
+}
 
-    for (const auto& [originalRange, mappedPair] : fileMap) {
-        const Range& mappedRange = mappedPair.first;
-        CriticalType type = mappedPair.second;
+void AbstractFileHandler::restoreStructure(char* buffer, size_t size, off_t offset) const {
+    (void) buffer;
+    (void) size;
+    (void) offset;
+}
 
-        // Skip if not overlapping with read range
-        if (readEnd < originalRange.getStart() || offset > originalRange.getEnd()) {
-            continue;
-        }
+bool AbstractFileHandler::usesMappingTemplates() const {
+    return false;
+}
 
-        // Calculate overlap
-        // we want to read [overlapStart, overlapEnd] from the orignal range 
-        int overlapStart = std::max(static_cast<int>(offset), originalRange.getStart());
-        int overlapEnd = std::min(static_cast<int>(readEnd), originalRange.getEnd());
-        size_t bytesToRead = overlapEnd - overlapStart + 1;
+ResultCode AbstractFileHandler::saveMapToFile(const char* mappingPath) {
 
-        size_t bufferOffset = overlapStart - offset;
-        off_t mappedOffset = mappedRange.getStart() + std::max(0, overlapStart - originalRange.getStart());
+    std::ofstream outFile(mappingPath, std::ios::binary | std::ios::trunc);
+    if (!outFile.is_open()) {
+        std::cerr << "Failed to open file for writing: " << mappingPath << std::endl;
+        return ResultCode::FAILURE;
+    }
 
-        int fd = (type == CriticalType::CRITICAL_DATA) ? fdCrit : fdNonCrit;
+    outFile << serializeMap();
 
-        if (lseek(fd, mappedOffset, SEEK_SET) < 0) {
-            std::perror("lseek failed");
-            readSuccess = false;
-            break;
-        }
+    outFile.close();
+    return ResultCode::SUCCESS;
+}
 
-        ssize_t bytesRead = read(fd, buffer + bufferOffset, bytesToRead);
-        if (bytesRead < 0) {
-            std::perror("read failed");
-            readSuccess = false;
-            break;
-        }
-        if (static_cast<size_t>(bytesRead) != bytesToRead) {
-            std::cerr << "Incomplete read: expected " << bytesToRead << " bytes, got " << bytesRead << std::endl;
-            readSuccess = false;
-            break;
-        }
+ResultCode AbstractFileHandler::readFile(const char* mappingPath, char* buffer, size_t size, off_t offset,
+                                         bool degradable) {
+    // Load the extents of the requested range (all of them unless the mapping is a paged index)
+    if (loadMapping(mappingPath, offset, offset + static_cast<int64_t>(size) - 1) != ResultCode::SUCCESS) {
+        std::cerr << "Failed to load file map from: " << mappingPath << std::endl;
+        return ResultCode::FAILURE;
     }
 
-    close(fdCrit);
-    close(fdNonCrit);
+    // Derive base path by removing ".mapping" suffix (a view, nothing is copied)
+    std::string_view basePath(mappingPath);
+    const std::string_view mappingSuffix = ".mapping";
+    if (basePath.size() <= mappingSuffix.size() || basePath.substr(basePath.size() - mappingSuffix.size()) != mappingSuffix) {
+        std::cerr << "Invalid mappingPath: missing .mapping suffix\n";
+        return ResultCode::FAILURE;
+    }
+    basePath.remove_suffix(mappingSuffix.size());
 
-    return readSuccess ? ResultCode::SUCCESS : ResultCode::FAILURE;
+    StreamReader streams;
+    streams.verifyCritical(&critChecksums);
+    streams.decryptCritical(&critCipher);
+    streams.decompressNoncritical(&noncritCompressor);
+    streams.allowDegraded(degradable);
+    if (!streams.open(basePath) || !streams.read(fileMap, buffer, size, offset)) {
+        return ResultCode::FAILURE;
+    }
+    restoreStructure(buffer, size, offset);
+    return ResultCode::SUCCESS;
 }
 
 ResultCode AbstractFileHandler::writeFile(const char* mappingPath, const char* buffer, size_t size, off_t offset) {
@@ -202,100 +783,1079 @@ ResultCode AbstractFileHandler::writeFile(const char* mappingPath, const char* b
     }
     basePath = basePath.substr(0, basePath.size() - mappingSuffix.size());
 
-    std::string critPath = basePath + ".crit";
-    std::string noncritPath = basePath + ".noncrit";
-
     bool mappingExists = std::ifstream(mappingPath).good();
-    std::vector<char> mergedBuffer;
+    FileMap oldMap(fileMap.get_allocator()); // same resource, so the swap below is valid
+    std::string oldAnnotations;
+    size_t oldSize = 0;
 
     if (mappingExists) {
-        // Load existing mapping (mappingfile -> std::map)
+        // Load existing mapping (mappingfile -> FileMap)
         if (loadMapFromFile(mappingPath) != ResultCode::SUCCESS) {
             std::cerr << "Failed to load existing mapping\n";
             return ResultCode::FAILURE;
         }
+        oldSize = getFileSize();
+        oldAnnotations = serializeAnnotations();
+    }
+    oldMap.swap(fileMap); // fileMap is regenerated below
 
-        // Reconstruct full logical file
-        int totalSize = 0;
-        for (const auto& [range, _] : fileMap) {
-            totalSize = std::max(totalSize, range.getEnd() + 1);
-        }
-        mergedBuffer.resize(totalSize, 0);
+    // The existing content is read through the old mapping while the new one is built, and
+    // verified, so corrupted critical bytes are not checksummed again as if they were good
+    BlockChecksums oldChecksums(critChecksums);
+    BlockCipher oldCipher(critCipher);
+    BlockCompressor oldCompressor(noncritCompressor);
+    StreamReader oldStreams;
+    oldStreams.verifyCritical(&oldChecksums);
+    oldStreams.decryptCritical(&oldCipher);
+    oldStreams.decompressNoncritical(&oldCompressor);
+    if (oldSize > 0 && !oldStreams.open(basePath)) {
+        std::cerr << "Failed to reconstruct existing data\n";
+        return ResultCode::FAILURE;
+    }
 
-        // if the file is empty, we don't need to read anything
-        if(totalSize != 0) {
-        
-            if (readFile(mappingPath, mergedBuffer.data(), totalSize, 0) != ResultCode::SUCCESS) {
-                std::cerr << "Failed to reconstruct existing data\n";
-                return ResultCode::FAILURE;
-            }
+    size_t writeEnd = static_cast<size_t>(offset) + size;
+    MergedSource merged(oldStreams, oldMap, oldSize, buffer, size, offset);
+    size_t newSize = merged.size();
 
-            // Merge new buffer
-            if (offset + size > mergedBuffer.size()) {
-                mergedBuffer.resize(offset + size, 0);
-            }
-            std::memcpy(mergedBuffer.data() + offset, buffer, size);
-        } 
-        else {
-            // if the file is empty, we just need to write the new data
-            mergedBuffer.resize(offset + size, 0);
-            std::memcpy(mergedBuffer.data() + offset, buffer, size);
+    // Overwrites that keep the structure go straight into the streams, other writes to a
+    // handler that can resume mapping mid-file only append the bytes of the changed tail.
+    // Under the intent log both commit the bytes they change as patches. The segment store
+    // only takes whole streams, so packed files always get a full rewrite. Zero fills larger
+    // than a window are left to the windowed rewrite too, which stores them as holes.
+    SegmentStore* segmentStore = getStorageContext().segmentStore;
+    bool inPlace = size > 0 && oldSize > 0 && !oldStreams.isPacked();
+    bool largeZeroFill = !buffer && size > WRITE_WINDOW_SIZE;
+    if (inPlace && buffer && writeEnd <= oldSize) {
+        bool handled = false;
+        ResultCode result = patchInPlace(basePath, oldMap, oldAnnotations, merged, buffer, size, offset, handled);
+        if (handled) {
+            return result;
+        }
+    }
+    if (inPlace && !largeZeroFill && !(segmentStore && segmentStore->accepts(newSize))) {
+        bool handled = false;
+        ResultCode result = rewriteTail(mappingPath, basePath, oldMap, oldSize, merged, offset, size, handled);
+        if (handled) {
+            return result;
         }
+    }
 
-    } else {
-        // New mapping
-        mergedBuffer.resize(offset + size, 0);
-        std::memcpy(mergedBuffer.data() + offset, buffer, size);
+    if (newSize > WRITE_WINDOW_SIZE) {
+        return writeWindowed(basePath, merged);
     }
 
-    // Re-analyze and split into critical/non-critical data
-    fileMap.clear(); // Clear existing map for regeneration
-    std::vector<char> critData; // buffer for critical data
-    std::vector<char> noncritData; // buffer for non-critical data
+    // Small enough to merge, re-analyze and split in memory
+    std::vector<char> mergedBuffer(newSize);
+    if (!merged.read(0, newSize, mergedBuffer.data())) {
+        return ResultCode::FAILURE;
+    }
 
     if (createMapping(mergedBuffer.data(), mergedBuffer.size()) != ResultCode::SUCCESS) {
         std::cerr << "Critical analysis failed\n";
         return ResultCode::FAILURE;
     }
 
-    // fill in the critical and non-critical data vectors
+    // Zero blocks are not stored in either stream
+    std::vector<std::pair<size_t, size_t>> holes;
+    findZeroBlocksParallel(mergedBuffer.data(), mergedBuffer.size(), 0, holes);
+    punchHoles(holes);
+
+    // Both streams are described as pieces of mergedBuffer and written from there with pwritev.
+    // The extents are in logical order, which is also their order in the streams.
+    IntentLog::Intent update;
+    update.basePath = basePath;
+    update.logicalSize = mergedBuffer.size();
     for (const auto& [range, mappedPair] : fileMap) {
-        const Range& mappedRange = mappedPair.first;
         CriticalType type = mappedPair.second;
-
+        if (type == CriticalType::HOLE_DATA) {
+            continue;
+        }
+        size_t length = range.getEnd() - range.getStart() + 1;
         if (type == CriticalType::CRITICAL_DATA) {
-            critData.insert(critData.end(), mergedBuffer.begin() + range.getStart(), mergedBuffer.begin() + range.getEnd() + 1);
+            addStreamPiece(update.critData, mergedBuffer.data(), range.getStart(), length);
+            update.critSize += length;
         } else {
-            noncritData.insert(noncritData.end(), mergedBuffer.begin() + range.getStart(), mergedBuffer.begin() + range.getEnd() + 1);
+            addStreamPiece(update.noncritData, mergedBuffer.data(), range.getStart(), length);
+            update.noncritSize += length;
         }
     }
-
-    // Write critical data
-    {
-        std::ofstream critFile(critPath, std::ios::binary | std::ios::trunc);
-        if (!critFile.is_open()) {
-            std::cerr << "Failed to open .crit file for writing\n";
+    // Only ciphertext goes into the intent log and the streams
+    std::vector<char> sealed;
+    if (getStorageContext().critKey) {
+        if (!critCipher.begin() || !critCipher.seal(update.critData, sealed) || !critCipher.finish(sealed)) {
+            std::cerr << "Failed to encrypt critical data\n";
             return ResultCode::FAILURE;
         }
-        critFile.write(critData.data(), critData.size());
-    }
+        update.critData.clear();
+        if (!sealed.empty()) {
+            addStreamPiece(update.critData, sealed.data(), 0, sealed.size());
+        }
+    } else {
+        critCipher.clear();
+    }
+    critChecksums.begin();
+    critChecksums.append(update.critData);
 
-    // Write non-critical data
-    {
-        std::ofstream noncritFile(noncritPath, std::ios::binary | std::ios::trunc);
-        if (!noncritFile.is_open()) {
-            std::cerr << "Failed to open .noncrit file for writing\n";
+    // .noncrit goes out in compressed blocks when the mount asks for them
+    std::vector<char> compressed;
+    NoncritCodec codec = getStorageContext().noncritCodec;
+    if (codec != NoncritCodec::NONE) {
+        if (!noncritCompressor.begin(codec) || !noncritCompressor.compress(update.noncritData, compressed) ||
+            !noncritCompressor.finish(compressed)) {
+            std::cerr << "Failed to compress non-critical data\n";
+            return ResultCode::FAILURE;
+        }
+        update.noncritData.clear();
+        if (!compressed.empty()) {
+            addStreamPiece(update.noncritData, compressed.data(), 0, compressed.size());
+        }
+        update.noncritSize = compressed.size();
+    } else {
+        noncritCompressor.clear();
+    }
+    update.mapping = serializeMap();
+
+    // With the intent log enabled the update becomes durable in the log first, so a crash
+    // between the stream writes below can be repaired by replaying it
+    IntentLog* intentLog = getStorageContext().intentLog;
+    if (intentLog) {
+        if (!intentLog->commit(update)) {
+            std::cerr << "Failed to commit update to intent log\n";
+            return ResultCode::FAILURE;
+        }
+        return ResultCode::SUCCESS;
+    }
+
+    return persistStreams(update);
+}
+
+ResultCode AbstractFileHandler::patchInPlace(const std::string& basePath, const FileMap& oldMap,
+                                             const std::string& oldAnnotations, ByteSource& merged, const char* buffer,
+                                             size_t size, off_t offset, bool& handled) {
+    handled = false;
+    int64_t writeStart = offset;
+    int64_t writeEnd = offset + static_cast<int64_t>(size) - 1;
+    if (remapAfterWrite(oldMap, merged, offset) != ResultCode::SUCCESS ||
+        !sameClassification(oldMap, fileMap, merged.size(), writeStart, writeEnd) ||
+        serializeAnnotations() != oldAnnotations) {
+        fileMap.clear();
+        return ResultCode::SUCCESS; // the full rewrite takes it from here
+    }
+
+    // The mapping on disk still describes the file, only stream bytes change
+    fileMap = oldMap;
+
+    std::string critPath = basePath + ".crit";
+    std::string noncritPath = basePath + ".noncrit";
+    int fdCrit = open(critPath.c_str(), O_RDWR); // read back for the checksums
+    int fdNoncrit = open(noncritPath.c_str(), O_RDWR); // and for compressed blocks
+    bool ok = fdCrit >= 0 && fdNoncrit >= 0;
+    if (!ok) {
+        std::perror("Failed to open critical or non-critical data file");
+    }
+    // Under the intent log nothing is written before the patches are committed
+    IntentLog* intentLog = getStorageContext().intentLog;
+    StreamFile critFile(fdCrit, intentLog ? StreamFile::HOLD_ALL : 0);
+    StreamFile noncritFile(fdNoncrit, intentLog ? StreamFile::HOLD_ALL : 0);
+
+    // The written range in the streams, collected first so the critical blocks it only
+    // partly overwrites are verified before anything is written
+    struct Patch {
+        CriticalType type;
+        int64_t start;
+        int64_t end;
+        off_t mappedOffset;
+    };
+    std::vector<Patch> patches;
+    int64_t critFrom = INT64_MAX;
+    int64_t critTo = 0;
+    bool noncritPatched = false;
+    for (auto it = fileMap.lower_bound(Range(writeStart, writeStart)); it != fileMap.end(); ++it) {
+        const Range& range = it->first;
+        CriticalType type = it->second.second;
+        if (range.getStart() > writeEnd) {
+            break;
+        }
+        if (type == CriticalType::HOLE_DATA) {
+            continue; // untouched, checked above
+        }
+        int64_t start = std::max(writeStart, range.getStart());
+        int64_t end = std::min(writeEnd, range.getEnd());
+        off_t mappedOffset = it->second.first.getStart() + (start - range.getStart());
+        patches.push_back({type, start, end, mappedOffset});
+        if (type == CriticalType::CRITICAL_DATA) {
+            critFrom = std::min<int64_t>(critFrom, mappedOffset);
+            critTo = std::max<int64_t>(critTo, mappedOffset + (end - start + 1));
+        } else {
+            noncritPatched = true;
+        }
+    }
+    bool compressed = noncritPatched && noncritCompressor.recorded();
+    if ((ok && critFrom < critTo && (needsResealing() || !critChecksums.check(critFile, critFrom, critTo))) ||
+        (compressed && needsCompaction(noncritCompressor))) {
+        // The full rewrite encrypts the stream, or reads the file through the parity, or fails;
+        // it also compacts a compressed stream
+        close(fdCrit);
+        close(fdNoncrit);
+        fileMap.clear();
+        return ResultCode::SUCCESS;
+    }
+    handled = true;
+
+    uint64_t critLength = critChecksums.streamLength();
+    struct stat st;
+    if (ok && critFrom < critTo && !critChecksums.recorded()) {
+        ok = fstat(fdCrit, &st) == 0;
+        critLength = ok ? st.st_size : 0;
+    }
+    for (size_t i = 0; ok && i < patches.size(); ++i) {
+        const Patch& patch = patches[i];
+        const char* data = buffer + (patch.start - writeStart);
+        size_t length = patch.end - patch.start + 1;
+        if (patch.type == CriticalType::CRITICAL_DATA && critCipher.recorded()) {
+            ok = critCipher.write(critFile, patch.mappedOffset, data, length, critLength);
+            continue;
+        }
+        if (patch.type == CriticalType::NON_CRITICAL_DATA && compressed) {
+            ok = noncritCompressor.write(noncritFile, patch.mappedOffset, data, length);
+            continue;
+        }
+        StreamFile& file = (patch.type == CriticalType::CRITICAL_DATA) ? critFile : noncritFile;
+        ok = file.write(data, length, patch.mappedOffset);
+    }
+
+    // Patched critical blocks get new checksums and seals, and compressed blocks new places,
+    // which go into the mapping
+    bool critPatched = critFrom < critTo;
+    if (ok && critPatched) {
+        if (critCipher.recorded()) {
+            size_t block = critCipher.blockSize();
+            critFrom = critFrom / block * block;
+            critTo = std::min<uint64_t>((critTo + block - 1) / block * block, critLength);
+        }
+        ok = critChecksums.update(critFile, critFrom, critTo, critLength);
+    }
+    if (ok && intentLog) {
+        ok = commitPatches(basePath, critFile, noncritFile) == ResultCode::SUCCESS;
+    }
+    if (ok && !intentLog && (critPatched || compressed)) {
+        ok = saveMapToFile((basePath + ".mapping").c_str()) == ResultCode::SUCCESS;
+    }
+    if (ok && !intentLog && critPatched) {
+        ok = updateRedundancy(fdCrit, basePath, critFrom, critTo, critLength);
+    }
+
+    if (fdCrit >= 0) close(fdCrit);
+    if (fdNoncrit >= 0) close(fdNoncrit);
+    return ok ? ResultCode::SUCCESS : ResultCode::FAILURE;
+}
+
+ResultCode AbstractFileHandler::remapAfterWrite(const FileMap& oldMap, ByteSource& merged, off_t offset) {
+    fileMap = oldMap;
+    uint64_t point = 0;
+    if (remapFrom(merged, offset, point) == ResultCode::SUCCESS) {
+        return ResultCode::SUCCESS;
+    }
+    fileMap.clear();
+    return createMappingFromSource(merged);
+}
+
+bool AbstractFileHandler::needsResealing() const {
+    return critCipher.recorded() ? !critCipher.keyed() : getStorageContext().critKey != nullptr;
+}
+
+ResultCode AbstractFileHandler::rewriteTail(const char* mappingPath, const std::string& basePath, const FileMap& oldMap,
+                                            size_t oldSize, ByteSource& merged, off_t offset, size_t size, bool& handled) {
+    handled = false;
+    uint64_t point = 0;
+    fileMap = oldMap;
+    if (remapFrom(merged, offset, point) != ResultCode::SUCCESS) {
+        fileMap.clear();
+        return ResultCode::SUCCESS; // the full rewrite takes it from here
+    }
+
+    std::string critPath = basePath + ".crit";
+    std::string noncritPath = basePath + ".noncrit";
+    int fds[2] = {open(critPath.c_str(), O_RDWR), open(noncritPath.c_str(), O_RDWR)};
+    auto giveUp = [&]() {
+        for (int fd : fds) {
+            if (fd >= 0) close(fd);
+        }
+        fileMap.clear();
+        return ResultCode::SUCCESS;
+    };
+    int64_t streamEnd[2] = {0, 0};
+    for (int stream = 0; stream < 2; ++stream) {
+        struct stat st;
+        if (fds[stream] < 0 || fstat(fds[stream], &st) == -1) {
+            return giveUp();
+        }
+        streamEnd[stream] = st.st_size;
+    }
+    // Writes into the old bytes of the files, i.e. the last block of a sealed or compressed
+    // stream taking appended bytes, are held until every fresh byte was read through the old
+    // mapping, which still needs those blocks as they were. Under the intent log every write
+    // is held and committed as a patch.
+    IntentLog* intentLog = getStorageContext().intentLog;
+    StreamFile files[2] = {StreamFile(fds[0], intentLog ? StreamFile::HOLD_ALL : streamEnd[0]),
+                           StreamFile(fds[1], intentLog ? StreamFile::HOLD_ALL : streamEnd[1])};
+    // Offsets in a compressed stream are those of its uncompressed bytes
+    if (noncritCompressor.recorded()) {
+        streamEnd[1] = noncritCompressor.streamLength();
+    }
+
+    // Place the new extents from point on: bytes the write left alone keep their place in the
+    // streams if their type did not change, the rest is appended after the current stream ends.
+    // Apart from the held last blocks, nothing the old mapping refers to is overwritten, so it
+    // stays valid until the new one is saved.
+    struct TailPiece {
+        int64_t start;
+        int64_t end;
+        int64_t mappedStart;
+        CriticalType type;
+        bool fresh; // appended, copied from the merged source
+    };
+    std::vector<TailPiece> tail;
+    int64_t appended[2] = {0, 0};
+    auto add = [&](int64_t start, int64_t end, int64_t mappedStart, CriticalType type, bool fresh) {
+        if (!tail.empty()) {
+            TailPiece& last = tail.back();
+            bool contiguous = type == CriticalType::HOLE_DATA ||
+                              last.mappedStart + (last.end - last.start) + 1 == mappedStart;
+            if (last.type == type && last.fresh == fresh && last.end + 1 == start && contiguous) {
+                last.end = end;
+                return;
+            }
+        }
+        tail.push_back({start, end, mappedStart, type, fresh});
+    };
+
+    int64_t writeStart = offset;
+    int64_t writeEnd = offset + static_cast<int64_t>(size) - 1;
+    int64_t oldEnd = static_cast<int64_t>(oldSize) - 1;
+    for (auto it = fileMap.lower_bound(Range(point, point)); it != fileMap.end(); ++it) {
+        CriticalType type = it->second.second;
+        int64_t pos = it->first.getStart();
+        while (pos <= it->first.getEnd()) {
+            int64_t end = it->first.getEnd();
+            if (type == CriticalType::HOLE_DATA || (pos > oldEnd && pos < writeStart)) {
+                // The gap a write past the end leaves is zero, like a hole
+                if (type != CriticalType::HOLE_DATA) {
+                    end = std::min(end, writeStart - 1);
+                }
+                add(pos, end, 0, CriticalType::HOLE_DATA, false);
+                pos = end + 1;
+                continue;
+            }
+
+            bool written = pos >= writeStart && pos <= writeEnd;
+            auto old = oldMap.lower_bound(Range(pos, pos));
+            bool kept = false;
+            if (!written && pos <= oldEnd) {
+                end = std::min(end, oldEnd);
+                if (pos < writeStart) {
+                    end = std::min(end, writeStart - 1);
+                }
+                if (old == oldMap.end() || old->first.getStart() > pos) {
+                    // Not stored before: zero, appended below
+                    if (old != oldMap.end()) {
+                        end = std::min(end, old->first.getStart() - 1);
+                    }
+                } else {
+                    end = std::min(end, old->first.getEnd());
+                    CriticalType oldType = old->second.second;
+                    if (oldType == CriticalType::HOLE_DATA) {
+                        add(pos, end, 0, CriticalType::HOLE_DATA, false);
+                        pos = end + 1;
+                        continue;
+                    }
+                    kept = oldType == type;
+                }
+            } else if (written) {
+                end = std::min(end, writeEnd);
+            }
+
+            if (kept) {
+                add(pos, end, old->second.first.getStart() + (pos - old->first.getStart()), type, false);
+            } else {
+                int stream = (type == CriticalType::CRITICAL_DATA) ? 0 : 1;
+                add(pos, end, streamEnd[stream] + appended[stream], type, true);
+                appended[stream] += end - pos + 1;
+            }
+            pos = end + 1;
+        }
+    }
+
+    // The streams only grow here, a full rewrite compacts them once they are mostly dead bytes
+    int64_t live[2] = {0, 0};
+    for (auto it = fileMap.begin(); it != fileMap.end() && it->first.getStart() < static_cast<int64_t>(point); ++it) {
+        if (it->second.second != CriticalType::HOLE_DATA) {
+            live[it->second.second == CriticalType::CRITICAL_DATA ? 0 : 1] += it->first.getEnd() - it->first.getStart() + 1;
+        }
+    }
+    for (const TailPiece& piece : tail) {
+        if (piece.type != CriticalType::HOLE_DATA) {
+            live[piece.type == CriticalType::CRITICAL_DATA ? 0 : 1] += piece.end - piece.start + 1;
+        }
+    }
+    for (int stream = 0; stream < 2; ++stream) {
+        if (streamEnd[stream] + appended[stream] > 2 * live[stream] + static_cast<int64_t>(TAIL_REWRITE_SLACK)) {
+            return giveUp();
+        }
+    }
+    // Patches are held in memory, larger tails are staged by the windowed rewrite
+    if (intentLog && appended[0] + appended[1] > static_cast<int64_t>(WRITE_WINDOW_SIZE)) {
+        return giveUp();
+    }
+
+    // The last critical block is checksummed again with the appended bytes, so its old
+    // bytes have to be good; the full rewrite reads them through the parity, or fails
+    uint64_t oldCritLength = critChecksums.streamLength();
+    if (appended[0] > 0 && !critChecksums.check(files[0], oldCritLength > 0 ? oldCritLength - 1 : 0, oldCritLength)) {
+        return giveUp();
+    }
+    if (appended[0] > 0 && needsResealing()) {
+        return giveUp();
+    }
+    // A file that starts out without non-critical bytes, e.g. the first chunk of a copy, has
+    // its stream compressed from the first appended block on
+    NoncritCodec codec = getStorageContext().noncritCodec;
+    if (appended[1] > 0 && streamEnd[1] == 0 && !noncritCompressor.recorded() && codec != NoncritCodec::NONE &&
+        !noncritCompressor.begin(codec)) {
+        return giveUp();
+    }
+    if (appended[1] > 0 && noncritCompressor.recorded() && needsCompaction(noncritCompressor)) {
+        return giveUp();
+    }
+    handled = true;
+
+    // Appended critical bytes of an encrypted stream are sealed along with the last old block,
+    // non-critical bytes of a compressed one compressed along with it
+    std::vector<char> block(std::min<int64_t>(std::max(appended[0], appended[1]), TAIL_COPY_BLOCK));
+    uint64_t sealedLength = oldCritLength;
+    for (const TailPiece& piece : tail) {
+        if (!piece.fresh) {
+            continue;
+        }
+        bool sealed = piece.type == CriticalType::CRITICAL_DATA && critCipher.recorded();
+        bool compressed = piece.type == CriticalType::NON_CRITICAL_DATA && noncritCompressor.recorded();
+        StreamFile& file = files[piece.type == CriticalType::CRITICAL_DATA ? 0 : 1];
+        for (int64_t pos = piece.start; pos <= piece.end; pos += block.size()) {
+            size_t length = std::min<int64_t>(block.size(), piece.end - pos + 1);
+            uint64_t mappedPos = piece.mappedStart + (pos - piece.start);
+            bool written = merged.read(pos, length, block.data());
+            if (written && sealed) {
+                written = critCipher.write(file, mappedPos, block.data(), length, sealedLength);
+            } else if (written && compressed) {
+                written = noncritCompressor.write(file, mappedPos, block.data(), length);
+            } else if (written) {
+                written = file.write(block.data(), length, mappedPos);
+            }
+            if (sealed) {
+                sealedLength = std::max<uint64_t>(sealedLength, mappedPos + length);
+            }
+            if (!written) {
+                std::perror("Failed to append to stream file");
+                giveUp();
+                return ResultCode::FAILURE;
+            }
+        }
+    }
+    // A sealed stream changed from the start of its old last block on
+    int64_t critLength = streamEnd[0] + appended[0];
+    int64_t critFrom = critCipher.recorded() ? streamEnd[0] / critCipher.blockSize() * critCipher.blockSize()
+                                             : streamEnd[0];
+    bool checksummed = (intentLog || (files[0].flush() && files[1].flush())) &&
+                       critChecksums.update(files[0], critFrom, critLength, critLength) &&
+                       (intentLog || updateRedundancy(fds[0], basePath, critFrom, critLength, critLength));
+    for (int fd : fds) {
+        close(fd);
+    }
+    if (!checksummed) {
+        return ResultCode::FAILURE;
+    }
+
+    // Only then does the mapping move to the new placement
+    fileMap.erase(fileMap.lower_bound(Range(point, point)), fileMap.end());
+    MappingBuilder extents(fileMap.get_allocator().resource());
+    extents.reserve(tail.size());
+    for (const TailPiece& piece : tail) {
+        int64_t length = piece.end - piece.start + 1;
+        extents.append(piece.start, piece.end, piece.mappedStart, piece.mappedStart + length - 1, piece.type);
+    }
+    if (extents.finalize(fileMap) != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
+    }
+    return intentLog ? commitPatches(basePath, files[0], files[1]) : saveMapToFile(mappingPath);
+}
+
+ResultCode AbstractFileHandler::commitPatches(const std::string& basePath, const StreamFile& critFile,
+                                              const StreamFile& noncritFile) {
+    std::vector<char> critPatches = encodePatches(critFile);
+    std::vector<char> noncritPatches = encodePatches(noncritFile);
+    IntentLog::Intent update;
+    update.basePath = basePath;
+    update.logicalSize = getFileSize();
+    update.patches = true;
+    addStreamPiece(update.critData, critPatches.data(), 0, critPatches.size());
+    update.critSize = critPatches.size();
+    addStreamPiece(update.noncritData, noncritPatches.data(), 0, noncritPatches.size());
+    update.noncritSize = noncritPatches.size();
+    update.mapping = serializeMap();
+    if (!getStorageContext().intentLog->commit(update)) {
+        std::cerr << "Failed to commit update to intent log\n";
+        return ResultCode::FAILURE;
+    }
+    return ResultCode::SUCCESS;
+}
+
+ResultCode AbstractFileHandler::writeWindowed(const std::string& basePath, ByteSource& merged) {
+    uint64_t logicalSize = merged.size();
+
+    // The mapping only needs the structures of the file, not every window of it
+    if (createMappingFromSource(merged) != ResultCode::SUCCESS) {
+        std::cerr << "Critical analysis failed\n";
+        return ResultCode::FAILURE;
+    }
+
+    size_t critSize = 0;
+    size_t noncritSize = 0;
+    for (const auto& [range, mappedPair] : fileMap) {
+        size_t length = range.getEnd() - range.getStart() + 1;
+        if (mappedPair.second == CriticalType::CRITICAL_DATA) {
+            critSize += length;
+        } else if (mappedPair.second == CriticalType::NON_CRITICAL_DATA) {
+            noncritSize += length;
+        }
+    }
+
+    // Records of the file still in the log patch or rename the streams this write replaces.
+    // Replaying them after its staged files are renamed in would write the old layout over the
+    // new streams, so they are checkpointed away first.
+    IntentLog* intentLog = getStorageContext().intentLog;
+    if (intentLog && !intentLog->checkpointIfDirty(basePath)) {
+        std::cerr << "Failed to checkpoint intent log before staged write\n";
+        return ResultCode::FAILURE;
+    }
+
+    // Split each window into staged stream files, leaving out its zero blocks. The pieces are
+    // appended in logical order, which is how punchHoles numbers the streams afterwards.
+    std::string stagedCrit = basePath + ".crit" + STAGED_SUFFIX;
+    std::string stagedNoncrit = basePath + ".noncrit" + STAGED_SUFFIX;
+    int fdCrit = open(stagedCrit.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int fdNoncrit = open(stagedNoncrit.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    auto fail = [&](const char* message) {
+        if (message) std::perror(message);
+        if (fdCrit >= 0) close(fdCrit);
+        if (fdNoncrit >= 0) close(fdNoncrit);
+        unlink(stagedCrit.c_str());
+        unlink(stagedNoncrit.c_str());
+        return ResultCode::FAILURE;
+    };
+    if (fdCrit < 0 || fdNoncrit < 0) {
+        return fail("Failed to create staged stream files");
+    }
+    // How far .noncrit compresses is only known once it is written
+    if (getStorageContext().noncritCodec != NoncritCodec::NONE) {
+        noncritSize = 0;
+    }
+    if (!reserveStreamFile(fdCrit, critSize) || !reserveStreamFile(fdNoncrit, noncritSize)) {
+        return fail(nullptr);
+    }
+
+    std::vector<char> window(std::min<uint64_t>(logicalSize, WRITE_WINDOW_SIZE));
+    std::vector<struct iovec> critPieces;
+    std::vector<struct iovec> noncritPieces;
+    std::vector<std::pair<size_t, size_t>> holes;
+    std::vector<std::pair<size_t, size_t>> windowHoles;
+    off_t critOffset = 0;
+    off_t noncritOffset = 0;
+    std::vector<char> sealed; // a window's critical bytes, encrypted
+    bool sealing = getStorageContext().critKey != nullptr;
+    if (!sealing) {
+        critCipher.clear();
+    } else if (!critCipher.begin()) {
+        return fail(nullptr);
+    }
+    std::vector<char> compressed; // a window's non-critical bytes, compressed
+    NoncritCodec codec = getStorageContext().noncritCodec;
+    bool compressing = codec != NoncritCodec::NONE;
+    if (!compressing) {
+        noncritCompressor.clear();
+    } else if (!noncritCompressor.begin(codec)) {
+        return fail(nullptr);
+    }
+    critChecksums.begin();
+    auto extent = fileMap.begin();
+    for (uint64_t pos = 0; pos < logicalSize; pos += window.size()) {
+        size_t length = std::min<uint64_t>(window.size(), logicalSize - pos);
+        if (!merged.read(pos, length, window.data())) {
+            return fail(nullptr);
+        }
+        windowHoles.clear();
+        findZeroBlocksParallel(window.data(), length, pos, windowHoles);
+
+        critPieces.clear();
+        noncritPieces.clear();
+        size_t critLength = 0;
+        size_t noncritLength = 0;
+        size_t hole = 0;
+        auto append = [&](int64_t start, int64_t end, CriticalType type) {
+            size_t pieceLength = end - start + 1;
+            if (type == CriticalType::CRITICAL_DATA) {
+                addStreamPiece(critPieces, window.data(), start - pos, pieceLength);
+                critLength += pieceLength;
+            } else {
+                addStreamPiece(noncritPieces, window.data(), start - pos, pieceLength);
+                noncritLength += pieceLength;
+            }
+        };
+
+        int64_t windowEnd = static_cast<int64_t>(pos + length) - 1;
+        while (extent != fileMap.end() && extent->first.getStart() <= windowEnd) {
+            int64_t start = std::max<int64_t>(extent->first.getStart(), pos);
+            int64_t end = std::min(extent->first.getEnd(), windowEnd);
+            CriticalType type = extent->second.second;
+            if (type != CriticalType::HOLE_DATA) {
+                // Both lists are sorted, so the holes before this extent are never needed again
+                while (hole < windowHoles.size() && static_cast<int64_t>(windowHoles[hole].second) < start) {
+                    hole++;
+                }
+                for (size_t next = hole; start <= end; next++) {
+                    if (next >= windowHoles.size() || static_cast<int64_t>(windowHoles[next].first) > end) {
+                        append(start, end, type);
+                        break;
+                    }
+                    if (static_cast<int64_t>(windowHoles[next].first) > start) {
+                        append(start, windowHoles[next].first - 1, type);
+                    }
+                    start = windowHoles[next].second + 1;
+                }
+            }
+            if (extent->first.getEnd() > windowEnd) {
+                break; // continues in the next window
+            }
+            ++extent;
+        }
+
+        for (const auto& windowHole : windowHoles) {
+            if (!holes.empty() && holes.back().second + 1 == windowHole.first) {
+                holes.back().second = windowHole.second;
+            } else {
+                holes.push_back(windowHole);
+            }
+        }
+
+        if (sealing) {
+            // A partial last block is sealed with the next window's bytes
+            sealed.clear();
+            if (!critCipher.seal(critPieces, sealed)) {
+                return fail(nullptr);
+            }
+            critPieces.clear();
+            if (!sealed.empty()) {
+                addStreamPiece(critPieces, sealed.data(), 0, sealed.size());
+            }
+            critLength = sealed.size();
+        }
+        critChecksums.append(critPieces);
+        if (compressing) {
+            // Likewise a partial last block is compressed with the next window's bytes
+            compressed.clear();
+            if (!noncritCompressor.compress(noncritPieces, compressed)) {
+                return fail(nullptr);
+            }
+            noncritPieces.clear();
+            if (!compressed.empty()) {
+                addStreamPiece(noncritPieces, compressed.data(), 0, compressed.size());
+            }
+            noncritLength = compressed.size();
+        }
+
+        // Both streams are written straight from the window, at the same time
+        bool written[2] = {true, true};
+        runParallel(2, [&](size_t stream) {
+            written[stream] = stream == 0 ? pwritevAll(fdCrit, critPieces, critOffset)
+                                          : pwritevAll(fdNoncrit, noncritPieces, noncritOffset);
+        });
+        if (!written[0] || !written[1]) {
+            return fail("Failed to write staged stream files");
+        }
+        critOffset += critLength;
+        noncritOffset += noncritLength;
+    }
+
+    sealed.clear();
+    if (sealing && (!critCipher.finish(sealed) || !writeAll(fdCrit, sealed.data(), sealed.size(), critOffset))) {
+        return fail("Failed to write staged stream files");
+    }
+    critChecksums.append(sealed.data(), sealed.size());
+    critOffset += sealed.size();
+    compressed.clear();
+    if (compressing && (!noncritCompressor.finish(compressed) ||
+                        !writeAll(fdNoncrit, compressed.data(), compressed.size(), noncritOffset))) {
+        return fail("Failed to write staged stream files");
+    }
+    noncritOffset += compressed.size();
+
+    // The reservation did not know about the holes
+    if (ftruncate(fdCrit, critOffset) == -1 || ftruncate(fdNoncrit, noncritOffset) == -1) {
+        return fail("Failed to trim staged stream files");
+    }
+    punchHoles(holes);
+
+    IntentLog::Intent update;
+    update.basePath = basePath;
+    update.logicalSize = logicalSize;
+    update.staged = true;
+    update.mapping = serializeMap();
+
+    if (intentLog) {
+        // The log record only carries the mapping, so the staged streams it points at
+        // have to be durable before it is
+        if (fdatasync(fdCrit) == -1 || fdatasync(fdNoncrit) == -1) {
+            return fail("fdatasync failed on staged stream files");
+        }
+        close(fdCrit);
+        close(fdNoncrit);
+        if (!intentLog->commit(update)) {
+            std::cerr << "Failed to commit update to intent log\n";
+            return ResultCode::FAILURE;
+        }
+        return ResultCode::SUCCESS;
+    }
+
+    close(fdCrit);
+    close(fdNoncrit);
+    return persistStreams(update);
+}
+
+ResultCode AbstractFileHandler::persistStreams(const IntentLog::Intent& update) {
+    std::string critPath = update.basePath + ".crit";
+    std::string noncritPath = update.basePath + ".noncrit";
+    std::string mappingPath = update.basePath + ".mapping";
+
+    // Small files go into a shared segment instead of their own stream files
+    SegmentStore* segmentStore = getStorageContext().segmentStore;
+    if (update.patches) {
+        // Only the changed bytes were logged; the critical ones also change the redundancy
+        int fdCrit = open(critPath.c_str(), O_RDWR);
+        int fdNoncrit = open(noncritPath.c_str(), O_RDWR);
+        uint64_t from[2];
+        uint64_t to[2];
+        struct stat st;
+        bool ok = fdCrit >= 0 && fdNoncrit >= 0;
+        if (!ok) {
+            std::perror(("Failed to open streams of " + update.basePath + " to patch").c_str());
+        }
+        ok = ok && applyPatches(fdCrit, update.critData, from[0], to[0]) &&
+             applyPatches(fdNoncrit, update.noncritData, from[1], to[1]) && fstat(fdCrit, &st) == 0 &&
+             (from[0] >= to[0] || updateRedundancy(fdCrit, update.basePath, from[0], to[0], st.st_size));
+        if (fdCrit >= 0) close(fdCrit);
+        if (fdNoncrit >= 0) close(fdNoncrit);
+        if (!ok) {
+            std::cerr << "Failed to apply stream patches to " << update.basePath << "\n";
+            return ResultCode::FAILURE;
+        }
+    } else if (update.staged) {
+        // A windowed write already built the streams, renaming them in applies it. Replaying an
+        // intent whose staged files were renamed before the crash finds nothing left to rename.
+        for (const std::string& path : {critPath, noncritPath}) {
+            if (rename((path + STAGED_SUFFIX).c_str(), path.c_str()) == -1 && errno != ENOENT) {
+                std::perror(("Failed to install staged " + path).c_str());
+                return ResultCode::FAILURE;
+            }
+        }
+        if (segmentStore) {
+            segmentStore->remove(update.basePath);
+        }
+    } else if (segmentStore && segmentStore->accepts(update.logicalSize)) {
+        if (!segmentStore->put(update.basePath, update.critData, update.noncritData)) {
+            std::cerr << "Failed to pack streams into segment\n";
             return ResultCode::FAILURE;
         }
-        noncritFile.write(noncritData.data(), noncritData.size());
+        // Drop stream files left over from when the file was larger
+        unlink(critPath.c_str());
+        unlink(noncritPath.c_str());
+        unlink((update.basePath + ".parity").c_str());
+        if (getStorageContext().replicas) {
+            getStorageContext().replicas->remove(critPath);
+        }
+    } else {
+        // The mapping already fixed both stream sizes, so each stream is preallocated in full.
+        // The two files are written at the same time.
+        bool written[2] = {true, true};
+        runParallel(2, [&](size_t stream) {
+            written[stream] = stream == 0 ? writeStreamFile(critPath, update.critData, update.critSize)
+                                          : writeStreamFile(noncritPath, update.noncritData, update.noncritSize);
+        });
+        if (!written[0]) {
+            std::cerr << "Failed to write .crit file\n";
+            return ResultCode::FAILURE;
+        }
+        if (!written[1]) {
+            std::cerr << "Failed to write .noncrit file\n";
+            return ResultCode::FAILURE;
+        }
+
+        // The file outgrew the packing threshold, its old packed entry is dead now
+        if (segmentStore) {
+            segmentStore->remove(update.basePath);
+        }
+    }
+
+    // Packed streams have no sidecar or replicas, stream files get theirs recomputed
+    bool packed = !update.staged && !update.patches && segmentStore && segmentStore->accepts(update.logicalSize);
+    if (!packed && !update.patches && !rebuildRedundancy(update.basePath)) {
+        std::cerr << "Failed to write .parity file or replicas\n";
+        return ResultCode::FAILURE;
     }
 
     // Save updated mapping
-    if (saveMapToFile(mappingPath) != ResultCode::SUCCESS) {
+    std::ofstream mappingFile(mappingPath, std::ios::binary | std::ios::trunc);
+    if (!mappingFile.is_open()) {
         std::cerr << "Failed to save mapping file\n";
         return ResultCode::FAILURE;
     }
+    mappingFile.write(update.mapping.data(), update.mapping.size());
+
+    return ResultCode::SUCCESS;
+}
+
+
+size_t AbstractFileHandler::getFileSize() const {
+    size_t totalSize = 0;
+    for (const auto& [range, _] : fileMap) {
+        totalSize = std::max(totalSize, static_cast<size_t>(range.getEnd()) + 1);
+    }
+    return totalSize;
+}
+
+void AbstractFileHandler::punchHoles(const std::vector<std::pair<size_t, size_t>>& holes) {
+    FileMap newMap(fileMap.get_allocator());
+    int64_t critOffset = 0;
+    int64_t noncritOffset = 0;
+    auto addPiece = [&](int64_t start, int64_t end, CriticalType type) {
+        int64_t& streamOffset = (type == CriticalType::CRITICAL_DATA) ? critOffset : noncritOffset;
+        int64_t length = end - start + 1;
+        newMap[Range(start, end)] = std::make_pair(Range(streamOffset, streamOffset + length - 1), type);
+        streamOffset += length;
+    };
+
+    // Cut every extent around the holes; holes and extents are both sorted by offset
+    size_t hole = 0;
+    for (const auto& [range, mappedPair] : fileMap) {
+        CriticalType type = mappedPair.second;
+        if (type == CriticalType::HOLE_DATA) {
+            continue; // rediscovered from the data below
+        }
+        int64_t pos = range.getStart();
+        while (hole < holes.size() && static_cast<int64_t>(holes[hole].second) < pos) {
+            hole++;
+        }
+        size_t next = hole;
+        while (pos <= range.getEnd()) {
+            if (next >= holes.size() || static_cast<int64_t>(holes[next].first) > range.getEnd()) {
+                addPiece(pos, range.getEnd(), type);
+                break;
+            }
+            if (static_cast<int64_t>(holes[next].first) > pos) {
+                addPiece(pos, holes[next].first - 1, type);
+            }
+            pos = holes[next].second + 1;
+            next++;
+        }
+    }
+
+    for (const auto& [start, end] : holes) {
+        int64_t length = static_cast<int64_t>(end - start + 1);
+        newMap[Range(start, end)] = std::make_pair(Range(0, length - 1), CriticalType::HOLE_DATA);
+    }
+
+    fileMap.swap(newMap);
+}
 
+ResultCode AbstractFileHandler::beginMapping() {
+    mappingInput.clear();
     return ResultCode::SUCCESS;
 }
 
+ResultCode AbstractFileHandler::feedMapping(const char* chunk, size_t size) {
+    mappingInput.insert(mappingInput.end(), chunk, chunk + size);
+    return ResultCode::SUCCESS;
+}
+
+ResultCode AbstractFileHandler::finishMapping() {
+    std::vector<char> buffer;
+    buffer.swap(mappingInput);
+    return createMapping(buffer.data(), buffer.size());
+}
+
+ResultCode AbstractFileHandler::remapFrom(ByteSource& source, uint64_t offset, uint64_t& point) {
+    (void) source;
+    (void) offset;
+    (void) point;
+    return ResultCode::FAILURE;
+}
+
+ResultCode AbstractFileHandler::createMappingFromSource(ByteSource& source) {
+    if (beginMapping() != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
+    }
+    std::vector<char> window(std::min<uint64_t>(source.size(), WRITE_WINDOW_SIZE));
+    for (uint64_t pos = 0; pos < source.size(); pos += window.size()) {
+        size_t length = std::min<uint64_t>(window.size(), source.size() - pos);
+        if (!source.read(pos, length, window.data()) || feedMapping(window.data(), length) != ResultCode::SUCCESS) {
+            return ResultCode::FAILURE;
+        }
+    }
+    return finishMapping();
+}
+
+off_t AbstractFileHandler::seekData(const char* mappingPath, off_t offset, int whence) {
+    if (loadMapFromFile(mappingPath) != ResultCode::SUCCESS) {
+        errno = EIO;
+        return -1;
+    }
+
+    off_t size = static_cast<off_t>(getFileSize());
+    if (offset >= size) {
+        errno = ENXIO;
+        return -1;
+    }
+
+    off_t pos = offset;
+    for (const auto& [range, mappedPair] : fileMap) {
+        if (range.getEnd() < pos) {
+            continue;
+        }
+        bool isHole = mappedPair.second == CriticalType::HOLE_DATA;
+        if (whence == SEEK_DATA) {
+            if (!isHole) {
+                return std::max<off_t>(pos, range.getStart());
+            }
+        } else {
+            // Bytes no extent covers read as zeros too
+            if (isHole || range.getStart() > pos) {
+                return pos;
+            }
+            pos = range.getEnd() + 1;
+        }
+    }
+
+    if (whence == SEEK_DATA) {
+        errno = ENXIO;
+        return -1;
+    }
+    return std::min(pos, size);
+}
+
+ResultCode AbstractFileHandler::allocateFile(const char* mappingPath, off_t offset, off_t length, bool keepSize) {
+    if (loadMapFromFile(mappingPath) != ResultCode::SUCCESS) {
+        std::cerr << "Failed to load file map from: " << mappingPath << std::endl;
+        return ResultCode::FAILURE;
+    }
+
+    size_t currentSize = getFileSize();
+    size_t end = static_cast<size_t>(offset + length);
+
+    // Growing the logical file means the handler has to classify the new (zero) bytes, which
+    // are never held in memory at once
+    if (!keepSize && end > currentSize) {
+        return writeFile(mappingPath, nullptr, end - currentSize, currentSize);
+    }
+
+    // Otherwise reserve room past the end of .noncrit, where future growth of the file lands
+    if (end > currentSize) {
+        std::string basePath(mappingPath);
+        basePath = basePath.substr(0, basePath.size() - strlen(".mapping"));
+        std::string noncritPath = basePath + ".noncrit";
+
+        int fd = open(noncritPath.c_str(), O_WRONLY);
+        if (fd < 0) {
+            return ResultCode::SUCCESS; // packed or empty file, nothing to reserve
+        }
+        struct stat st;
+        int res = fstat(fd, &st);
+        if (res == 0) {
+            res = fallocate(fd, FALLOC_FL_KEEP_SIZE, st.st_size, end - currentSize);
+        }
+        close(fd);
+        if (res == -1 && errno != EOPNOTSUPP) {
+            std::perror("fallocate failed on .noncrit");
+            return ResultCode::FAILURE;
+        }
+    }
+    return ResultCode::SUCCESS;
+}
+
+ResultCode AbstractFileHandler::cloneStreams(const std::string& fromBasePath, const std::string& toBasePath) {
+    std::string toCrit = toBasePath + ".crit";
+    std::string toNoncrit = toBasePath + ".noncrit";
+
+    SegmentStore* segmentStore = getStorageContext().segmentStore;
+    std::vector<char> packedCrit;
+    std::vector<char> packedNoncrit;
+    if (segmentStore && segmentStore->get(fromBasePath, packedCrit, packedNoncrit)) {
+        // Packed files are small by definition, re-packing them is cheaper than any clone
+        if (!segmentStore->put(toBasePath, {{packedCrit.data(), packedCrit.size()}},
+                               {{packedNoncrit.data(), packedNoncrit.size()}})) {
+            return ResultCode::FAILURE;
+        }
+        unlink(toCrit.c_str());
+        unlink(toNoncrit.c_str());
+        unlink((toBasePath + ".parity").c_str());
+        if (getStorageContext().replicas) {
+            getStorageContext().replicas->remove(toCrit);
+        }
+    } else {
+        if (!cloneBackingFile(fromBasePath + ".crit", toCrit) ||
+            !cloneBackingFile(fromBasePath + ".noncrit", toNoncrit)) {
+            return ResultCode::FAILURE;
+        }
+        std::string fromParity = fromBasePath + ".parity";
+        std::string toParity = toBasePath + ".parity";
+        if (access(fromParity.c_str(), F_OK) == 0 ? !cloneBackingFile(fromParity, toParity)
+                                                  : unlink(toParity.c_str()) == -1 && errno != ENOENT) {
+            return ResultCode::FAILURE;
+        }
+        if (!rebuildRedundancy(toBasePath, false)) {
+            return ResultCode::FAILURE;
+        }
+        if (segmentStore) {
+            segmentStore->remove(toBasePath);
+        }
+    }
+
+    // The mapping goes last, it is what makes the new streams visible
+    if (!cloneBackingFile(fromBasePath + ".mapping", toBasePath + ".mapping")) {
+        return ResultCode::FAILURE;
+    }
+    return ResultCode::SUCCESS;
+}
+
+ResultCode AbstractFileHandler::syncStreams(const std::string& basePath, bool dataOnly) {
+    bool syncNoncrit = getStorageContext().durability != DurabilityPolicy::RELAXED_NONCRIT;
+    bool ok = true;
+    for (const char* suffix : {".crit", ".noncrit", ".parity", ".mapping"}) {
+        if (!syncNoncrit && std::strcmp(suffix, ".noncrit") == 0) {
+            continue;
+        }
+        std::string path = basePath + suffix;
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue; // packed or not created yet
+        }
+        if ((dataOnly ? fdatasync(fd) : fsync(fd)) == -1) {
+            std::perror("sync failed");
+            ok = false;
+        }
+        close(fd);
+    }
+
+    SegmentStore* segmentStore = getStorageContext().segmentStore;
+    if (segmentStore && !segmentStore->sync(basePath)) {
+        ok = false;
+    }
+    return ok ? ResultCode::SUCCESS : ResultCode::FAILURE;
+}
@@ -4,13 +4,22 @@
 
 #include <string>
 #include <map>
+#include <memory_resource>
+#include <string_view>
 #include <utility>
 #include <vector>
 #include "../Utilities/Range.h"
+#include "../Utilities/IntentLog.h"
+#include "../Utilities/ByteSource.h"
+#include "../Utilities/BlockChecksums.h"
+#include "../Utilities/BlockCipher.h"
+#include "../Utilities/BlockCompressor.h"
+#include "../Utilities/StreamFile.h"
 
 enum class CriticalType {
     CRITICAL_DATA = 0,
-    NON_CRITICAL_DATA = 1
+    NON_CRITICAL_DATA = 1,
+    HOLE_DATA = 2 // all-zero range stored in neither stream; its mapped range only records the length
 };
 
 enum class ResultCode {
@@ -18,18 +27,170 @@ enum class ResultCode {
     FAILURE = 1
 };
 
+// Extents of a split file: logical range -> (range in its stream, type). Allocated from the
+// request arena while a RequestScope is active (see RequestArena.h).
+using FileMap = std::pmr::map<Range, std::pair<Range, CriticalType>>;
+
 class AbstractFileHandler {
 private:
-    std::map<Range, std::pair<Range, CriticalType>> fileMap; // map of file ranges to critical types
+    FileMap fileMap; // map of file ranges to critical types
+    std::vector<char> mappingInput; // chunks collected by the default incremental mapping
+    BlockChecksums critChecksums; // CRC32C of the .crit stream, verified by every read of it
+    BlockCipher critCipher; // encryption of the .crit stream, if the mount has a key
+    BlockCompressor noncritCompressor; // block index of the .noncrit stream, if it is compressed
+
+    /**
+     * @brief Turns the given all-zero ranges of the file into hole extents and renumbers the
+     * stream offsets of the remaining extents in logical order, which is the order writeFile
+     * gathers the streams in.
+     * 
+     * @param holes sorted, disjoint [start, end] logical ranges of zero blocks
+     */
+    void punchHoles(const std::vector<std::pair<size_t, size_t>>& holes);
+
+    /**
+     * @brief Maps and writes a file too large to hold in memory: the mapping is created from
+     * the merged source, then the file is split window by window into staged stream files that
+     * replace the current ones once complete.
+     * 
+     * @param basePath the backing path without the stream suffix
+     * @param merged the file as it looks after the write
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    ResultCode writeWindowed(const std::string& basePath, ByteSource& merged);
+
+    /**
+     * @brief Loads the mapping file at mappingPath into the fileMap. A paged index (see
+     * MappingIndex.h) only yields the extents overlapping [first, last]; a text mapping is
+     * always loaded whole.
+     * 
+     * @param mappingPath the path to the mapping file
+     * @param first first logical offset needed
+     * @param last last logical offset needed
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    ResultCode loadMapping(const char* mappingPath, int64_t first, int64_t last);
+
+    /**
+     * @brief Passes each '@' line of lines to loadMappingAnnotation.
+     */
+    ResultCode loadAnnotationLines(std::string_view lines);
+
+    /**
+     * @brief Loads an annotation line kept for every handler (the .crit checksums and
+     * encryption, the .noncrit block index), or passes it on to loadAnnotation.
+     */
+    ResultCode loadMappingAnnotation(std::string_view annotation);
+
+    /**
+     * @brief The handler's annotations followed by the .crit checksums and encryption and the
+     * .noncrit block index.
+     */
+    std::string serializeMappingAnnotations() const;
+
+    /**
+     * @brief Writes buffer straight into the existing streams when the write keeps the file's
+     * structure: the size stays the same and every byte keeps its classification. Checking this
+     * takes a remapFrom the written offset, or a createMappingFromSource for handlers that
+     * cannot resume mapping; both only read headers for container formats. Critical blocks the
+     * write only partly covers must pass their checksums, otherwise the full rewrite, which
+     * reads them through the parity, takes over. Encrypted critical blocks the write touches
+     * are sealed again under new nonces; the full rewrite also takes over when needsResealing.
+     * 
+     * @param basePath the backing path without the stream suffix
+     * @param oldMap the mapping the streams were written with
+     * @param merged the file as it looks after the write
+     * @param handled set if the write was applied, otherwise it needs a full rewrite
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    ResultCode patchInPlace(const std::string& basePath, const FileMap& oldMap,
+                            const std::string& oldAnnotations, ByteSource& merged, const char* buffer, size_t size,
+                            off_t offset, bool& handled);
+
+    /**
+     * @brief Applies a write by remapping the file from the handler's resync point and appending
+     * only the bytes whose placement changed to the streams. Unchanged bytes keep their place,
+     * so growing a file rewrites its tail instead of the whole file. Gives up, leaving the write
+     * to a full rewrite, when the handler has no resync point, the streams would hold more
+     * dead bytes than live ones, the last critical block fails its checksum, or critical bytes
+     * would be appended while needsResealing.
+     * 
+     * @param mappingPath the path to the mapping file
+     * @param basePath the backing path without the stream suffix
+     * @param oldMap the mapping the streams were written with
+     * @param oldSize the file size before the write
+     * @param merged the file as it looks after the write
+     * @param handled set if the write was applied, otherwise it needs a full rewrite
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    ResultCode rewriteTail(const char* mappingPath, const std::string& basePath, const FileMap& oldMap,
+                           size_t oldSize, ByteSource& merged, off_t offset, size_t size, bool& handled);
+
+    /**
+     * @brief Commits the bytes critFile and noncritFile held, with the mapping as it is now, to
+     * the intent log as one patch record; persistStreams applies it and updates the redundancy
+     * of the patched critical range.
+     */
+    ResultCode commitPatches(const std::string& basePath, const StreamFile& critFile, const StreamFile& noncritFile);
+
+    /**
+     * @brief Remaps the file after a write at offset: from the resync point with oldMap kept in
+     * front of it when the handler has one, otherwise from the start.
+     */
+    ResultCode remapAfterWrite(const FileMap& oldMap, ByteSource& merged, off_t offset);
+
+    /**
+     * @brief Whether critical bytes cannot be written in place but take a full rewrite: the
+     * mount has a key the stream is not encrypted under yet, or it is encrypted and the mount
+     * has no key.
+     */
+    bool needsResealing() const;
+
+protected:
+    /**
+     * @brief Handler-specific lines stored after the extents in the mapping file, each starting
+     * with '@' and ending with a newline. They record structure the extents alone do not capture.
+     * 
+     * @return std::string the annotation lines, empty by default
+     */
+    virtual std::string serializeAnnotations() const;
+
+    /**
+     * @brief Parses one annotation line of the mapping file. Unknown annotations are ignored,
+     * so a mapping stays readable by other handlers.
+     * 
+     * @param annotation the line without its leading '@'
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    virtual ResultCode loadAnnotation(std::string_view annotation);
+
+    /**
+     * @brief Rewrites the bytes of a range just read that the handler can rebuild from its
+     * annotations, so structure kept in the .noncrit stream is as safe as critical data.
+     * Does nothing by default.
+     * 
+     * @param buffer the bytes read
+     * @param size number of bytes read
+     * @param offset logical offset they were read from
+     */
+    virtual void restoreStructure(char* buffer, size_t size, off_t offset) const;
+
+    /**
+     * @brief Whether this handler's extent lists repeat across files (e.g. every image of one
+     * size and header layout), so they are worth storing once in the template store.
+     * 
+     * @return true to save the extents as a shared template, false (the default) to keep them inline
+     */
+    virtual bool usesMappingTemplates() const;
     
 
 public:
-    AbstractFileHandler() = default; // default constructor
+    AbstractFileHandler(); // default constructor, allocates from the current request arena
     AbstractFileHandler(const AbstractFileHandler&) = default; // copy constructor
     virtual ~AbstractFileHandler() = default;   // destructor
 
-    std::map<Range, std::pair<Range, CriticalType>>& getFileMap(); // getter for fileMap
-    ResultCode setFileMap(const std::map<Range, std::pair<Range, CriticalType>>& newFileMap); // setter for fileMap
+    FileMap& getFileMap(); // getter for fileMap
+    ResultCode setFileMap(const FileMap& newFileMap); // setter for fileMap
     
    
     /**
@@ -42,7 +203,7 @@ public:
      * @param type critical type (CRITICAL_DATA or NON_CRITICAL_DATA)
      * @return ResultCode SUCCESS if successful, FAILURE otherwise
      */
-    ResultCode addToFileMap(int origStart, int origEnd, int mappedStart, int mappedEnd, CriticalType type);
+    ResultCode addToFileMap(int64_t origStart, int64_t origEnd, int64_t mappedStart, int64_t mappedEnd, CriticalType type);
 
     /**
      * @brief Loads a mapping memory file from the given path and populates the fileMap with its contents.
@@ -52,6 +213,17 @@ public:
      */
     ResultCode loadMapFromFile(const char* mappingPath); 
 
+    /**
+     * @brief Logical size of a split file and the bytes its streams hold, read from the header
+     * of a paged index without loading its extents, or computed from a text mapping.
+     * 
+     * @param mappingPath the path to the mapping file
+     * @param logicalSize set to the size of the file
+     * @param storedBytes set to the bytes kept in .crit and .noncrit (holes excluded)
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    ResultCode getMappingSize(const char* mappingPath, uint64_t& logicalSize, uint64_t& storedBytes);
+
     /**
      * @brief Saves the current fileMap to a mapping memory file at the given path.
      * 
@@ -60,6 +232,48 @@ public:
      */
     ResultCode saveMapToFile(const char* mappingPath); 
 
+    /**
+     * @brief Serializes the current fileMap in the mapping file format: text lines, a paged
+     * index once the map has StorageContext::mappingIndexThreshold extents, or a reference to
+     * a shared template when the handler uses them and a template store is configured.
+     * 
+     * @return std::string the mapping file contents
+     */
+    std::string serializeMap() const;
+
+    /**
+     * @brief Writes an update's streams and mapping to the backing files of its base path,
+     * the .crit parity if StorageContext::parityShards is set and the .crit replicas if
+     * StorageContext::replicas is. Packs the streams into the
+     * segment store instead when the file is small enough. A patch update only writes its
+     * patches into the existing stream files.
+     * 
+     * @param update the new streams, mapping and logical size
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    static ResultCode persistStreams(const IntentLog::Intent& update);
+
+    /**
+     * @brief Makes the .crit, .noncrit, .parity and .mapping files (or the packed segment) of basePath durable.
+     * Under DurabilityPolicy::RELAXED_NONCRIT the .noncrit stream is skipped.
+     * 
+     * @param basePath the backing path without the stream suffix
+     * @param dataOnly use fdatasync instead of fsync
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    static ResultCode syncStreams(const std::string& basePath, bool dataOnly = true);
+
+    /**
+     * @brief Makes toBasePath an exact copy of fromBasePath by copying its .mapping, .crit,
+     * .noncrit and .parity directly (FICLONE reflinks where supported), without reassembling
+     * the logical file. The .crit replicas are copied from the new .crit.
+     * 
+     * @param fromBasePath the source backing path without the stream suffix
+     * @param toBasePath the destination backing path without the stream suffix
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    static ResultCode cloneStreams(const std::string& fromBasePath, const std::string& toBasePath);
+
     /**
      * @brief Reads a file from the given path and writes to the buffer with its contents.
      * 
@@ -67,21 +281,52 @@ public:
      * @param buffer buffer to read into
      * @param size size of the buffer
      * @param offset offset to read from
+     * @param degradable let slow or failing .noncrit reads return zeros (see
+     * StreamReader::allowDegraded); only for bytes going straight back to a reader
      * @return ResultCode SUCCESS if successful, FAILURE otherwise
      */
-    ResultCode readFile(const char* mappingPath, char* buffer, size_t size, off_t offset);
+    ResultCode readFile(const char* mappingPath, char* buffer, size_t size, off_t offset, bool degradable = false);
 
     /**
      * @brief Writes the given buffer to a file at the given path.
      * 
      * @param mappingPath - the path to the mapping file - to know where the content is stored
-     * @param buffer buffer to write from
+     * @param buffer buffer to write from, nullptr to write size zero bytes
      * @param size size of the buffer
      * @param offset offset to write to
      * @return ResultCode SUCCESS if successful, FAILURE otherwise
      */
     ResultCode writeFile(const char* mappingPath, const char* buffer, size_t size, off_t offset); 
 
+    /**
+     * @brief Allocates the logical range [offset, offset + length) of the file (the fallocate op).
+     * Growing the file adds zero bytes classified by the handler; with keepSize the logical size
+     * stays the same and only room in the .noncrit stream is reserved.
+     * 
+     * @param mappingPath - the path to the mapping file - to know where the content is stored
+     * @param offset start of the range to allocate
+     * @param length length of the range to allocate
+     * @param keepSize do not change the logical size (FALLOC_FL_KEEP_SIZE)
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    ResultCode allocateFile(const char* mappingPath, off_t offset, off_t length, bool keepSize);
+
+    /**
+     * @brief Logical size of the file described by the current fileMap.
+     */
+    size_t getFileSize() const;
+
+    /**
+     * @brief Finds the next data or hole position at or after offset (the lseek op with
+     * SEEK_DATA / SEEK_HOLE). The end of the file counts as a hole.
+     * 
+     * @param mappingPath the path to the mapping file
+     * @param offset position to start searching from
+     * @param whence SEEK_DATA or SEEK_HOLE
+     * @return off_t the position found, -1 with errno = ENXIO if there is none
+     */
+    off_t seekData(const char* mappingPath, off_t offset, int whence);
+
     /**
      * @brief Create a Mapping for critical data and non-critical data in the file, saved in the map object.
      * 
@@ -95,6 +340,46 @@ public:
      */
     virtual ResultCode createMapping(const char* buffer, size_t size) = 0; 
 
+    /**
+     * @brief Incremental form of createMapping for files that do not fit in memory: call
+     * beginMapping, then feedMapping with consecutive chunks of the file in order (of any size),
+     * then finishMapping once the whole file was fed. Handlers record extents as soon as they are
+     * known, so only the parser state and the extent list are kept between chunks; the fileMap is
+     * complete once finishMapping returns.
+     * 
+     * The default implementation collects the chunks and calls createMapping at the end.
+     * 
+     * @param chunk the next bytes of the file
+     * @param size the size of the chunk
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    virtual ResultCode beginMapping();
+    virtual ResultCode feedMapping(const char* chunk, size_t size);
+    virtual ResultCode finishMapping();
+
+    /**
+     * @brief Creates the mapping from a random-access view of the file. Handlers override it to
+     * read only the byte ranges their mapping depends on; the default reads the whole source
+     * through the incremental mapping.
+     * 
+     * @param source the file content
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    virtual ResultCode createMappingFromSource(ByteSource& source);
+
+    /**
+     * @brief Updates the fileMap, which describes the file before a change, for a file changed
+     * from offset on: the extents before a point at or before offset are kept and the rest is
+     * mapped again from the source. The new extents have stream offsets counted from 0.
+     * Handlers that can resume parsing mid-file override it; the default fails.
+     * 
+     * @param source the changed file
+     * @param offset first changed byte
+     * @param point set to the logical offset mapping resumed from
+     * @return ResultCode SUCCESS if successful, FAILURE if the file has to be mapped from the start
+     */
+    virtual ResultCode remapFrom(ByteSource& source, uint64_t offset, uint64_t& point);
+
     /**
      * @brief Reads the entire file into the buffer.
      * 
@@ -1,69 +1,90 @@
 #include "BmpFile.h"
 #include <cstring>
 #include <cstdint>
+#include <algorithm>
 
-ResultCode BmpFileHandler::createMapping(const char* buffer, size_t size) {
-    if (size == 0) {
-        return ResultCode::SUCCESS; // Nothing to map
-    }
-        size_t origOffset = 0;
-    size_t critOffset = 0;
-    size_t noncritOffset = 0;
+// File header (14 bytes) + DIB header (assume BITMAPINFOHEADER — 40 bytes)
+const size_t BMP_HEADERS_SIZE = 54;
 
-    // Check BMP signature
-    if (buffer[0] != 'B' || buffer[1] != 'M') {
-        return ResultCode::FAILURE;
-    }
+// Rows whose extents are reserved up front when the header is read
+const size_t BMP_MAX_RESERVED_ROWS = 65536;
 
-    // File header (14 bytes) — critical
-    addToFileMap(origOffset, origOffset + 13, critOffset, critOffset + 13, CriticalType::CRITICAL_DATA);
-    origOffset += 14;
-    critOffset += 14;
+ResultCode BmpFileHandler::startParsing() {
+    state = State::SIGNATURE;
+    rowsLeft = 0;
+    expectHeader(2);
+    return ResultCode::SUCCESS;
+}
 
-    // DIB header (assume BITMAPINFOHEADER — 40 bytes) — critical
-    addToFileMap(origOffset, origOffset + 39, critOffset, critOffset + 39, CriticalType::CRITICAL_DATA);
+ResultCode BmpFileHandler::onHeader(const char* header, size_t size) {
+    if (state == State::SIGNATURE) {
+        // Check BMP signature
+        if (header[0] != 'B' || header[1] != 'M') {
+            return ResultCode::FAILURE;
+        }
+        state = State::HEADERS;
+        expectHeader(BMP_HEADERS_SIZE - 2);
+        return mapHeader(0, size, CriticalType::CRITICAL_DATA);
+    }
 
-    // Get image dimensions and pixel data offset
-    int32_t width = *(const int32_t*)(buffer + 18);
-    int32_t height = *(const int32_t*)(buffer + 22);
-    uint16_t bitsPerPixel = *(const uint16_t*)(buffer + 28);
-    uint32_t pixelDataOffset = *(const uint32_t*)(buffer + 10);
-    origOffset += 40;
-    critOffset += 40;
+    // Get image dimensions and pixel data offset (header starts at file offset 2)
+    int32_t width;
+    int32_t height;
+    uint16_t bitsPerPixel;
+    std::memcpy(&pixelDataOffset, header + 10 - 2, sizeof(pixelDataOffset));
+    std::memcpy(&width, header + 18 - 2, sizeof(width));
+    std::memcpy(&height, header + 22 - 2, sizeof(height));
+    std::memcpy(&bitsPerPixel, header + 28 - 2, sizeof(bitsPerPixel));
 
-    if (pixelDataOffset > size || bitsPerPixel != 24 || width <= 0 || height == 0) {
+    if (bitsPerPixel != 24 || width <= 0 || height == 0) {
         return ResultCode::FAILURE; // Only 24-bit BMP supported
     }
 
-    // Critical area before pixel data (e.g., color table if any)
-    if (origOffset < pixelDataOffset) {
-        size_t gap = pixelDataOffset - origOffset;
-        addToFileMap(origOffset, origOffset + gap - 1, critOffset, critOffset + gap - 1, CriticalType::CRITICAL_DATA);
-        origOffset += gap;
-        critOffset += gap;
+    // File and DIB headers are critical
+    if (mapHeader(0, size, CriticalType::CRITICAL_DATA) != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
     }
 
     // Row padding: each row in BMP is aligned to 4 bytes
-    size_t rowSize = ((width * 3 + 3) / 4) * 4;
-    size_t pixelSize = width * 3;
-    size_t absHeight = height > 0 ? height : -height;
+    size_t rowSize = ((static_cast<size_t>(width) * 3 + 3) / 4) * 4;
+    pixelSize = static_cast<size_t>(width) * 3;
+    padding = rowSize - pixelSize;
+    rowsLeft = height > 0 ? height : -static_cast<int64_t>(height);
+    // Padded rows alternate between pixel and padding extents (unpadded rows merge into one);
+    // the height is not trusted beyond what a real image would have
+    if (padding > 0) {
+        reserveExtents(2 * std::min<size_t>(rowsLeft, BMP_MAX_RESERVED_ROWS) + 2);
+    }
 
-    for (size_t row = 0; row < absHeight; ++row) {
-        if (origOffset + rowSize > size) return ResultCode::FAILURE;
+    // Critical area before pixel data (e.g., color table if any)
+    state = State::GAP;
+    expectPayload(pixelDataOffset > BMP_HEADERS_SIZE ? pixelDataOffset - BMP_HEADERS_SIZE : 0, CriticalType::CRITICAL_DATA);
+    return ResultCode::SUCCESS;
+}
 
-        // Map pixel data (non-critical)
-        addToFileMap(origOffset, origOffset + pixelSize - 1, noncritOffset, noncritOffset + pixelSize - 1, CriticalType::NON_CRITICAL_DATA);
-        origOffset += pixelSize;
-        noncritOffset += pixelSize;
+ResultCode BmpFileHandler::nextRow() {
+    if (rowsLeft == 0) {
+        // Anything after the last row is kept as is
+        expectTrailing(CriticalType::CRITICAL_DATA);
+        return ResultCode::SUCCESS;
+    }
+    rowsLeft--;
+    // Map pixel data (non-critical)
+    state = State::PIXELS;
+    expectPayload(pixelSize, CriticalType::NON_CRITICAL_DATA);
+    return ResultCode::SUCCESS;
+}
 
+ResultCode BmpFileHandler::onPayloadEnd() {
+    if (state == State::PIXELS && padding > 0) {
         // Map padding (critical)
-        size_t padding = rowSize - pixelSize;
-        if (padding > 0) {
-            addToFileMap(origOffset, origOffset + padding - 1, critOffset, critOffset + padding - 1, CriticalType::CRITICAL_DATA);
-            origOffset += padding;
-            critOffset += padding;
-        }
+        state = State::PADDING;
+        expectPayload(padding, CriticalType::CRITICAL_DATA);
+        return ResultCode::SUCCESS;
     }
+    return nextRow();
+}
 
-    return ResultCode::SUCCESS;
+bool BmpFileHandler::usesMappingTemplates() const {
+    return true;
 }
@@ -1,17 +1,31 @@
 #ifndef BMP_FILE_HANDLERS_HPP
 #define BMP_FILE_HANDLERS_HPP
 
-#include "AbstractFile.h"
+#include "IncrementalFile.h"
+#include <cstdint>
 
-class BmpFileHandler : public AbstractFileHandler {
+class BmpFileHandler : public IncrementalFileHandler {
 public:
     BmpFileHandler() = default; // default constructor
     BmpFileHandler(const BmpFileHandler&) = default; // copy constructor
     ~BmpFileHandler() override = default; // destructor
 
-    ResultCode createMapping(const char* buffer, size_t size) override;
+protected:
+    ResultCode startParsing() override;
+    ResultCode onHeader(const char* header, size_t size) override;
+    ResultCode onPayloadEnd() override;
+    bool usesMappingTemplates() const override; // every image of one size has the same layout
+
+private:
+    enum class State { SIGNATURE, HEADERS, GAP, PIXELS, PADDING };
+    State state = State::SIGNATURE;
+    uint32_t pixelDataOffset = 0;
+    size_t pixelSize = 0;   // pixel bytes per row
+    size_t padding = 0;     // padding bytes per row
+    size_t rowsLeft = 0;
+
+    ResultCode nextRow();
 };
 
 
 #endif // BMP_FILE_HANDLERS_HPP
-
@@ -5,16 +5,29 @@
 #include <cstdint>
 #include <vector>
 #include <utility>
+#include <functional>
+#include <set>
 
 // Constants
 const int TIFF_HEADER_SIZE = 8;
 const int IFD_ENTRY_SIZE = 12;
 
-// DNG-specific tag IDs
-const uint16_t DNG_COLOR_MATRIX = 0xC621;
-const uint16_t DNG_CAMERA_CALIBRATION = 0xC623;
-const uint16_t DNG_AS_SHOT_NEUTRAL = 0xC628;
-const uint16_t DNG_MAKER_NOTE = 0xC634;
+// TIFF tags that locate image data and further IFDs
+const uint16_t TAG_STRIP_OFFSETS = 0x0111;
+const uint16_t TAG_STRIP_BYTE_COUNTS = 0x0117;
+const uint16_t TAG_TILE_OFFSETS = 0x0144;
+const uint16_t TAG_TILE_BYTE_COUNTS = 0x0145;
+const uint16_t TAG_SUB_IFDS = 0x014A;
+const uint16_t TAG_JPEG_OFFSET = 0x0201; // JPEGInterchangeFormat, old-style JPEG previews
+const uint16_t TAG_JPEG_LENGTH = 0x0202; // JPEGInterchangeFormatLength
+
+// TIFF field types used by those tags
+const uint16_t TYPE_SHORT = 3;
+const uint16_t TYPE_LONG = 4;
+const uint16_t TYPE_IFD = 13;
+
+// Upper bound on the IFDs visited, so a corrupt file cannot keep the parser busy
+const size_t MAX_IFDS = 1024;
 
 // Helper: Endian awareness
 enum class Endian {
@@ -41,25 +54,66 @@ uint32_t read32(const char* ptr, Endian endian) {
     return val;
 }
 
-// Helper: Check if tag is DNG-specific metadata
-bool isDngMetadataTag(uint16_t tag) {
-    return tag == DNG_COLOR_MATRIX ||
-           tag == DNG_CAMERA_CALIBRATION ||
-           tag == DNG_AS_SHOT_NEUTRAL ||
-           tag == DNG_MAKER_NOTE;
+enum class LayoutStatus {
+    COMPLETE,
+    NEED_MORE, // a structure lies beyond the bytes available so far
+    INVALID
+};
+
+// Returns [offset, offset + length) of the file, or nullptr if those bytes are not available.
+// The pointer is only valid until the next call.
+using FetchFn = std::function<const char*(uint64_t offset, size_t length)>;
+
+// Reads the SHORT/LONG values of an IFD entry, stored inline when they fit in 4 bytes and at
+// the value offset otherwise. Entries of other types leave values empty, and so does an array
+// out of bounds of a complete file.
+static LayoutStatus readValues(const FetchFn& fetch, bool complete, Endian endian, const char* entry,
+                               std::vector<uint32_t>& values) {
+    uint16_t type = read16(entry + 2, endian);
+    uint32_t count = read32(entry + 4, endian);
+    size_t width = (type == TYPE_SHORT) ? 2 : (type == TYPE_LONG || type == TYPE_IFD) ? 4 : 0;
+    values.clear();
+    if (width == 0 || count == 0) {
+        return LayoutStatus::COMPLETE;
+    }
+
+    uint64_t total = static_cast<uint64_t>(count) * width;
+    const char* data = entry + 8;
+    if (total > 4) {
+        data = fetch(read32(entry + 8, endian), total);
+        if (!data) {
+            return complete ? LayoutStatus::COMPLETE : LayoutStatus::NEED_MORE;
+        }
+    }
+    values.reserve(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        values.push_back(width == 2 ? read16(data + i * 2, endian) : read32(data + i * 4, endian));
+    }
+    return LayoutStatus::COMPLETE;
 }
 
-ResultCode DngFileHandler::createMapping(const char* buffer, size_t size) {
-    
-    // if the buffer is empty, we don't need to do anything
-    if (size == 0) {
-        return ResultCode::SUCCESS;
+// Adds the blocks described by parallel offset and byte count tables
+static void addBlocks(const std::vector<uint32_t>& offsets, const std::vector<uint32_t>& lengths, DngLayout& layout) {
+    for (size_t i = 0; i < std::min(offsets.size(), lengths.size()); ++i) {
+        layout.imageBlocks.emplace_back(offsets[i], lengths[i]);
     }
+}
 
-    if (!buffer || size < TIFF_HEADER_SIZE) {
+// Reads the layout through fetch. With `complete` set the whole file is available, and
+// structures out of bounds are errors (the first IFD) or skipped (anything else) rather
+// than NEED_MORE.
+//
+// Every IFD is visited: the main chain (raw image or preview, then thumbnails), the SubIFDs
+// in which DNG stores the full-resolution raw image and further previews, and their chains.
+static LayoutStatus parseLayout(const FetchFn& fetch, bool complete, DngLayout& layout) {
+    char buffer[TIFF_HEADER_SIZE];
+    const char* header = fetch(0, TIFF_HEADER_SIZE);
+    if (!header) {
+        if (!complete) return LayoutStatus::NEED_MORE;
         std::cerr << "Invalid buffer or size too small" << std::endl;
-        return ResultCode::FAILURE;
+        return LayoutStatus::INVALID;
     }
+    std::memcpy(buffer, header, TIFF_HEADER_SIZE);
 
     // 1. Read byte order
     Endian endian;
@@ -69,123 +123,229 @@ ResultCode DngFileHandler::createMapping(const char* buffer, size_t size) {
         endian = Endian::BIG;
     } else {
         std::cerr << "Invalid byte order" << std::endl;
-        return ResultCode::FAILURE;
+        return LayoutStatus::INVALID;
     }
 
     // 2. Validate magic number
     uint16_t magic = read16(buffer + 2, endian);
     if (magic != 42) {
         std::cerr << "Invalid TIFF magic number" << std::endl;
-        return ResultCode::FAILURE;
+        return LayoutStatus::INVALID;
     }
 
-    // 3. Read offset to first IFD
-    uint32_t ifdOffset = read32(buffer + 4, endian);
-    if (ifdOffset >= size || ifdOffset + 2 > size) {
-        std::cerr << "Invalid IFD offset" << std::endl;
-        return ResultCode::FAILURE;
-    }
+    // 3. Walk the IFDs, starting with the first one
+    uint32_t firstIfd = read32(buffer + 4, endian);
+    std::vector<uint32_t> pending = {firstIfd};
+    std::set<uint32_t> visited;
+    layout.ifdCount = 0;
+    layout.imageBlocks.clear();
 
-    // 4. Map TIFF header
-    addToFileMap(0, TIFF_HEADER_SIZE - 1, 0, TIFF_HEADER_SIZE - 1, CriticalType::CRITICAL_DATA);
+    std::vector<char> ifd;
+    std::vector<uint32_t> values, stripOffsets, stripLengths, tileOffsets, tileLengths;
+    while (!pending.empty()) {
+        uint32_t ifdOffset = pending.back();
+        pending.pop_back();
+        if (ifdOffset == 0 || !visited.insert(ifdOffset).second) {
+            continue; // end of a chain, or an IFD already seen
+        }
+        if (visited.size() > MAX_IFDS) {
+            std::cerr << "Too many IFDs" << std::endl;
+            return LayoutStatus::INVALID;
+        }
 
-    // 5. Read number of IFD entries
-    uint16_t entryCount = read16(buffer + ifdOffset, endian);
-    size_t ifdSize = 2 + entryCount * IFD_ENTRY_SIZE + 4; // includes nextIFD offset
-    if (ifdOffset + ifdSize > size) {
-        std::cerr << "IFD size exceeds file size" << std::endl;
-        return ResultCode::FAILURE;
+        // 4. Read number of IFD entries, then the whole IFD
+        const char* countField = fetch(ifdOffset, 2);
+        const char* ifdData = nullptr;
+        size_t ifdSize = 0;
+        if (countField) {
+            uint16_t entryCount = read16(countField, endian);
+            ifdSize = 2 + entryCount * IFD_ENTRY_SIZE + 4; // includes nextIFD offset
+            ifdData = fetch(ifdOffset, ifdSize);
+        }
+        if (!ifdData) {
+            if (!complete) return LayoutStatus::NEED_MORE;
+            if (ifdOffset == firstIfd) {
+                std::cerr << "Invalid IFD offset" << std::endl;
+                return LayoutStatus::INVALID;
+            }
+            continue; // a dangling link: the bytes it would describe stay critical
+        }
+        ifd.assign(ifdData, ifdData + ifdSize);
+        uint16_t entryCount = read16(ifd.data(), endian);
+        layout.ifdCount++;
+
+        // 5. Parse IFD entries
+        stripOffsets.clear();
+        stripLengths.clear();
+        tileOffsets.clear();
+        tileLengths.clear();
+        uint32_t jpegOffset = 0, jpegLength = 0;
+        for (int i = 0; i < entryCount; ++i) {
+            const char* entry = ifd.data() + 2 + i * IFD_ENTRY_SIZE;
+            uint16_t tag = read16(entry, endian);
+            std::vector<uint32_t>* target = nullptr;
+            switch (tag) {
+                case TAG_STRIP_OFFSETS: target = &stripOffsets; break;
+                case TAG_STRIP_BYTE_COUNTS: target = &stripLengths; break;
+                case TAG_TILE_OFFSETS: target = &tileOffsets; break;
+                case TAG_TILE_BYTE_COUNTS: target = &tileLengths; break;
+                case TAG_SUB_IFDS:
+                case TAG_JPEG_OFFSET:
+                case TAG_JPEG_LENGTH: target = &values; break;
+                default: continue;
+            }
+            LayoutStatus status = readValues(fetch, complete, endian, entry, *target);
+            if (status != LayoutStatus::COMPLETE) {
+                return status;
+            }
+            if (tag == TAG_SUB_IFDS) {
+                pending.insert(pending.end(), values.begin(), values.end());
+            } else if (tag == TAG_JPEG_OFFSET && !values.empty()) {
+                jpegOffset = values[0];
+            } else if (tag == TAG_JPEG_LENGTH && !values.empty()) {
+                jpegLength = values[0];
+            }
+        }
+        addBlocks(stripOffsets, stripLengths, layout);
+        addBlocks(tileOffsets, tileLengths, layout);
+        if (jpegOffset > 0 && jpegLength > 0) {
+            layout.imageBlocks.emplace_back(jpegOffset, jpegLength);
+        }
+
+        // 6. Follow the chain
+        pending.push_back(read32(ifd.data() + ifdSize - 4, endian));
     }
 
-    // Map IFD as critical
-    addToFileMap(ifdOffset, ifdOffset + ifdSize - 1,
-                 TIFF_HEADER_SIZE, TIFF_HEADER_SIZE + ifdSize - 1,
-                 CriticalType::CRITICAL_DATA);
+    return LayoutStatus::COMPLETE;
+}
 
-    // 6. Parse IFD entries
-    std::vector<std::pair<uint32_t, uint32_t>> imageBlocks;
-    std::vector<std::pair<uint32_t, uint32_t>> metadataBlocks;
+ResultCode DngFileHandler::mapLayout(const DngLayout& layout, size_t size) {
+    // Image data (strips, tiles and previews of every IFD) goes to the .noncrit stream. The rest
+    // of the file, the header, the IFDs, their tag values and whatever lies between the image
+    // blocks, is critical, so every byte is covered. The header stays critical even if a
+    // corrupt table points into it.
+    std::vector<std::pair<uint64_t, uint64_t>> blocks; // start, end (exclusive)
+    blocks.reserve(layout.imageBlocks.size());
+    for (const auto& [offset, length] : layout.imageBlocks) {
+        uint64_t start = std::max<uint64_t>(offset, TIFF_HEADER_SIZE);
+        uint64_t end = std::min<uint64_t>(static_cast<uint64_t>(offset) + length, size);
+        if (start < end) {
+            blocks.emplace_back(start, end);
+        }
+    }
+    std::sort(blocks.begin(), blocks.end());
 
-    for (int i = 0; i < entryCount; ++i) {
-        size_t entryOffset = ifdOffset + 2 + i * IFD_ENTRY_SIZE;
-        if (entryOffset + 12 > size) {
-            std::cerr << "IFD entry out of bounds" << std::endl;
+    uint64_t pos = 0;
+    uint64_t critOffset = 0;
+    uint64_t noncritOffset = 0;
+    size_t i = 0;
+    while (pos < size) {
+        if (i == blocks.size() || blocks[i].first > pos) {
+            uint64_t end = (i == blocks.size()) ? size : blocks[i].first;
+            addToFileMap(pos, end - 1, critOffset, critOffset + (end - pos) - 1, CriticalType::CRITICAL_DATA);
+            critOffset += end - pos;
+            pos = end;
             continue;
         }
 
-        uint16_t tag = read16(buffer + entryOffset, endian);
-        uint16_t type = read16(buffer + entryOffset + 2, endian);
-        uint32_t count = read32(buffer + entryOffset + 4, endian);
-        uint32_t valueOffset = read32(buffer + entryOffset + 8, endian);
-
-        // Handle DNG metadata tags
-        if (isDngMetadataTag(tag)) {
-            uint32_t dataSize = count * (type == 3 ? 2 : 4); // Approximate size
-            if (valueOffset + dataSize <= size) {
-                metadataBlocks.emplace_back(valueOffset, dataSize);
-            }
+        // Adjacent and overlapping blocks (tiles are usually stored back to back) form one extent
+        uint64_t end = blocks[i].second;
+        while (i < blocks.size() && blocks[i].first <= end) {
+            end = std::max(end, blocks[i].second);
+            ++i;
         }
-        // Handle image data tags
-        else if (tag == 0x0111 || tag == 0x0117) { // StripOffsets or StripByteCounts
-            std::vector<uint32_t> values;
-
-            if ((type == 3 && count <= 2) || (type == 4 && count == 1)) {
-                values.push_back(valueOffset);
-            } else {
-                if (valueOffset + count * 4 > size) continue;
-                for (uint32_t j = 0; j < count; ++j) {
-                    uint32_t val = read32(buffer + valueOffset + j * 4, endian);
-                    values.push_back(val);
-                }
-            }
+        uint64_t start = pos;
+        addToFileMap(start, end - 1, noncritOffset, noncritOffset + (end - start) - 1, CriticalType::NON_CRITICAL_DATA);
+        noncritOffset += end - start;
+        pos = end;
+    }
 
-            if (tag == 0x0111) {  // StripOffsets
-                for (auto& v : values) {
-                    imageBlocks.emplace_back(v, 0);
-                }
-            } else if (tag == 0x0117) { // StripByteCounts
-                for (size_t j = 0; j < std::min(imageBlocks.size(), values.size()); ++j) {
-                    imageBlocks[j].second = values[j];
-                }
-            }
-        }
+    return ResultCode::SUCCESS;
+}
+
+ResultCode DngFileHandler::createMapping(const char* buffer, size_t size) {
+    
+    // if the buffer is empty, we don't need to do anything
+    if (size == 0) {
+        return ResultCode::SUCCESS;
     }
 
-    // 7. Map metadata blocks as critical
-    size_t mappedOffset = TIFF_HEADER_SIZE + ifdSize;
-    for (const auto& [offset, length] : metadataBlocks) {
-        if (offset < size && length > 0 && offset + length <= size) {
-            addToFileMap(offset, offset + length - 1,
-                        mappedOffset, mappedOffset + length - 1,
-                        CriticalType::CRITICAL_DATA);
-            mappedOffset += length;
-        }
+    if (!buffer) {
+        std::cerr << "Invalid buffer or size too small" << std::endl;
+        return ResultCode::FAILURE;
     }
 
-    // 8. Map image data blocks as non-critical
-    mappedOffset = 0;
-    for (const auto& [offset, length] : imageBlocks) {
-        if (offset < size && length > 0 && offset + length <= size) {
-            addToFileMap(offset, offset + length - 1,
-                        mappedOffset, mappedOffset + length - 1,
-                        CriticalType::NON_CRITICAL_DATA);
-            mappedOffset += length;
+    auto fetch = [&](uint64_t offset, size_t length) -> const char* {
+        return (offset <= size && length <= size - offset) ? buffer + offset : nullptr;
+    };
+    DngLayout parsed;
+    if (parseLayout(fetch, true, parsed) != LayoutStatus::COMPLETE) {
+        return ResultCode::FAILURE;
+    }
+    return mapLayout(parsed, size);
+}
+
+ResultCode DngFileHandler::createMappingFromSource(ByteSource& source) {
+    uint64_t size = source.size();
+    if (size == 0) {
+        return ResultCode::SUCCESS;
+    }
+
+    // Only the header, the IFDs and their strip and tile tables are read
+    std::vector<char> scratch;
+    auto fetch = [&](uint64_t offset, size_t length) -> const char* {
+        if (offset > size || length > size - offset) {
+            return nullptr;
         }
+        scratch.resize(length);
+        return source.read(offset, length, scratch.data()) ? scratch.data() : nullptr;
+    };
+    DngLayout parsed;
+    if (parseLayout(fetch, true, parsed) != LayoutStatus::COMPLETE) {
+        return ResultCode::FAILURE;
     }
+    return mapLayout(parsed, size);
+}
 
+ResultCode DngFileHandler::beginMapping() {
+    prefix.clear();
+    received = 0;
+    layoutKnown = false;
     return ResultCode::SUCCESS;
 }
 
-/**
-TODO: fix the mapping file generation
+ResultCode DngFileHandler::feedMapping(const char* chunk, size_t size) {
+    received += size;
+    if (layoutKnown) {
+        return ResultCode::SUCCESS;
+    }
 
-Wrong output from the DNG file handler:
-0-7 0-7 CRITICAL_DATA
-8-721 8-721 CRITICAL_DATA
-13334-13369 722-757 CRITICAL_DATA
-13478-13513 758-793 CRITICAL_DATA
-13646-13657 794-805 CRITICAL_DATA
-13742-308141 0-131327 NON_CRITICAL_DATA
+    prefix.insert(prefix.end(), chunk, chunk + size);
+    auto fetch = [&](uint64_t offset, size_t length) -> const char* {
+        return (offset <= prefix.size() && length <= prefix.size() - offset) ? prefix.data() + offset : nullptr;
+    };
+    switch (parseLayout(fetch, false, knownLayout)) {
+        case LayoutStatus::COMPLETE:
+            layoutKnown = true;
+            std::vector<char>().swap(prefix);
+            return ResultCode::SUCCESS;
+        case LayoutStatus::NEED_MORE:
+            return ResultCode::SUCCESS;
+        default:
+            return ResultCode::FAILURE;
+    }
+}
 
-  
- */
\ No newline at end of file
+ResultCode DngFileHandler::finishMapping() {
+    if (!layoutKnown) {
+        // The whole file was kept, map it the usual way
+        std::vector<char> buffer;
+        buffer.swap(prefix);
+        return createMapping(buffer.data(), buffer.size());
+    }
+    return mapLayout(knownLayout, received);
+}
+
+bool DngFileHandler::usesMappingTemplates() const {
+    return true;
+}
@@ -2,6 +2,15 @@
 #define DNG_FILE_HANDLERS_HPP
 
 #include "AbstractFile.h"
+#include <cstdint>
+#include <vector>
+#include <utility>
+
+// Where the image data of a DNG file is, as read from all of its IFDs
+struct DngLayout {
+    size_t ifdCount = 0;                                    // IFDs visited: the main chain, SubIFDs and their chains
+    std::vector<std::pair<uint32_t, uint32_t>> imageBlocks; // offset, length of every strip, tile and JPEG preview
+};
 
 class DngFileHandler : public AbstractFileHandler {
 public:
@@ -10,6 +19,28 @@ public:
     ~DngFileHandler() override = default; // destructor
     
     ResultCode createMapping(const char* buffer, size_t size) override;
+
+    /**
+     * The layout is usually known from the first kilobytes of the file: only the bytes up to
+     * the last IFD and strip or tile table are kept, the image data is just counted.
+     */
+    ResultCode beginMapping() override;
+    ResultCode feedMapping(const char* chunk, size_t size) override;
+    ResultCode finishMapping() override;
+
+    // Reads only the header, the IFDs and their strip and tile tables
+    ResultCode createMappingFromSource(ByteSource& source) override;
+
+protected:
+    bool usesMappingTemplates() const override; // files from one camera and mode share a layout
+
+private:
+    std::vector<char> prefix; // bytes kept until the layout is known
+    uint64_t received = 0;
+    bool layoutKnown = false;
+    DngLayout knownLayout;
+
+    ResultCode mapLayout(const DngLayout& layout, size_t size);
 };
 
-#endif // DNG_FILE_HANDLERS_HPP 
\ No newline at end of file
+#endif // DNG_FILE_HANDLERS_HPP 
@@ -0,0 +1,261 @@
+#include "IncrementalFile.h"
+#include <algorithm>
+
+// Read size for scanned payloads when mapping from a ByteSource
+const size_t SOURCE_SCAN_BLOCK = 256 * 1024;
+
+ResultCode IncrementalFileHandler::createMapping(const char* buffer, size_t size) {
+    if (beginMapping() != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
+    }
+    reserveExtents(estimateExtents(size));
+    if (feedMapping(buffer, size) != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
+    }
+    return finishMapping();
+}
+
+ResultCode IncrementalFileHandler::beginMapping() {
+    resetDriver(0);
+    return startParsing();
+}
+
+void IncrementalFileHandler::resetDriver(uint64_t start) {
+    expect = Expect::TRAILING;
+    header.clear();
+    headerSize = 0;
+    payloadRemaining = 0;
+    position = start;
+    critOffset = 0;
+    noncritOffset = 0;
+    havePending = false;
+    extents.clear();
+}
+
+ResultCode IncrementalFileHandler::feedMapping(const char* chunk, size_t size) {
+    // A zero-length payload ends without consuming anything
+    while (size > 0 || (expect == Expect::PAYLOAD && payloadRemaining == 0)) {
+        size_t taken = 0;
+        ResultCode result = ResultCode::SUCCESS;
+
+        switch (expect) {
+            case Expect::HEADER:
+                taken = std::min(size, headerSize - header.size());
+                header.insert(header.end(), chunk, chunk + taken);
+                position += taken;
+                if (header.size() == headerSize) {
+                    std::vector<char> complete;
+                    complete.swap(header);
+                    completedHeaderStart = headerStart;
+                    result = onHeader(complete.data(), complete.size());
+                }
+                break;
+
+            case Expect::PAYLOAD:
+                taken = static_cast<size_t>(std::min<uint64_t>(size, payloadRemaining));
+                result = map(position, taken, pieceType);
+                position += taken;
+                payloadRemaining -= taken;
+                if (result == ResultCode::SUCCESS && payloadRemaining == 0) {
+                    result = onPayloadEnd();
+                }
+                break;
+
+            case Expect::SCAN: {
+                bool ended = false;
+                taken = scanPayload(chunk, size, ended);
+                result = map(position, taken, pieceType);
+                position += taken;
+                if (result == ResultCode::SUCCESS && ended) {
+                    result = onPayloadEnd();
+                }
+                break;
+            }
+
+            case Expect::TRAILING:
+                taken = size;
+                result = map(position, taken, pieceType);
+                position += taken;
+                break;
+        }
+
+        if (result != ResultCode::SUCCESS) {
+            return result;
+        }
+        chunk += taken;
+        size -= taken;
+    }
+    return ResultCode::SUCCESS;
+}
+
+ResultCode IncrementalFileHandler::finishMapping() {
+    if (feedMapping(nullptr, 0) != ResultCode::SUCCESS || onEndOfFile() != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
+    }
+    flushPending();
+    return extents.finalize(getFileMap());
+}
+
+ResultCode IncrementalFileHandler::createMappingFromSource(ByteSource& source) {
+    if (beginMapping() != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
+    }
+    reserveExtents(estimateExtents(source.size()));
+    return mapSource(source);
+}
+
+ResultCode IncrementalFileHandler::remapFrom(ByteSource& source, uint64_t offset, uint64_t& point) {
+    if (!findResyncPoint(offset, point) || point > source.size()) {
+        return ResultCode::FAILURE;
+    }
+    resetDriver(point);
+    if (resumeParsing(point) != ResultCode::SUCCESS) {
+        return ResultCode::FAILURE;
+    }
+
+    // Keep the extents in front of point, cutting the one that reaches past it
+    FileMap& fileMap = getFileMap();
+    int64_t start = static_cast<int64_t>(point);
+    auto it = fileMap.lower_bound(Range(start, start));
+    if (it != fileMap.end() && it->first.getStart() < start) {
+        Range kept(it->first.getStart(), start - 1);
+        Range mapped(it->second.first.getStart(), it->second.first.getStart() + (start - 1 - kept.getStart()));
+        CriticalType type = it->second.second;
+        it = fileMap.erase(it);
+        fileMap.emplace_hint(it, kept, std::make_pair(mapped, type));
+    }
+    fileMap.erase(it, fileMap.end());
+
+    // The stream offsets of the new extents start at 0, the caller places them in the streams
+    return mapSource(source);
+}
+
+ResultCode IncrementalFileHandler::mapSource(ByteSource& source) {
+    uint64_t size = source.size();
+    std::vector<char> buffer;
+    while (position < size) {
+        uint64_t remaining = size - position;
+
+        // Known extents are mapped without reading them
+        if (expect == Expect::PAYLOAD || expect == Expect::TRAILING) {
+            uint64_t length = (expect == Expect::PAYLOAD) ? std::min(payloadRemaining, remaining) : remaining;
+            if (map(position, length, pieceType) != ResultCode::SUCCESS) {
+                return ResultCode::FAILURE;
+            }
+            position += length;
+            if (expect == Expect::PAYLOAD) {
+                payloadRemaining -= length;
+                if (payloadRemaining == 0 && onPayloadEnd() != ResultCode::SUCCESS) {
+                    return ResultCode::FAILURE;
+                }
+            }
+            continue;
+        }
+
+        // Headers are read exactly, scanned payloads in blocks
+        size_t wanted = (expect == Expect::HEADER) ? headerSize - header.size() : SOURCE_SCAN_BLOCK;
+        wanted = static_cast<size_t>(std::min<uint64_t>(wanted, remaining));
+        buffer.resize(wanted);
+        if (!source.read(position, wanted, buffer.data()) ||
+            feedMapping(buffer.data(), wanted) != ResultCode::SUCCESS) {
+            return ResultCode::FAILURE;
+        }
+    }
+    return finishMapping();
+}
+
+bool IncrementalFileHandler::findResyncPoint(uint64_t offset, uint64_t& point) const {
+    (void) offset;
+    (void) point;
+    return false;
+}
+
+ResultCode IncrementalFileHandler::resumeParsing(uint64_t point) {
+    (void) point;
+    return ResultCode::FAILURE;
+}
+
+ResultCode IncrementalFileHandler::onPayloadEnd() {
+    expectTrailing(CriticalType::CRITICAL_DATA);
+    return ResultCode::SUCCESS;
+}
+
+size_t IncrementalFileHandler::scanPayload(const char* data, size_t size, bool& ended) {
+    (void) data;
+    ended = false;
+    return size;
+}
+
+ResultCode IncrementalFileHandler::onEndOfFile() {
+    if (expect == Expect::HEADER && !header.empty()) {
+        return map(headerStart, header.size(), CriticalType::CRITICAL_DATA);
+    }
+    return ResultCode::SUCCESS;
+}
+
+void IncrementalFileHandler::expectHeader(size_t size) {
+    expect = Expect::HEADER;
+    header.clear();
+    headerSize = size;
+    headerStart = position;
+}
+
+void IncrementalFileHandler::expectPayload(uint64_t length, CriticalType type) {
+    expect = Expect::PAYLOAD;
+    payloadRemaining = length;
+    pieceType = type;
+}
+
+void IncrementalFileHandler::expectScan(CriticalType type) {
+    expect = Expect::SCAN;
+    pieceType = type;
+}
+
+void IncrementalFileHandler::expectTrailing(CriticalType type) {
+    expect = Expect::TRAILING;
+    pieceType = type;
+}
+
+ResultCode IncrementalFileHandler::mapHeader(size_t start, size_t length, CriticalType type) {
+    return map(completedHeaderStart + start, length, type);
+}
+
+uint64_t IncrementalFileHandler::getPosition() const {
+    return position;
+}
+
+size_t IncrementalFileHandler::estimateExtents(uint64_t fileSize) const {
+    (void) fileSize;
+    return 0;
+}
+
+void IncrementalFileHandler::reserveExtents(size_t count) {
+    extents.reserve(extents.size() + count);
+}
+
+ResultCode IncrementalFileHandler::map(uint64_t start, uint64_t length, CriticalType type) {
+    if (length == 0) {
+        return ResultCode::SUCCESS;
+    }
+    if (havePending && pendingType == type && pendingStart + pendingLength == start) {
+        pendingLength += length;
+        return ResultCode::SUCCESS;
+    }
+    flushPending();
+    havePending = true;
+    pendingStart = start;
+    pendingLength = length;
+    pendingType = type;
+    return ResultCode::SUCCESS;
+}
+
+void IncrementalFileHandler::flushPending() {
+    if (!havePending) {
+        return;
+    }
+    havePending = false;
+    uint64_t& streamOffset = (pendingType == CriticalType::CRITICAL_DATA) ? critOffset : noncritOffset;
+    extents.append(pendingStart, pendingStart + pendingLength - 1,
+                   streamOffset, streamOffset + pendingLength - 1, pendingType);
+    streamOffset += pendingLength;
+}
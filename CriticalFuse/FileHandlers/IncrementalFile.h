@@ -0,0 +1,144 @@
+#ifndef INCREMENTAL_FILE_HANDLERS_HPP
+#define INCREMENTAL_FILE_HANDLERS_HPP
+
+#include "AbstractFile.h"
+#include "MappingBuilder.h"
+#include <cstdint>
+#include <vector>
+
+/**
+ * Base for handlers whose format can be classified front to back in one pass.
+ *
+ * The handler describes what comes next and the driver cuts the incoming chunks accordingly:
+ *   - a header of a fixed size, collected across chunks if needed and passed to onHeader
+ *   - a payload of known length and type, mapped without being copied
+ *   - a scanned payload of unknown length, whose end the handler finds with scanPayload
+ *   - the trailing bytes up to the end of the file
+ * Contiguous pieces of the same type are merged into one extent, so the mapping does not
+ * depend on how the file was chunked. Extents are collected in a MappingBuilder and added to
+ * the fileMap together by finishMapping.
+ *
+ * Mapping from a ByteSource only reads headers and scanned payloads: payloads of known length
+ * and trailing bytes are mapped without being read.
+ */
+class IncrementalFileHandler : public AbstractFileHandler {
+public:
+    IncrementalFileHandler() = default; // default constructor
+    IncrementalFileHandler(const IncrementalFileHandler&) = default; // copy constructor
+    ~IncrementalFileHandler() override = default; // destructor
+
+    // The whole buffer is fed as a single chunk
+    ResultCode createMapping(const char* buffer, size_t size) override;
+
+    ResultCode beginMapping() override;
+    ResultCode feedMapping(const char* chunk, size_t size) override;
+    ResultCode finishMapping() override;
+    ResultCode createMappingFromSource(ByteSource& source) override;
+
+    // Resumes at findResyncPoint(offset) and maps the rest of the source from there
+    ResultCode remapFrom(ByteSource& source, uint64_t offset, uint64_t& point) override;
+
+protected:
+    /**
+     * @brief Resets the parser state of the handler and sets the first expectation.
+     */
+    virtual ResultCode startParsing() = 0;
+
+    /**
+     * @brief A header requested with expectHeader is complete. The handler classifies its
+     * bytes with mapHeader and sets the next expectation.
+     */
+    virtual ResultCode onHeader(const char* header, size_t size) = 0;
+
+    /**
+     * @brief A payload (fixed or scanned) ended. The handler sets the next expectation.
+     */
+    virtual ResultCode onPayloadEnd();
+
+    /**
+     * @brief Finds the end of a scanned payload.
+     *
+     * @param data the next bytes of the file
+     * @param size the number of bytes available
+     * @param ended set if the payload ends within data
+     * @return size_t number of bytes that belong to the payload (size unless ended)
+     */
+    virtual size_t scanPayload(const char* data, size_t size, bool& ended);
+
+    /**
+     * @brief The end of the file was reached. By default the bytes of an incomplete header
+     * are kept as critical data.
+     */
+    virtual ResultCode onEndOfFile();
+
+    void expectHeader(size_t size);
+    void expectPayload(uint64_t length, CriticalType type);
+    void expectScan(CriticalType type);
+    void expectTrailing(CriticalType type);
+
+    /**
+     * @brief Classifies [start, start + length) of the header just passed to onHeader.
+     */
+    ResultCode mapHeader(size_t start, size_t length, CriticalType type);
+
+    uint64_t getPosition() const; // logical offset of the next byte to be fed
+
+    /**
+     * @brief Number of extents the handler expects for a file of the given size, reserved
+     * up front when the size is known. 0 (the default) if it cannot tell.
+     */
+    virtual size_t estimateExtents(uint64_t fileSize) const;
+
+    /**
+     * @brief Reserves room for count more extents, for handlers that learn the layout from a header.
+     */
+    void reserveExtents(size_t count);
+
+    /**
+     * @brief Finds where mapping can resume for a file changed from offset on: the start of a
+     * structure at or before offset, where the parser does not depend on the bytes before it.
+     *
+     * @param offset first changed byte
+     * @param point set to the resync point
+     * @return true if there is one, false (the default) if the file must be mapped from the start
+     */
+    virtual bool findResyncPoint(uint64_t offset, uint64_t& point) const;
+
+    /**
+     * @brief Like startParsing, for mapping resumed at a point found by findResyncPoint.
+     * Annotation state about the bytes from point on is dropped. Fails by default.
+     */
+    virtual ResultCode resumeParsing(uint64_t point);
+
+private:
+    enum class Expect { HEADER, PAYLOAD, SCAN, TRAILING };
+
+    Expect expect = Expect::TRAILING;
+    CriticalType pieceType = CriticalType::CRITICAL_DATA;
+    std::vector<char> header;
+    size_t headerSize = 0;
+    uint64_t headerStart = 0;
+    uint64_t completedHeaderStart = 0; // start of the header passed to onHeader
+    uint64_t payloadRemaining = 0;
+    uint64_t position = 0;
+
+    // Next free offsets of the two streams
+    uint64_t critOffset = 0;
+    uint64_t noncritOffset = 0;
+
+    // Last piece, held back until it can no longer grow
+    bool havePending = false;
+    uint64_t pendingStart = 0;
+    uint64_t pendingLength = 0;
+    CriticalType pendingType = CriticalType::CRITICAL_DATA;
+
+    MappingBuilder extents; // flushed pieces, in logical order
+
+    ResultCode map(uint64_t start, uint64_t length, CriticalType type);
+    void flushPending();
+    void resetDriver(uint64_t start); // clears the driver state, the next byte fed is at start
+    ResultCode mapSource(ByteSource& source); // feeds the source from position on, then finishes
+
+};
+
+#endif // INCREMENTAL_FILE_HANDLERS_HPP
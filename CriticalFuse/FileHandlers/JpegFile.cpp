@@ -1,83 +1,216 @@
 #include "JpegFile.h"
+#include "../Utilities/MarkerScan.h"
+#include "../Utilities/RequestArena.h"
 #include <cstdint>
-#include <cstring>
+#include <algorithm>
+#include <charconv>
+#include <sstream>
 
-ResultCode JpegFileHandler::createMapping(const char* buffer, size_t size) {
-    if (size == 0) {
-        return ResultCode::SUCCESS; // Nothing to map
-    }
-    
-    if (size < 2 || static_cast<uint8_t>(buffer[0]) != 0xFF || static_cast<uint8_t>(buffer[1]) != 0xD8) {
-        return ResultCode::FAILURE; // Not a valid JPEG
-    }
+JpegFileHandler::JpegFileHandler() : scans(requestResource()), restarts(requestResource()) {}
 
-    size_t origOffset = 0;
-    size_t critOffset = 0;
-    size_t noncritOffset = 0;
+ResultCode JpegFileHandler::startParsing() {
+    state = State::SOI;
+    segmentMarker = 0;
+    inScan = false;
+    scans.clear();
+    restarts.clear();
+    expectHeader(2);
+    return ResultCode::SUCCESS;
+}
 
-    // SOI marker (Start of Image)
-    addToFileMap(origOffset, origOffset + 1, critOffset, critOffset + 1, CriticalType::CRITICAL_DATA);
-    origOffset += 2;
-    critOffset += 2;
+ResultCode JpegFileHandler::onHeader(const char* header, size_t size) {
+    switch (state) {
+        case State::SOI:
+            if (static_cast<uint8_t>(header[0]) != 0xFF || static_cast<uint8_t>(header[1]) != 0xD8) {
+                return ResultCode::FAILURE; // Not a valid JPEG
+            }
+            // SOI marker (Start of Image)
+            state = State::MARKER;
+            expectHeader(2);
+            return mapHeader(0, size, CriticalType::CRITICAL_DATA);
 
-    while (origOffset + 4 <= size) {
-        if (static_cast<uint8_t>(buffer[origOffset]) != 0xFF) {
-            return ResultCode::FAILURE; // Invalid marker
-        }
+        case State::MARKER:
+            if (static_cast<uint8_t>(header[0]) != 0xFF) {
+                return ResultCode::FAILURE; // Invalid marker
+            }
+            return onMarker(static_cast<uint8_t>(header[1]), 0, 2);
 
-        uint8_t marker = static_cast<uint8_t>(buffer[origOffset + 1]);
-        origOffset += 2;
+        case State::MARKER_CODE:
+            return onMarker(static_cast<uint8_t>(header[0]), 0, 1);
 
-        // Standalone marker (no payload)
-        if (marker == 0xD9) { // EOI (End of Image)
-            addToFileMap(origOffset - 2, origOffset - 1, critOffset, critOffset + 1, CriticalType::CRITICAL_DATA);
-            critOffset += 2;
-            break;
+        case State::LENGTH: {
+            uint16_t segmentLength = (static_cast<uint8_t>(header[0]) << 8) | static_cast<uint8_t>(header[1]);
+            if (segmentLength < 2) {
+                return ResultCode::FAILURE;
+            }
+            // The whole segment, length field included, is critical
+            state = State::SEGMENT;
+            expectPayload(segmentLength - 2, CriticalType::CRITICAL_DATA);
+            return mapHeader(0, size, CriticalType::CRITICAL_DATA);
         }
 
-        // Handle Start of Scan marker (SOS): pixel data follows
-        if (marker == 0xDA) {
-            if (origOffset + 2 > size) return ResultCode::FAILURE;
-            uint16_t sosLength = (static_cast<uint8_t>(buffer[origOffset]) << 8) | static_cast<uint8_t>(buffer[origOffset + 1]);
-
-            // Map SOS marker segment as critical
-            addToFileMap(origOffset - 2, origOffset + sosLength - 1, critOffset, critOffset + sosLength + 1, CriticalType::CRITICAL_DATA);
-            critOffset += sosLength + 2;
-            origOffset += sosLength;
-
-            // Scan for end of pixel data (next 0xFF marker)
-            size_t scanStart = origOffset;
-            while (origOffset + 1 < size) {
-                if (static_cast<uint8_t>(buffer[origOffset]) == 0xFF && static_cast<uint8_t>(buffer[origOffset + 1]) != 0x00) {
-                    break;
-                }
-                origOffset++;
-            }
+        default:
+            return ResultCode::FAILURE;
+    }
+}
 
-            // Map pixel data as NON_CRITICAL
-            size_t scanLength = origOffset - scanStart;
-            if (scanLength > 0) {
-                addToFileMap(scanStart, origOffset - 1, noncritOffset, noncritOffset + scanLength - 1, CriticalType::NON_CRITICAL_DATA);
-                noncritOffset += scanLength;
-            }
+ResultCode JpegFileHandler::onMarker(uint8_t marker, size_t headerStart, size_t headerLength) {
+    // Stuffed zero byte inside entropy-coded data, not a marker
+    if (inScan && marker == 0x00) {
+        state = State::SCAN;
+        expectScan(CriticalType::NON_CRITICAL_DATA);
+        return mapHeader(headerStart, headerLength, CriticalType::NON_CRITICAL_DATA);
+    }
 
-            continue;
+    // Fill bytes: more 0xFF before the marker code
+    if (marker == 0xFF) {
+        state = State::MARKER_CODE;
+        expectHeader(1);
+        return mapHeader(headerStart, headerLength, CriticalType::CRITICAL_DATA);
+    }
+
+    // Restart markers interrupt the scan, the entropy-coded data continues after them.
+    // Markers in the expected order stay in the scan's extent and go into the index, which
+    // rebuilds them on read; anything unusual is kept as critical data instead.
+    if (inScan && marker >= 0xD0 && marker <= 0xD7) {
+        state = State::SCAN;
+        expectScan(CriticalType::NON_CRITICAL_DATA);
+        Scan& scan = scans.back();
+        if (headerLength == 2 && marker == 0xD0 + (scan.restartCount & 7)) {
+            restarts.push_back(getPosition() - 2);
+            scan.restartCount++;
+            return mapHeader(headerStart, headerLength, CriticalType::NON_CRITICAL_DATA);
         }
+        return mapHeader(headerStart, headerLength, CriticalType::CRITICAL_DATA);
+    }
+    inScan = false;
 
-        // Other segments with length field
-        if (origOffset + 2 > size) return ResultCode::FAILURE;
-        uint16_t segmentLength = (static_cast<uint8_t>(buffer[origOffset]) << 8) | static_cast<uint8_t>(buffer[origOffset + 1]);
+    if (marker == 0xD9) { // EOI (End of Image)
+        // Whatever follows the image is kept as is
+        expectTrailing(CriticalType::CRITICAL_DATA);
+        return mapHeader(headerStart, headerLength, CriticalType::CRITICAL_DATA);
+    }
 
-        // Ensure full segment fits in buffer
-        if (origOffset + segmentLength > size) {
-            return ResultCode::FAILURE;
+    // Other standalone markers (no payload)
+    if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+        state = State::MARKER;
+        expectHeader(2);
+        return mapHeader(headerStart, headerLength, CriticalType::CRITICAL_DATA);
+    }
+
+    // Segments with length field
+    segmentMarker = marker;
+    state = State::LENGTH;
+    expectHeader(2);
+    return mapHeader(headerStart, headerLength, CriticalType::CRITICAL_DATA);
+}
+
+ResultCode JpegFileHandler::onPayloadEnd() {
+    // Start of Scan (SOS): pixel data follows
+    if (state == State::SEGMENT && segmentMarker == 0xDA) {
+        state = State::SCAN;
+        inScan = true;
+        scans.push_back(Scan{getPosition(), getPosition(), restarts.size(), 0});
+        expectScan(CriticalType::NON_CRITICAL_DATA);
+        return ResultCode::SUCCESS;
+    }
+
+    // The scan stopped at a 0xFF: read it as a marker. If it turns out to be a stuffed byte
+    // or a restart marker the scan resumes and ends further on.
+    if (state == State::SCAN) {
+        scans.back().end = getPosition();
+    }
+    state = State::MARKER;
+    expectHeader(2);
+    return ResultCode::SUCCESS;
+}
+
+size_t JpegFileHandler::scanPayload(const char* data, size_t size, bool& ended) {
+    // Pixel data runs until the next 0xFF that is not followed by a stuffed zero byte.
+    // A 0xFF at the end of the chunk ends the scan too; onMarker resumes it if it was stuffed.
+    size_t offset = findJpegMarker(data, size);
+    ended = offset < size;
+    return offset;
+}
+
+ResultCode JpegFileHandler::onEndOfFile() {
+    // Truncated file: the scan runs to the end
+    if (state == State::SCAN) {
+        scans.back().end = getPosition();
+    }
+    return IncrementalFileHandler::onEndOfFile();
+}
+
+std::string JpegFileHandler::serializeAnnotations() const {
+    std::ostringstream out;
+    for (const Scan& scan : scans) {
+        out << "@SCAN " << scan.start << ' ' << scan.end;
+        for (size_t i = 0; i < scan.restartCount; ++i) {
+            out << ' ' << restarts[scan.firstRestart + i];
         }
+        out << '\n';
+    }
+    return out.str();
+}
 
-        // Map entire segment as critical
-        addToFileMap(origOffset - 2, origOffset + segmentLength - 1, critOffset, critOffset + segmentLength + 1, CriticalType::CRITICAL_DATA);
-        critOffset += segmentLength + 2;
-        origOffset += segmentLength;
+ResultCode JpegFileHandler::loadAnnotation(std::string_view annotation) {
+    const std::string_view tag = "SCAN";
+    if (annotation.substr(0, tag.size()) != tag ||
+        (annotation.size() > tag.size() && annotation[tag.size()] != ' ')) {
+        return ResultCode::SUCCESS; // not ours
     }
 
+    // Space-separated numbers after the tag: start, end, then the restart marker offsets
+    const char* pos = annotation.data() + tag.size();
+    const char* end = annotation.data() + annotation.size();
+    auto next = [&pos, end](uint64_t& value) {
+        if (pos == end || *pos != ' ') {
+            return false;
+        }
+        std::from_chars_result result = std::from_chars(pos + 1, end, value);
+        pos = result.ptr;
+        return result.ec == std::errc();
+    };
+
+    Scan scan;
+    if (!next(scan.start) || !next(scan.end) || scan.end < scan.start) {
+        return ResultCode::FAILURE;
+    }
+    scan.firstRestart = restarts.size();
+    uint64_t restart = 0;
+    while (pos != end) {
+        // Sorted, whole markers inside the scan
+        if (!next(restart) || restart < scan.start || restart + 2 > scan.end ||
+            (scan.restartCount > 0 && restart < restarts.back() + 2)) {
+            restarts.resize(scan.firstRestart);
+            return ResultCode::FAILURE;
+        }
+        restarts.push_back(restart);
+        scan.restartCount++;
+    }
+    scans.push_back(scan);
     return ResultCode::SUCCESS;
 }
+
+void JpegFileHandler::restoreStructure(char* buffer, size_t size, off_t offset) const {
+    uint64_t readStart = offset;
+    uint64_t readEnd = readStart + size;
+    for (const Scan& scan : scans) {
+        if (scan.end <= readStart || scan.start >= readEnd) {
+            continue;
+        }
+        auto first = restarts.begin() + scan.firstRestart;
+        auto last = first + scan.restartCount;
+        // First marker whose second byte is at or after readStart
+        auto it = std::lower_bound(first, last, readStart > 0 ? readStart - 1 : 0);
+        for (; it != last && *it < readEnd; ++it) {
+            size_t index = it - first;
+            if (*it >= readStart) {
+                buffer[*it - readStart] = static_cast<char>(0xFF);
+            }
+            if (*it + 1 < readEnd) {
+                buffer[*it + 1 - readStart] = static_cast<char>(0xD0 + (index & 7));
+            }
+        }
+    }
+}
@@ -1,16 +1,61 @@
+
 #ifndef JPEG_FILE_HANDLERS_HPP
 #define JPEG_FILE_HANDLERS_HPP
 
-#include "AbstractFile.h"
+#include "IncrementalFile.h"
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
 
 
-class JpegFileHandler : public AbstractFileHandler {
+class JpegFileHandler : public IncrementalFileHandler {
 public:
-    JpegFileHandler() = default; // default constructor
+    JpegFileHandler(); // default constructor, allocates from the current request arena
     JpegFileHandler(const JpegFileHandler&) = default; // copy constructor
     ~JpegFileHandler() override = default; // destructor
 
-    ResultCode createMapping(const char* buffer, size_t size) override;
+protected:
+    ResultCode startParsing() override;
+    ResultCode onHeader(const char* header, size_t size) override;
+    ResultCode onPayloadEnd() override;
+    size_t scanPayload(const char* data, size_t size, bool& ended) override;
+    ResultCode onEndOfFile() override;
+
+    // Scans are stored as "@SCAN <start> <end> <restart marker offsets...>" lines
+    std::string serializeAnnotations() const override;
+    ResultCode loadAnnotation(std::string_view annotation) override;
+
+    // Restart markers live in the .noncrit extent of their scan and are rewritten from the index,
+    // so a degraded read that lost the scan's bytes still returns them
+    void restoreStructure(char* buffer, size_t size, off_t offset) const override;
+
+private:
+    enum class State {
+        SOI,          // FF D8
+        MARKER,       // FF xx
+        MARKER_CODE,  // xx after fill bytes (the FF was already mapped)
+        LENGTH,       // 2-byte segment length
+        SEGMENT,      // segment payload
+        SCAN          // entropy-coded data after SOS
+    };
+    State state = State::SOI;
+    uint8_t segmentMarker = 0;
+    bool inScan = false; // markers are read from inside entropy-coded data
+
+    // Entropy-coded data of one SOS segment and the restart markers inside it
+    struct Scan {
+        uint64_t start = 0;
+        uint64_t end = 0;          // one past the last byte, where the ending marker starts
+        size_t firstRestart = 0;   // index of the scan's first marker in restarts
+        size_t restartCount = 0;
+    };
+    std::pmr::vector<Scan> scans;        // in file order; progressive JPEGs have many
+    std::pmr::vector<uint64_t> restarts; // offsets of the RSTn markers of all scans, each scan's
+                                         // starting at RST0 and cycling to RST7
+
+    ResultCode onMarker(uint8_t marker, size_t headerStart, size_t headerLength);
 };
 
-#endif // JPEG_FILE_HANDLERS_HPP
\ No newline at end of file
+#endif // JPEG_FILE_HANDLERS_HPP
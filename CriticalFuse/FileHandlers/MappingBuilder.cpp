@@ -0,0 +1,42 @@
+#include "MappingBuilder.h"
+#include "../Utilities/RequestArena.h"
+
+#include <iostream>
+
+MappingBuilder::MappingBuilder(std::pmr::memory_resource* resource)
+    : extents(resource ? resource : requestResource()) {}
+
+void MappingBuilder::reserve(size_t count) {
+    extents.reserve(count);
+}
+
+size_t MappingBuilder::size() const {
+    return extents.size();
+}
+
+ResultCode MappingBuilder::finalize(FileMap& fileMap) {
+    // The first extent must also start after the ones already in the map
+    int64_t previousEnd = fileMap.empty() ? -1 : fileMap.rbegin()->first.getEnd();
+    for (const Extent& extent : extents) {
+        if (extent.origStart <= previousEnd || extent.origEnd < extent.origStart || extent.mappedStart < 0 ||
+            extent.mappedEnd - extent.mappedStart != extent.origEnd - extent.origStart) {
+            std::cerr << "Invalid extent " << extent.origStart << '-' << extent.origEnd << ' '
+                      << extent.mappedStart << '-' << extent.mappedEnd << std::endl;
+            extents.clear();
+            return ResultCode::FAILURE;
+        }
+        previousEnd = extent.origEnd;
+    }
+
+    // Sorted input: every insertion goes right before end(), in amortized constant time
+    for (const Extent& extent : extents) {
+        fileMap.emplace_hint(fileMap.end(), Range(extent.origStart, extent.origEnd),
+                             std::make_pair(Range(extent.mappedStart, extent.mappedEnd), extent.type));
+    }
+    extents.clear();
+    return ResultCode::SUCCESS;
+}
+
+void MappingBuilder::clear() {
+    extents.clear();
+}
@@ -0,0 +1,68 @@
+#ifndef MAPPING_BUILDER_H
+#define MAPPING_BUILDER_H
+
+#include "AbstractFile.h"
+
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+/**
+ * Collects the extents of a mapping in logical order and inserts them into a FileMap in one go.
+ *
+ * Handlers produce their extents front to back, so instead of validating and inserting each
+ * one as it is found (addToFileMap), append only records it and finalize checks the whole
+ * list in a single pass before appending it at the end of the map.
+ */
+class MappingBuilder {
+public:
+    /**
+     * @param resource memory for the extent list, the current request arena by default
+     */
+    explicit MappingBuilder(std::pmr::memory_resource* resource = nullptr);
+
+    /**
+     * @brief Makes room for count extents, so append does not reallocate.
+     */
+    void reserve(size_t count);
+
+    /**
+     * @brief Records the extent [origStart, origEnd] -> [mappedStart, mappedEnd]. Extents must
+     * be appended in increasing logical order; nothing is checked until finalize.
+     */
+    void append(int64_t origStart, int64_t origEnd, int64_t mappedStart, int64_t mappedEnd, CriticalType type) noexcept {
+        extents.push_back(Extent{origStart, origEnd, mappedStart, mappedEnd, type});
+    }
+
+    /**
+     * @brief Number of extents recorded since the last finalize.
+     */
+    size_t size() const;
+
+    /**
+     * @brief Checks the recorded extents (valid, equally long ranges in increasing, disjoint
+     * logical order) and adds them to fileMap, after the extents already in it.
+     * The builder is empty afterwards, even if the check failed.
+     *
+     * @param fileMap the map to add the extents to, left unchanged on failure
+     * @return ResultCode SUCCESS if successful, FAILURE otherwise
+     */
+    ResultCode finalize(FileMap& fileMap);
+
+    /**
+     * @brief Drops the recorded extents.
+     */
+    void clear();
+
+private:
+    struct Extent {
+        int64_t origStart;
+        int64_t origEnd;
+        int64_t mappedStart;
+        int64_t mappedEnd;
+        CriticalType type;
+    };
+    std::pmr::vector<Extent> extents;
+};
+
+#endif // MAPPING_BUILDER_H
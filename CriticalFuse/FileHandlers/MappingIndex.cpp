@@ -0,0 +1,203 @@
+#include "MappingIndex.h"
+#include "MappingBuilder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>     // For pread
+
+namespace {
+
+const char INDEX_MAGIC[8] = {'C', 'F', 'M', 'A', 'P', 'I', 'X', '1'};
+
+struct PageHeader {
+    uint32_t level; // 0 for leaves
+    uint32_t count; // entries in the page
+};
+
+struct LeafEntry {
+    int64_t start;
+    int64_t end;
+    int64_t mappedStart;
+    uint32_t type;
+    uint32_t reserved;
+};
+
+struct InnerEntry {
+    int64_t firstStart; // first logical offset of the child's subtree
+    uint64_t child;
+};
+
+const size_t LEAF_CAPACITY = (MAPPING_INDEX_PAGE_SIZE - sizeof(PageHeader)) / sizeof(LeafEntry);
+const size_t INNER_CAPACITY = (MAPPING_INDEX_PAGE_SIZE - sizeof(PageHeader)) / sizeof(InnerEntry);
+
+// Appends one page holding count entries of entrySize bytes to out
+void appendPage(std::string& out, uint32_t level, const void* entries, size_t count, size_t entrySize) {
+    size_t pageStart = out.size();
+    out.resize(pageStart + MAPPING_INDEX_PAGE_SIZE, '\0');
+    PageHeader pageHeader{level, static_cast<uint32_t>(count)};
+    std::memcpy(&out[pageStart], &pageHeader, sizeof(pageHeader));
+    std::memcpy(&out[pageStart + sizeof(pageHeader)], entries, count * entrySize);
+}
+
+} // namespace
+
+bool isMappingIndex(const char* data, size_t size) {
+    return size >= sizeof(INDEX_MAGIC) && std::memcmp(data, INDEX_MAGIC, sizeof(INDEX_MAGIC)) == 0;
+}
+
+std::string buildMappingIndex(const FileMap& fileMap, const std::string& annotations) {
+    MappingIndexReader::Header header{};
+    std::memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    header.pageSize = MAPPING_INDEX_PAGE_SIZE;
+    header.extentCount = fileMap.size();
+
+    std::string out(MAPPING_INDEX_PAGE_SIZE, '\0'); // header page, filled in last
+
+    // Leaves, remembering the first offset of each for the level above
+    std::vector<InnerEntry> children;
+    std::vector<LeafEntry> leaf;
+    leaf.reserve(LEAF_CAPACITY);
+    auto flushLeaf = [&]() {
+        uint64_t pageNumber = out.size() / MAPPING_INDEX_PAGE_SIZE;
+        children.push_back(InnerEntry{leaf.front().start, pageNumber});
+        appendPage(out, 0, leaf.data(), leaf.size(), sizeof(LeafEntry));
+        leaf.clear();
+    };
+    for (const auto& [range, mappedPair] : fileMap) {
+        leaf.push_back(LeafEntry{range.getStart(), range.getEnd(), mappedPair.first.getStart(),
+                                 static_cast<uint32_t>(mappedPair.second), 0});
+        header.logicalSize = std::max<uint64_t>(header.logicalSize, range.getEnd() + 1);
+        if (mappedPair.second != CriticalType::HOLE_DATA) {
+            header.storedBytes += range.getEnd() - range.getStart() + 1;
+        }
+        if (leaf.size() == LEAF_CAPACITY) {
+            flushLeaf();
+        }
+    }
+    if (!leaf.empty()) {
+        flushLeaf();
+    }
+    header.leafCount = children.size();
+    header.depth = children.empty() ? 0 : 1;
+
+    // Inner levels until a single page is left: the root
+    while (children.size() > 1) {
+        std::vector<InnerEntry> parents;
+        for (size_t first = 0; first < children.size(); first += INNER_CAPACITY) {
+            size_t count = std::min(INNER_CAPACITY, children.size() - first);
+            uint64_t pageNumber = out.size() / MAPPING_INDEX_PAGE_SIZE;
+            parents.push_back(InnerEntry{children[first].firstStart, pageNumber});
+            appendPage(out, header.depth, &children[first], count, sizeof(InnerEntry));
+        }
+        children.swap(parents);
+        header.depth++;
+    }
+    header.rootPage = children.empty() ? 0 : children.front().child;
+
+    header.annotationsOffset = out.size();
+    header.annotationsLength = annotations.size();
+    out += annotations;
+    std::memcpy(&out[0], &header, sizeof(header));
+    return out;
+}
+
+bool MappingIndexReader::open(int fd) {
+    this->fd = fd;
+    ssize_t bytesRead = pread(fd, &header, sizeof(header), 0);
+    if (bytesRead != static_cast<ssize_t>(sizeof(header)) || !isMappingIndex(header.magic, sizeof(header.magic)) ||
+        header.pageSize != MAPPING_INDEX_PAGE_SIZE) {
+        std::cerr << "Invalid mapping index header" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+uint64_t MappingIndexReader::extentCount() const {
+    return header.extentCount;
+}
+
+uint64_t MappingIndexReader::logicalSize() const {
+    return header.logicalSize;
+}
+
+uint64_t MappingIndexReader::storedBytes() const {
+    return header.storedBytes;
+}
+
+bool MappingIndexReader::readPage(uint64_t pageNumber, uint32_t expectedLevel, uint32_t& count) {
+    ssize_t bytesRead = pread(fd, page, MAPPING_INDEX_PAGE_SIZE, pageNumber * MAPPING_INDEX_PAGE_SIZE);
+    if (bytesRead != static_cast<ssize_t>(MAPPING_INDEX_PAGE_SIZE)) {
+        std::cerr << "Failed to read mapping index page " << pageNumber << std::endl;
+        return false;
+    }
+    PageHeader pageHeader;
+    std::memcpy(&pageHeader, page, sizeof(pageHeader));
+    size_t capacity = expectedLevel == 0 ? LEAF_CAPACITY : INNER_CAPACITY;
+    if (pageHeader.level != expectedLevel || pageHeader.count == 0 || pageHeader.count > capacity) {
+        std::cerr << "Damaged mapping index page " << pageNumber << std::endl;
+        return false;
+    }
+    count = pageHeader.count;
+    return true;
+}
+
+bool MappingIndexReader::loadRange(int64_t first, int64_t last, FileMap& fileMap) {
+    fileMap.clear();
+    if (header.depth == 0 || last < first) {
+        return true;
+    }
+
+    // Descend to the leaf whose first extent is the last one starting at or before first
+    uint64_t pageNumber = header.rootPage;
+    uint32_t count = 0;
+    for (uint32_t level = header.depth - 1; level > 0; --level) {
+        if (!readPage(pageNumber, level, count)) {
+            return false;
+        }
+        const InnerEntry* entries = reinterpret_cast<const InnerEntry*>(page + sizeof(PageHeader));
+        const InnerEntry* next = std::upper_bound(entries, entries + count, first,
+            [](int64_t offset, const InnerEntry& entry) { return offset < entry.firstStart; });
+        pageNumber = (next == entries) ? entries[0].child : (next - 1)->child;
+    }
+
+    // Leaves are consecutive pages: walk them until an extent starts past last
+    MappingBuilder extents(fileMap.get_allocator().resource());
+    for (; pageNumber >= 1 && pageNumber <= header.leafCount; ++pageNumber) {
+        if (!readPage(pageNumber, 0, count)) {
+            return false;
+        }
+        const LeafEntry* entries = reinterpret_cast<const LeafEntry*>(page + sizeof(PageHeader));
+        for (uint32_t i = 0; i < count; ++i) {
+            const LeafEntry& entry = entries[i];
+            if (entry.start > last) {
+                return extents.finalize(fileMap) == ResultCode::SUCCESS;
+            }
+            if (entry.end < first) {
+                continue;
+            }
+            if (entry.type > static_cast<uint32_t>(CriticalType::HOLE_DATA)) {
+                std::cerr << "Damaged mapping index extent at " << entry.start << std::endl;
+                return false;
+            }
+            extents.append(entry.start, entry.end, entry.mappedStart, entry.mappedStart + (entry.end - entry.start),
+                           static_cast<CriticalType>(entry.type));
+        }
+    }
+    return extents.finalize(fileMap) == ResultCode::SUCCESS;
+}
+
+bool MappingIndexReader::readAnnotations(std::pmr::vector<char>& annotations) {
+    annotations.resize(header.annotationsLength);
+    size_t loaded = 0;
+    while (loaded < annotations.size()) {
+        ssize_t bytesRead = pread(fd, annotations.data() + loaded, annotations.size() - loaded,
+                                  header.annotationsOffset + loaded);
+        if (bytesRead <= 0) {
+            std::cerr << "Failed to read mapping index annotations" << std::endl;
+            return false;
+        }
+        loaded += bytesRead;
+    }
+    return true;
+}
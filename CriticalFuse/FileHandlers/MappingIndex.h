@@ -0,0 +1,95 @@
+#ifndef MAPPING_INDEX_H
+#define MAPPING_INDEX_H
+
+#include "AbstractFile.h"
+
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+/**
+ * Paged B+tree form of a mapping file, keyed by logical offset, for files with so many extents
+ * that loading the text mapping dominates every request. A read descends from the root to the
+ * leaf holding its first byte and loads only the extents it overlaps, so the pages touched per
+ * request stay the same however many extents the file has.
+ *
+ * Layout, in pages of MAPPING_INDEX_PAGE_SIZE bytes and native byte order:
+ *   page 0                 header: magic, page counts, root, logical size, annotations
+ *   pages 1 .. leafCount   leaves with the extents in logical order
+ *   following pages        inner levels bottom-up, each entry the first offset of a child; the root last
+ *   after the last page    the handler's annotation lines, as in the text format
+ */
+
+const size_t MAPPING_INDEX_PAGE_SIZE = 4096;
+
+/**
+ * @brief Whether the bytes at the start of a mapping file are a paged index.
+ */
+bool isMappingIndex(const char* data, size_t size);
+
+/**
+ * @brief Builds the paged index of a mapping.
+ *
+ * @param fileMap the extents
+ * @param annotations the handler's annotation lines (serializeAnnotations)
+ * @return std::string the mapping file contents
+ */
+std::string buildMappingIndex(const FileMap& fileMap, const std::string& annotations);
+
+/**
+ * Reads extents out of a paged mapping index through an open file descriptor, one page at a time.
+ */
+class MappingIndexReader {
+public:
+    MappingIndexReader() = default;
+    MappingIndexReader(const MappingIndexReader&) = delete;
+    MappingIndexReader& operator=(const MappingIndexReader&) = delete;
+
+    /**
+     * @brief Reads and checks the header of the index in fd. The reader does not own fd.
+     *
+     * @return true if fd holds a valid index, false otherwise
+     */
+    bool open(int fd);
+
+    uint64_t extentCount() const;
+    uint64_t logicalSize() const; // one past the end of the last extent
+    uint64_t storedBytes() const; // bytes kept in the two streams, i.e. not in holes
+
+    /**
+     * @brief Replaces the contents of fileMap with the extents overlapping [first, last].
+     *
+     * @return true if successful, false if the index is damaged or could not be read
+     */
+    bool loadRange(int64_t first, int64_t last, FileMap& fileMap);
+
+    /**
+     * @brief Reads the annotation lines stored after the pages.
+     */
+    bool readAnnotations(std::pmr::vector<char>& annotations);
+
+private:
+    struct Header {
+        char magic[8];
+        uint32_t pageSize;
+        uint32_t depth;             // levels of the tree including the leaves, 0 for no extents
+        uint64_t extentCount;
+        uint64_t leafCount;
+        uint64_t rootPage;
+        uint64_t logicalSize;
+        uint64_t storedBytes;
+        uint64_t annotationsOffset;
+        uint64_t annotationsLength;
+    };
+
+    int fd = -1;
+    Header header{};
+    alignas(8) char page[MAPPING_INDEX_PAGE_SIZE]; // the page read last
+
+    bool readPage(uint64_t pageNumber, uint32_t expectedLevel, uint32_t& count);
+
+    friend std::string buildMappingIndex(const FileMap& fileMap, const std::string& annotations);
+};
+
+#endif // MAPPING_INDEX_H
@@ -0,0 +1,72 @@
+#include "Mp4File.h"
+#include <cstring>
+#include <cstdint>  // for uint32_t, uint64_t
+
+namespace {
+
+const size_t BOX_HEADER_SIZE = 8;   // 32-bit size and type
+const size_t LARGE_SIZE_SIZE = 8;   // 64-bit size following a 32-bit size of 1
+
+uint64_t readBigEndian(const char* data, size_t size) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < size; ++i) {
+        value = (value << 8) | uint8_t(data[i]);
+    }
+    return value;
+}
+
+// Payload types: sample data and free space are non-critical, everything else describes the media
+CriticalType payloadType(const char* type) {
+    if (memcmp(type, "mdat", 4) == 0 || memcmp(type, "free", 4) == 0 || memcmp(type, "skip", 4) == 0) {
+        return CriticalType::NON_CRITICAL_DATA;
+    }
+    return CriticalType::CRITICAL_DATA;
+}
+
+} // namespace
+
+ResultCode Mp4FileHandler::startParsing() {
+    state = State::BOX_HEADER;
+    expectHeader(BOX_HEADER_SIZE);
+    return ResultCode::SUCCESS;
+}
+
+ResultCode Mp4FileHandler::onHeader(const char* header, size_t size) {
+    if (state == State::LARGE_SIZE) {
+        // Box header: 4 bytes size (1) + 4 bytes type + 8 bytes size
+        expectBox(boxType, readBigEndian(header, LARGE_SIZE_SIZE), BOX_HEADER_SIZE + LARGE_SIZE_SIZE);
+        return mapHeader(0, size, CriticalType::CRITICAL_DATA);
+    }
+
+    uint32_t boxSize = static_cast<uint32_t>(readBigEndian(header, 4));
+    if (boxSize == 1) {
+        state = State::LARGE_SIZE;
+        memcpy(boxType, header + 4, 4);
+        expectHeader(LARGE_SIZE_SIZE);
+    } else if (boxSize == 0) {
+        // The last box extends to the end of the file
+        expectTrailing(payloadType(header + 4));
+    } else {
+        expectBox(header + 4, boxSize, BOX_HEADER_SIZE);
+    }
+
+    // Box header: 4 bytes size + 4 bytes type
+    return mapHeader(0, size, CriticalType::CRITICAL_DATA);
+}
+
+void Mp4FileHandler::expectBox(const char* type, uint64_t boxSize, size_t headerSize) {
+    state = State::BOX_HEADER;
+    if (boxSize < headerSize) {
+        // A size smaller than its own header: the structure cannot be followed past this
+        // point, so the rest of the file is kept as is
+        expectTrailing(CriticalType::CRITICAL_DATA);
+        return;
+    }
+    expectPayload(boxSize - headerSize, payloadType(type));
+}
+
+ResultCode Mp4FileHandler::onPayloadEnd() {
+    state = State::BOX_HEADER;
+    expectHeader(BOX_HEADER_SIZE);
+    return ResultCode::SUCCESS;
+}
@@ -0,0 +1,36 @@
+#ifndef MP4_FILE_HANDLERS_HPP
+#define MP4_FILE_HANDLERS_HPP
+
+#include "IncrementalFile.h"
+#include <cstdint>
+
+/**
+ * ISO base media files (MP4, MOV): a sequence of top-level boxes, each a size and a type
+ * followed by its payload.
+ *
+ * The boxes describing the media (ftyp, moov, and the moof of every fragment) are critical,
+ * the sample data in mdat is not, and neither is free space (free, skip). Only box headers
+ * are buffered, payloads are mapped as they stream by, so multi-GB files are mapped without
+ * being held in memory. Unknown boxes are kept critical.
+ */
+class Mp4FileHandler : public IncrementalFileHandler {
+public:
+    Mp4FileHandler() = default; // default constructor
+    Mp4FileHandler(const Mp4FileHandler&) = default; // copy constructor
+    ~Mp4FileHandler() override = default; // destructor
+
+protected:
+    ResultCode startParsing() override;
+    ResultCode onHeader(const char* header, size_t size) override;
+    ResultCode onPayloadEnd() override;
+
+private:
+    enum class State { BOX_HEADER, LARGE_SIZE };
+    State state = State::BOX_HEADER;
+    char boxType[4] = {0}; // type of the box whose 64-bit size is expected
+
+    // Sets the expectation for the payload of a box, which starts after headerSize bytes
+    void expectBox(const char* type, uint64_t boxSize, size_t headerSize);
+};
+
+#endif // MP4_FILE_HANDLERS_HPP
@@ -1,78 +1,173 @@
 #include "PngFile.h"
+#include "../Utilities/RequestArena.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
 #include <cstring>
 #include <cstdint>  // for uint32_t
+#include <sstream>
 
-ResultCode PngFileHandler::createMapping(const char* buffer, size_t size) {
-    if (size == 0) {
-        return ResultCode::SUCCESS;
+namespace {
+
+const uint64_t CHUNK_OVERHEAD = 12; // 4 bytes length + 4 bytes type + 4 bytes CRC
+
+// Chunk types are four ASCII letters; anything else is not a chunk worth indexing
+bool isChunkType(const char* type) {
+    for (int i = 0; i < 4; ++i) {
+        if (!std::isalpha(static_cast<unsigned char>(type[i]))) {
+            return false;
+        }
     }
+    return true;
+}
+
+} // namespace
 
+PngFileHandler::PngFileHandler() : chunks(requestResource()) {}
+
+ResultCode PngFileHandler::startParsing() {
     // PNG signature (8 bytes)
-    const unsigned char pngSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
-    if (size < 8 || memcmp(buffer, pngSignature, 8) != 0) {
-        return ResultCode::FAILURE; // Not a valid PNG file
+    state = State::SIGNATURE;
+    chunks.clear();
+    expectHeader(8);
+    return ResultCode::SUCCESS;
+}
+
+ResultCode PngFileHandler::onHeader(const char* header, size_t size) {
+    if (state == State::SIGNATURE) {
+        const unsigned char pngSignature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+        if (memcmp(header, pngSignature, 8) != 0) {
+            return ResultCode::FAILURE; // Not a valid PNG file
+        }
+
+        // Signature is critical
+        state = State::CHUNK_HEADER;
+        expectHeader(8);
+        return mapHeader(0, size, CriticalType::CRITICAL_DATA);
     }
 
-    size_t origOffset = 0;
-    size_t critOffset = 0;
-    size_t noncritOffset = 0;
-
-    // Signature is critical
-    addToFileMap(origOffset, origOffset + 7, critOffset, critOffset + 7, CriticalType::CRITICAL_DATA);
-    origOffset += 8;
-    critOffset += 8;
-
-    while (origOffset + 8 <= size) {
-        // Read chunk length (big endian)
-        uint32_t chunkLength = (uint8_t(buffer[origOffset]) << 24) |
-                               (uint8_t(buffer[origOffset + 1]) << 16) |
-                               (uint8_t(buffer[origOffset + 2]) << 8) |
-                               (uint8_t(buffer[origOffset + 3]));
-
-        // Ensure chunk header + data + CRC fits in file
-        if (origOffset + 12ULL + chunkLength > size) {
-            break; // Truncated or malformed
+    // Read chunk length (big endian)
+    uint32_t chunkLength = (uint8_t(header[0]) << 24) |
+                           (uint8_t(header[1]) << 16) |
+                           (uint8_t(header[2]) << 8) |
+                           (uint8_t(header[3]));
+
+    // Read chunk type (4 chars)
+    char chunkType[5] = {0};
+    memcpy(chunkType, &header[4], 4);
+    addChunk(getPosition() - size, chunkLength, chunkType);
+    bool isCritical = (strcmp(chunkType, "IHDR") == 0 ||
+                       strcmp(chunkType, "PLTE") == 0 ||
+                       strcmp(chunkType, "IDAT") == 0 ||
+                       strcmp(chunkType, "IEND") == 0);
+    bool isIDAT = strcmp(chunkType, "IDAT") == 0;
+
+    // Chunk data: IDAT pixel data is non-critical, as is the data of ancillary chunks
+    CriticalType dataType = (isCritical && !isIDAT) ? CriticalType::CRITICAL_DATA : CriticalType::NON_CRITICAL_DATA;
+    state = State::CHUNK_DATA;
+    expectPayload(chunkLength, dataType);
+
+    // Chunk header: 4 bytes length + 4 bytes type
+    return mapHeader(0, size, CriticalType::CRITICAL_DATA);
+}
+
+ResultCode PngFileHandler::onPayloadEnd() {
+    if (state == State::CHUNK_DATA) {
+        // CRC (4 bytes): always critical
+        state = State::CHUNK_CRC;
+        expectPayload(4, CriticalType::CRITICAL_DATA);
+    } else {
+        state = State::CHUNK_HEADER;
+        expectHeader(8);
+    }
+    return ResultCode::SUCCESS;
+}
+
+void PngFileHandler::addChunk(uint64_t start, uint32_t length, const char* type) {
+    if (!isChunkType(type)) {
+        return;
+    }
+    if (!chunks.empty()) {
+        ChunkRun& last = chunks.back();
+        if (last.length == length && memcmp(last.type, type, 4) == 0 &&
+            last.start + last.count * (CHUNK_OVERHEAD + last.length) == start) {
+            last.count++;
+            return;
         }
+    }
+    ChunkRun run{start, length, {0}, 1};
+    memcpy(run.type, type, 4);
+    chunks.push_back(run);
+}
+
+std::string PngFileHandler::serializeAnnotations() const {
+    std::ostringstream out;
+    for (const ChunkRun& run : chunks) {
+        out << "@CHUNKS " << run.start << ' ' << std::string_view(run.type, 4) << ' '
+            << run.length << ' ' << run.count << '\n';
+    }
+    return out.str();
+}
 
-        // Read chunk type (4 chars)
-        char chunkType[5] = {0};
-        memcpy(chunkType, &buffer[origOffset + 4], 4);
-        bool isCritical = (strcmp(chunkType, "IHDR") == 0 ||
-                           strcmp(chunkType, "PLTE") == 0 ||
-                           strcmp(chunkType, "IDAT") == 0 ||
-                           strcmp(chunkType, "IEND") == 0);
-        bool isIDAT = strcmp(chunkType, "IDAT") == 0;
-
-        // Chunk header: 4 bytes length + 4 bytes type
-        addToFileMap(origOffset, origOffset + 7, critOffset, critOffset + 7, CriticalType::CRITICAL_DATA);
-        origOffset += 8;
-        critOffset += 8;
-
-        // Chunk data
-        if (chunkLength > 0) {
-            if (isIDAT) {
-                // Non-critical pixel data
-                addToFileMap(origOffset, origOffset + chunkLength - 1, noncritOffset, noncritOffset + chunkLength - 1, CriticalType::NON_CRITICAL_DATA);
-                origOffset += chunkLength;
-                noncritOffset += chunkLength;
-            } else {
-                CriticalType dataType = isCritical ? CriticalType::CRITICAL_DATA : CriticalType::NON_CRITICAL_DATA;
-                size_t mappedStart = (dataType == CriticalType::CRITICAL_DATA) ? critOffset : noncritOffset;
-                addToFileMap(origOffset, origOffset + chunkLength - 1,
-                             mappedStart, mappedStart + chunkLength - 1, dataType);
-                origOffset += chunkLength;
-                if (dataType == CriticalType::CRITICAL_DATA)
-                    critOffset += chunkLength;
-                else
-                    noncritOffset += chunkLength;
-            }
+ResultCode PngFileHandler::loadAnnotation(std::string_view annotation) {
+    const std::string_view tag = "CHUNKS ";
+    if (annotation.substr(0, tag.size()) != tag) {
+        return ResultCode::SUCCESS; // not ours
+    }
+
+    // "<start> <type> <length> <count>", after the chunks already loaded
+    const char* pos = annotation.data() + tag.size();
+    const char* end = annotation.data() + annotation.size();
+    ChunkRun run{};
+    std::from_chars_result result = std::from_chars(pos, end, run.start);
+    pos = result.ptr;
+    if (result.ec != std::errc() || end - pos < 6 || pos[0] != ' ' || pos[5] != ' ' || !isChunkType(pos + 1)) {
+        return ResultCode::FAILURE;
+    }
+    memcpy(run.type, pos + 1, 4);
+    result = std::from_chars(pos + 6, end, run.length);
+    pos = result.ptr;
+    if (result.ec != std::errc() || pos == end || *pos != ' ') {
+        return ResultCode::FAILURE;
+    }
+    result = std::from_chars(pos + 1, end, run.count);
+    if (result.ec != std::errc() || result.ptr != end || run.count == 0) {
+        return ResultCode::FAILURE;
+    }
+    if (!chunks.empty()) {
+        const ChunkRun& last = chunks.back();
+        if (run.start < last.start + last.count * (CHUNK_OVERHEAD + last.length)) {
+            return ResultCode::FAILURE;
         }
+    }
+    chunks.push_back(run);
+    return ResultCode::SUCCESS;
+}
 
-        // CRC (4 bytes): always critical
-        addToFileMap(origOffset, origOffset + 3, critOffset, critOffset + 3, CriticalType::CRITICAL_DATA);
-        origOffset += 4;
-        critOffset += 4;
+bool PngFileHandler::findResyncPoint(uint64_t offset, uint64_t& point) const {
+    // Last run starting at or before offset
+    auto it = std::upper_bound(chunks.begin(), chunks.end(), offset,
+                               [](uint64_t value, const ChunkRun& run) { return value < run.start; });
+    if (it == chunks.begin()) {
+        return false; // inside the signature, or no index
     }
+    --it;
+    uint64_t chunkSize = CHUNK_OVERHEAD + it->length;
+    uint64_t index = std::min<uint64_t>(it->count - 1, (offset - it->start) / chunkSize);
+    point = it->start + index * chunkSize;
+    return true;
+}
 
+ResultCode PngFileHandler::resumeParsing(uint64_t point) {
+    // Chunks from point on are indexed again as they are parsed
+    while (!chunks.empty() && chunks.back().start >= point) {
+        chunks.pop_back();
+    }
+    if (!chunks.empty()) {
+        ChunkRun& last = chunks.back();
+        last.count = std::min<uint64_t>(last.count, (point - last.start) / (CHUNK_OVERHEAD + last.length));
+    }
+    state = State::CHUNK_HEADER;
+    expectHeader(8);
     return ResultCode::SUCCESS;
 }
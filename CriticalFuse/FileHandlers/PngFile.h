@@ -1,15 +1,54 @@
 #ifndef PNG_FILE_HANDLERS_HPP
 #define PNG_FILE_HANDLERS_HPP
 
-#include "AbstractFile.h"
+#include "IncrementalFile.h"
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
 
-class PngFileHandler : public AbstractFileHandler {
+/**
+ * PNG files: the signature followed by chunks, each a length, a type, its data and a CRC.
+ *
+ * The mapping keeps an index of the chunks, so a write can be remapped from the chunk it
+ * starts in instead of from the signature (see remapFrom).
+ */
+class PngFileHandler : public IncrementalFileHandler {
 public:
-    PngFileHandler() = default; // default constructor
+    PngFileHandler(); // default constructor, allocates from the current request arena
     PngFileHandler(const PngFileHandler&) = default; // copy constructor
     ~PngFileHandler() override = default; // destructor
 
-    ResultCode createMapping(const char* buffer, size_t size) override;
+protected:
+    ResultCode startParsing() override;
+    ResultCode onHeader(const char* header, size_t size) override;
+    ResultCode onPayloadEnd() override;
+
+    // Chunks are stored as "@CHUNKS <start> <type> <length> <count>" lines
+    std::string serializeAnnotations() const override;
+    ResultCode loadAnnotation(std::string_view annotation) override;
+
+    // Mapping resumes at the start of the indexed chunk holding the offset
+    bool findResyncPoint(uint64_t offset, uint64_t& point) const override;
+    ResultCode resumeParsing(uint64_t point) override;
+
+private:
+    enum class State { SIGNATURE, CHUNK_HEADER, CHUNK_DATA, CHUNK_CRC };
+    State state = State::SIGNATURE;
+
+    // count back-to-back chunks of one type and data length, the first starting at start.
+    // Images split their pixel data into many IDAT chunks of the same size, so the index
+    // of a file stays a few lines long.
+    struct ChunkRun {
+        uint64_t start;
+        uint32_t length;
+        char type[4];
+        uint64_t count;
+    };
+    std::pmr::vector<ChunkRun> chunks;
+
+    void addChunk(uint64_t start, uint32_t length, const char* type);
 };
 
-#endif // PNG_FILE_HANDLERS_HPP
\ No newline at end of file
+#endif // PNG_FILE_HANDLERS_HPP
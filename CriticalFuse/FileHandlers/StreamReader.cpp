@@ -0,0 +1,459 @@
+#include "StreamReader.h"
+#include "../Utilities/StorageContext.h"
+#include "../Utilities/SegmentStore.h"
+#include "../Utilities/ThreadPool.h"
+#include "../Utilities/RequestArena.h"
+#include "../Utilities/Metrics.h"
+#include "../Utilities/ReplicaSet.h"
+#include "../Utilities/ReadRace.h"
+
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <algorithm>
+#include <atomic>
+#include <memory_resource>
+#include <fcntl.h>      // For open
+#include <unistd.h>     // For close, pread, dup
+
+namespace {
+
+// Reads at least this large are split into pieces fetched concurrently by the worker pool,
+// e.g. a whole tiled raw image, where each tile is a separate extent or part of one
+const size_t PARALLEL_READ_THRESHOLD = 256 * 1024;
+const size_t PARALLEL_READ_PIECE = 64 * 1024;
+
+struct ReadPiece {
+    CriticalType type;
+    char* buffer;
+    size_t size;
+    off_t mappedOffset;
+};
+
+} // namespace
+
+StreamReader::StreamReader()
+    : critPath(requestResource()), parityPath(requestResource()), rebuiltBlock(requestResource()),
+      cachedData(requestResource()) {}
+
+StreamReader::~StreamReader() {
+    if (fdCrit >= 0) close(fdCrit);
+    if (fdNonCrit >= 0) close(fdNonCrit);
+}
+
+bool StreamReader::open(std::string_view basePath) {
+    // Small files may have their streams packed into a shared segment instead
+    SegmentStore* segmentStore = getStorageContext().segmentStore;
+    packed = segmentStore && segmentStore->get(std::string(basePath), packedCrit, packedNoncrit);
+    if (packed) {
+        return true;
+    }
+
+    // Stream paths are built on the stack, this runs on every read
+    char criticalPath[PATH_MAX];
+    char nonCriticalPath[PATH_MAX];
+    int length = static_cast<int>(basePath.size());
+    if (snprintf(criticalPath, sizeof(criticalPath), "%.*s.crit", length, basePath.data()) >= PATH_MAX ||
+        snprintf(nonCriticalPath, sizeof(nonCriticalPath), "%.*s.noncrit", length, basePath.data()) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        std::perror("Stream path too long");
+        return false;
+    }
+    parityPath.assign(basePath.data(), basePath.size());
+    parityPath += ".parity";
+    if (getStorageContext().replicas) {
+        critPath = criticalPath;
+    }
+    fdCrit = ::open(criticalPath, O_RDONLY);
+    fdNonCrit = ::open(nonCriticalPath, O_RDONLY);
+    if (fdCrit < 0 || fdNonCrit < 0) {
+        std::perror("Failed to open critical or non-critical data file");
+        return false;
+    }
+    return true;
+}
+
+bool StreamReader::readStream(CriticalType type, char* buffer, size_t size, off_t mappedOffset) {
+    if (type == CriticalType::CRITICAL_DATA && critChecksums && critChecksums->recorded()) {
+        return readVerified(buffer, size, mappedOffset);
+    }
+    if (type == CriticalType::CRITICAL_DATA && critCipher && critCipher->recorded()) {
+        std::cerr << "Encrypted critical stream has no checksums" << std::endl;
+        errno = EIO;
+        return false;
+    }
+    if (type == CriticalType::NON_CRITICAL_DATA && noncritCompressor && noncritCompressor->recorded()) {
+        return readCompressed(buffer, size, mappedOffset);
+    }
+    return readRaw(type, buffer, size, mappedOffset);
+}
+
+bool StreamReader::readCompressed(char* buffer, size_t size, uint64_t offset) {
+    const BlockCompressor& compressor = *noncritCompressor;
+    uint64_t end = offset + size;
+    if (end > compressor.streamLength()) {
+        std::cerr << "Non-critical read past the compressed stream length " << compressor.streamLength() << std::endl;
+        errno = EIO;
+        return false;
+    }
+
+    uint64_t blockSize = compressor.blockSize();
+    std::pmr::vector<char> spill(requestResource());
+    uint64_t pos = offset;
+    while (pos < end) {
+        uint64_t index = pos / blockSize;
+        uint64_t blockStart = index * blockSize;
+        size_t blockLength = compressor.blockLength(index);
+        uint64_t copyEnd = std::min(end, blockStart + blockLength);
+        char* target = buffer + (pos - offset);
+
+        // Blocks the read covers whole are decompressed straight into the buffer
+        if (pos == blockStart && copyEnd == blockStart + blockLength) {
+            if (!readCompressedBlock(index, target)) {
+                return false;
+            }
+            pos = copyEnd;
+            continue;
+        }
+
+        // The others go through the cache, outside its lock while they are decompressed
+        {
+            std::lock_guard<std::mutex> lock(cacheMutex);
+            const uint64_t* cached = std::find(cachedIndex, cachedIndex + CACHED_BLOCKS, index);
+            if (cached != cachedIndex + CACHED_BLOCKS) {
+                std::memcpy(target, cachedData.data() + (cached - cachedIndex) * blockSize + (pos - blockStart),
+                            copyEnd - pos);
+                pos = copyEnd;
+                continue;
+            }
+        }
+        spill.resize(blockLength);
+        if (!readCompressedBlock(index, spill.data())) {
+            return false;
+        }
+        std::memcpy(target, spill.data() + (pos - blockStart), copyEnd - pos);
+        pos = copyEnd;
+
+        std::lock_guard<std::mutex> lock(cacheMutex);
+        // Slots are filled in order, so the cache only grows as far as a read needs it
+        cachedData.resize(std::max<size_t>(cachedData.size(), (nextCached + 1) * blockSize));
+        std::memcpy(cachedData.data() + nextCached * blockSize, spill.data(), blockLength);
+        cachedIndex[nextCached] = index;
+        nextCached = (nextCached + 1) % CACHED_BLOCKS;
+    }
+    return true;
+}
+
+bool StreamReader::readCompressedBlock(uint64_t index, char* target) {
+    const BlockCompressor& compressor = *noncritCompressor;
+    size_t blockLength = compressor.blockLength(index);
+    uint64_t storedOffset = 0;
+    size_t storedSize = 0;
+    if (!compressor.locate(index, storedOffset, storedSize)) {
+        std::cerr << "Malformed index entry of .noncrit block " << index << std::endl;
+        errno = EIO;
+        return false;
+    }
+
+    // Blocks stored as they are need no second buffer
+    std::pmr::vector<char> stored(requestResource());
+    char* storedData = target;
+    if (storedSize != blockLength) {
+        stored.resize(storedSize);
+        storedData = stored.data();
+    }
+    bool degraded = false;
+    bool read = (degradable && !packed) ? readDegradable(storedData, storedSize, storedOffset, degraded)
+                                        : readRaw(CriticalType::NON_CRITICAL_DATA, storedData, storedSize, storedOffset);
+    if (!read) {
+        return false;
+    }
+    if (degraded) {
+        std::memset(target, 0, blockLength);
+        return true;
+    }
+    if (storedData == target) {
+        return true;
+    }
+    if (compressor.decompress(index, storedData, storedSize, target)) {
+        getMetrics().decompressedBlocks++;
+        return true;
+    }
+    if (!BlockCompressor::supported(compressor.codec())) {
+        std::cerr << "Non-critical stream is compressed with a codec this build lacks" << std::endl;
+    } else {
+        std::cerr << "Non-critical block at stream offset " << index * compressor.blockSize()
+                  << " does not decompress" << std::endl;
+    }
+    if (degradable) {
+        std::memset(target, 0, blockLength);
+        getMetrics().degradedReads++;
+        return true;
+    }
+    errno = EIO;
+    return false;
+}
+
+bool StreamReader::readVerified(char* buffer, size_t size, off_t mappedOffset) {
+    const BlockChecksums& checksums = *critChecksums;
+    uint64_t blockSize = checksums.blockSize();
+    uint64_t streamLength = checksums.streamLength();
+    uint64_t start = mappedOffset;
+    uint64_t end = start + size;
+    if (end > streamLength) {
+        std::cerr << "Critical read past the checksummed stream length " << streamLength << std::endl;
+        getMetrics().checksumMismatches++;
+        errno = EIO;
+        return false;
+    }
+
+    char edge[BlockChecksums::BLOCK_SIZE];
+    uint64_t pos = start;
+    while (pos < end) {
+        uint64_t blockStart = pos / blockSize * blockSize;
+        uint64_t blockEnd = std::min(blockStart + blockSize, streamLength);
+        if (pos == blockStart && blockEnd <= end) {
+            // Whole blocks are read straight into the buffer and checked there
+            uint64_t runEnd = (end == streamLength) ? end : end / blockSize * blockSize;
+            if (!readBlocks(buffer + (pos - start), pos, runEnd)) {
+                return false;
+            }
+            pos = runEnd;
+            continue;
+        }
+
+        // A block the read only covers part of is checked on the side
+        std::pmr::vector<char> spill(requestResource());
+        char* blockData = edge;
+        if (blockEnd - blockStart > sizeof(edge)) {
+            spill.resize(blockEnd - blockStart);
+            blockData = spill.data();
+        }
+        if (!readBlocks(blockData, blockStart, blockEnd)) {
+            return false;
+        }
+        uint64_t copyEnd = std::min(end, blockEnd);
+        std::memcpy(buffer + (pos - start), blockData + (pos - blockStart), copyEnd - pos);
+        pos = copyEnd;
+    }
+    return true;
+}
+
+bool StreamReader::readBlocks(char* target, uint64_t from, uint64_t to) {
+    if (!readCheckedBlocks(target, from, to)) {
+        return false;
+    }
+    if (!critCipher || !critCipher->recorded()) {
+        return true;
+    }
+
+    // Checksums, parity and replicas all work on the ciphertext, the plaintext only exists here
+    if (!critCipher->keyed()) {
+        std::cerr << "Critical stream is encrypted, the mount has no key for it" << std::endl;
+        errno = EACCES;
+        return false;
+    }
+    if (!critCipher->open(from, target, to - from)) {
+        std::cerr << "Critical blocks at stream offset " << from << " failed authentication" << std::endl;
+        getMetrics().authFailures++;
+        errno = EIO;
+        return false;
+    }
+    return true;
+}
+
+bool StreamReader::readCheckedBlocks(char* target, uint64_t from, uint64_t to) {
+    const BlockChecksums& checksums = *critChecksums;
+    if (readRaw(CriticalType::CRITICAL_DATA, target, to - from, from) && checksums.verify(from, target, to - from)) {
+        return true;
+    }
+
+    // Find the bad blocks one by one, on the primary in case a stale replica answered, and
+    // rebuild them from the other blocks of their stripes
+    uint64_t blockSize = checksums.blockSize();
+    for (uint64_t pos = from; pos < to; pos += blockSize) {
+        char* block = target + (pos - from);
+        size_t length = std::min(blockSize, to - pos);
+        if (readRaw(CriticalType::CRITICAL_DATA, block, length, pos, true) && checksums.verify(pos, block, length)) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(rebuiltMutex);
+        if (rebuiltIndex == pos / blockSize) {
+            std::memcpy(block, rebuiltBlock.data(), length);
+            continue;
+        }
+        std::cerr << "Checksum mismatch in critical block at stream offset " << pos << std::endl;
+        getMetrics().checksumMismatches++;
+        std::call_once(parityOpened, [this]() {
+            parity.open(parityPath.c_str());
+        });
+        if (!parity.recover(fdCrit, checksums, pos / blockSize, block)) {
+            errno = EIO;
+            return false;
+        }
+        std::cerr << "Rebuilt critical block at stream offset " << pos << " from parity" << std::endl;
+        getMetrics().recoveredBlocks++;
+        rebuiltIndex = pos / blockSize;
+        rebuiltBlock.assign(block, block + length);
+    }
+    return true;
+}
+
+bool StreamReader::readRaw(CriticalType type, char* buffer, size_t size, off_t mappedOffset, bool primaryOnly) {
+    if (packed) {
+        const std::vector<char>& stream = (type == CriticalType::CRITICAL_DATA) ? packedCrit : packedNoncrit;
+        if (static_cast<size_t>(mappedOffset) + size > stream.size()) {
+            std::cerr << "Packed stream too short for mapped offset " << mappedOffset << std::endl;
+            return false;
+        }
+        std::memcpy(buffer, stream.data() + mappedOffset, size);
+        return true;
+    }
+
+    ReplicaSet* replicas = getStorageContext().replicas;
+    if (type == CriticalType::CRITICAL_DATA && replicas && !primaryOnly) {
+        return replicas->read(fdCrit, critPath, buffer, size, mappedOffset);
+    }
+    if (type == CriticalType::NON_CRITICAL_DATA && degradable) {
+        bool degraded = false;
+        return readDegradable(buffer, size, mappedOffset, degraded);
+    }
+
+    int fd = (type == CriticalType::CRITICAL_DATA) ? fdCrit : fdNonCrit;
+    ssize_t bytesRead = pread(fd, buffer, size, mappedOffset);
+    if (bytesRead < 0) {
+        std::perror("read failed");
+        return false;
+    }
+    if (static_cast<size_t>(bytesRead) != size) {
+        std::cerr << "Incomplete read: expected " << size << " bytes, got " << bytesRead << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool StreamReader::readDegradable(char* buffer, size_t size, off_t mappedOffset, bool& degraded) {
+    if (ReadRace::readCached(fdNonCrit, buffer, size, mappedOffset)) {
+        return true;
+    }
+    auto remaining = degradeAt - std::chrono::steady_clock::now();
+    // Once too many reads were abandoned, degraded reads give up at once
+    if (remaining.count() > 0 && ReadRace::running() < ReadRace::MAX_RUNNING) {
+        ReadRace race(size, mappedOffset);
+        int fd = dup(fdNonCrit); // the read may outlive this reader
+        if (fd >= 0) {
+            race.start(fd);
+        }
+        if (race.wait(remaining)) {
+            race.copyAnswer(buffer);
+            return true;
+        }
+    }
+
+    // Pixel data is allowed to be lost, a late answer is worth less than a prompt blank one
+    std::memset(buffer, 0, size);
+    getMetrics().degradedReads++;
+    degraded = true;
+    return true;
+}
+
+bool StreamReader::read(const FileMap& fileMap, char* buffer, size_t size, off_t offset) {
+    std::memset(buffer, 0, size);  // zero-initialize output buffer
+    if (size == 0) {
+        return true;
+    }
+
+    int64_t readEnd = offset + static_cast<int64_t>(size) - 1;
+    if (degradable) {
+        degradeAt = std::chrono::steady_clock::now() + std::chrono::microseconds(getStorageContext().noncritBudgetUs);
+    }
+
+    // Stream files serve concurrent preads; a packed entry is already in memory
+    ThreadPool* workers = getStorageContext().workers;
+    bool parallel = workers && workers->concurrency() > 1 && !packed && size >= PARALLEL_READ_THRESHOLD;
+    std::pmr::vector<ReadPiece> pieces(requestResource());
+
+    // Extents are sorted and disjoint: start at the first one ending at or after offset
+    for (auto it = fileMap.lower_bound(Range(offset, offset)); it != fileMap.end(); ++it) {
+        const Range& originalRange = it->first;
+        const Range& mappedRange = it->second.first;
+        CriticalType type = it->second.second;
+
+        if (originalRange.getStart() > readEnd) {
+            break;
+        }
+        // Holes read as the zeros already in the buffer
+        if (type == CriticalType::HOLE_DATA) {
+            continue;
+        }
+
+        // we want to read [overlapStart, overlapEnd] from the orignal range
+        int64_t overlapStart = std::max<int64_t>(offset, originalRange.getStart());
+        int64_t overlapEnd = std::min(readEnd, originalRange.getEnd());
+        size_t bytesToRead = overlapEnd - overlapStart + 1;
+
+        size_t bufferOffset = overlapStart - offset;
+        off_t mappedOffset = mappedRange.getStart() + (overlapStart - originalRange.getStart());
+
+        if (!parallel) {
+            if (!readStream(type, buffer + bufferOffset, bytesToRead, mappedOffset)) {
+                return false;
+            }
+            continue;
+        }
+        for (size_t done = 0; done < bytesToRead; done += PARALLEL_READ_PIECE) {
+            size_t pieceSize = std::min(PARALLEL_READ_PIECE, bytesToRead - done);
+            pieces.push_back({type, buffer + bufferOffset + done, pieceSize, static_cast<off_t>(mappedOffset + done)});
+        }
+    }
+
+    if (pieces.empty()) {
+        return true;
+    }
+
+    // Each task reads consecutive pieces adding up to about a full piece, so a map of many
+    // small extents does not turn into one task per extent
+    std::pmr::vector<size_t> taskStarts(requestResource());
+    size_t taskBytes = PARALLEL_READ_PIECE;
+    for (size_t i = 0; i < pieces.size(); ++i) {
+        if (taskBytes >= PARALLEL_READ_PIECE) {
+            taskStarts.push_back(i);
+            taskBytes = 0;
+        }
+        taskBytes += pieces[i].size;
+    }
+    taskStarts.push_back(pieces.size());
+
+    std::atomic<bool> failed{false};
+    workers->parallelFor(taskStarts.size() - 1, [this, &pieces, &taskStarts, &failed](size_t task) {
+        for (size_t i = taskStarts[task]; i < taskStarts[task + 1] && !failed; ++i) {
+            const ReadPiece& piece = pieces[i];
+            if (!readStream(piece.type, piece.buffer, piece.size, piece.mappedOffset)) {
+                failed = true;
+            }
+        }
+    });
+    return !failed;
+}
+
+bool StreamReader::isPacked() const {
+    return packed;
+}
+
+void StreamReader::verifyCritical(const BlockChecksums* checksums) {
+    critChecksums = checksums;
+}
+
+void StreamReader::decryptCritical(const BlockCipher* cipher) {
+    critCipher = cipher;
+}
+
+void StreamReader::decompressNoncritical(const BlockCompressor* compressor) {
+    noncritCompressor = compressor;
+}
+
+void StreamReader::allowDegraded(bool allow) {
+    degradable = allow && getStorageContext().noncritBudgetUs > 0;
+}
@@ -0,0 +1,132 @@
+#ifndef STREAM_READER_H
+#define STREAM_READER_H
+
+#include "AbstractFile.h"
+#include "../Utilities/BlockChecksums.h"
+#include "../Utilities/BlockCipher.h"
+#include "../Utilities/BlockCompressor.h"
+#include "../Utilities/StreamParity.h"
+
+#include <chrono>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <sys/types.h>  // For off_t
+
+/**
+ * Reads logical byte ranges of a split file through its mapping, either from its .crit and
+ * .noncrit stream files or from its packed segment entry. The streams are opened once, so a
+ * caller reading the file window by window does not reopen them for every window.
+ */
+class StreamReader {
+public:
+    StreamReader();
+    StreamReader(const StreamReader&) = delete;
+    StreamReader& operator=(const StreamReader&) = delete;
+    ~StreamReader();
+
+    /**
+     * @brief Opens the streams of a split file.
+     *
+     * @param basePath the backing path without the stream suffix
+     * @return true if successful, false otherwise
+     */
+    bool open(std::string_view basePath);
+
+    /**
+     * @brief Reads [offset, offset + size) of the logical file described by fileMap.
+     * Holes and bytes no extent covers read as zeros. Large reads from stream files are
+     * split into pieces read concurrently on StorageContext::workers, if set. With
+     * StorageContext::replicas set, critical reads are hedged across the .crit replicas.
+     *
+     * @param fileMap the mapping of the file the streams belong to
+     * @param buffer buffer to read into
+     * @param size number of bytes to read
+     * @param offset logical offset to read from
+     * @return true if successful, false otherwise
+     */
+    bool read(const FileMap& fileMap, char* buffer, size_t size, off_t offset);
+
+    /**
+     * @brief Whether the streams live in the segment store rather than in stream files.
+     */
+    bool isPacked() const;
+
+    /**
+     * @brief Verifies every block of the .crit stream a read touches against checksums, if
+     * they are recorded. A block that fails, or cannot be read, is counted in
+     * Metrics::checksumMismatches and rebuilt from the .parity sidecar if there is one;
+     * otherwise the read fails with errno set to EIO. checksums must outlive the reads.
+     */
+    void verifyCritical(const BlockChecksums* checksums);
+
+    /**
+     * @brief Decrypts the .crit stream with cipher, if it is recorded, once its blocks passed
+     * their checksums, which an encrypted stream always has. A block whose tag does not match
+     * is counted in Metrics::authFailures and fails the read with EIO; without the mount key
+     * the stream was sealed under reads fail with EACCES. cipher must outlive the reads.
+     */
+    void decryptCritical(const BlockCipher* cipher);
+
+    /**
+     * @brief Reads the .noncrit stream through compressor, if it is recorded: only the blocks a
+     * read overlaps are read and decompressed, those it covers whole straight into the buffer,
+     * the others into a small cache of recent blocks, which the next extents of the read often
+     * need again. A block that does not decompress fails the read with EIO, or reads as zeros
+     * where degraded reads are allowed. compressor must outlive the reads.
+     */
+    void decompressNoncritical(const BlockCompressor* compressor);
+
+    /**
+     * @brief Lets the .noncrit parts of a read that has taken StorageContext::noncritBudgetUs,
+     * or that fail, return zeros instead, counted in Metrics::degradedReads. Only for reads whose bytes
+     * go back to a reader, never for those a write builds on. No effect without a budget.
+     */
+    void allowDegraded(bool allow);
+
+private:
+    bool packed = false;
+    std::vector<char> packedCrit;
+    std::vector<char> packedNoncrit;
+    int fdCrit = -1;
+    int fdNonCrit = -1;
+    const BlockChecksums* critChecksums = nullptr;
+    const BlockCipher* critCipher = nullptr;
+    bool degradable = false;
+    std::chrono::steady_clock::time_point degradeAt; // the budget is for the whole read, not each extent
+    std::pmr::string critPath; // only set with StorageContext::replicas, which reads are hedged across
+    std::pmr::string parityPath;
+    std::once_flag parityOpened; // the sidecar is only opened once a block needs it
+    StreamParity parity;
+    // The last rebuilt block, which files of many small extents read over and over
+    std::mutex rebuiltMutex;
+    uint64_t rebuiltIndex = UINT64_MAX;
+    std::pmr::vector<char> rebuiltBlock;
+    const BlockCompressor* noncritCompressor = nullptr;
+    // Recently decompressed .noncrit blocks, one after the other in cachedData, replaced round-robin
+    static const size_t CACHED_BLOCKS = 4;
+    std::mutex cacheMutex;
+    std::pmr::vector<char> cachedData;
+    uint64_t cachedIndex[CACHED_BLOCKS] = {UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX};
+    size_t nextCached = 0;
+
+    bool readStream(CriticalType type, char* buffer, size_t size, off_t mappedOffset);
+    // Critical reads are hedged across the replicas unless primaryOnly
+    bool readRaw(CriticalType type, char* buffer, size_t size, off_t mappedOffset, bool primaryOnly = false);
+    bool readVerified(char* buffer, size_t size, off_t mappedOffset);
+    // Reads .noncrit within the budget, or fills with zeros and sets degraded
+    bool readDegradable(char* buffer, size_t size, off_t mappedOffset, bool& degraded);
+    // Reads [offset, offset + size) of the uncompressed .noncrit stream
+    bool readCompressed(char* buffer, size_t size, uint64_t offset);
+    // Reads and decompresses one block into target, or zeros if degraded reads allow it
+    bool readCompressedBlock(uint64_t index, char* target);
+    // Reads and verifies whole blocks [from, to) of .crit into target and decrypts them
+    bool readBlocks(char* target, uint64_t from, uint64_t to);
+    // readBlocks up to decryption, rebuilding bad blocks
+    bool readCheckedBlocks(char* target, uint64_t from, uint64_t to);
+};
+
+#endif // STREAM_READER_H
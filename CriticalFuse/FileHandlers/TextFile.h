@@ -1,15 +1,22 @@
 #ifndef TEXT_FILE_HANDLERS_HPP
 #define TEXT_FILE_HANDLERS_HPP
 
-#include "AbstractFile.h"
+#include "IncrementalFile.h"
 
-class TextFileHandler : public AbstractFileHandler {
+class TextFileHandler : public IncrementalFileHandler {
     public:
         TextFileHandler() = default; // default constructor
         TextFileHandler(const TextFileHandler&) = default; // copy constructor
         virtual ~TextFileHandler() override = default;   // destructor
 
-        ResultCode createMapping(const char* buffer, size_t size) override;
+    protected:
+        ResultCode startParsing() override;
+        ResultCode onHeader(const char* header, size_t size) override;
+        ResultCode onPayloadEnd() override;
+        size_t estimateExtents(uint64_t fileSize) const override;
+
+    private:
+        bool criticalBlock = true; // type of the block being mapped
 };
 
 #endif // TEXT_FILE_HANDLERS_HPP
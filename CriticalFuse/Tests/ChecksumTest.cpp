@@ -0,0 +1,83 @@
+// Round trips of checksummed .crit streams: every CRC32C implementation the CPU can run agrees
+// with the table-driven one and the reference value, a flipped bit in a critical block fails
+// reads of that block with EIO while reads of the others succeed, and writes keep the
+// checksums of the blocks they change up to date.
+//
+// Usage: ./ChecksumTest
+// The split streams are written under /tmp/ChecksumTest.
+
+#include "FileHandlers/PngFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/BlockChecksums.h"
+#include "Utilities/Crc32c.h"
+#include "Utilities/Metrics.h"
+
+#include <cerrno>
+#include <cstring>
+
+int main() {
+    std::string root = scratchDirectory("ChecksumTest");
+    std::mt19937 rng(45);
+
+    // Lengths and alignments on both sides of the three-stream threshold
+    std::vector<char> bytes(4 * BlockChecksums::BLOCK_SIZE);
+    for (char& byte : bytes) {
+        byte = static_cast<char>(rng());
+    }
+    std::vector<Crc32cImpl> implementations = availableCrc32c();
+    for (const Crc32cImpl& implementation : implementations) {
+        CHECK(implementation.compute(0, "123456789", 9) == 0xE3069283);
+        for (int i = 0; i < 2000; ++i) {
+            size_t offset = rng() % BlockChecksums::BLOCK_SIZE;
+            size_t size = rng() % (3 * BlockChecksums::BLOCK_SIZE);
+            size_t split = size > 0 ? rng() % size : 0;
+            uint32_t expected = implementations[0].compute(i, bytes.data() + offset, size);
+            uint32_t continued = implementation.compute(i, bytes.data() + offset, split);
+            continued = implementation.compute(continued, bytes.data() + offset + split, size - split);
+            CHECK(implementation.compute(i, bytes.data() + offset, size) == expected && continued == expected);
+        }
+    }
+
+    // A palette of a few blocks, whose bytes lie at about the same offsets in .crit as in the file
+    const size_t block = BlockChecksums::BLOCK_SIZE;
+    std::vector<char> png = syntheticPng(400000, 4 * block, 8192, rng);
+    std::string mappingPath = root + "/a.png.mapping";
+    CHECK(writeSplit<PngFileHandler>(mappingPath, png.data(), png.size()));
+    CHECK(readsBack<PngFileHandler>(mappingPath, png));
+
+    // Writes into the palette reseal its blocks' checksums
+    std::vector<char> patch(block, 'p');
+    size_t offset = block + block / 2;
+    std::memcpy(&png[offset], patch.data(), patch.size());
+    CHECK(writeSplit<PngFileHandler>(mappingPath, patch.data(), patch.size(), offset));
+    CHECK(readsBack<PngFileHandler>(mappingPath, png));
+
+    // A flipped bit in the third block
+    std::string critPath = root + "/a.png.crit";
+    std::vector<char> crit = loadFile(critPath);
+    crit[2 * block + 100] ^= 0x10;
+    saveFile(critPath, crit);
+    std::vector<char> data;
+    uint64_t mismatches = getMetrics().checksumMismatches;
+    errno = 0;
+    CHECK(!readSplit<PngFileHandler>(mappingPath, data, png.size()) && errno == EIO);
+    errno = 0;
+    CHECK(!readSplit<PngFileHandler>(mappingPath, data, 10, 2 * block + 50) && errno == EIO);
+    CHECK(getMetrics().checksumMismatches > mismatches);
+    CHECK(readSplit<PngFileHandler>(mappingPath, data, block, 0) &&
+          std::equal(data.begin(), data.end(), png.begin()));
+    CHECK(readSplit<PngFileHandler>(mappingPath, data, block, 3 * block + 200) &&
+          std::equal(data.begin(), data.end(), png.begin() + 3 * block + 200));
+    CHECK(readSplit<PngFileHandler>(mappingPath, data, 100000, 200000) &&
+          std::equal(data.begin(), data.end(), png.begin() + 200000));
+
+    // Without its checksum line the same streams read the flipped bit back unnoticed
+    std::vector<char> saved = loadFile(mappingPath);
+    std::string mapping(saved.begin(), saved.end());
+    size_t line = mapping.find("@CRC32C ");
+    CHECK(line != std::string::npos);
+    mapping.erase(line, mapping.find('\n', line) + 1 - line);
+    saveFile(mappingPath, std::vector<char>(mapping.begin(), mapping.end()));
+    CHECK(readSplit<PngFileHandler>(mappingPath, data, png.size()) && data != png);
+    return testResult("ChecksumTest");
+}
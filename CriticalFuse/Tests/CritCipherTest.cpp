@@ -0,0 +1,109 @@
+// Round trips of encrypted .crit streams: writes that start or end inside a block re-seal it
+// with the bytes they do not cover intact, a tampered seal fails the read with EIO and a
+// file read without its key fails with EACCES.
+//
+// Usage: ./CritCipherTest
+// Needs libcrypto; the split streams are written under /tmp/CritCipherTest.
+
+#include "FileHandlers/PngFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/BlockCipher.h"
+#include "Utilities/StorageContext.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+// Seals plain into a stream file, writes size bytes at offset through BlockCipher::write and
+// checks that the whole stream opens to plain with those bytes laid over it
+void checkStreamWrite(const std::string& path, std::vector<char> plain, uint64_t offset, size_t size,
+                      std::mt19937& rng) {
+    BlockCipher cipher;
+    std::vector<char> sealed;
+    CHECK(cipher.begin() && cipher.seal({{plain.data(), plain.size()}}, sealed) && cipher.finish(sealed));
+    saveFile(path, sealed);
+
+    std::vector<char> data(size);
+    for (char& byte : data) {
+        byte = static_cast<char>(rng());
+    }
+    int fd = open(path.c_str(), O_RDWR);
+    StreamFile file(fd);
+    CHECK(fd >= 0 && cipher.write(file, offset, data.data(), size, plain.size()));
+    close(fd);
+    if (offset + size > plain.size()) {
+        plain.resize(offset + size, 0);
+    }
+    std::memcpy(plain.data() + offset, data.data(), size);
+
+    std::vector<char> stream = loadFile(path);
+    CHECK(stream.size() == plain.size() && cipher.open(0, stream.data(), stream.size()) && stream == plain);
+}
+
+} // namespace
+
+int main() {
+    if (!BlockCipher::supported()) {
+        std::cout << "CritCipherTest: skipped, built without libcrypto" << std::endl;
+        return 0;
+    }
+    std::string root = scratchDirectory("CritCipherTest");
+    std::mt19937 rng(49);
+    MountKey key;
+    for (unsigned char& byte : key.bytes) {
+        byte = static_cast<unsigned char>(rng());
+    }
+    getStorageContext().critKey = &key;
+
+    // Writes at and across block boundaries of a 10000 byte stream, in place and past its end
+    const size_t block = BlockCipher::BLOCK_SIZE;
+    std::vector<char> plain(10000);
+    for (char& byte : plain) {
+        byte = static_cast<char>(rng());
+    }
+    std::string streamPath = root + "/stream.crit";
+    checkStreamWrite(streamPath, plain, block, 10, rng);            // starts on a boundary, ends inside
+    checkStreamWrite(streamPath, plain, block + 100, 10, rng);      // inside one block
+    checkStreamWrite(streamPath, plain, block - 10, 20, rng);       // across a boundary
+    checkStreamWrite(streamPath, plain, block, block, rng);         // one whole block
+    checkStreamWrite(streamPath, plain, 0, 10, rng);                // the first bytes
+    checkStreamWrite(streamPath, plain, 2 * block + 10, 2000, rng); // the partial last block
+    checkStreamWrite(streamPath, plain, 9990, 500, rng);            // past the end
+    checkStreamWrite(streamPath, plain, 12000, 100, rng);           // past the end, leaving a gap
+
+    // The same through a split PNG whose palette, critical, spans a few blocks
+    std::vector<char> png = syntheticPng(1 << 20, 3 * block, 50000, rng);
+    std::string mappingPath = root + "/a.png.mapping";
+    CHECK(writeSplit<PngFileHandler>(mappingPath, png.data(), png.size()));
+    std::vector<char> stream = loadFile(root + "/a.png.crit");
+    CHECK(std::search(stream.begin(), stream.end(), png.begin() + 100, png.begin() + 200) == stream.end());
+    CHECK(readsBack<PngFileHandler>(mappingPath, png));
+    for (auto [offset, size] : {std::pair<size_t, size_t>{block, 10}, {block - 5, 10}, {2 * block + 1, block}}) {
+        std::vector<char> patch(size, static_cast<char>(rng()));
+        CHECK(writeSplit<PngFileHandler>(mappingPath, patch.data(), size, offset));
+        std::memcpy(png.data() + offset, patch.data(), size);
+        CHECK(readsBack<PngFileHandler>(mappingPath, png));
+    }
+
+    // Without the key the file cannot be read, with a tampered seal it fails authentication
+    getStorageContext().critKey = nullptr;
+    std::vector<char> data;
+    errno = 0;
+    CHECK(!readSplit<PngFileHandler>(mappingPath, data, png.size()) && errno == EACCES);
+    getStorageContext().critKey = &key;
+    std::vector<char> mapping = loadFile(mappingPath);
+    std::string text(mapping.begin(), mapping.end());
+    size_t line = text.find("@AES256GCM");
+    CHECK(line != std::string::npos);
+    size_t digit = text.find('\n', line) - 1;
+    mapping[digit] = mapping[digit] == '0' ? '1' : '0';
+    saveFile(mappingPath, mapping);
+    errno = 0;
+    CHECK(!readSplit<PngFileHandler>(mappingPath, data, png.size()) && errno == EIO);
+
+    getStorageContext().critKey = nullptr;
+    return testResult("CritCipherTest");
+}
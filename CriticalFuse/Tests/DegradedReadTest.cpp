@@ -0,0 +1,107 @@
+// Round trips of degradable reads: a .noncrit stream that cannot be read, or a compressed block
+// that does not decompress, reads as zeros where the request allows it while every critical
+// byte still reads back exactly; without a budget, or for requests that do not allow it, the
+// same reads fail.
+//
+// Usage: ./DegradedReadTest
+// The split streams are written under /tmp/DegradedReadTest.
+
+#include "FileHandlers/BmpFile.h"
+#include "FileHandlers/PngFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/BlockCompressor.h"
+#include "Utilities/Metrics.h"
+#include "Utilities/StorageContext.h"
+
+#include <algorithm>
+
+namespace {
+
+// Whether each byte of data, read at offset, is the file's or, for non-critical bytes that
+// were lost, a zero; lost receives the number of those zeros
+bool onlyLosesPixels(const FileMap& fileMap, const std::vector<char>& file, const std::vector<char>& data,
+                     size_t offset, size_t& lost) {
+    lost = 0;
+    for (const auto& [range, mapped] : fileMap) {
+        size_t start = std::max<size_t>(range.getStart(), offset);
+        size_t end = std::min<size_t>(range.getEnd() + 1, offset + data.size());
+        for (size_t i = start; i < end; ++i) {
+            if (data[i - offset] == file[i]) {
+                continue;
+            }
+            if (mapped.second != CriticalType::NON_CRITICAL_DATA || data[i - offset] != 0) {
+                return false;
+            }
+            lost++;
+        }
+    }
+    return true;
+}
+
+// Reads the file whole and in pieces, degradable and not, with the .noncrit stream damaged
+template <typename Handler>
+void checkDamaged(const std::string& mappingPath, const std::vector<char>& file, std::mt19937& rng) {
+    Handler handler;
+    CHECK(handler.createMapping(file.data(), file.size()) == ResultCode::SUCCESS);
+    std::vector<char> data;
+    size_t lost = 0;
+    uint64_t degraded = getMetrics().degradedReads;
+    CHECK(readSplit<Handler>(mappingPath, data, file.size(), 0, true));
+    CHECK(onlyLosesPixels(handler.getFileMap(), file, data, 0, lost) && lost > 0);
+    CHECK(getMetrics().degradedReads > degraded);
+    CHECK(!readSplit<Handler>(mappingPath, data, file.size(), 0, false));
+    for (int i = 0; i < 50; ++i) {
+        size_t offset = rng() % file.size();
+        size_t size = 1 + rng() % std::min<size_t>(50000, file.size() - offset);
+        CHECK(readSplit<Handler>(mappingPath, data, size, offset, true));
+        CHECK(onlyLosesPixels(handler.getFileMap(), file, data, offset, lost));
+    }
+
+    // Without a budget degradable reads block and fail like the others
+    unsigned budget = getStorageContext().noncritBudgetUs;
+    getStorageContext().noncritBudgetUs = 0;
+    CHECK(!readSplit<Handler>(mappingPath, data, file.size(), 0, true));
+    getStorageContext().noncritBudgetUs = budget;
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("DegradedReadTest");
+    std::mt19937 rng(48);
+    getStorageContext().noncritBudgetUs = 100000;
+
+    // An intact file reads back exactly, degradable or not
+    std::vector<char> png = syntheticPng(500000, 768, 16384, rng);
+    std::string basePath = root + "/a.png";
+    CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", png.data(), png.size()));
+    std::vector<char> data;
+    uint64_t degraded = getMetrics().degradedReads;
+    CHECK(readSplit<PngFileHandler>(basePath + ".mapping", data, png.size(), 0, true) && data == png);
+    CHECK(getMetrics().degradedReads == degraded);
+
+    // The second half of .noncrit cut off
+    std::vector<char> noncrit = loadFile(basePath + ".noncrit");
+    saveFile(basePath + ".noncrit", std::vector<char>(noncrit.begin(), noncrit.begin() + noncrit.size() / 2));
+    checkDamaged<PngFileHandler>(basePath + ".mapping", png, rng);
+
+    // Compressed blocks that do not decompress, of pixel data that compresses
+    NoncritCodec codec = BlockCompressor::supported(NoncritCodec::LZ4)    ? NoncritCodec::LZ4
+                         : BlockCompressor::supported(NoncritCodec::ZSTD) ? NoncritCodec::ZSTD
+                                                                          : NoncritCodec::NONE;
+    if (codec != NoncritCodec::NONE) {
+        getStorageContext().noncritCodec = codec;
+        std::vector<char> bmp = syntheticBmp(1000, 500, rng);
+        std::string compressedPath = root + "/b.bmp";
+        CHECK(writeSplit<BmpFileHandler>(compressedPath + ".mapping", bmp.data(), bmp.size()));
+        noncrit = loadFile(compressedPath + ".noncrit");
+        CHECK(noncrit.size() < bmp.size());
+        std::fill(noncrit.begin() + noncrit.size() / 3, noncrit.begin() + noncrit.size() * 2 / 3, 0);
+        saveFile(compressedPath + ".noncrit", noncrit);
+        checkDamaged<BmpFileHandler>(compressedPath + ".mapping", bmp, rng);
+        getStorageContext().noncritCodec = NoncritCodec::NONE;
+    } else {
+        std::cout << "DegradedReadTest: compressed streams skipped, built without lz4 and zstd" << std::endl;
+    }
+    return testResult("DegradedReadTest");
+}
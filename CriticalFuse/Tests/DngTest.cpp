@@ -0,0 +1,85 @@
+// Round trips of tiled DNGs: the header, IFDs and tile tables of every IFD, SubIFDs included,
+// go to .crit and the tiles, preview strip and thumbnail to .noncrit, whether the file is
+// written whole or in FUSE-sized pieces, and it reads back serially and on the worker pool.
+//
+// Usage: ./DngTest
+// The split streams are written under /tmp/DngTest.
+
+#include "FileHandlers/DngFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/StorageContext.h"
+#include "Utilities/ThreadPool.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+const size_t TILES = 40;
+const size_t TILE_SIZE = 256 * 64 * 2;
+const size_t PREVIEW_SIZE = 64 * 1024;
+const size_t THUMBNAIL_SIZE = 4096;
+const size_t WRITE_SIZE = 128 * 1024; // FUSE's default max_write
+
+// The whole file and random reads, some across tile boundaries
+void checkReads(const std::string& mappingPath, const std::vector<char>& dng, std::mt19937& rng) {
+    CHECK(readsBack<DngFileHandler>(mappingPath, dng));
+    for (int i = 0; i < 100; ++i) {
+        size_t offset = rng() % dng.size();
+        size_t size = 1 + rng() % std::min<size_t>(3 * TILE_SIZE, dng.size() - offset);
+        std::vector<char> data;
+        CHECK(readSplit<DngFileHandler>(mappingPath, data, size, offset) &&
+              std::equal(data.begin(), data.end(), dng.begin() + offset));
+    }
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("DngTest");
+    std::mt19937 rng(42);
+    std::vector<char> dng = syntheticDng(TILES, TILE_SIZE, PREVIEW_SIZE, THUMBNAIL_SIZE, rng);
+    size_t imageSize = TILES * TILE_SIZE + PREVIEW_SIZE + THUMBNAIL_SIZE;
+
+    // Everything but the image data of the three IFDs is critical
+    DngFileHandler handler;
+    CHECK(handler.createMapping(dng.data(), dng.size()) == ResultCode::SUCCESS);
+    size_t critical = 0;
+    for (const auto& [range, mapped] : handler.getFileMap()) {
+        if (mapped.second == CriticalType::CRITICAL_DATA) {
+            critical += range.getEnd() - range.getStart() + 1;
+        }
+    }
+    CHECK(critical == dng.size() - imageSize);
+
+    std::string whole = root + "/whole.dng";
+    CHECK(writeSplit<DngFileHandler>(whole + ".mapping", dng.data(), dng.size()));
+    CHECK(loadFile(whole + ".crit").size() == dng.size() - imageSize);
+    CHECK(loadFile(whole + ".noncrit").size() == imageSize);
+    checkReads(whole + ".mapping", dng, rng);
+
+    // Written in pieces, a fresh handler each, the layout is found from the first ones
+    std::string pieces = root + "/pieces.dng";
+    for (size_t offset = 0; offset < dng.size(); offset += WRITE_SIZE) {
+        size_t size = std::min(WRITE_SIZE, dng.size() - offset);
+        CHECK(writeSplit<DngFileHandler>(pieces + ".mapping", dng.data() + offset, size, offset));
+    }
+    CHECK(loadFile(pieces + ".crit") == loadFile(whole + ".crit"));
+    CHECK(loadFile(pieces + ".noncrit") == loadFile(whole + ".noncrit"));
+    checkReads(pieces + ".mapping", dng, rng);
+
+    // The worker pool reads the pieces of a request concurrently
+    ThreadPool pool(3);
+    getStorageContext().workers = &pool;
+    checkReads(whole + ".mapping", dng, rng);
+
+    // An overwrite across two tiles stays in .noncrit
+    std::vector<char> patch(TILE_SIZE, 't');
+    size_t offset = 4096 + TILES * 8 + TILE_SIZE / 2;
+    std::memcpy(&dng[offset], patch.data(), patch.size());
+    CHECK(writeSplit<DngFileHandler>(whole + ".mapping", patch.data(), patch.size(), offset));
+    CHECK(loadFile(whole + ".crit").size() == dng.size() - imageSize);
+    checkReads(whole + ".mapping", dng, rng);
+    getStorageContext().workers = nullptr;
+    return testResult("DngTest");
+}
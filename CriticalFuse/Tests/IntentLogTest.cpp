@@ -0,0 +1,183 @@
+// Round trips of split files written through the intent log: what a log left behind by a crash
+// replays, that unlinked and renamed files are not brought back by it, that writes in place
+// and to the tail log only the bytes they change, and that those patches are not replayed
+// over a staged rewrite that followed them.
+//
+// Usage: ./IntentLogTest
+// The split streams and the log are written under /tmp/IntentLogTest.
+
+#include "FileHandlers/BmpFile.h"
+#include "FileHandlers/PngFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/BlockCipher.h"
+#include "Utilities/BlockCompressor.h"
+#include "Utilities/IntentLog.h"
+#include "Utilities/ReplicaSet.h"
+#include "Utilities/StorageContext.h"
+
+#include <cstring>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+std::unique_ptr<IntentLog> openLog(const std::string& path) {
+    auto log = std::make_unique<IntentLog>(
+        path,
+        [](const IntentLog::Intent& update) {
+            return AbstractFileHandler::persistStreams(update) == ResultCode::SUCCESS;
+        },
+        [](const std::string& basePath) {
+            return AbstractFileHandler::syncStreams(basePath) == ResultCode::SUCCESS;
+        });
+    CHECK(log->open());
+    return log;
+}
+
+off_t fileSize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+bool exists(const std::string& path) {
+    return access(path.c_str(), F_OK) == 0;
+}
+
+void removeSplit(const std::string& basePath) {
+    for (const char* suffix : {".mapping", ".crit", ".noncrit", ".parity"}) {
+        unlink((basePath + suffix).c_str());
+    }
+}
+
+void renameSplit(const std::string& from, const std::string& to) {
+    for (const char* suffix : {".mapping", ".crit", ".noncrit", ".parity"}) {
+        rename((from + suffix).c_str(), (to + suffix).c_str());
+    }
+}
+
+// An overwrite of palette and pixel bytes and an IDAT turned into a palette, which moves its
+// bytes to the end of .crit, are logged as patches. Replaying the log over the streams as they
+// were before brings the file and its replica to the same state.
+void checkPatches(const std::string& basePath, const std::string& logPath, std::mt19937& rng) {
+    std::string root = basePath.substr(0, basePath.rfind('/'));
+    std::string name = basePath.substr(root.size());
+    ReplicaSet replicas(root, {root + "/replica"}, 95, std::chrono::microseconds(1000));
+    CHECK(replicas.open());
+    getStorageContext().replicas = &replicas;
+    IntentLog* log = getStorageContext().intentLog;
+    std::vector<char> png = syntheticPng(400000, 3000, 8192, rng);
+    CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", png.data(), png.size()));
+    std::vector<std::vector<char>> before;
+    for (const char* suffix : {".mapping", ".crit", ".noncrit"}) {
+        before.push_back(loadFile(basePath + suffix));
+    }
+    off_t logBefore = fileSize(logPath);
+
+    std::vector<char> patch(10, 'p');
+    for (size_t offset : {100, 200000}) {
+        std::memcpy(&png[offset], patch.data(), patch.size());
+        CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", patch.data(), patch.size(), offset));
+    }
+    size_t lastIdat = png.size() - 12 - (8192 + 12) + 4;
+    CHECK(std::memcmp(&png[lastIdat], "IDAT", 4) == 0);
+    std::memcpy(&png[lastIdat], "PLTE", 4);
+    CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", "PLTE", 4, lastIdat));
+    CHECK(readsBack<PngFileHandler>(basePath + ".mapping", png));
+    // Compressed blocks are logged whole, still far less than the file
+    CHECK(fileSize(logPath) - logBefore < static_cast<off_t>(png.size() / 2));
+    CHECK(loadFile(root + "/replica" + name + ".crit") == loadFile(basePath + ".crit"));
+
+    size_t stream = 0;
+    for (const char* suffix : {".mapping", ".crit", ".noncrit"}) {
+        saveFile(basePath + suffix, before[stream++]);
+    }
+    getStorageContext().intentLog = nullptr;
+    std::unique_ptr<IntentLog> replayed = openLog(logPath);
+    CHECK(readsBack<PngFileHandler>(basePath + ".mapping", png));
+    CHECK(loadFile(root + "/replica" + name + ".crit") == loadFile(basePath + ".crit"));
+    // The replay dropped the running log's records, which starts over from an empty file
+    CHECK(log->checkpoint());
+    getStorageContext().intentLog = log;
+    getStorageContext().replicas = nullptr;
+}
+
+// A patch of a file rewritten in staged streams afterwards must not be replayed over the
+// newer streams, which have a layout of their own.
+void checkPatchBeforeStaged(const std::string& basePath, const std::string& logPath, std::mt19937& rng) {
+    IntentLog* log = getStorageContext().intentLog;
+    std::vector<char> bmp = syntheticBmp(2000, 1700, rng);
+    CHECK(writeSplit<BmpFileHandler>(basePath + ".mapping", bmp.data(), bmp.size()));
+    std::vector<char> patch(4096, 'p');
+    CHECK(writeSplit<BmpFileHandler>(basePath + ".mapping", patch.data(), patch.size(), 1000000));
+    std::vector<char> wider = syntheticBmp(2400, 1500, rng);
+    CHECK(writeSplit<BmpFileHandler>(basePath + ".mapping", wider.data(), wider.size()));
+    CHECK(readsBack<BmpFileHandler>(basePath + ".mapping", wider));
+
+    getStorageContext().intentLog = nullptr;
+    std::unique_ptr<IntentLog> replayed = openLog(logPath);
+    CHECK(readsBack<BmpFileHandler>(basePath + ".mapping", wider));
+    CHECK(log->checkpoint());
+    getStorageContext().intentLog = log;
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("IntentLogTest");
+    std::string logPath = root + "/.intent.log";
+    std::mt19937 rng(27);
+    std::vector<char> first = syntheticPng(200000, 768, 8192, rng);
+    std::vector<char> second = syntheticPng(300000, 768, 8192, rng);
+
+    // The running log is never checkpointed on its own here, so its records are still there
+    // for the second log to replay, as after a crash
+    std::unique_ptr<IntentLog> log = openLog(logPath);
+    getStorageContext().intentLog = log.get();
+    std::string a = root + "/a.png";
+    std::string b = root + "/b.png";
+    std::string c = root + "/c.png";
+    CHECK(writeSplit<PngFileHandler>(a + ".mapping", first.data(), first.size()));
+    CHECK(writeSplit<PngFileHandler>(b + ".mapping", first.data(), first.size()));
+    CHECK(writeSplit<PngFileHandler>(c + ".mapping", second.data(), second.size()));
+
+    // a is unlinked, b renamed over c, as the FUSE layer does it
+    CHECK(log->checkpointIfDirty(a));
+    removeSplit(a);
+    CHECK(log->checkpointIfDirty(b) && log->checkpointIfDirty(c));
+    renameSplit(b, c);
+
+    getStorageContext().intentLog = nullptr;
+    std::unique_ptr<IntentLog> replayed = openLog(logPath);
+    CHECK(!exists(a + ".mapping") && !exists(a + ".crit"));
+    CHECK(!exists(b + ".mapping") && !exists(b + ".crit"));
+    CHECK(readsBack<PngFileHandler>(c + ".mapping", first));
+
+    // Writes after the checkpoint are replayed again
+    getStorageContext().intentLog = log.get();
+    CHECK(writeSplit<PngFileHandler>(a + ".mapping", second.data(), second.size()));
+    removeSplit(a);
+    getStorageContext().intentLog = nullptr;
+    replayed = openLog(logPath);
+    CHECK(readsBack<PngFileHandler>(a + ".mapping", second));
+
+    // Patches are logged for plain streams and for sealed and compressed ones
+    replayed.reset();
+    log = openLog(logPath);
+    getStorageContext().intentLog = log.get();
+    checkPatches(root + "/d.png", logPath, rng);
+    checkPatchBeforeStaged(root + "/f.bmp", logPath, rng);
+    MountKey key;
+    for (unsigned char& byte : key.bytes) {
+        byte = static_cast<unsigned char>(rng());
+    }
+    if (BlockCipher::supported() && BlockCompressor::supported(NoncritCodec::LZ4)) {
+        getStorageContext().critKey = &key;
+        getStorageContext().noncritCodec = NoncritCodec::LZ4;
+        checkPatches(root + "/e.png", logPath, rng);
+        getStorageContext().critKey = nullptr;
+        getStorageContext().noncritCodec = NoncritCodec::NONE;
+    }
+    getStorageContext().intentLog = nullptr;
+    return testResult("IntentLogTest");
+}
@@ -0,0 +1,112 @@
+// Round trips of files whose mapping is saved as a paged index: the index holds the same
+// extents as the text mapping and loads exactly those overlapping a range, reads of the split
+// file return its bytes, and overwrites and appends keep it readable.
+//
+// Usage: ./MappingIndexTest
+// The split streams are written under /tmp/MappingIndexTest.
+
+#include "FileHandlers/BmpFile.h"
+#include "FileHandlers/MappingIndex.h"
+#include "FileHandlers/TextFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/StorageContext.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+bool isIndex(const std::string& mappingPath) {
+    std::vector<char> mapping = loadFile(mappingPath);
+    return isMappingIndex(mapping.data(), mapping.size());
+}
+
+// Loads [first, last] from the index and compares it with the extents of reference overlapping it
+void checkRange(MappingIndexReader& index, const FileMap& reference, int64_t first, int64_t last) {
+    FileMap loaded;
+    CHECK(index.loadRange(first, last, loaded));
+    FileMap expected;
+    for (const auto& entry : reference) {
+        if (entry.first.getEnd() >= first && entry.first.getStart() <= last) {
+            expected.insert(entry);
+        }
+    }
+    CHECK(loaded == expected);
+}
+
+// Writes data with a paged index, checks the index against the handler's own mapping and reads
+template <typename Handler>
+void checkIndexed(const std::string& mappingPath, std::vector<char> data, std::mt19937& rng) {
+    getStorageContext().mappingIndexThreshold = 1;
+    CHECK(writeSplit<Handler>(mappingPath, data.data(), data.size()));
+    CHECK(isIndex(mappingPath));
+    Handler reference;
+    CHECK(reference.createMapping(data.data(), data.size()) == ResultCode::SUCCESS);
+    const FileMap& extents = reference.getFileMap();
+
+    int fd = open(mappingPath.c_str(), O_RDONLY);
+    MappingIndexReader index;
+    CHECK(fd >= 0 && index.open(fd));
+    CHECK(index.extentCount() == extents.size());
+    CHECK(index.logicalSize() == data.size());
+    checkRange(index, extents, 0, static_cast<int64_t>(data.size()) - 1);
+    for (int i = 0; i < 100; ++i) {
+        int64_t first = rng() % data.size();
+        checkRange(index, extents, first, first + rng() % 50000);
+    }
+    close(fd);
+
+    CHECK(readsBack<Handler>(mappingPath, data));
+    for (int i = 0; i < 100; ++i) {
+        size_t offset = rng() % data.size();
+        size_t size = 1 + rng() % std::min<size_t>(20000, data.size() - offset);
+        std::vector<char> read;
+        CHECK(readSplit<Handler>(mappingPath, read, size, offset) &&
+              std::equal(read.begin(), read.end(), data.begin() + offset));
+    }
+
+    // An overwrite in the middle and an append keep the file indexed
+    std::vector<char> patch(3000, 'x');
+    size_t offset = data.size() / 2;
+    std::memcpy(&data[offset], patch.data(), patch.size());
+    CHECK(writeSplit<Handler>(mappingPath, patch.data(), patch.size(), offset));
+    data.insert(data.end(), patch.begin(), patch.end());
+    CHECK(writeSplit<Handler>(mappingPath, patch.data(), patch.size(), data.size() - patch.size()));
+    CHECK(isIndex(mappingPath));
+    CHECK(readsBack<Handler>(mappingPath, data));
+    getStorageContext().mappingIndexThreshold = 0;
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("MappingIndexTest");
+    std::mt19937 rng(40);
+
+    // Below the threshold the mapping stays text
+    std::vector<char> text(2 << 20);
+    for (size_t i = 0; i < text.size(); ++i) {
+        text[i] = static_cast<char>('a' + i % 26);
+    }
+    getStorageContext().mappingIndexThreshold = 1 << 30;
+    CHECK(writeSplit<TextFileHandler>(root + "/small.txt.mapping", text.data(), text.size()));
+    CHECK(!isIndex(root + "/small.txt.mapping"));
+
+    // A text file has an extent every few bytes, a padded BMP two per row
+    checkIndexed<TextFileHandler>(root + "/a.txt.mapping", text, rng);
+    checkIndexed<BmpFileHandler>(root + "/b.bmp.mapping", syntheticBmp(1001, 700, rng), rng);
+
+    // An index without extents
+    std::string empty = buildMappingIndex(FileMap(), "");
+    CHECK(isMappingIndex(empty.data(), empty.size()));
+    std::string emptyPath = root + "/empty.mapping";
+    saveFile(emptyPath, std::vector<char>(empty.begin(), empty.end()));
+    int fd = open(emptyPath.c_str(), O_RDONLY);
+    MappingIndexReader index;
+    FileMap loaded;
+    CHECK(fd >= 0 && index.open(fd) && index.extentCount() == 0 && index.loadRange(0, 100, loaded) && loaded.empty());
+    close(fd);
+    return testResult("MappingIndexTest");
+}
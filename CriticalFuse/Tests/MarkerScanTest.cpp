@@ -0,0 +1,105 @@
+// Round trips of JPEG marker scanning: every scanner the CPU can run finds the same markers as
+// the scalar one at every length and alignment, and a JPEG with restart intervals splits and
+// reads back, its restart markers too once the .noncrit stream holding them is lost.
+//
+// Usage: ./MarkerScanTest
+// The split streams are written under /tmp/MarkerScanTest.
+
+#include "FileHandlers/JpegFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/MarkerScan.h"
+#include "Utilities/StorageContext.h"
+
+#include <algorithm>
+
+namespace {
+
+// Dense 0xFF/0x00 input, where the vector scanners' block boundaries matter
+void crossCheck(const std::vector<MarkerScanImpl>& scanners, std::mt19937& rng) {
+    const char alphabet[] = {'\xFF', '\x00', '\xD0', '\x12'};
+    std::vector<char> data(300);
+    for (int round = 0; round < 2000; ++round) {
+        for (char& byte : data) {
+            byte = alphabet[rng() % 4];
+        }
+        size_t start = rng() % 8;
+        for (size_t size = 0; size + start <= data.size(); ++size) {
+            size_t expected = scanners[0].scan(data.data() + start, size);
+            for (const MarkerScanImpl& scanner : scanners) {
+                if (scanner.scan(data.data() + start, size) != expected) {
+                    std::cerr << scanner.name << " disagrees with " << scanners[0].name << " at size " << size
+                              << std::endl;
+                    CHECK(false);
+                    return;
+                }
+            }
+        }
+    }
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("MarkerScanTest");
+    std::mt19937 rng(34);
+    std::vector<MarkerScanImpl> scanners = availableMarkerScanners();
+    CHECK(!scanners.empty());
+    crossCheck(scanners, rng);
+
+    // A stuffed 0xFF00 is data, a 0xFF in the last byte is returned as a possible marker
+    const char stuffed[] = {'\x12', '\xFF', '\x00', '\x34', '\xFF', '\xD0'};
+    const char trailing[] = {'\x12', '\x34', '\xFF'};
+    for (const MarkerScanImpl& scanner : scanners) {
+        CHECK(scanner.scan(stuffed, sizeof(stuffed)) == 4);
+        CHECK(scanner.scan(stuffed, 3) == 3);
+        CHECK(scanner.scan(trailing, sizeof(trailing)) == 2);
+    }
+
+    std::vector<char> jpeg = syntheticJpeg(1 << 20, rng);
+    std::vector<uint64_t> markers;
+    for (size_t i = 12; i + 3 < jpeg.size(); ++i) {
+        if (jpeg[i] == '\xFF' && (static_cast<uint8_t>(jpeg[i + 1]) & 0xF8) == 0xD0) {
+            markers.push_back(i);
+        }
+    }
+    CHECK(markers.size() == 256);
+    std::string mappingPath = root + "/a.jpg.mapping";
+    CHECK(writeSplit<JpegFileHandler>(mappingPath, jpeg.data(), jpeg.size()));
+    // The whole file and reads that start and end on markers and inside segments
+    CHECK(readsBack<JpegFileHandler>(mappingPath, jpeg));
+    for (int i = 0; i < 200; ++i) {
+        size_t offset = rng() % jpeg.size();
+        size_t size = 1 + rng() % std::min<size_t>(20000, jpeg.size() - offset);
+        if (i % 2 == 0) {
+            offset = markers[rng() % markers.size()];
+            size = std::min(size, jpeg.size() - offset);
+        }
+        std::vector<char> data;
+        CHECK(readSplit<JpegFileHandler>(mappingPath, data, size, offset) &&
+              std::equal(data.begin(), data.end(), jpeg.begin() + offset));
+    }
+
+    // The markers are in the scan's .noncrit extent; with it lost, degraded reads still return
+    // each of them, rewritten from the restart index, among the lost bytes
+    saveFile(root + "/a.jpg.noncrit", {});
+    getStorageContext().noncritBudgetUs = 100000;
+    for (int i = 0; i < 50; ++i) {
+        size_t offset = i == 0 ? 0 : markers[rng() % markers.size()] + rng() % 3 - 1;
+        size_t size = i == 0 ? jpeg.size() : 1 + rng() % std::min<size_t>(20000, jpeg.size() - offset);
+        std::vector<char> data;
+        CHECK(readSplit<JpegFileHandler>(mappingPath, data, size, offset, true));
+        size_t restored = 0;
+        for (uint64_t marker : markers) {
+            for (uint64_t pos : {marker, marker + 1}) {
+                if (pos >= offset && pos < offset + data.size()) {
+                    restored += data[pos - offset] == jpeg[pos];
+                    CHECK(data[pos - offset] == jpeg[pos]);
+                }
+            }
+        }
+        CHECK(restored > 0 || size < 4096);
+        CHECK(i > 0 || data != jpeg);
+    }
+    getStorageContext().noncritBudgetUs = 0;
+    return testResult("MarkerScanTest");
+}
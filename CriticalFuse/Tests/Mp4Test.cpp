@@ -0,0 +1,106 @@
+// Round trips of fragmented MP4s: box headers, moov and every moof go to .crit and the sample
+// data and free space to .noncrit, for boxes with 32-bit sizes, a 64-bit size and a last box
+// of size 0 running to the end of the file, whether the file is written whole or in FUSE-sized
+// pieces. A box whose size is smaller than its header keeps the rest of the file critical.
+//
+// Usage: ./Mp4Test
+// The split streams are written under /tmp/Mp4Test.
+
+#include "FileHandlers/Mp4File.h"
+#include "Tests/TestSupport.h"
+
+#include <algorithm>
+
+namespace {
+
+const size_t WRITE_SIZE = 128 * 1024; // FUSE's default max_write
+
+// A box of the given type and payload size drawn from rng; largeSize writes its size in the
+// 64-bit field, toEnd writes size 0. Returns the number of header bytes.
+size_t putBox(std::vector<char>& data, const char* type, size_t payloadSize, std::mt19937& rng,
+              bool largeSize = false, bool toEnd = false) {
+    size_t headerSize = largeSize ? 16 : 8;
+    uint64_t boxSize = headerSize + payloadSize;
+    putBigEndian(data, toEnd ? 0 : largeSize ? 1 : static_cast<uint32_t>(boxSize));
+    data.insert(data.end(), type, type + 4);
+    if (largeSize) {
+        putBigEndian(data, static_cast<uint32_t>(boxSize >> 32));
+        putBigEndian(data, static_cast<uint32_t>(boxSize));
+    }
+    for (size_t i = 0; i < payloadSize; ++i) {
+        data.push_back(static_cast<char>(rng()));
+    }
+    return headerSize;
+}
+
+size_t criticalBytes(const std::vector<char>& data) {
+    Mp4FileHandler handler;
+    CHECK(handler.createMapping(data.data(), data.size()) == ResultCode::SUCCESS);
+    size_t critical = 0;
+    for (const auto& [range, mapped] : handler.getFileMap()) {
+        if (mapped.second == CriticalType::CRITICAL_DATA) {
+            critical += range.getEnd() - range.getStart() + 1;
+        }
+    }
+    return critical;
+}
+
+// Splits the file whole and in pieces, checks the streams and reads it back
+void checkSplit(const std::string& basePath, const std::vector<char>& mp4, size_t critical, std::mt19937& rng) {
+    CHECK(criticalBytes(mp4) == critical);
+
+    std::string whole = basePath + ".whole";
+    CHECK(writeSplit<Mp4FileHandler>(whole + ".mapping", mp4.data(), mp4.size()));
+    CHECK(loadFile(whole + ".crit").size() == critical);
+    CHECK(loadFile(whole + ".noncrit").size() == mp4.size() - critical);
+    CHECK(readsBack<Mp4FileHandler>(whole + ".mapping", mp4));
+
+    // A fresh handler each, box headers split across writes are picked up from the streams
+    std::string pieces = basePath + ".pieces";
+    for (size_t offset = 0; offset < mp4.size(); offset += WRITE_SIZE) {
+        size_t size = std::min(WRITE_SIZE, mp4.size() - offset);
+        CHECK(writeSplit<Mp4FileHandler>(pieces + ".mapping", mp4.data() + offset, size, offset));
+    }
+    CHECK(loadFile(pieces + ".crit") == loadFile(whole + ".crit"));
+    CHECK(loadFile(pieces + ".noncrit") == loadFile(whole + ".noncrit"));
+    CHECK(readsBack<Mp4FileHandler>(pieces + ".mapping", mp4));
+
+    for (int i = 0; i < 50; ++i) {
+        size_t offset = rng() % mp4.size();
+        size_t size = 1 + rng() % std::min<size_t>(3 * WRITE_SIZE, mp4.size() - offset);
+        std::vector<char> data;
+        CHECK(readSplit<Mp4FileHandler>(pieces + ".mapping", data, size, offset) &&
+              std::equal(data.begin(), data.end(), mp4.begin() + offset));
+    }
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("Mp4Test");
+    std::mt19937 rng(43);
+
+    // ftyp and moov, a first fragment's mdat with a 64-bit size, free space, and a second
+    // fragment whose mdat runs to the end of the file
+    std::vector<char> mp4;
+    size_t critical = 0;
+    critical += putBox(mp4, "ftyp", 16, rng) + 16;
+    critical += putBox(mp4, "moov", 3000, rng) + 3000;
+    critical += putBox(mp4, "mdat", 300000, rng, true);
+    critical += putBox(mp4, "free", 1000, rng);
+    critical += putBox(mp4, "moof", 500, rng) + 500;
+    critical += putBox(mp4, "mdat", 200000, rng, false, true);
+    checkSplit(root + "/fragmented.mp4", mp4, critical, rng);
+
+    // Past a box that claims fewer bytes than its own header nothing can be told apart
+    std::vector<char> broken;
+    critical = putBox(broken, "ftyp", 16, rng) + 16;
+    critical += putBox(broken, "mdat", 100000, rng);
+    size_t brokenAt = broken.size();
+    putBox(broken, "moov", 2000, rng);
+    std::fill(broken.begin() + brokenAt, broken.begin() + brokenAt + 3, 0);
+    broken[brokenAt + 3] = 4;
+    critical += broken.size() - brokenAt;
+    checkSplit(root + "/broken.mp4", broken, critical, rng);
+    return testResult("Mp4Test");
+}
@@ -0,0 +1,92 @@
+// Round trips of compressed .noncrit streams, with each codec the build has: a BMP whose pixel
+// data compresses reads back whole and by random small reads through the block index, and
+// writes inside a block, across blocks and past the end recompress only what they cover, also
+// after the mount's codec changed.
+//
+// Usage: ./NoncritCompressTest
+// Needs lz4 or zstd; the split streams are written under /tmp/NoncritCompressTest.
+
+#include "FileHandlers/BmpFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/BlockCompressor.h"
+#include "Utilities/Metrics.h"
+#include "Utilities/StorageContext.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+void checkRandomReads(const std::string& mappingPath, const std::vector<char>& bmp, std::mt19937& rng) {
+    for (int i = 0; i < 300; ++i) {
+        size_t offset = rng() % bmp.size();
+        size_t size = 1 + rng() % std::min<size_t>(i % 10 == 0 ? 200000 : 4096, bmp.size() - offset);
+        std::vector<char> data;
+        CHECK(readSplit<BmpFileHandler>(mappingPath, data, size, offset) &&
+              std::equal(data.begin(), data.end(), bmp.begin() + offset));
+    }
+}
+
+// Overwrites bytes of bmp through the split file and checks that it reads back
+void checkWrite(const std::string& mappingPath, std::vector<char>& bmp, size_t offset, size_t size, std::mt19937& rng) {
+    std::vector<char> patch(size);
+    for (char& byte : patch) {
+        byte = static_cast<char>(rng());
+    }
+    if (offset + size > bmp.size()) {
+        bmp.resize(offset + size);
+    }
+    std::memcpy(&bmp[offset], patch.data(), size);
+    CHECK(writeSplit<BmpFileHandler>(mappingPath, patch.data(), size, offset));
+    CHECK(readsBack<BmpFileHandler>(mappingPath, bmp));
+}
+
+void checkCodec(const std::string& basePath, NoncritCodec codec, std::mt19937& rng) {
+    getStorageContext().noncritCodec = codec;
+    std::vector<char> bmp = syntheticBmp(2048, 400, rng);
+    std::string mappingPath = basePath + ".mapping";
+    CHECK(writeSplit<BmpFileHandler>(mappingPath, bmp.data(), bmp.size()));
+    CHECK(loadFile(basePath + ".noncrit").size() < bmp.size() * 3 / 4);
+    CHECK(readsBack<BmpFileHandler>(mappingPath, bmp));
+
+    // A small read decompresses only the blocks it overlaps
+    uint64_t decompressed = getMetrics().decompressedBlocks;
+    std::vector<char> data;
+    CHECK(readSplit<BmpFileHandler>(mappingPath, data, 100, 3 * BlockCompressor::BLOCK_SIZE + 1000));
+    CHECK(getMetrics().decompressedBlocks - decompressed == 1);
+    checkRandomReads(mappingPath, bmp, rng);
+
+    const size_t block = BlockCompressor::BLOCK_SIZE;
+    checkWrite(mappingPath, bmp, 2 * block + 100, 10, rng);          // inside one block
+    checkWrite(mappingPath, bmp, 4 * block - 500, 1000, rng);        // across a boundary
+    checkWrite(mappingPath, bmp, 6 * block + 54, 2 * block, rng);    // whole blocks
+    checkWrite(mappingPath, bmp, bmp.size() - 300, 100000, rng);     // the last block and past the end
+    checkRandomReads(mappingPath, bmp, rng);
+
+    // The codec is recorded per file: once the mount's changes, writes keep the file's
+    getStorageContext().noncritCodec = NoncritCodec::NONE;
+    CHECK(readsBack<BmpFileHandler>(mappingPath, bmp));
+    checkWrite(mappingPath, bmp, 5 * block + 7, 3000, rng);
+    CHECK(loadFile(basePath + ".noncrit").size() < bmp.size() * 3 / 4);
+    checkRandomReads(mappingPath, bmp, rng);
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("NoncritCompressTest");
+    std::mt19937 rng(50);
+    bool any = false;
+    for (auto [name, codec] : {std::pair<const char*, NoncritCodec>{"lz4", NoncritCodec::LZ4},
+                               {"zstd", NoncritCodec::ZSTD}}) {
+        if (BlockCompressor::supported(codec)) {
+            checkCodec(root + "/" + name + ".bmp", codec, rng);
+            any = true;
+        }
+    }
+    if (!any) {
+        std::cout << "NoncritCompressTest: skipped, built without lz4 and zstd" << std::endl;
+        return 0;
+    }
+    return testResult("NoncritCompressTest");
+}
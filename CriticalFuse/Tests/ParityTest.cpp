@@ -0,0 +1,186 @@
+// Round trips of .crit streams with a .parity sidecar: every GF(2^8) kernel encodes the same
+// parity and decodes lost shards back, and a split file whose critical blocks are corrupted,
+// zeroed or cut off reads back as long as each stripe lost no more blocks than it has parity,
+// including after writes that changed the stripes and after a replay of the intent log.
+//
+// Usage: ./ParityTest
+// The split streams are written under /tmp/ParityTest.
+
+#include "FileHandlers/PngFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/BlockChecksums.h"
+#include "Utilities/IntentLog.h"
+#include "Utilities/Metrics.h"
+#include "Utilities/ReedSolomon.h"
+#include "Utilities/StorageContext.h"
+#include "Utilities/StreamParity.h"
+
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <unistd.h>
+
+namespace {
+
+const size_t SHARD_SIZE = 4096;
+
+// Encodes random stripes with every kernel, then erases up to parityShards shards and rebuilds them
+void checkCode(unsigned dataShards, unsigned parityShards, std::mt19937& rng) {
+    unsigned total = dataShards + parityShards;
+    std::vector<uint8_t> bytes(total * SHARD_SIZE);
+    for (size_t i = 0; i < dataShards * SHARD_SIZE; ++i) {
+        bytes[i] = static_cast<uint8_t>(rng());
+    }
+    std::vector<uint8_t*> shards(total);
+    for (unsigned j = 0; j < total; ++j) {
+        shards[j] = &bytes[j * SHARD_SIZE];
+    }
+
+    std::vector<uint8_t> encoded;
+    for (const GfMulAddImpl& implementation : availableGfMulAdd()) {
+        ReedSolomon code(dataShards, parityShards, implementation.compute);
+        code.encode(shards.data(), shards.data() + dataShards, SHARD_SIZE);
+        if (encoded.empty()) {
+            encoded = bytes;
+        }
+        CHECK(bytes == encoded);
+
+        for (int round = 0; round < 20; ++round) {
+            std::vector<unsigned> erased;
+            while (erased.size() < parityShards) {
+                unsigned index = rng() % total;
+                if (std::find(erased.begin(), erased.end(), index) == erased.end()) {
+                    erased.push_back(index);
+                }
+            }
+            for (unsigned index : erased) {
+                if (index < dataShards) {
+                    std::memset(shards[index], 0, SHARD_SIZE);
+                }
+            }
+            CHECK(code.reconstruct(shards.data(), erased, SHARD_SIZE));
+            CHECK(std::equal(bytes.begin(), bytes.begin() + dataShards * SHARD_SIZE, encoded.begin()));
+        }
+        std::vector<unsigned> tooMany;
+        for (unsigned j = 0; j <= parityShards && j < dataShards; ++j) {
+            tooMany.push_back(j);
+        }
+        if (tooMany.size() > parityShards) {
+            CHECK(!code.reconstruct(shards.data(), tooMany, SHARD_SIZE));
+        }
+        bytes = encoded;
+    }
+}
+
+void damage(std::vector<char>& stream, size_t block, bool zero) {
+    size_t start = block * BlockChecksums::BLOCK_SIZE;
+    for (size_t i = start; i < std::min(stream.size(), start + BlockChecksums::BLOCK_SIZE); ++i) {
+        stream[i] = zero ? 0 : stream[i] ^ 0x5a;
+    }
+}
+
+// Damages the given .crit blocks (and parity blocks, numbered from the header) and reads the file
+bool readsDamaged(const std::string& basePath, const std::vector<char>& png, const std::vector<char>& crit,
+                  std::vector<size_t> blocks, std::vector<size_t> parityBlocks = {}) {
+    std::vector<char> damaged = crit;
+    for (size_t block : blocks) {
+        damage(damaged, block, block % 2 == 0);
+    }
+    saveFile(basePath + ".crit", damaged);
+    std::vector<char> parity = loadFile(basePath + ".parity");
+    std::vector<char> original = parity;
+    for (size_t block : parityBlocks) {
+        size_t start = StreamParity::HEADER_SIZE + block * BlockChecksums::BLOCK_SIZE;
+        for (size_t i = start; i < start + BlockChecksums::BLOCK_SIZE; ++i) {
+            parity[i] ^= 0x5a;
+        }
+    }
+    saveFile(basePath + ".parity", parity);
+    bool readBack = readsBack<PngFileHandler>(basePath + ".mapping", png);
+    saveFile(basePath + ".crit", crit);
+    saveFile(basePath + ".parity", original);
+    return readBack;
+}
+
+std::unique_ptr<IntentLog> openLog(const std::string& path) {
+    auto log = std::make_unique<IntentLog>(
+        path,
+        [](const IntentLog::Intent& update) {
+            return AbstractFileHandler::persistStreams(update) == ResultCode::SUCCESS;
+        },
+        [](const std::string& basePath) {
+            return AbstractFileHandler::syncStreams(basePath) == ResultCode::SUCCESS;
+        });
+    CHECK(log->open());
+    return log;
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("ParityTest");
+    std::mt19937 rng(46);
+    checkCode(8, 2, rng);
+    checkCode(4, 4, rng);
+    checkCode(10, 1, rng);
+
+    // 20 critical blocks in stripes of 8 data and 2 parity blocks
+    getStorageContext().parityStripe = 8;
+    getStorageContext().parityShards = 2;
+    const size_t block = BlockChecksums::BLOCK_SIZE;
+    std::vector<char> png = syntheticPng(300000, 20 * block - 100, 8192, rng);
+    std::string basePath = root + "/a.png";
+    CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", png.data(), png.size()));
+    CHECK(access((basePath + ".parity").c_str(), F_OK) == 0);
+    std::vector<char> crit = loadFile(basePath + ".crit");
+    CHECK(crit.size() > 16 * block);
+
+    uint64_t recovered = getMetrics().recoveredBlocks;
+    CHECK(readsDamaged(basePath, png, crit, {3}));                // a zeroed block
+    CHECK(readsDamaged(basePath, png, crit, {1, 6}));             // two in one stripe
+    CHECK(readsDamaged(basePath, png, crit, {0, 9, 17}));         // one in each stripe
+    CHECK(readsDamaged(basePath, png, crit, {5}, {0}));           // a data and a parity block of a stripe
+    CHECK(getMetrics().recoveredBlocks >= recovered + 7);
+    errno = 0;
+    CHECK(!readsDamaged(basePath, png, crit, {1, 2, 6}) && errno == EIO); // more than the stripe's parity
+
+    // The last, partial block cut off the stream
+    saveFile(basePath + ".crit", std::vector<char>(crit.begin(), crit.begin() + crit.size() / block * block));
+    CHECK(readsBack<PngFileHandler>(basePath + ".mapping", png));
+    saveFile(basePath + ".crit", crit);
+
+    // Writes update the parity of the stripes they change
+    std::vector<char> patch(2 * block, 'p');
+    size_t offset = 9 * block + 100;
+    std::memcpy(&png[offset], patch.data(), patch.size());
+    CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", patch.data(), patch.size(), offset));
+    crit = loadFile(basePath + ".crit");
+    CHECK(readsDamaged(basePath, png, crit, {9, 10}));
+
+    // Replaying a log left by a crash, with parity configured as the mount sets it before the
+    // log opens, rebuilds the sidecar instead of dropping it
+    std::string logPath = root + "/.intent.log";
+    std::unique_ptr<IntentLog> log = openLog(logPath);
+    getStorageContext().intentLog = log.get();
+    std::string logged = root + "/b.png";
+    CHECK(writeSplit<PngFileHandler>(logged + ".mapping", png.data(), png.size()));
+    std::memcpy(&png[offset], "replayed", 8);
+    CHECK(writeSplit<PngFileHandler>(logged + ".mapping", "replayed", 8, offset));
+    getStorageContext().intentLog = nullptr;
+    unlink((logged + ".parity").c_str());
+    std::unique_ptr<IntentLog> replayed = openLog(logPath);
+    CHECK(access((logged + ".parity").c_str(), F_OK) == 0);
+    crit = loadFile(logged + ".crit");
+    CHECK(readsDamaged(logged, png, crit, {9, 10}));
+    replayed.reset();
+    CHECK(log->checkpoint());
+    log.reset();
+
+    // Without parity shards a rewrite drops the sidecar
+    getStorageContext().parityShards = 0;
+    unlink((basePath + ".mapping").c_str());
+    CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", png.data(), png.size()));
+    CHECK(access((basePath + ".parity").c_str(), F_OK) != 0);
+    CHECK(readsBack<PngFileHandler>(basePath + ".mapping", png));
+    return testResult("ParityTest");
+}
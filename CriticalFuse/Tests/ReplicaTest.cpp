@@ -0,0 +1,84 @@
+// Round trips of replicated .crit streams: mirrors copy what changed and set the length,
+// replicas follow renames and removals, a read the primary cannot answer is served by a
+// replica, and a split file keeps reading back through its replica when its primary .crit is
+// cut short, but not when the replica is damaged as well.
+//
+// Usage: ./ReplicaTest
+// The primary streams are written under /tmp/ReplicaTest, the replicas under its replica/.
+
+#include "FileHandlers/PngFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/Metrics.h"
+#include "Utilities/ReplicaSet.h"
+#include "Utilities/StorageContext.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+int main() {
+    std::string root = scratchDirectory("ReplicaTest");
+    std::string replicaRoot = root + "/replica";
+    std::mt19937 rng(47);
+    ReplicaSet replicas(root, {replicaRoot}, 95, std::chrono::microseconds(1000));
+    CHECK(replicas.open() && replicas.count() == 1);
+    CHECK(replicas.deadline() == std::chrono::microseconds(1000));
+
+    // The whole primary, then only the changed range and the new length
+    std::string path = root + "/a.crit";
+    std::vector<char> data(100000);
+    for (char& byte : data) {
+        byte = static_cast<char>(rng());
+    }
+    saveFile(path, data);
+    int fd = open(path.c_str(), O_RDWR);
+    CHECK(fd >= 0 && replicas.mirror(fd, path, 0, data.size(), data.size()));
+    CHECK(loadFile(replicaRoot + "/a.crit") == data);
+    std::memset(&data[5000], 'm', 100);
+    CHECK(pwrite(fd, &data[5000], 100, 5000) == 100);
+    data.resize(90000);
+    CHECK(ftruncate(fd, data.size()) == 0);
+    CHECK(replicas.mirror(fd, path, 5000, 5100, data.size()));
+    CHECK(loadFile(replicaRoot + "/a.crit") == data);
+
+    // Past the end of the primary the replica has to answer; it has the bytes once mirrored
+    std::vector<char> buffer(4096);
+    uint64_t wins = getMetrics().hedgeWins;
+    CHECK(ftruncate(fd, 50000) == 0);
+    CHECK(replicas.read(fd, path, buffer.data(), buffer.size(), 80000) &&
+          std::equal(buffer.begin(), buffer.end(), data.begin() + 80000));
+    CHECK(getMetrics().hedgeWins > wins);
+    CHECK(!replicas.read(fd, path, buffer.data(), buffer.size(), 95000));
+    close(fd);
+
+    // Replicas follow their primaries
+    replicas.rename(path, root + "/b.crit");
+    CHECK(access((replicaRoot + "/a.crit").c_str(), F_OK) != 0 && loadFile(replicaRoot + "/b.crit") == data);
+    replicas.remove(root + "/b.crit");
+    CHECK(access((replicaRoot + "/b.crit").c_str(), F_OK) != 0);
+
+    // A split file mirrors its .crit on writes, whole and in place
+    getStorageContext().replicas = &replicas;
+    std::vector<char> png = syntheticPng(300000, 5 * 4096, 8192, rng);
+    std::string basePath = root + "/c.png";
+    CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", png.data(), png.size()));
+    std::vector<char> patch(3000, 'p');
+    std::memcpy(&png[6000], patch.data(), patch.size());
+    CHECK(writeSplit<PngFileHandler>(basePath + ".mapping", patch.data(), patch.size(), 6000));
+    std::vector<char> crit = loadFile(basePath + ".crit");
+    CHECK(loadFile(replicaRoot + "/c.png.crit") == crit);
+
+    // With its primary .crit cut short the file reads back from the replica, which checksums
+    // catch once it is damaged too
+    saveFile(basePath + ".crit", std::vector<char>(crit.begin(), crit.begin() + crit.size() / 2));
+    CHECK(readsBack<PngFileHandler>(basePath + ".mapping", png));
+    std::vector<char> damaged = crit;
+    damaged[crit.size() * 3 / 4] ^= 0x01;
+    saveFile(replicaRoot + "/c.png.crit", damaged);
+    std::vector<char> read;
+    errno = 0;
+    CHECK(!readSplit<PngFileHandler>(basePath + ".mapping", read, png.size()) && errno == EIO);
+    getStorageContext().replicas = nullptr;
+    return testResult("ReplicaTest");
+}
@@ -0,0 +1,98 @@
+// Round trips of reads served from the per-thread request arena: a handler made in a request
+// scope reads the same bytes as one on the heap without allocating once the thread's arena
+// exists, a request too large for the arena overflows to the heap and still reads back, and
+// nested scopes and concurrent threads keep their memory apart.
+//
+// Usage: ./RequestArenaTest
+// The split streams are written under /tmp/RequestArenaTest.
+
+#include "FileHandlers/JpegFile.h"
+#include "FileHandlers/TextFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/Metrics.h"
+#include "Utilities/RequestArena.h"
+
+#include <algorithm>
+#include <thread>
+
+namespace {
+
+const size_t READ_SIZE = 128 * 1024; // FUSE's default max_read
+
+// Reads size bytes at offset through a handler made in a request scope, as CriticalFUSE does,
+// and returns the heap allocations the read made
+template <typename Handler>
+uint64_t scopedRead(const std::string& mappingPath, const std::vector<char>& expected, size_t size, size_t offset) {
+    std::vector<char> buffer(size);
+    uint64_t before = threadAllocationCount();
+    ResultCode result;
+    {
+        RequestScope scope;
+        result = makeRequestObject<Handler>()->readFile(mappingPath.c_str(), buffer.data(), size, offset);
+    }
+    uint64_t allocations = threadAllocationCount() - before;
+    CHECK(result == ResultCode::SUCCESS && std::equal(buffer.begin(), buffer.end(), expected.begin() + offset));
+    return allocations;
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("RequestArenaTest");
+    std::mt19937 rng(38);
+
+    // Outside a scope request memory is the heap; nested scopes share the outermost one's arena
+    CHECK(requestResource() == std::pmr::get_default_resource());
+    {
+        RequestScope outer;
+        std::pmr::memory_resource* arena = requestResource();
+        CHECK(arena != std::pmr::get_default_resource());
+        {
+            RequestScope inner;
+            CHECK(requestResource() == arena);
+        }
+        CHECK(requestResource() == arena);
+    }
+    CHECK(requestResource() == std::pmr::get_default_resource());
+
+    // After the first request has created the thread's arena, reads allocate nothing
+    std::vector<char> jpeg = syntheticJpeg(4 << 20, rng);
+    std::string jpegPath = root + "/a.jpg.mapping";
+    CHECK(writeSplit<JpegFileHandler>(jpegPath, jpeg.data(), jpeg.size()));
+    scopedRead<JpegFileHandler>(jpegPath, jpeg, READ_SIZE, 0);
+    uint64_t allocations = 0;
+    for (int i = 0; i < 100; ++i) {
+        size_t offset = rng() % (jpeg.size() - READ_SIZE);
+        allocations += scopedRead<JpegFileHandler>(jpegPath, jpeg, READ_SIZE, offset);
+    }
+    CHECK(allocations == 0);
+    CHECK(readsBack<JpegFileHandler>(jpegPath, jpeg));
+
+    // A text mapping of an extent every few bytes does not fit in the arena
+    std::vector<char> text(1 << 20);
+    for (size_t i = 0; i < text.size(); ++i) {
+        text[i] = static_cast<char>('a' + i % 26);
+    }
+    std::string textPath = root + "/b.txt.mapping";
+    CHECK(writeSplit<TextFileHandler>(textPath, text.data(), text.size()));
+    uint64_t overflowBefore = getMetrics().arenaOverflowBytes;
+    CHECK(scopedRead<TextFileHandler>(textPath, text, READ_SIZE, text.size() / 2) > 0);
+    CHECK(getMetrics().arenaOverflowBytes > overflowBefore);
+    // The next request starts from an empty arena again
+    CHECK(scopedRead<JpegFileHandler>(jpegPath, jpeg, READ_SIZE, 4096) == 0);
+
+    // Each thread reads through its own arena
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < 4; ++t) {
+        threads.emplace_back([&jpegPath, &jpeg, t]() {
+            std::mt19937 offsets(t);
+            for (int i = 0; i < 200; ++i) {
+                scopedRead<JpegFileHandler>(jpegPath, jpeg, 1 + offsets() % READ_SIZE, offsets() % (jpeg.size() / 2));
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    return testResult("RequestArenaTest");
+}
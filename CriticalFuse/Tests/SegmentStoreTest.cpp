@@ -0,0 +1,54 @@
+// Round trips of small files packed into segments: overwritten files read back their last
+// contents after compaction and after the store is reopened, and files in the segment
+// directory that are not segments are skipped instead of failing the mount.
+//
+// Usage: ./SegmentStoreTest
+// The store is created under /tmp/SegmentStoreTest.
+
+#include "FileHandlers/TextFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/SegmentStore.h"
+#include "Utilities/StorageContext.h"
+
+#include <unistd.h>
+
+namespace {
+
+std::vector<char> contents(int version) {
+    std::string text = "packed file, version " + std::to_string(version) + "\n";
+    return std::vector<char>(text.begin(), text.end());
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("SegmentStoreTest");
+    std::string mappingPath = root + "/a.txt.mapping";
+    std::vector<char> last;
+    {
+        // Tiny segments, so the overwrites leave several of them mostly dead
+        SegmentStore store(root, 100, 256);
+        CHECK(store.open());
+        getStorageContext().segmentStore = &store;
+        for (int version = 0; version < 20; ++version) {
+            last = contents(version);
+            CHECK(writeSplit<TextFileHandler>(mappingPath, last.data(), last.size()));
+        }
+        CHECK(access((root + "/a.txt.crit").c_str(), F_OK) != 0); // packed, not split into files
+        CHECK(store.compact() > 0);
+        CHECK(readsBack<TextFileHandler>(mappingPath, last));
+        getStorageContext().segmentStore = nullptr;
+    }
+
+    // A stray file next to the segments must not stop the store from opening
+    saveFile(root + "/.segments/seg-backup", last);
+    SegmentStore reopened(root, 100, 256);
+    CHECK(reopened.open());
+    getStorageContext().segmentStore = &reopened;
+    CHECK(readsBack<TextFileHandler>(mappingPath, last));
+
+    reopened.rename(root + "/a.txt", root + "/b.txt");
+    CHECK(reopened.contains(root + "/b.txt") && !reopened.contains(root + "/a.txt"));
+    getStorageContext().segmentStore = nullptr;
+    return testResult("SegmentStoreTest");
+}
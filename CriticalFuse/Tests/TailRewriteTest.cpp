@@ -0,0 +1,126 @@
+// Round trips of writes that change the type of chunks near the end of a PNG, which the tail
+// rewrite appends to the streams: bytes that become critical or non-critical are appended to
+// the last block of a sealed .crit or compressed .noncrit stream while the old content is
+// still read through that block. A file grown by fallocate keeps its new zero bytes as holes,
+// without ever holding them in memory.
+//
+// Usage: ./TailRewriteTest
+// The split streams are written under /tmp/TailRewriteTest.
+
+#include "FileHandlers/BmpFile.h"
+#include "FileHandlers/PngFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/BlockCipher.h"
+#include "Utilities/BlockCompressor.h"
+#include "Utilities/ReplicaSet.h"
+#include "Utilities/StorageContext.h"
+
+#include <cstring>
+#include <utility>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+namespace {
+
+// A PNG of the given chunks after the signature; starts receives the offset of each chunk
+std::vector<char> pngOf(const std::vector<std::pair<const char*, size_t>>& chunks, std::vector<size_t>& starts,
+                        std::mt19937& rng) {
+    std::vector<char> data = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    for (const auto& [type, length] : chunks) {
+        starts.push_back(data.size());
+        putPngChunk(data, type, length, rng);
+    }
+    return data;
+}
+
+// Renames the chunks at first and second in a single write spanning both type fields, and
+// checks the file before and after
+void checkRetype(const std::string& mappingPath, std::vector<char> png, size_t first, const char* firstType,
+                 size_t second, const char* secondType) {
+    CHECK(writeSplit<PngFileHandler>(mappingPath, png.data(), png.size()));
+    CHECK(readsBack<PngFileHandler>(mappingPath, png));
+    std::memcpy(&png[first + 4], firstType, 4);
+    std::memcpy(&png[second + 4], secondType, 4);
+    CHECK(writeSplit<PngFileHandler>(mappingPath, &png[first + 4], second - first + 4, first + 4));
+    CHECK(readsBack<PngFileHandler>(mappingPath, png));
+}
+
+long maxResidentKb() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+off_t fileSize(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// Grows a BMP by 64 MiB of allocated zeros past its pixel data
+void checkAllocation(const std::string& basePath, std::mt19937& rng) {
+    std::vector<char> bmp = syntheticBmp(200, 200, rng);
+    std::string mappingPath = basePath + ".mapping";
+    CHECK(writeSplit<BmpFileHandler>(mappingPath, bmp.data(), bmp.size()));
+    const size_t growth = 64 * 1024 * 1024;
+    long residentBefore = maxResidentKb();
+    BmpFileHandler handler;
+    CHECK(handler.allocateFile(mappingPath.c_str(), bmp.size(), growth, false) == ResultCode::SUCCESS);
+    CHECK(maxResidentKb() - residentBefore < static_cast<long>(growth / 1024 / 2));
+    CHECK(fileSize(basePath + ".crit") + fileSize(basePath + ".noncrit") < static_cast<off_t>(2 * bmp.size()));
+    bmp.resize(bmp.size() + growth, 0);
+    CHECK(readsBack<BmpFileHandler>(mappingPath, bmp));
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("TailRewriteTest");
+    std::mt19937 rng(49);
+
+    // The last IDAT turns into a palette, appended to .crit and resealing its last block, then
+    // the palette after it into text, read from that block. The replica gets the resealed block.
+    if (BlockCipher::supported()) {
+        MountKey key;
+        for (unsigned char& byte : key.bytes) {
+            byte = static_cast<unsigned char>(rng());
+        }
+        getStorageContext().critKey = &key;
+        ReplicaSet replicas(root, {root + "/replica"}, 95, std::chrono::microseconds(1000));
+        CHECK(replicas.open());
+        getStorageContext().replicas = &replicas;
+        std::vector<size_t> starts;
+        std::vector<char> png = pngOf({{"IHDR", 13}, {"IDAT", 4000}, {"IDAT", 4000}, {"IDAT", 4000},
+                                       {"PLTE", 1000}, {"IEND", 0}}, starts, rng);
+        checkRetype(root + "/sealed.png.mapping", png, starts[3], "PLTE", starts[4], "tEXt");
+        CHECK(loadFile(root + "/replica/sealed.png.crit") == loadFile(root + "/sealed.png.crit"));
+        getStorageContext().replicas = nullptr;
+        getStorageContext().critKey = nullptr;
+    } else {
+        std::cout << "TailRewriteTest: sealed streams skipped, built without libcrypto" << std::endl;
+    }
+
+    // The palette turns into text, appended to .noncrit and recompressing its last block, then
+    // the IDAT after it into a palette, read from that block
+    NoncritCodec codec = BlockCompressor::supported(NoncritCodec::LZ4)    ? NoncritCodec::LZ4
+                         : BlockCompressor::supported(NoncritCodec::ZSTD) ? NoncritCodec::ZSTD
+                                                                          : NoncritCodec::NONE;
+    if (codec != NoncritCodec::NONE) {
+        getStorageContext().noncritCodec = codec;
+        std::vector<size_t> starts;
+        std::vector<char> png = pngOf({{"IHDR", 13}, {"IDAT", 4000}, {"IDAT", 4000}, {"PLTE", 1000},
+                                       {"IDAT", 3000}, {"IEND", 0}}, starts, rng);
+        checkRetype(root + "/compressed.png.mapping", png, starts[3], "tEXt", starts[4], "PLTE");
+        getStorageContext().noncritCodec = NoncritCodec::NONE;
+    } else {
+        std::cout << "TailRewriteTest: compressed streams skipped, built without lz4 and zstd" << std::endl;
+    }
+
+    // Plain streams take the same write
+    std::vector<size_t> starts;
+    std::vector<char> png = pngOf({{"IHDR", 13}, {"IDAT", 4000}, {"PLTE", 1000}, {"IDAT", 3000}, {"IEND", 0}},
+                                  starts, rng);
+    checkRetype(root + "/plain.png.mapping", png, starts[2], "tEXt", starts[3], "PLTE");
+
+    checkAllocation(root + "/allocated.bmp", rng);
+    return testResult("TailRewriteTest");
+}
@@ -0,0 +1,96 @@
+// Round trips of split files whose mappings share a template: two BMPs of one size store their
+// extents once and refer to them by id, read back in a later process that has to load the
+// template from the store, and a template of the same id with other contents is never used.
+//
+// Usage: ./TemplateTest
+// The split streams and templates are written under /tmp/TemplateTest.
+
+#include "FileHandlers/BmpFile.h"
+#include "Tests/TestSupport.h"
+#include "Utilities/StorageContext.h"
+#include "Utilities/TemplateStore.h"
+
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+std::vector<std::string> templateNames(const std::string& root) {
+    std::vector<std::string> names;
+    DIR* dir = opendir((root + "/.templates").c_str());
+    if (dir) {
+        while (struct dirent* entry = readdir(dir)) {
+            if (entry->d_name[0] != '.') {
+                names.push_back(entry->d_name);
+            }
+        }
+        closedir(dir);
+    }
+    return names;
+}
+
+std::string firstLine(const std::string& path) {
+    std::vector<char> contents = loadFile(path);
+    std::string text(contents.begin(), contents.end());
+    return text.substr(0, text.find('\n'));
+}
+
+} // namespace
+
+int main() {
+    std::string root = scratchDirectory("TemplateTest");
+    std::mt19937 rng(41);
+    std::vector<char> first = syntheticBmp(300, 200, rng);
+    std::vector<char> second = syntheticBmp(300, 200, rng);
+    std::string a = root + "/a.bmp";
+    std::string b = root + "/b.bmp";
+
+    // Written by a child, so this process starts without any template parsed, as after a remount
+    pid_t writer = fork();
+    if (writer == 0) {
+        TemplateStore store(root);
+        CHECK(store.open());
+        getStorageContext().templateStore = &store;
+        CHECK(writeSplit<BmpFileHandler>(a + ".mapping", first.data(), first.size()));
+        CHECK(writeSplit<BmpFileHandler>(b + ".mapping", second.data(), second.size()));
+        CHECK(readsBack<BmpFileHandler>(a + ".mapping", first));
+        _exit(testFailures() > 0 ? 1 : 0);
+    }
+    int status = 0;
+    CHECK(writer > 0 && waitpid(writer, &status, 0) == writer && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // Both mappings refer to the one template the layout was stored in
+    std::vector<std::string> names = templateNames(root);
+    CHECK(names.size() == 1);
+    if (names.size() != 1) {
+        return testResult("TemplateTest");
+    }
+    CHECK(firstLine(a + ".mapping") == "&" + names[0]);
+    CHECK(firstLine(b + ".mapping") == "&" + names[0]);
+    std::vector<char> shared = loadFile(root + "/.templates/" + names[0]);
+    CHECK(TemplateStore::templateId(std::string_view(shared.data(), shared.size())) ==
+          std::stoull(names[0], nullptr, 16));
+
+    // Without the store the template cannot be found
+    CHECK(!readsBack<BmpFileHandler>(b + ".mapping", second));
+    TemplateStore store(root);
+    CHECK(store.open());
+    getStorageContext().templateStore = &store;
+    CHECK(readsBack<BmpFileHandler>(a + ".mapping", first));
+    CHECK(readsBack<BmpFileHandler>(b + ".mapping", second));
+
+    // Another list already stored under the layout's id is refused, the extents stay inline
+    std::string other = root + "/other";
+    CHECK(std::system(("mkdir -p " + other + "/.templates").c_str()) == 0);
+    saveFile(other + "/.templates/" + names[0], {'0', '-', '0', ' ', '0', '-', '0', ' ', 'H', '\n'});
+    TemplateStore colliding(other);
+    CHECK(colliding.open());
+    getStorageContext().templateStore = &colliding;
+    std::string c = other + "/c.bmp";
+    CHECK(writeSplit<BmpFileHandler>(c + ".mapping", first.data(), first.size()));
+    CHECK(firstLine(c + ".mapping")[0] != '&');
+    CHECK(readsBack<BmpFileHandler>(c + ".mapping", first));
+    getStorageContext().templateStore = nullptr;
+    return testResult("TemplateTest");
+}
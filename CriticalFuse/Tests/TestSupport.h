@@ -0,0 +1,235 @@
+#ifndef TEST_SUPPORT_H
+#define TEST_SUPPORT_H
+
+#include "FileHandlers/AbstractFile.h"
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * Shared scaffolding of the round-trip tests in Tests/: scratch directories, reads and
+ * writes of split files through a fresh handler and synthetic files to split, which the
+ * benchmarks in Benchmarks/ split too. Each test is its own executable that exits
+ * with 1 after any failed CHECK, so `make test` stops at the first failing feature.
+ */
+
+inline int& testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+// Records a failed condition with its location and keeps going, so one run reports them all
+#define CHECK(condition)                                                                       \
+    do {                                                                                       \
+        if (!(condition)) {                                                                    \
+            std::cerr << __FILE__ << ':' << __LINE__ << ": CHECK failed: " #condition << std::endl; \
+            testFailures()++;                                                                  \
+        }                                                                                      \
+    } while (0)
+
+/**
+ * @brief Prints the verdict of a test executable and returns its exit status.
+ */
+inline int testResult(const char* name) {
+    if (testFailures() > 0) {
+        std::cout << name << ": " << testFailures() << " checks failed" << std::endl;
+        return 1;
+    }
+    std::cout << name << ": passed" << std::endl;
+    return 0;
+}
+
+/**
+ * @brief Creates an empty directory for a test's split files, removing what a previous run left.
+ */
+inline std::string scratchDirectory(const std::string& name) {
+    std::string path = "/tmp/" + name;
+    if (std::system(("rm -rf " + path + " && mkdir -p " + path).c_str()) != 0) {
+        std::cerr << "Failed to create " << path << std::endl;
+        std::exit(1);
+    }
+    return path;
+}
+
+inline std::vector<char> loadFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+inline void saveFile(const std::string& path, const std::vector<char>& data) {
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(data.data(), data.size());
+}
+
+/**
+ * @brief Reads size bytes at offset of a split file through a fresh handler, as a FUSE request does.
+ *
+ * @return false if the read fails
+ */
+template <typename Handler>
+bool readSplit(const std::string& mappingPath, std::vector<char>& out, size_t size, off_t offset = 0,
+               bool degradable = false) {
+    out.assign(size, 0x5a);
+    Handler handler;
+    return handler.readFile(mappingPath.c_str(), out.data(), size, offset, degradable) == ResultCode::SUCCESS;
+}
+
+template <typename Handler>
+bool writeSplit(const std::string& mappingPath, const char* data, size_t size, off_t offset = 0) {
+    Handler handler;
+    return handler.writeFile(mappingPath.c_str(), data, size, offset) == ResultCode::SUCCESS;
+}
+
+// Whether the whole split file reads back as expected
+template <typename Handler>
+bool readsBack(const std::string& mappingPath, const std::vector<char>& expected) {
+    std::vector<char> data;
+    return readSplit<Handler>(mappingPath, data, expected.size()) && data == expected;
+}
+
+inline void putBigEndian(std::vector<char>& data, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        data.push_back(static_cast<char>(value >> shift));
+    }
+}
+
+inline void putLittleEndian(std::vector<char>& data, size_t offset, uint32_t value, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        data[offset + i] = static_cast<char>(value >> (8 * i));
+    }
+}
+
+/**
+ * @brief Appends a PNG chunk of length bytes drawn from rng, with a placeholder CRC the
+ * handler does not check.
+ */
+inline void putPngChunk(std::vector<char>& data, const char* type, size_t length, std::mt19937& rng) {
+    putBigEndian(data, static_cast<uint32_t>(length));
+    data.insert(data.end(), type, type + 4);
+    for (size_t i = 0; i < length; ++i) {
+        data.push_back(static_cast<char>(rng()));
+    }
+    putBigEndian(data, 0x55555555);
+}
+
+/**
+ * @brief A PNG whose critical bytes are its signature, IHDR, a PLTE of paletteSize bytes
+ * and the chunk headers, followed by IDAT chunks of idatSize bytes, its .noncrit stream,
+ * until it is at least size bytes long.
+ */
+inline std::vector<char> syntheticPng(size_t size, size_t paletteSize, size_t idatSize, std::mt19937& rng) {
+    std::vector<char> data = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+    putPngChunk(data, "IHDR", 13, rng);
+    putPngChunk(data, "PLTE", paletteSize, rng);
+    while (data.size() < size) {
+        putPngChunk(data, "IDAT", idatSize, rng);
+    }
+    putPngChunk(data, "IEND", 0, rng);
+    return data;
+}
+
+/**
+ * @brief SOI, an SOS segment and scanSize bytes of entropy-coded data drawn from rng, with
+ * stuffed 0xFF bytes and a restart marker every 4 KiB, like a large baseline JPEG with restart
+ * intervals, and EOI.
+ */
+inline std::vector<char> syntheticJpeg(size_t scanSize, std::mt19937& rng) {
+    std::vector<char> data = {'\xFF', '\xD8', '\xFF', '\xDA', 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3F, 0x00};
+    int restart = 0;
+    for (size_t i = 0; i < scanSize; ++i) {
+        char byte = static_cast<char>(rng());
+        data.push_back(byte);
+        if (byte == '\xFF') {
+            data.push_back(0x00);
+        }
+        if (i % 4096 == 4095) {
+            data.push_back('\xFF');
+            data.push_back(static_cast<char>(0xD0 + (restart++ & 7)));
+        }
+    }
+    data.push_back('\xFF');
+    data.push_back('\xD9');
+    return data;
+}
+
+/**
+ * @brief A 24-bit BMP of width x height pixels. Its pixel data, the .noncrit stream, is a
+ * gradient with a little noise, compressible about as well as a photograph's smooth regions.
+ */
+inline std::vector<char> syntheticBmp(size_t width, size_t height, std::mt19937& rng) {
+    const size_t headersSize = 54;
+    size_t rowSize = (width * 3 + 3) / 4 * 4;
+    std::vector<char> data(headersSize + rowSize * height);
+    data[0] = 'B';
+    data[1] = 'M';
+    putLittleEndian(data, 2, data.size(), 4);
+    putLittleEndian(data, 10, headersSize, 4);
+    putLittleEndian(data, 14, 40, 4);
+    putLittleEndian(data, 18, width, 4);
+    putLittleEndian(data, 22, height, 4);
+    putLittleEndian(data, 26, 1, 2);
+    putLittleEndian(data, 28, 24, 2);
+    putLittleEndian(data, 34, rowSize * height, 4);
+    for (size_t y = 0; y < height; ++y) {
+        char* row = &data[headersSize + y * rowSize];
+        for (size_t x = 0; x < width * 3; ++x) {
+            row[x] = static_cast<char>((x / 3 + y) / 4 + (rng() % 4 == 0));
+        }
+    }
+    return data;
+}
+
+/**
+ * @brief A little-endian DNG laid out like a camera's: tiles raw tiles of tileSize bytes in a
+ * SubIFD, a preview strip of previewSize bytes in IFD0 and a JPEG thumbnail of thumbnailSize
+ * bytes in IFD1. The header, IFDs and tile tables, its critical bytes, fill the first 4 KiB and
+ * the tables after them; the image data, drawn from rng, follows.
+ */
+inline std::vector<char> syntheticDng(size_t tiles, size_t tileSize, size_t previewSize, size_t thumbnailSize,
+                                      std::mt19937& rng) {
+    const size_t tablesOffset = 4096;
+    size_t tileData = tablesOffset + tiles * 8;
+    size_t preview = tileData + tiles * tileSize;
+    size_t thumbnail = preview + previewSize;
+    std::vector<char> data(thumbnail + thumbnailSize);
+    for (size_t i = tileData; i < data.size(); ++i) {
+        data[i] = static_cast<char>(rng());
+    }
+
+    // Entries of LONG values: tag, count, value or offset of the values
+    auto putIfd = [&data](size_t offset, const std::vector<std::array<uint32_t, 3>>& entries, uint32_t next) {
+        putLittleEndian(data, offset, entries.size(), 2);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            size_t entry = offset + 2 + i * 12;
+            putLittleEndian(data, entry, entries[i][0], 2);
+            putLittleEndian(data, entry + 2, 4, 2); // LONG
+            putLittleEndian(data, entry + 4, entries[i][1], 4);
+            putLittleEndian(data, entry + 8, entries[i][2], 4);
+        }
+        putLittleEndian(data, offset + 2 + entries.size() * 12, next, 4);
+    };
+    data[0] = 'I';
+    data[1] = 'I';
+    putLittleEndian(data, 2, 42, 2);
+    putLittleEndian(data, 4, 8, 4);
+    for (size_t i = 0; i < tiles; ++i) {
+        putLittleEndian(data, tablesOffset + i * 4, tileData + i * tileSize, 4);
+        putLittleEndian(data, tablesOffset + tiles * 4 + i * 4, tileSize, 4);
+    }
+    uint32_t count = static_cast<uint32_t>(tiles);
+    putIfd(8, {{0x0111, 1, static_cast<uint32_t>(preview)}, {0x0117, 1, static_cast<uint32_t>(previewSize)},
+               {0x014A, 1, 512}}, 1024);
+    putIfd(512, {{0x0144, count, tablesOffset}, {0x0145, count, static_cast<uint32_t>(tablesOffset + tiles * 4)}}, 0);
+    putIfd(1024, {{0x0201, 1, static_cast<uint32_t>(thumbnail)}, {0x0202, 1, static_cast<uint32_t>(thumbnailSize)}},
+           0);
+    return data;
+}
+
+#endif // TEST_SUPPORT_H
@@ -0,0 +1,221 @@
+#include "BlockChecksums.h"
+#include "Crc32c.h"
+#include "RequestArena.h"
+
+#include <algorithm>
+#include <charconv>
+#include <iostream>
+
+namespace {
+
+const std::string_view TAG = "CRC32C ";
+
+// Blocks read back from the stream file at a time when recomputing checksums
+const size_t UPDATE_READ_BLOCKS = 64;
+
+bool parseHex(const char* digits, uint32_t& value) {
+    value = 0;
+    for (int i = 0; i < 8; ++i) {
+        char c = digits[i];
+        uint32_t nibble;
+        if (c >= '0' && c <= '9') {
+            nibble = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            nibble = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            nibble = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        value = (value << 4) | nibble;
+    }
+    return true;
+}
+
+} // namespace
+
+BlockChecksums::BlockChecksums(std::pmr::memory_resource* resource)
+    : checksums(resource ? resource : requestResource()),
+      digits(resource ? resource : requestResource()) {}
+
+void BlockChecksums::clear() {
+    checksums.clear();
+    digits.clear();
+    length = 0;
+    block = BLOCK_SIZE;
+    isRecorded = false;
+}
+
+void BlockChecksums::begin() {
+    clear();
+    isRecorded = true;
+}
+
+void BlockChecksums::append(const char* data, size_t size) {
+    decode();
+    while (size > 0) {
+        // The checksum of a partial last block is continued by the next bytes
+        size_t used = length % block;
+        if (used == 0) {
+            checksums.push_back(0);
+        }
+        size_t taken = std::min(size, block - used);
+        checksums.back() = crc32c(checksums.back(), data, taken);
+        length += taken;
+        data += taken;
+        size -= taken;
+    }
+}
+
+void BlockChecksums::append(const std::vector<struct iovec>& pieces) {
+    for (const struct iovec& piece : pieces) {
+        append(static_cast<const char*>(piece.iov_base), piece.iov_len);
+    }
+}
+
+bool BlockChecksums::update(const StreamFile& file, uint64_t from, uint64_t to, uint64_t newLength) {
+    if (!isRecorded) {
+        from = 0;
+        to = newLength;
+    } else if (newLength != length) {
+        from = std::min(from, length);
+        to = newLength;
+    }
+    to = std::min(to, newLength);
+    decode();
+    isRecorded = true;
+    length = newLength;
+    checksums.resize((length + block - 1) / block);
+
+    // Whole blocks, the last one ending at the end of the stream
+    uint64_t start = from / block * block;
+    uint64_t stop = std::min<uint64_t>((to + block - 1) / block * block, length);
+    std::vector<char> buffer(std::min<uint64_t>(UPDATE_READ_BLOCKS * block, std::max(stop, start) - start));
+    while (start < stop) {
+        size_t size = static_cast<size_t>(std::min<uint64_t>(buffer.size(), stop - start));
+        if (!file.read(buffer.data(), size, start)) {
+            return false;
+        }
+        for (size_t offset = 0; offset < size; offset += block) {
+            checksums[(start + offset) / block] = crc32c(0, buffer.data() + offset, std::min(block, size - offset));
+        }
+        start += size;
+    }
+    return true;
+}
+
+bool BlockChecksums::check(const StreamFile& file, uint64_t from, uint64_t to) const {
+    to = std::min(to, length);
+    if (!isRecorded || from >= to) {
+        return true;
+    }
+    uint64_t start = from / block * block;
+    uint64_t stop = std::min<uint64_t>((to + block - 1) / block * block, length);
+    std::vector<char> buffer(std::min<uint64_t>(UPDATE_READ_BLOCKS * block, stop - start));
+    while (start < stop) {
+        size_t size = static_cast<size_t>(std::min<uint64_t>(buffer.size(), stop - start));
+        if (!file.read(buffer.data(), size, start) || !verify(start, buffer.data(), size)) {
+            return false;
+        }
+        start += size;
+    }
+    return true;
+}
+
+bool BlockChecksums::verify(uint64_t offset, const char* data, size_t size) const {
+    for (size_t done = 0; done < size; done += block) {
+        uint32_t checksum;
+        if (!recordedChecksum((offset + done) / block, checksum) ||
+            crc32c(0, data + done, std::min(block, size - done)) != checksum) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool BlockChecksums::recordedChecksum(uint64_t index, uint32_t& checksum) const {
+    if (digits.empty()) {
+        if (index >= checksums.size()) {
+            return false;
+        }
+        checksum = checksums[index];
+        return true;
+    }
+    return index < digits.size() / 8 && parseHex(digits.data() + index * 8, checksum);
+}
+
+void BlockChecksums::decode() {
+    if (digits.empty()) {
+        return;
+    }
+    // A malformed checksum decodes to one its block will almost surely not match
+    checksums.resize(digits.size() / 8);
+    for (size_t i = 0; i < checksums.size(); ++i) {
+        if (!parseHex(digits.data() + i * 8, checksums[i])) {
+            checksums[i] = 0xffffffff;
+        }
+    }
+    digits.clear();
+}
+
+bool BlockChecksums::recorded() const {
+    return isRecorded;
+}
+
+uint64_t BlockChecksums::streamLength() const {
+    return length;
+}
+
+size_t BlockChecksums::blockSize() const {
+    return block;
+}
+
+std::string BlockChecksums::serialize() const {
+    if (!isRecorded || length == 0) {
+        return "";
+    }
+    std::string line = "@" + std::string(TAG) + std::to_string(block) + ' ' + std::to_string(length) + ' ';
+    if (!digits.empty()) {
+        return line + std::string(digits.data(), digits.size()) + '\n';
+    }
+    size_t written = line.size();
+    line.resize(written + checksums.size() * 8 + 1);
+    for (uint32_t checksum : checksums) {
+        snprintf(&line[written], 9, "%08x", checksum);
+        written += 8;
+    }
+    line.back() = '\n';
+    return line;
+}
+
+bool BlockChecksums::load(std::string_view line, bool& handled) {
+    handled = line.substr(0, TAG.size()) == TAG;
+    if (!handled) {
+        return true;
+    }
+
+    const char* pos = line.data() + TAG.size();
+    const char* end = line.data() + line.size();
+    uint64_t blockSize = 0;
+    uint64_t streamLength = 0;
+    std::from_chars_result result = std::from_chars(pos, end, blockSize);
+    if (result.ec != std::errc() || result.ptr == end || *result.ptr != ' ' || blockSize == 0 || blockSize > (1u << 24)) {
+        return false;
+    }
+    result = std::from_chars(result.ptr + 1, end, streamLength);
+    if (result.ec != std::errc() || result.ptr == end || *result.ptr != ' ') {
+        return false;
+    }
+    pos = result.ptr + 1;
+    uint64_t count = (streamLength + blockSize - 1) / blockSize;
+    if (static_cast<uint64_t>(end - pos) != count * 8) {
+        return false;
+    }
+
+    clear();
+    digits.assign(pos, end);
+    block = blockSize;
+    length = streamLength;
+    isRecorded = true;
+    return true;
+}
@@ -0,0 +1,111 @@
+#ifndef BLOCK_CHECKSUMS_H
+#define BLOCK_CHECKSUMS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/uio.h>    // For struct iovec
+
+#include "StreamFile.h"
+
+/**
+ * CRC32C of every fixed-size block of a stream file, kept in the file's mapping as one
+ * "@CRC32C <block size> <stream length> <checksums>" line, the checksums 8 hex digits each.
+ *
+ * The length is recorded with the checksums, so bytes a crashed update appended past the end
+ * of the stream do not make its last block fail verification. Mappings written before
+ * checksums existed have none recorded; their streams are read unverified.
+ *
+ * A mapping is loaded for every request, and most requests verify a few blocks of a large
+ * stream, so loaded checksums stay as their hex digits until a block is verified or the
+ * checksums are changed; a malformed digit then fails verification of its block.
+ */
+class BlockChecksums {
+public:
+    static const size_t BLOCK_SIZE = 4096;
+
+    /**
+     * @param resource memory for the checksums, the current request arena by default
+     */
+    explicit BlockChecksums(std::pmr::memory_resource* resource = nullptr);
+
+    /**
+     * @brief Forgets the checksums: the stream is not verified.
+     */
+    void clear();
+
+    /**
+     * @brief Starts checksumming a stream from its first byte, with append.
+     */
+    void begin();
+
+    /**
+     * @brief Checksums the next size bytes of the stream.
+     */
+    void append(const char* data, size_t size);
+
+    /**
+     * @brief Checksums the next bytes of the stream, gathered from pieces.
+     */
+    void append(const std::vector<struct iovec>& pieces);
+
+    /**
+     * @brief Recomputes the checksums of the blocks overlapping [from, to) from the stream
+     * file after it was changed in place or grew to length. Blocks past the old length are
+     * always recomputed, and all of them if no checksums were recorded.
+     *
+     * @param file the stream file
+     * @return true if successful, false if the stream could not be read
+     */
+    bool update(const StreamFile& file, uint64_t from, uint64_t to, uint64_t length);
+
+    /**
+     * @brief Verifies the blocks overlapping [from, to) in the stream file, before a write
+     * changes part of them: update would otherwise take corrupted bytes around the write
+     * for good ones. Passes if nothing is recorded.
+     *
+     * @param file the stream file
+     * @return true if the blocks match, false if they do not or cannot be read
+     */
+    bool check(const StreamFile& file, uint64_t from, uint64_t to) const;
+
+    /**
+     * @brief Whether data, the stream bytes from offset, matches the checksums. offset must be
+     * at a block boundary and data must end at one or at the end of the stream.
+     */
+    bool verify(uint64_t offset, const char* data, size_t size) const;
+
+    bool recorded() const;        // whether the stream has checksums to verify against
+    uint64_t streamLength() const; // length of the checksummed stream
+    size_t blockSize() const;
+
+    /**
+     * @brief The mapping line, "" if nothing is recorded or the stream is empty.
+     */
+    std::string serialize() const;
+
+    /**
+     * @brief Parses a mapping line without its leading '@', replacing the checksums.
+     *
+     * @param handled set if the line is a checksum line
+     * @return false if it is one but malformed
+     */
+    bool load(std::string_view line, bool& handled);
+
+private:
+    std::pmr::vector<uint32_t> checksums;
+    std::pmr::string digits; // loaded checksums not decoded into checksums yet
+
+    // Checksum of block index, false if its digits are malformed
+    bool recordedChecksum(uint64_t index, uint32_t& checksum) const;
+    // Decodes loaded digits before the checksums are changed or written out
+    void decode();
+    uint64_t length = 0;
+    size_t block = BLOCK_SIZE;
+    bool isRecorded = false;
+};
+
+#endif // BLOCK_CHECKSUMS_H
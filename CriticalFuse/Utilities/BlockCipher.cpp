@@ -0,0 +1,410 @@
+#include "BlockCipher.h"
+#include "StorageContext.h"
+#include "RequestArena.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+
+#ifdef CRITICALFS_HAVE_OPENSSL
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#endif
+
+namespace {
+
+const std::string_view TAG = "AES256GCM ";
+
+// HKDF info of the per-file keys, so the mount key could derive other keys later
+constexpr std::string_view KEY_INFO = "CriticalFuse .crit";
+
+const size_t SEAL_SIZE = BlockCipher::NONCE_SIZE + BlockCipher::TAG_SIZE;
+
+int hexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+bool parseHex(const char* digits, size_t size, unsigned char* bytes) {
+    for (size_t i = 0; i < size; ++i) {
+        int high = hexValue(digits[2 * i]);
+        int low = hexValue(digits[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        bytes[i] = static_cast<unsigned char>(high << 4 | low);
+    }
+    return true;
+}
+
+void appendHex(std::string& out, const void* data, size_t size) {
+    static const char DIGITS[] = "0123456789abcdef";
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; ++i) {
+        out += DIGITS[bytes[i] >> 4];
+        out += DIGITS[bytes[i] & 0xf];
+    }
+}
+
+#ifdef CRITICALFS_HAVE_OPENSSL
+
+struct ContextDeleter {
+    void operator()(EVP_CIPHER_CTX* ctx) const {
+        EVP_CIPHER_CTX_free(ctx);
+    }
+};
+
+// One context per thread, keyed again by every call: reads of several files run on each worker
+EVP_CIPHER_CTX* threadContext() {
+    thread_local std::unique_ptr<EVP_CIPHER_CTX, ContextDeleter> ctx(EVP_CIPHER_CTX_new());
+    return ctx.get();
+}
+
+// Fetched once, EVP_aes_256_gcm() would look up the implementation on every init
+const EVP_CIPHER* aes256gcm() {
+    static EVP_CIPHER* cipher = EVP_CIPHER_fetch(nullptr, "AES-256-GCM", nullptr);
+    return cipher;
+}
+
+#endif // CRITICALFS_HAVE_OPENSSL
+
+} // namespace
+
+bool MountKey::load(const char* path) {
+    std::ifstream in(path, std::ios::binary);
+    std::string contents((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    if (!in.is_open()) {
+        std::perror(("Failed to read key file " + std::string(path)).c_str());
+        return false;
+    }
+    if (contents.size() == SIZE) {
+        std::memcpy(bytes, contents.data(), SIZE);
+        return true;
+    }
+    while (!contents.empty() && (contents.back() == '\n' || contents.back() == '\r')) {
+        contents.pop_back();
+    }
+    if (contents.size() == 2 * SIZE && parseHex(contents.data(), SIZE, bytes)) {
+        return true;
+    }
+    std::cerr << "Key file " << path << " must hold " << SIZE << " bytes or " << 2 * SIZE << " hex digits"
+              << std::endl;
+    return false;
+}
+
+BlockCipher::BlockCipher(std::pmr::memory_resource* resource)
+    : seals(resource ? resource : requestResource()),
+      digits(resource ? resource : requestResource()),
+      pending(resource ? resource : requestResource()) {}
+
+bool BlockCipher::supported() {
+#ifdef CRITICALFS_HAVE_OPENSSL
+    return true;
+#else
+    return false;
+#endif
+}
+
+void BlockCipher::clear() {
+    seals.clear();
+    digits.clear();
+    pending.clear();
+    block = BLOCK_SIZE;
+    isRecorded = false;
+    isKeyed = false;
+}
+
+bool BlockCipher::begin() {
+    clear();
+#ifdef CRITICALFS_HAVE_OPENSSL
+    if (RAND_bytes(salt, SALT_SIZE) != 1) {
+        std::cerr << "Failed to draw a salt for the .crit key" << std::endl;
+        return false;
+    }
+    if (!deriveKey()) {
+        return false;
+    }
+    isRecorded = true;
+    return true;
+#else
+    std::cerr << "Built without libcrypto, .crit streams cannot be encrypted" << std::endl;
+    return false;
+#endif
+}
+
+bool BlockCipher::deriveKey() {
+    const MountKey* mountKey = getStorageContext().critKey;
+    if (!mountKey) {
+        return false;
+    }
+#ifdef CRITICALFS_HAVE_OPENSSL
+    // HKDF-SHA256 (RFC 5869) with a single block of output: extract, then expand
+    unsigned char prk[32];
+    unsigned int length = 0;
+    unsigned char info[KEY_INFO.size() + 1];
+    std::memcpy(info, KEY_INFO.data(), KEY_INFO.size());
+    info[KEY_INFO.size()] = 1;
+    isKeyed = HMAC(EVP_sha256(), salt, SALT_SIZE, mountKey->bytes, MountKey::SIZE, prk, &length) &&
+              HMAC(EVP_sha256(), prk, sizeof(prk), info, sizeof(info), key, &length);
+    if (!isKeyed) {
+        std::cerr << "Failed to derive the .crit key" << std::endl;
+    }
+    return isKeyed;
+#else
+    return false;
+#endif
+}
+
+bool BlockCipher::seal(const std::vector<struct iovec>& pieces, std::vector<char>& out) {
+    for (const struct iovec& piece : pieces) {
+        const char* data = static_cast<const char*>(piece.iov_base);
+        size_t size = piece.iov_len;
+
+        // The partial block left by earlier pieces is completed first
+        if (!pending.empty()) {
+            size_t taken = std::min(size, block - pending.size());
+            pending.append(data, taken);
+            data += taken;
+            size -= taken;
+            if (pending.size() < block) {
+                continue;
+            }
+            size_t at = out.size();
+            out.resize(at + block);
+            if (!sealBlocks(pending.data(), block, out.data() + at, seals.size() / SEAL_SIZE)) {
+                return false;
+            }
+            pending.clear();
+        }
+
+        size_t whole = size / block * block;
+        if (whole > 0) {
+            size_t at = out.size();
+            out.resize(at + whole);
+            if (!sealBlocks(data, whole, out.data() + at, seals.size() / SEAL_SIZE)) {
+                return false;
+            }
+        }
+        pending.assign(data + whole, size - whole);
+    }
+    return true;
+}
+
+bool BlockCipher::finish(std::vector<char>& out) {
+    if (pending.empty()) {
+        return true;
+    }
+    size_t at = out.size();
+    out.resize(at + pending.size());
+    bool ok = sealBlocks(pending.data(), pending.size(), out.data() + at, seals.size() / SEAL_SIZE);
+    pending.clear();
+    return ok;
+}
+
+bool BlockCipher::write(StreamFile& file, uint64_t offset, const char* data, size_t size, uint64_t length) {
+    if (size == 0) {
+        return true;
+    }
+    if (!decode()) {
+        std::cerr << "Malformed .crit seals" << std::endl;
+        return false;
+    }
+
+    // Whole blocks from the one holding the first byte written, or the end of the stream if
+    // the write starts past it, to the one holding the last byte written
+    uint64_t end = offset + size;
+    uint64_t newLength = std::max(length, end);
+    uint64_t first = std::min(offset, length) / block * block;
+    uint64_t last = std::min<uint64_t>((end + block - 1) / block * block, newLength);
+    std::vector<char> buffer(last - first, 0);
+
+    // Bytes of the first and last block the write does not cover stay as they were. The two
+    // are one block if the write stays within it, which is then only opened once.
+    uint64_t edges[2] = {first, (end - 1) / block * block};
+    bool opened = false;
+    for (int edge = 0; edge < 2; ++edge) {
+        uint64_t start = edges[edge];
+        uint64_t stop = std::min(start + block, length);
+        bool kept = edge == 0 ? start < std::min(offset, stop) : end < stop;
+        if (!kept || (edge == 1 && start == edges[0] && opened)) {
+            continue;
+        }
+        opened = true;
+        char* target = buffer.data() + (start - first);
+        if (!file.read(target, stop - start, start) || !open(start, target, stop - start)) {
+            std::cerr << "Failed to open .crit block at stream offset " << start << " for a write" << std::endl;
+            return false;
+        }
+    }
+    std::memcpy(buffer.data() + (offset - first), data, size);
+
+    if (!sealBlocks(buffer.data(), buffer.size(), buffer.data(), first / block)) {
+        return false;
+    }
+    return file.write(buffer.data(), buffer.size(), first);
+}
+
+bool BlockCipher::sealBlocks(const char* data, size_t size, char* out, uint64_t index) {
+#ifdef CRITICALFS_HAVE_OPENSSL
+    EVP_CIPHER_CTX* ctx = threadContext();
+    if (!isKeyed || !ctx || EVP_EncryptInit_ex(ctx, aes256gcm(), nullptr, key, nullptr) != 1) {
+        std::cerr << "Failed to set up .crit encryption" << std::endl;
+        return false;
+    }
+    uint64_t blocks = (size + block - 1) / block;
+    if (seals.size() < (index + blocks) * SEAL_SIZE) {
+        seals.resize((index + blocks) * SEAL_SIZE);
+    }
+    // The nonces of the whole run are drawn at once, the generator costs more per call than per byte
+    std::vector<unsigned char> nonces(blocks * NONCE_SIZE);
+    if (RAND_bytes(nonces.data(), static_cast<int>(nonces.size())) != 1) {
+        std::cerr << "Failed to draw nonces for .crit blocks" << std::endl;
+        return false;
+    }
+    for (size_t done = 0; done < size; done += block, ++index) {
+        int length = static_cast<int>(std::min(block, size - done));
+        auto* seal = reinterpret_cast<unsigned char*>(&seals[index * SEAL_SIZE]);
+        std::memcpy(seal, nonces.data() + done / block * NONCE_SIZE, NONCE_SIZE);
+        auto* bytes = reinterpret_cast<unsigned char*>(out + done);
+        int written = 0;
+        if (EVP_EncryptInit_ex(ctx, nullptr, nullptr, nullptr, seal) != 1 ||
+            EVP_EncryptUpdate(ctx, bytes, &written, reinterpret_cast<const unsigned char*>(data + done), length) != 1 ||
+            EVP_EncryptFinal_ex(ctx, bytes + written, &written) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, TAG_SIZE, seal + NONCE_SIZE) != 1) {
+            std::cerr << "Failed to encrypt .crit block" << std::endl;
+            return false;
+        }
+    }
+    return true;
+#else
+    (void) data; (void) size; (void) out; (void) index;
+    return false;
+#endif
+}
+
+bool BlockCipher::open(uint64_t offset, char* data, size_t size) const {
+#ifdef CRITICALFS_HAVE_OPENSSL
+    EVP_CIPHER_CTX* ctx = threadContext();
+    if (!isKeyed || offset % block != 0 || !ctx ||
+        EVP_DecryptInit_ex(ctx, aes256gcm(), nullptr, key, nullptr) != 1) {
+        return false;
+    }
+    for (size_t done = 0; done < size; done += block) {
+        int length = static_cast<int>(std::min(block, size - done));
+        unsigned char seal[SEAL_SIZE];
+        if (!recordedSeal((offset + done) / block, seal)) {
+            return false;
+        }
+        auto* bytes = reinterpret_cast<unsigned char*>(data + done);
+        int written = 0;
+        if (EVP_DecryptInit_ex(ctx, nullptr, nullptr, nullptr, seal) != 1 ||
+            EVP_DecryptUpdate(ctx, bytes, &written, bytes, length) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, TAG_SIZE, seal + NONCE_SIZE) != 1 ||
+            EVP_DecryptFinal_ex(ctx, bytes + written, &written) != 1) {
+            return false;
+        }
+    }
+    return true;
+#else
+    (void) offset; (void) data; (void) size;
+    return false;
+#endif
+}
+
+bool BlockCipher::recordedSeal(uint64_t index, unsigned char* seal) const {
+    if (digits.empty()) {
+        if (index >= seals.size() / SEAL_SIZE) {
+            return false;
+        }
+        std::memcpy(seal, seals.data() + index * SEAL_SIZE, SEAL_SIZE);
+        return true;
+    }
+    return index < digits.size() / (2 * SEAL_SIZE) && parseHex(digits.data() + index * 2 * SEAL_SIZE, SEAL_SIZE, seal);
+}
+
+bool BlockCipher::decode() {
+    if (digits.empty()) {
+        return true;
+    }
+    seals.resize(digits.size() / 2);
+    bool ok = parseHex(digits.data(), seals.size(), reinterpret_cast<unsigned char*>(seals.data()));
+    digits.clear();
+    return ok;
+}
+
+bool BlockCipher::recorded() const {
+    return isRecorded;
+}
+
+bool BlockCipher::keyed() const {
+    return isKeyed;
+}
+
+size_t BlockCipher::blockSize() const {
+    return block;
+}
+
+std::string BlockCipher::serialize() const {
+    if (!isRecorded || (seals.empty() && digits.empty())) {
+        return "";
+    }
+    std::string line = "@" + std::string(TAG) + std::to_string(block) + ' ';
+    appendHex(line, salt, SALT_SIZE);
+    line += ' ';
+    if (!digits.empty()) {
+        line.append(digits.data(), digits.size());
+    } else {
+        line.reserve(line.size() + 2 * seals.size() + 1);
+        appendHex(line, seals.data(), seals.size());
+    }
+    line += '\n';
+    return line;
+}
+
+bool BlockCipher::load(std::string_view line, bool& handled) {
+    handled = line.substr(0, TAG.size()) == TAG;
+    if (!handled) {
+        return true;
+    }
+
+    const char* pos = line.data() + TAG.size();
+    const char* end = line.data() + line.size();
+    uint64_t blockSize = 0;
+    std::from_chars_result result = std::from_chars(pos, end, blockSize);
+    if (result.ec != std::errc() || result.ptr == end || *result.ptr != ' ' || blockSize == 0 || blockSize > (1u << 24)) {
+        return false;
+    }
+    pos = result.ptr + 1;
+    if (static_cast<size_t>(end - pos) < 2 * SALT_SIZE + 1 || pos[2 * SALT_SIZE] != ' ') {
+        return false;
+    }
+    clear();
+    if (!parseHex(pos, SALT_SIZE, salt)) {
+        return false;
+    }
+    pos += 2 * SALT_SIZE + 1;
+    if ((end - pos) % (2 * SEAL_SIZE) != 0) {
+        return false;
+    }
+    digits.assign(pos, end);
+    block = blockSize;
+    isRecorded = true;
+
+    // Without the mount key the mapping still loads, reads of the stream fail
+    deriveKey();
+    return true;
+}
@@ -0,0 +1,147 @@
+#ifndef BLOCK_CIPHER_H
+#define BLOCK_CIPHER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/uio.h>    // For struct iovec
+
+#include "StreamFile.h"
+
+/**
+ * The secret every per-file .crit key is derived from, read once at mount time.
+ */
+struct MountKey {
+    static const size_t SIZE = 32;
+
+    unsigned char bytes[SIZE];
+
+    /**
+     * @brief Reads the key from a file holding either SIZE raw bytes or 2 * SIZE hex digits,
+     * optionally followed by a newline.
+     *
+     * @return true if successful, false if the file cannot be read or holds something else
+     */
+    bool load(const char* path);
+};
+
+/**
+ * AES-256-GCM encryption of a .crit stream, one fixed-size block at a time, kept in the file's
+ * mapping as one "@AES256GCM <block size> <salt> <seals>" line, the salt 32 hex digits and each
+ * block's seal, its nonce followed by its authentication tag, 56.
+ *
+ * Each file is encrypted under its own key, HKDF-SHA256 of StorageContext::critKey and a random
+ * salt drawn whenever the stream is written in full. Every time a block is sealed it gets a new
+ * random nonce, so writes can seal the blocks they change again in place. Blocks are encrypted
+ * without expansion, so stream offsets are those of the plaintext, and the block checksums and
+ * parity work on the ciphertext.
+ *
+ * Only the critical bytes of a file, a few blocks for most formats, are encrypted, so the cost
+ * of a file follows its critical bytes, not its size. AES-NI and carry-less multiply are used
+ * through OpenSSL's libcrypto, which the build needs for encryption (CRITICALFS_HAVE_OPENSSL);
+ * without it encrypted streams can be neither written nor read.
+ */
+class BlockCipher {
+public:
+    static const size_t BLOCK_SIZE = 4096;
+    static const size_t SALT_SIZE = 16;
+    static const size_t NONCE_SIZE = 12;
+    static const size_t TAG_SIZE = 16;
+
+    /**
+     * @param resource memory for the seals, the current request arena by default
+     */
+    explicit BlockCipher(std::pmr::memory_resource* resource = nullptr);
+
+    /**
+     * @brief Whether this build can encrypt (it was linked against libcrypto).
+     */
+    static bool supported();
+
+    /**
+     * @brief Forgets the encryption: the stream is stored in the clear.
+     */
+    void clear();
+
+    /**
+     * @brief Starts sealing a stream from its first byte under a new salt and the key derived
+     * from it and StorageContext::critKey.
+     *
+     * @return true if successful, false without a mount key or libcrypto
+     */
+    bool begin();
+
+    /**
+     * @brief Encrypts the next bytes of the stream, gathered from pieces, appending the
+     * ciphertext of every block they complete to out. A partial last block waits for the next
+     * bytes or finish.
+     *
+     * @return true if successful, false if encryption failed
+     */
+    bool seal(const std::vector<struct iovec>& pieces, std::vector<char>& out);
+
+    /**
+     * @brief Appends the ciphertext of the partial last block, if any, to out.
+     */
+    bool finish(std::vector<char>& out);
+
+    /**
+     * @brief Writes data at offset into the encrypted stream file, which holds length bytes:
+     * the blocks it covers are sealed again, the bytes of the first and last one it does not
+     * cover decrypted first, and a gap past length filled with zeros.
+     *
+     * @param file the stream file, open for reading and writing
+     * @return true if successful, false if a block could not be read, opened or written
+     */
+    bool write(StreamFile& file, uint64_t offset, const char* data, size_t size, uint64_t length);
+
+    /**
+     * @brief Decrypts data, the stream bytes from offset, in place and checks their tags.
+     * offset must be at a block boundary and data must end at one or at the end of the stream.
+     * Safe to call from several threads at once.
+     *
+     * @return true if every block is authentic, false otherwise, leaving data undefined
+     */
+    bool open(uint64_t offset, char* data, size_t size) const;
+
+    bool recorded() const; // whether the stream is encrypted
+    bool keyed() const;    // whether its key is known, i.e. the mount has the key it was sealed under
+    size_t blockSize() const;
+
+    /**
+     * @brief The mapping line, "" if the stream is not encrypted.
+     */
+    std::string serialize() const;
+
+    /**
+     * @brief Parses a mapping line without its leading '@', replacing the encryption state, and
+     * derives the file's key if the mount has a key.
+     *
+     * @param handled set if the line is an encryption line
+     * @return false if it is one but malformed
+     */
+    bool load(std::string_view line, bool& handled);
+
+private:
+    std::pmr::string seals;  // NONCE_SIZE + TAG_SIZE bytes per block
+    std::pmr::string digits; // loaded seals not decoded into seals, two hex digits per byte
+    std::pmr::string pending; // plaintext of the partial block being sealed
+    unsigned char salt[SALT_SIZE] = {};
+    unsigned char key[32] = {};
+    size_t block = BLOCK_SIZE;
+    bool isRecorded = false;
+    bool isKeyed = false;
+
+    bool deriveKey();
+    // Seal of block index, false if it is missing or its digits are malformed
+    bool recordedSeal(uint64_t index, unsigned char* seal) const;
+    // Decodes loaded digits before seals are changed
+    bool decode();
+    // Seals whole blocks, and a partial last one, from data into out as blocks from index on
+    bool sealBlocks(const char* data, size_t size, char* out, uint64_t index);
+};
+
+#endif // BLOCK_CIPHER_H
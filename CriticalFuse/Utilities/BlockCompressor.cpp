@@ -0,0 +1,434 @@
+#include "BlockCompressor.h"
+#include "RequestArena.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <iostream>
+#include <memory>
+
+#ifdef CRITICALFS_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef CRITICALFS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+namespace {
+
+const std::string_view LZ4_TAG = "LZ4 ";
+const std::string_view ZSTD_TAG = "ZSTD ";
+
+// Hex digits of a block's place in the stream file and of its stored size
+const size_t OFFSET_DIGITS = 16;
+const size_t SIZE_DIGITS = 8;
+const size_t ENTRY_DIGITS = OFFSET_DIGITS + SIZE_DIGITS;
+
+// Fastest level: pixel data is read far more often than written, and level 1 already gets
+// most of what zstd finds in it
+const int ZSTD_LEVEL = 1;
+
+std::string_view tagOf(NoncritCodec codec) {
+    return codec == NoncritCodec::ZSTD ? ZSTD_TAG : LZ4_TAG;
+}
+
+template <typename T>
+bool parseHex(const char* digits, size_t count, T& value) {
+    std::from_chars_result result = std::from_chars(digits, digits + count, value, 16);
+    return result.ec == std::errc() && result.ptr == digits + count;
+}
+
+#ifdef CRITICALFS_HAVE_ZSTD
+
+struct CompressDeleter {
+    void operator()(ZSTD_CCtx* ctx) const {
+        ZSTD_freeCCtx(ctx);
+    }
+    void operator()(ZSTD_DCtx* ctx) const {
+        ZSTD_freeDCtx(ctx);
+    }
+};
+
+// One context of each kind per thread, creating them costs more than a block
+ZSTD_CCtx* compressContext() {
+    thread_local std::unique_ptr<ZSTD_CCtx, CompressDeleter> ctx(ZSTD_createCCtx());
+    return ctx.get();
+}
+
+ZSTD_DCtx* decompressContext() {
+    thread_local std::unique_ptr<ZSTD_DCtx, CompressDeleter> ctx(ZSTD_createDCtx());
+    return ctx.get();
+}
+
+#endif // CRITICALFS_HAVE_ZSTD
+
+} // namespace
+
+BlockCompressor::BlockCompressor(std::pmr::memory_resource* resource)
+    : blocks(resource ? resource : requestResource()),
+      digits(resource ? resource : requestResource()),
+      pending(resource ? resource : requestResource()) {}
+
+bool BlockCompressor::supported(NoncritCodec codec) {
+    switch (codec) {
+#ifdef CRITICALFS_HAVE_LZ4
+        case NoncritCodec::LZ4: return true;
+#endif
+#ifdef CRITICALFS_HAVE_ZSTD
+        case NoncritCodec::ZSTD: return true;
+#endif
+        default: return false;
+    }
+}
+
+bool BlockCompressor::parseCodec(const char* name, NoncritCodec& codec) {
+    if (std::strcmp(name, "lz4") == 0) {
+        codec = NoncritCodec::LZ4;
+        return true;
+    }
+    if (std::strcmp(name, "zstd") == 0) {
+        codec = NoncritCodec::ZSTD;
+        return true;
+    }
+    return false;
+}
+
+void BlockCompressor::clear() {
+    blocks.clear();
+    digits.clear();
+    pending.clear();
+    streamCodec = NoncritCodec::NONE;
+    length = 0;
+    storedEnd = 0;
+    block = BLOCK_SIZE;
+}
+
+bool BlockCompressor::begin(NoncritCodec codec) {
+    clear();
+    if (!supported(codec)) {
+        std::cerr << "Built without the codec to compress .noncrit streams with" << std::endl;
+        return false;
+    }
+    streamCodec = codec;
+    return true;
+}
+
+bool BlockCompressor::compress(const std::vector<struct iovec>& pieces, std::vector<char>& out) {
+    for (const struct iovec& piece : pieces) {
+        const char* data = static_cast<const char*>(piece.iov_base);
+        size_t size = piece.iov_len;
+
+        // The partial block left by earlier pieces is completed first
+        if (!pending.empty()) {
+            size_t taken = std::min(size, block - pending.size());
+            pending.append(data, taken);
+            data += taken;
+            size -= taken;
+            if (pending.size() < block) {
+                continue;
+            }
+            if (!appendBlock(pending.data(), block, out)) {
+                return false;
+            }
+            pending.clear();
+        }
+
+        for (; size >= block; data += block, size -= block) {
+            if (!appendBlock(data, block, out)) {
+                return false;
+            }
+        }
+        pending.assign(data, size);
+    }
+    return true;
+}
+
+bool BlockCompressor::finish(std::vector<char>& out) {
+    if (pending.empty()) {
+        return true;
+    }
+    bool ok = appendBlock(pending.data(), pending.size(), out);
+    pending.clear();
+    return ok;
+}
+
+bool BlockCompressor::appendBlock(const char* data, size_t size, std::vector<char>& out) {
+    if (streamCodec == NoncritCodec::NONE) {
+        return false;
+    }
+    size_t at = out.size();
+    out.resize(at + storedBound(size));
+    size_t stored = compressBlock(data, size, out.data() + at);
+    out.resize(at + stored);
+    blocks.push_back({storedEnd, static_cast<uint32_t>(stored)});
+    storedEnd += stored;
+    length += size;
+    return true;
+}
+
+bool BlockCompressor::write(StreamFile& file, uint64_t offset, const char* data, size_t size) {
+    if (size == 0) {
+        return true;
+    }
+    if (!decode()) {
+        std::cerr << "Malformed .noncrit block index" << std::endl;
+        return false;
+    }
+    storedEnd = storedLength();
+
+    // Whole blocks from the one holding the first byte written, or the end of the stream if
+    // the write starts past it, to the one holding the last byte written
+    uint64_t end = offset + size;
+    uint64_t newLength = std::max(length, end);
+    std::vector<char> plain(block);
+    std::vector<char> stored(storedBound(block));
+    for (uint64_t index = std::min(offset, length) / block; index <= (end - 1) / block; ++index) {
+        uint64_t blockStart = index * block;
+        size_t oldLength = index < blocks.size() ? blockLength(index) : 0;
+        size_t newBlockLength = std::min<uint64_t>(block, newLength - blockStart);
+        std::fill(plain.begin(), plain.begin() + newBlockLength, 0);
+
+        // Bytes of the block the write does not cover stay as they were
+        if (oldLength > 0 && (blockStart < offset || blockStart + oldLength > end)) {
+            const StoredBlock& old = blocks[index];
+            if (!file.read(stored.data(), old.size, old.offset) ||
+                !decompress(index, stored.data(), old.size, plain.data())) {
+                std::cerr << "Failed to decompress .noncrit block at stream offset " << blockStart
+                          << " for a write" << std::endl;
+                return false;
+            }
+        }
+        uint64_t copyStart = std::max(offset, blockStart);
+        uint64_t copyEnd = std::min<uint64_t>(end, blockStart + newBlockLength);
+        std::memcpy(plain.data() + (copyStart - blockStart), data + (copyStart - offset), copyEnd - copyStart);
+
+        size_t storedSize = compressBlock(plain.data(), newBlockLength, stored.data());
+        bool last = index < blocks.size() && blocks[index].offset + blocks[index].size == storedEnd;
+        uint64_t at = storedEnd;
+        if (index < blocks.size() && (storedSize <= blocks[index].size || last)) {
+            at = blocks[index].offset;
+        }
+        if (!file.write(stored.data(), storedSize, at)) {
+            return false;
+        }
+
+        if (index >= blocks.size()) {
+            blocks.resize(index + 1);
+        }
+        blocks[index] = {at, static_cast<uint32_t>(storedSize)};
+        length = std::max<uint64_t>(length, blockStart + newBlockLength);
+        if (last || at == storedEnd) {
+            storedEnd = at + storedSize;
+        }
+    }
+    return true;
+}
+
+size_t BlockCompressor::compressBlock(const char* data, size_t size, char* out) const {
+    size_t compressed = 0;
+    switch (streamCodec) {
+#ifdef CRITICALFS_HAVE_LZ4
+        case NoncritCodec::LZ4:
+            compressed = LZ4_compress_default(data, out, static_cast<int>(size), static_cast<int>(storedBound(size)));
+            break;
+#endif
+#ifdef CRITICALFS_HAVE_ZSTD
+        case NoncritCodec::ZSTD: {
+            ZSTD_CCtx* ctx = compressContext();
+            size_t result = ctx ? ZSTD_compressCCtx(ctx, out, storedBound(size), data, size, ZSTD_LEVEL) : 0;
+            compressed = ZSTD_isError(result) ? 0 : result;
+            break;
+        }
+#endif
+        default:
+            break;
+    }
+
+    // Blocks that do not shrink are stored as they are, their stored size tells them apart
+    if (compressed == 0 || compressed >= size) {
+        std::memcpy(out, data, size);
+        return size;
+    }
+    return compressed;
+}
+
+size_t BlockCompressor::storedBound(size_t size) const {
+    size_t bound = size;
+#ifdef CRITICALFS_HAVE_LZ4
+    if (streamCodec == NoncritCodec::LZ4) {
+        bound = LZ4_compressBound(static_cast<int>(size));
+    }
+#endif
+#ifdef CRITICALFS_HAVE_ZSTD
+    if (streamCodec == NoncritCodec::ZSTD) {
+        bound = ZSTD_compressBound(size);
+    }
+#endif
+    return std::max(bound, size);
+}
+
+bool BlockCompressor::locate(uint64_t index, uint64_t& storedOffset, size_t& storedSize) const {
+    if (digits.empty()) {
+        if (index >= blocks.size()) {
+            return false;
+        }
+        storedOffset = blocks[index].offset;
+        storedSize = blocks[index].size;
+        return true;
+    }
+    const char* entry = digits.data() + index * ENTRY_DIGITS;
+    uint32_t size = 0;
+    if (index >= digits.size() / ENTRY_DIGITS || !parseHex(entry, OFFSET_DIGITS, storedOffset) ||
+        !parseHex(entry + OFFSET_DIGITS, SIZE_DIGITS, size)) {
+        return false;
+    }
+    // No block is stored larger than it is
+    storedSize = size;
+    return storedSize > 0 && storedSize <= blockLength(index);
+}
+
+bool BlockCompressor::decompress(uint64_t index, const char* stored, size_t storedSize, char* out) const {
+    size_t size = blockLength(index);
+    if (storedSize == size) {
+        std::memcpy(out, stored, size);
+        return true;
+    }
+    switch (streamCodec) {
+#ifdef CRITICALFS_HAVE_LZ4
+        case NoncritCodec::LZ4:
+            return LZ4_decompress_safe(stored, out, static_cast<int>(storedSize), static_cast<int>(size)) ==
+                   static_cast<int>(size);
+#endif
+#ifdef CRITICALFS_HAVE_ZSTD
+        case NoncritCodec::ZSTD: {
+            ZSTD_DCtx* ctx = decompressContext();
+            return ctx && ZSTD_decompressDCtx(ctx, out, size, stored, storedSize) == size;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+bool BlockCompressor::decode() {
+    if (digits.empty()) {
+        return true;
+    }
+    size_t count = digits.size() / ENTRY_DIGITS;
+    std::pmr::vector<StoredBlock> decoded(count, blocks.get_allocator());
+    for (size_t i = 0; i < count; ++i) {
+        size_t size = 0;
+        if (!locate(i, decoded[i].offset, size)) {
+            return false;
+        }
+        decoded[i].size = static_cast<uint32_t>(size);
+    }
+    blocks.swap(decoded);
+    digits.clear();
+    return true;
+}
+
+bool BlockCompressor::recorded() const {
+    return streamCodec != NoncritCodec::NONE;
+}
+
+NoncritCodec BlockCompressor::codec() const {
+    return streamCodec;
+}
+
+size_t BlockCompressor::blockSize() const {
+    return block;
+}
+
+size_t BlockCompressor::blockLength(uint64_t index) const {
+    uint64_t start = index * block;
+    return start < length ? std::min<uint64_t>(block, length - start) : 0;
+}
+
+uint64_t BlockCompressor::streamLength() const {
+    return length;
+}
+
+uint64_t BlockCompressor::storedLength() const {
+    uint64_t end = 0;
+    uint64_t count = (length + block - 1) / block;
+    for (uint64_t index = 0; index < count; ++index) {
+        uint64_t storedOffset = 0;
+        size_t storedSize = 0;
+        if (locate(index, storedOffset, storedSize)) {
+            end = std::max(end, storedOffset + storedSize);
+        }
+    }
+    return end;
+}
+
+uint64_t BlockCompressor::liveBytes() const {
+    uint64_t live = 0;
+    uint64_t count = (length + block - 1) / block;
+    for (uint64_t index = 0; index < count; ++index) {
+        uint64_t storedOffset = 0;
+        size_t storedSize = 0;
+        if (locate(index, storedOffset, storedSize)) {
+            live += storedSize;
+        }
+    }
+    return live;
+}
+
+std::string BlockCompressor::serialize() const {
+    if (!recorded() || length == 0) {
+        return "";
+    }
+    std::string line = "@" + std::string(tagOf(streamCodec)) + std::to_string(block) + ' ' + std::to_string(length) + ' ';
+    if (!digits.empty()) {
+        return line + std::string(digits.data(), digits.size()) + '\n';
+    }
+    size_t written = line.size();
+    line.resize(written + blocks.size() * ENTRY_DIGITS + 1);
+    for (const StoredBlock& stored : blocks) {
+        snprintf(&line[written], ENTRY_DIGITS + 1, "%016llx%08x", static_cast<unsigned long long>(stored.offset),
+                 static_cast<unsigned>(stored.size));
+        written += ENTRY_DIGITS;
+    }
+    line.back() = '\n';
+    return line;
+}
+
+bool BlockCompressor::load(std::string_view line, bool& handled) {
+    NoncritCodec codec = NoncritCodec::NONE;
+    if (line.substr(0, LZ4_TAG.size()) == LZ4_TAG) {
+        codec = NoncritCodec::LZ4;
+    } else if (line.substr(0, ZSTD_TAG.size()) == ZSTD_TAG) {
+        codec = NoncritCodec::ZSTD;
+    }
+    handled = codec != NoncritCodec::NONE;
+    if (!handled) {
+        return true;
+    }
+
+    const char* pos = line.data() + tagOf(codec).size();
+    const char* end = line.data() + line.size();
+    uint64_t blockSize = 0;
+    uint64_t streamLength = 0;
+    std::from_chars_result result = std::from_chars(pos, end, blockSize);
+    if (result.ec != std::errc() || result.ptr == end || *result.ptr != ' ' || blockSize == 0 || blockSize > (1u << 24)) {
+        return false;
+    }
+    result = std::from_chars(result.ptr + 1, end, streamLength);
+    if (result.ec != std::errc() || result.ptr == end || *result.ptr != ' ') {
+        return false;
+    }
+    pos = result.ptr + 1;
+    uint64_t count = (streamLength + blockSize - 1) / blockSize;
+    if (static_cast<uint64_t>(end - pos) != count * ENTRY_DIGITS) {
+        return false;
+    }
+
+    // Mapped even if the build lacks the codec, reads of the stream then fail
+    clear();
+    digits.assign(pos, end);
+    block = blockSize;
+    length = streamLength;
+    streamCodec = codec;
+    return true;
+}
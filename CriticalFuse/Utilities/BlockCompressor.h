@@ -0,0 +1,150 @@
+#ifndef BLOCK_COMPRESSOR_H
+#define BLOCK_COMPRESSOR_H
+
+#include "StorageContext.h"
+#include "StreamFile.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/uio.h>    // For struct iovec
+
+/**
+ * Compression of a .noncrit stream in fixed-size blocks, each compressed on its own so a read
+ * only decompresses the blocks it overlaps. The block index is kept in the file's mapping as
+ * one "@LZ4 <block size> <stream length> <blocks>" line ("@ZSTD ..." for zstd), each block's
+ * place in the stream file 16 hex digits and its stored size 8.
+ *
+ * Offsets in the mapping stay those of the uncompressed stream, the index translates them. A
+ * block that does not shrink is stored as it is, with its full length as stored size, so
+ * already compressed pixel data costs little more than the attempt.
+ *
+ * Writes compress the blocks they touch again. A block goes back into its old place if it
+ * still fits there, or if it is the last one in the file, so appending to a stream keeps
+ * rewriting its last block in place; otherwise it moves to the end of the file, and the place
+ * it leaves is dead until a full rewrite compacts the stream (see liveBytes). Like any bytes
+ * of .noncrit, a block written in place can be lost to a crash before its mapping is saved.
+ *
+ * LZ4 and zstd come from liblz4 and libzstd, each used if the build found it
+ * (CRITICALFS_HAVE_LZ4, CRITICALFS_HAVE_ZSTD); a stream compressed with a codec the build
+ * lacks cannot be read.
+ */
+class BlockCompressor {
+public:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    /**
+     * @param resource memory for the block index, the current request arena by default
+     */
+    explicit BlockCompressor(std::pmr::memory_resource* resource = nullptr);
+
+    /**
+     * @brief Whether this build can compress and decompress with codec.
+     */
+    static bool supported(NoncritCodec codec);
+
+    /**
+     * @brief Parses a codec name, "lz4" or "zstd".
+     *
+     * @return false if the name is neither
+     */
+    static bool parseCodec(const char* name, NoncritCodec& codec);
+
+    /**
+     * @brief Forgets the compression: the stream is stored as it is.
+     */
+    void clear();
+
+    /**
+     * @brief Starts compressing a stream from its first byte with codec.
+     *
+     * @return true if successful, false if the build lacks codec
+     */
+    bool begin(NoncritCodec codec);
+
+    /**
+     * @brief Compresses the next bytes of the stream, gathered from pieces, appending the
+     * stored form of every block they complete to out. A partial last block waits for the
+     * next bytes or finish.
+     *
+     * @return true if successful, false if compression failed
+     */
+    bool compress(const std::vector<struct iovec>& pieces, std::vector<char>& out);
+
+    /**
+     * @brief Appends the stored form of the partial last block, if any, to out.
+     */
+    bool finish(std::vector<char>& out);
+
+    /**
+     * @brief Writes data at offset into the compressed stream file: the blocks it covers are
+     * compressed again, with the bytes of the first and last one it does not cover
+     * decompressed first, and a gap past the end of the stream filled with zeros.
+     *
+     * @param file the stream file, open for reading and writing
+     * @return true if successful, false if a block could not be read, decompressed or written
+     */
+    bool write(StreamFile& file, uint64_t offset, const char* data, size_t size);
+
+    /**
+     * @brief Where block index is stored in the stream file, false if it is not recorded or
+     * its digits are malformed.
+     */
+    bool locate(uint64_t index, uint64_t& storedOffset, size_t& storedSize) const;
+
+    /**
+     * @brief Decompresses the stored form of block index into out, blockLength(index) bytes.
+     * Safe to call from several threads at once.
+     *
+     * @return true if successful, false if the stored bytes do not decompress to the block
+     */
+    bool decompress(uint64_t index, const char* stored, size_t storedSize, char* out) const;
+
+    bool recorded() const;          // whether the stream is compressed
+    NoncritCodec codec() const;
+    size_t blockSize() const;
+    size_t blockLength(uint64_t index) const; // blockSize, except for the last block
+    uint64_t streamLength() const;  // length of the uncompressed stream
+    uint64_t storedLength() const;  // end of the last block stored in the stream file
+    uint64_t liveBytes() const;     // stored bytes the index refers to, storedLength minus the dead ones
+
+    /**
+     * @brief The mapping line, "" if the stream is not compressed or empty.
+     */
+    std::string serialize() const;
+
+    /**
+     * @brief Parses a mapping line without its leading '@', replacing the compression state.
+     *
+     * @param handled set if the line is a compression line
+     * @return false if it is one but malformed
+     */
+    bool load(std::string_view line, bool& handled);
+
+private:
+    struct StoredBlock {
+        uint64_t offset;
+        uint32_t size;
+    };
+
+    std::pmr::vector<StoredBlock> blocks;
+    std::pmr::string digits;  // loaded index not decoded into blocks, 24 hex digits per block
+    std::pmr::string pending; // bytes of the partial block being compressed
+    NoncritCodec streamCodec = NoncritCodec::NONE;
+    uint64_t length = 0;
+    uint64_t storedEnd = 0;
+    size_t block = BLOCK_SIZE;
+
+    // Decodes loaded digits before the index is changed
+    bool decode();
+    // Stored form of one block into out, returns its size or 0 on failure
+    size_t compressBlock(const char* data, size_t size, char* out) const;
+    size_t storedBound(size_t size) const;
+    // Compresses the next whole or last partial block of the stream into out
+    bool appendBlock(const char* data, size_t size, std::vector<char>& out);
+};
+
+#endif // BLOCK_COMPRESSOR_H
@@ -0,0 +1,51 @@
+#ifndef BYTE_SOURCE_H
+#define BYTE_SOURCE_H
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/**
+ * Random-access view of a file's logical content. Handlers of container formats use it to
+ * read just the structures their mapping depends on (headers, IFDs, chunk headers) instead
+ * of the whole file.
+ */
+class ByteSource {
+public:
+    virtual ~ByteSource() = default;
+
+    /**
+     * @brief Logical size of the file.
+     */
+    virtual uint64_t size() const = 0;
+
+    /**
+     * @brief Reads [offset, offset + length) of the file into out.
+     * @return true if successful, false on an I/O error or if the range is out of bounds
+     */
+    virtual bool read(uint64_t offset, size_t length, char* out) = 0;
+};
+
+/**
+ * ByteSource over a file that is already in memory.
+ */
+class BufferSource : public ByteSource {
+public:
+    BufferSource(const char* buffer, size_t length) : buffer(buffer), length(length) {}
+
+    uint64_t size() const override { return length; }
+
+    bool read(uint64_t offset, size_t count, char* out) override {
+        if (offset > length || count > length - offset) {
+            return false;
+        }
+        std::memcpy(out, buffer + offset, count);
+        return true;
+    }
+
+private:
+    const char* buffer;
+    size_t length;
+};
+
+#endif // BYTE_SOURCE_H
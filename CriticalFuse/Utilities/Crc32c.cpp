@@ -0,0 +1,178 @@
+#include "Crc32c.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#define CRC32C_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const uint32_t POLYNOMIAL = 0x82F63B78; // reflected Castagnoli polynomial
+
+// Slicing-by-8 tables: entries[k][b] is the CRC of byte b followed by k zero bytes
+struct Crc32cTable {
+    uint32_t entries[8][256];
+
+    Crc32cTable() {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                crc = (crc & 1) ? (crc >> 1) ^ POLYNOMIAL : crc >> 1;
+            }
+            entries[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; ++i) {
+            for (int k = 1; k < 8; ++k) {
+                entries[k][i] = entries[0][entries[k - 1][i] & 0xFF] ^ (entries[k - 1][i] >> 8);
+            }
+        }
+    }
+};
+
+const Crc32cTable table;
+
+uint32_t crc32cTable(uint32_t crc, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+    while (size >= 8) {
+        uint32_t low;
+        uint32_t high;
+        std::memcpy(&low, bytes, 4);
+        std::memcpy(&high, bytes + 4, 4);
+        low ^= crc; // little endian, like every CPU this runs on
+        crc = table.entries[7][low & 0xFF] ^ table.entries[6][(low >> 8) & 0xFF] ^
+              table.entries[5][(low >> 16) & 0xFF] ^ table.entries[4][low >> 24] ^
+              table.entries[3][high & 0xFF] ^ table.entries[2][(high >> 8) & 0xFF] ^
+              table.entries[1][(high >> 16) & 0xFF] ^ table.entries[0][high >> 24];
+        bytes += 8;
+        size -= 8;
+    }
+    while (size-- > 0) {
+        crc = table.entries[0][(crc ^ *bytes++) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+
+// The crc32 instruction has a latency of three cycles but a throughput of one per cycle, so
+// large buffers are cut into three lanes checksummed together, whose CRCs are then combined.
+// Lanes of two sizes: long ones for bulk data, short ones for what is left of a 4 KiB block.
+const size_t LONG_LANE = 1024;
+const size_t SHORT_LANE = 256;
+
+// x^n mod P in the reflected representation, where the top bit is x^0
+uint32_t powerOfX(uint64_t n) {
+    uint32_t value = 0x80000000;
+    while (n-- > 0) {
+        value = (value & 1) ? (value >> 1) ^ POLYNOMIAL : value >> 1;
+    }
+    return value;
+}
+
+// Multipliers moving a CRC past one lane: appending n zero bytes multiplies it by x^(8n). The
+// carry-less product of two reflected values is one degree too high and the crc32 instruction
+// that reduces it adds x^32, hence the 33.
+const uint32_t LONG_SHIFT = powerOfX(8 * LONG_LANE - 33);
+const uint32_t SHORT_SHIFT = powerOfX(8 * SHORT_LANE - 33);
+
+__attribute__((target("sse4.2")))
+uint64_t crcLane(uint64_t crc, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, data + i, 8);
+        crc = _mm_crc32_u64(crc, word);
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint64_t shiftCrc(uint64_t crc, uint32_t multiplier) {
+    __m128i product = _mm_clmulepi64_si128(_mm_cvtsi64_si128(crc), _mm_cvtsi32_si128(multiplier), 0);
+    return _mm_crc32_u64(0, _mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint64_t crcThreeLanes(uint64_t crc, const uint8_t*& bytes, size_t& size, size_t lane, uint32_t shift) {
+    while (size >= 3 * lane) {
+        uint64_t first = crc;
+        uint64_t second = 0;
+        uint64_t third = 0;
+        for (size_t i = 0; i < lane; i += 8) {
+            uint64_t words[3];
+            std::memcpy(&words[0], bytes + i, 8);
+            std::memcpy(&words[1], bytes + lane + i, 8);
+            std::memcpy(&words[2], bytes + 2 * lane + i, 8);
+            first = _mm_crc32_u64(first, words[0]);
+            second = _mm_crc32_u64(second, words[1]);
+            third = _mm_crc32_u64(third, words[2]);
+        }
+        crc = shiftCrc(shiftCrc(first, shift) ^ second, shift) ^ third;
+        bytes += 3 * lane;
+        size -= 3 * lane;
+    }
+    return crc;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32cTail(uint64_t crc, const uint8_t* bytes, size_t size) {
+    size_t words = size & ~size_t(7);
+    crc = crcLane(crc, bytes, words);
+    uint32_t crc32 = static_cast<uint32_t>(crc);
+    for (size_t i = words; i < size; ++i) {
+        crc32 = _mm_crc32_u8(crc32, bytes[i]);
+    }
+    return ~crc32;
+}
+
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const void* data, size_t size) {
+    return crc32cTail(~crc, static_cast<const uint8_t*>(data), size);
+}
+
+__attribute__((target("sse4.2,pclmul")))
+uint32_t crc32cPclmul(uint32_t crc, const void* data, size_t size) {
+    const uint8_t* bytes = static_cast<const uint8_t*>(data);
+    uint64_t state = static_cast<uint32_t>(~crc);
+    state = crcThreeLanes(state, bytes, size, LONG_LANE, LONG_SHIFT);
+    state = crcThreeLanes(state, bytes, size, SHORT_LANE, SHORT_SHIFT);
+    return crc32cTail(state, bytes, size);
+}
+
+#endif // CRC32C_X86
+
+Crc32cFunction selectCrc32c() {
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        return crc32cPclmul;
+    }
+    if (__builtin_cpu_supports("sse4.2")) {
+        return crc32cSse42;
+    }
+#endif
+    return crc32cTable;
+}
+
+} // namespace
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t size) {
+    static const Crc32cFunction compute = selectCrc32c();
+    return compute(crc, data, size);
+}
+
+std::vector<Crc32cImpl> availableCrc32c() {
+    std::vector<Crc32cImpl> implementations = {{"table", crc32cTable}};
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        implementations.push_back({"sse4.2", crc32cSse42});
+    }
+    if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("pclmul")) {
+        implementations.push_back({"sse4.2+pclmul", crc32cPclmul});
+    }
+#endif
+    return implementations;
+}
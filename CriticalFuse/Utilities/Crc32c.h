@@ -0,0 +1,34 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Computes the CRC32C (Castagnoli) checksum of data, continuing from a previous value.
+ *
+ * Uses the SSE4.2 crc32 instruction, three streams at a time combined with PCLMULQDQ, when the
+ * CPU supports them, chosen once at startup; a table-driven version otherwise.
+ *
+ * @param crc previous checksum, 0 for a fresh computation
+ * @param data bytes to checksum
+ * @param size number of bytes
+ * @return uint32_t the updated checksum
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t size);
+
+typedef uint32_t (*Crc32cFunction)(uint32_t crc, const void* data, size_t size);
+
+struct Crc32cImpl {
+    const char* name;
+    Crc32cFunction compute;
+};
+
+/**
+ * @brief All implementations of crc32c this CPU can run, table-driven first.
+ * Used to benchmark and cross-check them.
+ */
+std::vector<Crc32cImpl> availableCrc32c();
+
+#endif // CRC32C_H
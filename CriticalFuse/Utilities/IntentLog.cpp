@@ -0,0 +1,337 @@
+#include "IntentLog.h"
+#include "Crc32c.h"
+#include "ScatterWrite.h"
+
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>      // For open
+#include <unistd.h>     // For pread, fdatasync, ftruncate, close
+#include <sys/stat.h>   // For fstat
+
+namespace {
+
+const uint32_t RECORD_MAGIC = 0x4C544E49; // "INTL"
+
+// The streams were staged in files of their own before the record was written
+const uint32_t RECORD_FLAG_STAGED = 1;
+// The stream data are patches of the existing stream files
+const uint32_t RECORD_FLAG_PATCHES = 2;
+
+// On-disk record header, followed by path, mapping, crit and noncrit bytes.
+// The CRC covers the header (with crc = 0) and the whole payload.
+struct RecordHeader {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t sequence;
+    uint64_t logicalSize;
+    uint32_t pathLength;
+    uint32_t mappingLength;
+    uint32_t flags;
+    uint32_t reserved;
+    uint64_t critLength;
+    uint64_t noncritLength;
+};
+
+uint64_t payloadSize(const RecordHeader& header) {
+    return static_cast<uint64_t>(header.pathLength) + header.mappingLength + header.critLength + header.noncritLength;
+}
+
+bool preadFull(int fd, char* buffer, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t bytesRead = pread(fd, buffer, size, offset);
+        if (bytesRead <= 0) {
+            return false;
+        }
+        buffer += bytesRead;
+        size -= bytesRead;
+        offset += bytesRead;
+    }
+    return true;
+}
+
+} // namespace
+
+IntentLog::IntentLog(const std::string& logPath, ApplyFn apply, SyncFn sync, size_t checkpointBytes)
+    : logPath(logPath), apply(std::move(apply)), sync(std::move(sync)), checkpointBytes(checkpointBytes) {}
+
+IntentLog::~IntentLog() {
+    stopCheckpointer();
+    if (fd >= 0) {
+        checkpoint();
+        close(fd);
+    }
+}
+
+bool IntentLog::open() {
+    fd = ::open(logPath.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        std::perror("Failed to open intent log");
+        return false;
+    }
+    if (!replay()) {
+        return false;
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    return checkpointLocked(lock);
+}
+
+bool IntentLog::replay() {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        std::perror("fstat failed on intent log");
+        return false;
+    }
+
+    uint64_t offset = 0;
+    size_t replayed = 0;
+    std::vector<char> payload;
+    while (offset + sizeof(RecordHeader) <= static_cast<uint64_t>(st.st_size)) {
+        RecordHeader header;
+        if (!preadFull(fd, reinterpret_cast<char*>(&header), sizeof(header), offset) || header.magic != RECORD_MAGIC) {
+            break;
+        }
+        uint64_t size = payloadSize(header);
+        if (offset + sizeof(header) + size > static_cast<uint64_t>(st.st_size)) {
+            break; // torn tail: the writer never got an acknowledgement
+        }
+        payload.resize(size);
+        if (!preadFull(fd, payload.data(), size, offset + sizeof(header))) {
+            break;
+        }
+
+        uint32_t expectedCrc = header.crc;
+        header.crc = 0;
+        uint32_t crc = crc32c(0, &header, sizeof(header));
+        crc = crc32c(crc, payload.data(), payload.size());
+        if (crc != expectedCrc) {
+            std::cerr << "Intent log record " << header.sequence << " failed its checksum, stopping replay" << std::endl;
+            break;
+        }
+
+        Intent intent;
+        const char* cursor = payload.data();
+        intent.basePath.assign(cursor, header.pathLength);
+        cursor += header.pathLength;
+        intent.mapping.assign(cursor, header.mappingLength);
+        cursor += header.mappingLength;
+        intent.logicalSize = header.logicalSize;
+        intent.critData = {{const_cast<char*>(cursor), header.critLength}};
+        intent.critSize = header.critLength;
+        cursor += header.critLength;
+        intent.noncritData = {{const_cast<char*>(cursor), header.noncritLength}};
+        intent.noncritSize = header.noncritLength;
+        intent.staged = (header.flags & RECORD_FLAG_STAGED) != 0;
+        intent.patches = (header.flags & RECORD_FLAG_PATCHES) != 0;
+
+        if (!apply(intent)) {
+            std::cerr << "Failed to replay intent for " << intent.basePath << std::endl;
+            return false;
+        }
+        dirtyPaths.insert(intent.basePath);
+        nextSequence = header.sequence + 1;
+        offset += sizeof(header) + size;
+        replayed++;
+    }
+
+    if (replayed > 0) {
+        std::cerr << "Replayed " << replayed << " intents from " << logPath << std::endl;
+    }
+    logSize = offset;
+    return true;
+}
+
+bool IntentLog::writeBatch(const std::vector<Pending*>& batch) {
+    // The streams are written straight from the callers' buffers
+    std::vector<struct iovec> iov;
+    uint64_t batchSize = 0;
+    for (Pending* pending : batch) {
+        const Intent& intent = *pending->intent;
+        iov.push_back({pending->header.data(), pending->header.size()});
+        iov.insert(iov.end(), intent.critData.begin(), intent.critData.end());
+        iov.insert(iov.end(), intent.noncritData.begin(), intent.noncritData.end());
+        batchSize += pending->header.size() + intent.critSize + intent.noncritSize;
+    }
+
+    if (!pwritevAll(fd, std::move(iov), logSize)) {
+        std::perror("Failed to append to intent log");
+        return false;
+    }
+
+    // One sync makes the whole batch durable
+    if (fdatasync(fd) == -1) {
+        std::perror("fdatasync failed on intent log");
+        // Whatever reached the file is not acknowledged, make sure replay never sees it
+        if (ftruncate(fd, logSize) == -1) {
+            std::perror("Failed to drop unacknowledged intents");
+        }
+        return false;
+    }
+    logSize += batchSize;
+    return true;
+}
+
+bool IntentLog::commit(const Intent& intent) {
+    Pending pending;
+    pending.intent = &intent;
+
+    RecordHeader header;
+    header.magic = RECORD_MAGIC;
+    header.crc = 0;
+    header.logicalSize = intent.logicalSize;
+    header.pathLength = static_cast<uint32_t>(intent.basePath.size());
+    header.mappingLength = static_cast<uint32_t>(intent.mapping.size());
+    header.flags = (intent.staged ? RECORD_FLAG_STAGED : 0) | (intent.patches ? RECORD_FLAG_PATCHES : 0);
+    header.reserved = 0;
+    header.critLength = intent.critSize;
+    header.noncritLength = intent.noncritSize;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    header.sequence = nextSequence++;
+    lock.unlock();
+
+    // Checksum and serialize outside the lock, the payload can be large
+    uint32_t crc = crc32c(0, &header, sizeof(header));
+    crc = crc32c(crc, intent.basePath.data(), intent.basePath.size());
+    crc = crc32c(crc, intent.mapping.data(), intent.mapping.size());
+    for (const struct iovec& piece : intent.critData) {
+        crc = crc32c(crc, piece.iov_base, piece.iov_len);
+    }
+    for (const struct iovec& piece : intent.noncritData) {
+        crc = crc32c(crc, piece.iov_base, piece.iov_len);
+    }
+    header.crc = crc;
+
+    pending.header.resize(sizeof(header));
+    std::memcpy(pending.header.data(), &header, sizeof(header));
+    pending.header.insert(pending.header.end(), intent.basePath.begin(), intent.basePath.end());
+    pending.header.insert(pending.header.end(), intent.mapping.begin(), intent.mapping.end());
+
+    lock.lock();
+    queue.push_back(&pending);
+    while (!pending.done) {
+        if (busy) {
+            idle.wait(lock);
+            continue;
+        }
+
+        // Become the leader for everything queued so far
+        busy = true;
+        std::vector<Pending*> batch;
+        batch.swap(queue);
+        lock.unlock();
+
+        bool durable = writeBatch(batch);
+        // Apply in log order so replay and the live tree agree on the final state
+        std::vector<std::string> applied;
+        for (Pending* member : batch) {
+            member->ok = durable && apply(*member->intent);
+            if (member->ok) {
+                applied.push_back(member->intent->basePath);
+            }
+        }
+
+        lock.lock();
+        dirtyPaths.insert(applied.begin(), applied.end());
+        if (logSize >= checkpointBytes) {
+            checkpointLocked(lock);
+        }
+        for (Pending* member : batch) {
+            member->done = true;
+        }
+        busy = false;
+        idle.notify_all();
+    }
+    return pending.ok;
+}
+
+bool IntentLog::checkpointLocked(std::unique_lock<std::mutex>& lock) {
+    // The caller owns the log (busy), so the lock can be dropped while syncing
+    std::set<std::string> paths;
+    paths.swap(dirtyPaths);
+    lock.unlock();
+
+    bool ok = true;
+    for (const std::string& basePath : paths) {
+        if (!sync(basePath)) {
+            std::cerr << "Checkpoint failed to sync " << basePath << std::endl;
+            ok = false;
+        }
+    }
+    if (ok && (ftruncate(fd, 0) == -1 || fdatasync(fd) == -1)) {
+        std::perror("Failed to truncate intent log");
+        ok = false;
+    }
+
+    lock.lock();
+    if (!ok) {
+        // Keep the log, it is still needed to recover these files
+        dirtyPaths.insert(paths.begin(), paths.end());
+        return false;
+    }
+    logSize = 0;
+    return true;
+}
+
+void IntentLog::acquire(std::unique_lock<std::mutex>& lock) {
+    idle.wait(lock, [this]() { return !busy; });
+    busy = true;
+}
+
+void IntentLog::release(std::unique_lock<std::mutex>& lock) {
+    busy = false;
+    idle.notify_all();
+    (void) lock;
+}
+
+bool IntentLog::checkpoint() {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (logSize == 0) {
+        return true;
+    }
+    acquire(lock);
+    bool ok = checkpointLocked(lock);
+    release(lock);
+    return ok;
+}
+
+bool IntentLog::checkpointIfDirty(const std::string& basePath) {
+    std::unique_lock<std::mutex> lock(mutex);
+    acquire(lock); // a batch being applied may hold the path
+    bool ok = logSize == 0 || dirtyPaths.count(basePath) == 0 || checkpointLocked(lock);
+    release(lock);
+    return ok;
+}
+
+void IntentLog::startCheckpointer(unsigned intervalSeconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (checkpointer.joinable()) {
+        return;
+    }
+    stopping = false;
+    checkpointer = std::thread([this, intervalSeconds]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            checkpointerWake.wait_for(lock, std::chrono::seconds(intervalSeconds));
+            if (stopping || logSize == 0) {
+                continue;
+            }
+            acquire(lock);
+            checkpointLocked(lock);
+            release(lock);
+        }
+    });
+}
+
+void IntentLog::stopCheckpointer() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    checkpointerWake.notify_all();
+    if (checkpointer.joinable()) {
+        checkpointer.join();
+    }
+}
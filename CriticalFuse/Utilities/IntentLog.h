@@ -0,0 +1,127 @@
+#ifndef INTENT_LOG_H
+#define INTENT_LOG_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>    // For struct iovec
+
+/**
+ * Mount-wide write-ahead log of update intents.
+ *
+ * Every update of a split file is appended as one self-checking record holding the new
+ * .crit and .noncrit streams and the new mapping. Concurrent commits are batched so that a
+ * single fdatasync makes the whole batch durable (group commit). Once durable, the batch is
+ * applied to the stream files without syncing them; the stream files are only synced at the
+ * next checkpoint, which then truncates the log. Records still in the log at startup are
+ * replayed in order, so a crash between the writes of .crit, .noncrit and .mapping can no
+ * longer leave a torn file behind.
+ *
+ * Files too large to carry in a record are written to staged stream files first; their
+ * record only holds the mapping and applying it renames the staged files into place, so the
+ * file's earlier records are checkpointed before its staged files are written. Writes that
+ * patch the existing stream files in place or append to them log only the changed bytes.
+ */
+class IntentLog {
+public:
+    struct Intent {
+        std::string basePath;  // backing path without the stream suffix
+        size_t logicalSize = 0;
+        // The new streams as pieces of the caller's buffers, in stream order
+        std::vector<struct iovec> critData;
+        size_t critSize = 0;   // total length of critData
+        std::vector<struct iovec> noncritData;
+        size_t noncritSize = 0; // total length of noncritData
+        std::string mapping;   // serialized mapping file contents
+        bool staged = false;   // streams were written and synced to <basePath>.crit/.noncrit.staged
+                               // ahead of the record, which then carries no stream data
+        bool patches = false;  // critData and noncritData are patches of the existing stream files,
+                               // each a u64 offset and a u64 length followed by that many bytes
+    };
+
+    // Writes an intent to its stream files (no syncing needed)
+    using ApplyFn = std::function<bool(const Intent&)>;
+    // Makes the stream files of basePath durable
+    using SyncFn = std::function<bool(const std::string& basePath)>;
+
+    /**
+     * @param logPath path of the log file
+     * @param apply applies a committed intent to the stream files
+     * @param sync syncs the stream files of a base path at checkpoint time
+     * @param checkpointBytes log size after which a checkpoint is taken
+     */
+    IntentLog(const std::string& logPath, ApplyFn apply, SyncFn sync, size_t checkpointBytes = 64 * 1024 * 1024);
+    IntentLog(const IntentLog&) = delete;
+    IntentLog& operator=(const IntentLog&) = delete;
+    ~IntentLog();
+
+    /**
+     * @brief Opens the log, replays every complete record left from a previous run and checkpoints.
+     * @return true if successful, false otherwise
+     */
+    bool open();
+
+    /**
+     * @brief Appends the intent, waits until its batch is durable and applied.
+     * @return true if the intent is durable and applied, false otherwise
+     */
+    bool commit(const Intent& intent);
+
+    /**
+     * @brief Syncs every stream file touched since the last checkpoint and truncates the log.
+     */
+    bool checkpoint();
+
+    /**
+     * @brief Checkpoints if records of basePath may still be in the log. Called before the
+     * file is unlinked or renamed, replaying its records would otherwise bring it back.
+     */
+    bool checkpointIfDirty(const std::string& basePath);
+
+    /**
+     * @brief Starts / stops a thread that checkpoints a non-empty log periodically.
+     */
+    void startCheckpointer(unsigned intervalSeconds = 30);
+    void stopCheckpointer();
+
+private:
+    struct Pending {
+        const Intent* intent;
+        std::vector<char> header;
+        bool done = false;
+        bool ok = false;
+    };
+
+    std::string logPath;
+    ApplyFn apply;
+    SyncFn sync;
+    size_t checkpointBytes;
+
+    int fd = -1;
+    uint64_t logSize = 0;
+    uint64_t nextSequence = 1;
+    std::set<std::string> dirtyPaths; // applied since the last checkpoint
+
+    std::mutex mutex;
+    std::condition_variable idle;
+    bool busy = false; // a group-commit leader or the checkpointer owns the log
+    std::vector<Pending*> queue;
+
+    std::thread checkpointer;
+    std::condition_variable checkpointerWake;
+    bool stopping = false;
+
+    bool writeBatch(const std::vector<Pending*>& batch);
+    bool checkpointLocked(std::unique_lock<std::mutex>& lock);
+    bool replay();
+    void acquire(std::unique_lock<std::mutex>& lock);
+    void release(std::unique_lock<std::mutex>& lock);
+};
+
+#endif // INTENT_LOG_H
@@ -0,0 +1,123 @@
+#include "MarkerScan.h"
+
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MARKER_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+size_t scanScalar(const char* data, size_t size) {
+    size_t offset = 0;
+    while (offset < size) {
+        const void* found = std::memchr(data + offset, 0xFF, size - offset);
+        if (!found) {
+            return size;
+        }
+        offset = static_cast<const char*>(found) - data;
+        if (offset + 1 < size && data[offset + 1] == 0x00) {
+            offset += 2; // stuffed byte
+            continue;
+        }
+        return offset;
+    }
+    return size;
+}
+
+// The vector scanners compare a block against 0xFF and the same block shifted by one byte
+// against 0x00, so a stuffed pair is rejected without a branch per byte. A block needs one
+// byte past its end for that, so the last bytes of the data are left to the scalar scan.
+
+#ifdef MARKER_SCAN_X86
+
+__attribute__((target("sse2")))
+size_t scanSse2(const char* data, size_t size) {
+    const __m128i ff = _mm_set1_epi8(static_cast<char>(0xFF));
+    const __m128i zero = _mm_setzero_si128();
+    size_t offset = 0;
+    while (offset + 17 <= size) {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset));
+        uint32_t candidates = _mm_movemask_epi8(_mm_cmpeq_epi8(block, ff));
+        if (candidates != 0) {
+            __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + offset + 1));
+            uint32_t stuffed = _mm_movemask_epi8(_mm_cmpeq_epi8(next, zero));
+            uint32_t markers = candidates & ~stuffed;
+            if (markers != 0) {
+                return offset + __builtin_ctz(markers);
+            }
+        }
+        offset += 16;
+    }
+    return offset + scanScalar(data + offset, size - offset);
+}
+
+__attribute__((target("avx2")))
+size_t scanAvx2(const char* data, size_t size) {
+    const __m256i ff = _mm256_set1_epi8(static_cast<char>(0xFF));
+    const __m256i zero = _mm256_setzero_si256();
+    size_t offset = 0;
+    while (offset + 65 <= size) {
+        // Two blocks per iteration: entropy-coded data rarely contains 0xFF at all
+        __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset));
+        __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset + 32));
+        __m256i either = _mm256_or_si256(_mm256_cmpeq_epi8(low, ff), _mm256_cmpeq_epi8(high, ff));
+        if (_mm256_testz_si256(either, either)) {
+            offset += 64;
+            continue;
+        }
+        for (size_t half = 0; half < 64; half += 32) {
+            __m256i block = half ? high : low;
+            uint32_t candidates = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, ff));
+            if (candidates == 0) {
+                continue;
+            }
+            __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + offset + half + 1));
+            uint32_t stuffed = _mm256_movemask_epi8(_mm256_cmpeq_epi8(next, zero));
+            uint32_t markers = candidates & ~stuffed;
+            if (markers != 0) {
+                return offset + half + __builtin_ctz(markers);
+            }
+        }
+        offset += 64;
+    }
+    return offset + scanScalar(data + offset, size - offset);
+}
+
+#endif // MARKER_SCAN_X86
+
+MarkerScanner selectScanner() {
+#ifdef MARKER_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return scanAvx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return scanSse2;
+    }
+#endif
+    return scanScalar;
+}
+
+} // namespace
+
+size_t findJpegMarker(const char* data, size_t size) {
+    static const MarkerScanner scanner = selectScanner();
+    return scanner(data, size);
+}
+
+std::vector<MarkerScanImpl> availableMarkerScanners() {
+    std::vector<MarkerScanImpl> scanners = {{"scalar", scanScalar}};
+#ifdef MARKER_SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        scanners.push_back({"sse2", scanSse2});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        scanners.push_back({"avx2", scanAvx2});
+    }
+#endif
+    return scanners;
+}
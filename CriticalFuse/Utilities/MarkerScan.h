@@ -0,0 +1,33 @@
+#ifndef MARKER_SCAN_H
+#define MARKER_SCAN_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * @brief Finds the first 0xFF in JPEG entropy-coded data that is not a stuffed 0xFF00.
+ * A 0xFF in the last byte is returned as well, since its successor is not known yet.
+ * Restart markers are returned like any other marker; the caller decides to resume the scan.
+ *
+ * Uses AVX2 or SSE2 when the CPU supports them, chosen once at startup.
+ *
+ * @param data entropy-coded bytes
+ * @param size number of bytes
+ * @return size_t offset of the marker's 0xFF, or size if there is none
+ */
+size_t findJpegMarker(const char* data, size_t size);
+
+typedef size_t (*MarkerScanner)(const char* data, size_t size);
+
+struct MarkerScanImpl {
+    const char* name;
+    MarkerScanner scan;
+};
+
+/**
+ * @brief All implementations of findJpegMarker this CPU can run, scalar first.
+ * Used to benchmark and cross-check them.
+ */
+std::vector<MarkerScanImpl> availableMarkerScanners();
+
+#endif // MARKER_SCAN_H
@@ -0,0 +1,78 @@
+#include "Metrics.h"
+
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+namespace {
+
+thread_local uint64_t threadAllocations = 0;
+std::atomic<uint64_t> totalAllocations{0};
+
+void* countedAllocate(size_t size) {
+    threadAllocations++;
+    totalAllocations.fetch_add(1, std::memory_order_relaxed);
+    void* memory = std::malloc(size ? size : 1);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+void* countedAllocate(size_t size, std::align_val_t alignment) {
+    threadAllocations++;
+    totalAllocations.fetch_add(1, std::memory_order_relaxed);
+    size_t align = static_cast<size_t>(alignment);
+    void* memory = std::aligned_alloc(align, (size + align - 1) / align * align);
+    if (!memory) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+} // namespace
+
+// Replacement global allocation functions: plain malloc/free plus a per-thread counter
+void* operator new(size_t size) { return countedAllocate(size); }
+void* operator new[](size_t size) { return countedAllocate(size); }
+void* operator new(size_t size, std::align_val_t alignment) { return countedAllocate(size, alignment); }
+void* operator new[](size_t size, std::align_val_t alignment) { return countedAllocate(size, alignment); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+std::string Metrics::render() const {
+    std::ostringstream out;
+    out << "split_reads " << splitReads.load() << '\n'
+        << "split_read_allocations " << splitReadAllocations.load() << '\n'
+        << "split_writes " << splitWrites.load() << '\n'
+        << "split_write_allocations " << splitWriteAllocations.load() << '\n'
+        << "arena_overflow_bytes " << arenaOverflowBytes.load() << '\n'
+        << "checksum_mismatches " << checksumMismatches.load() << '\n'
+        << "recovered_blocks " << recoveredBlocks.load() << '\n'
+        << "hedged_reads " << hedgedReads.load() << '\n'
+        << "hedge_wins " << hedgeWins.load() << '\n'
+        << "degraded_reads " << degradedReads.load() << '\n'
+        << "auth_failures " << authFailures.load() << '\n'
+        << "decompressed_blocks " << decompressedBlocks.load() << '\n'
+        << "heap_allocations " << totalAllocationCount() << '\n';
+    return out.str();
+}
+
+Metrics& getMetrics() {
+    static Metrics metrics;
+    return metrics;
+}
+
+uint64_t threadAllocationCount() {
+    return threadAllocations;
+}
+
+uint64_t totalAllocationCount() {
+    return totalAllocations.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,46 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * Process-wide counters of the split-file request path, shown in the mount's /.stats file.
+ *
+ * Heap allocations are counted by the replacement operator new in Metrics.cpp, so a request
+ * can measure the allocations it made with threadAllocationCount() before and after.
+ */
+struct Metrics {
+    std::atomic<uint64_t> splitReads{0};
+    std::atomic<uint64_t> splitReadAllocations{0};  // heap allocations made by splitReads
+    std::atomic<uint64_t> splitWrites{0};
+    std::atomic<uint64_t> splitWriteAllocations{0}; // heap allocations made by splitWrites
+    std::atomic<uint64_t> arenaOverflowBytes{0};    // request memory that did not fit in the thread's arena
+    std::atomic<uint64_t> checksumMismatches{0};    // critical blocks that failed CRC32C verification on read
+    std::atomic<uint64_t> recoveredBlocks{0};       // of those, blocks rebuilt from the .parity sidecar
+    std::atomic<uint64_t> hedgedReads{0};           // critical reads also sent to a replica after the deadline
+    std::atomic<uint64_t> hedgeWins{0};             // of those, reads a replica answered first
+    std::atomic<uint64_t> degradedReads{0};         // non-critical reads answered with zeros, past the budget or failed
+    std::atomic<uint64_t> authFailures{0};          // encrypted critical blocks whose tag did not match on read
+    std::atomic<uint64_t> decompressedBlocks{0};    // compressed non-critical blocks decompressed by reads
+
+    /**
+     * @brief Formats the counters as "name value" lines.
+     */
+    std::string render() const;
+};
+
+Metrics& getMetrics();
+
+/**
+ * @brief Number of heap allocations (operator new) the calling thread has made so far.
+ */
+uint64_t threadAllocationCount();
+
+/**
+ * @brief Number of heap allocations (operator new) made by all threads so far.
+ */
+uint64_t totalAllocationCount();
+
+#endif // METRICS_H
@@ -1,7 +1,7 @@
 #include "Range.h"
 #include <stdexcept>
 
-Range::Range(int start, int end) : startIdx(start), endIdx(end) {
+Range::Range(int64_t start, int64_t end) : startIdx(start), endIdx(end) {
     if (start > end) {
         throw std::invalid_argument("Start index cannot be greater than end index.");
     }
@@ -9,29 +9,29 @@ Range::Range(int start, int end) : startIdx(start), endIdx(end) {
 
 Range::Range(const Range& other) : startIdx(other.startIdx), endIdx(other.endIdx) {}
 
-int Range::getStart() const {
+int64_t Range::getStart() const {
     return startIdx;
 }
 
-int Range::getEnd() const {
+int64_t Range::getEnd() const {
     return endIdx;
 }
 
-void Range::setStart(int start) {
+void Range::setStart(int64_t start) {
     if (start > endIdx) {
         throw std::invalid_argument("Start index cannot be greater than end index.");
     }
     startIdx = start;
 }
 
-void Range::setEnd(int end) {
+void Range::setEnd(int64_t end) {
     if (end < startIdx) {
         throw std::invalid_argument("End index cannot be less than start index.");
     }
     endIdx = end;
 }
 
-bool Range::contains(int index) const {
+bool Range::contains(int64_t index) const {
     return index >= startIdx && index <= endIdx;
 }
 
@@ -1,26 +1,27 @@
 #ifndef RANGE_H
 #define RANGE_H
 
+#include <cstdint>
 
 class Range {
-    // Represents a close range [startIdx, endIdx]  
+    // Represents a close range [startIdx, endIdx] of 64-bit file offsets
 private:
-    int startIdx;
-    int endIdx;
+    int64_t startIdx;
+    int64_t endIdx;
 
 public:
     Range() : startIdx(0), endIdx(0) {} // Default constructor
-    Range(int start, int end);
+    Range(int64_t start, int64_t end);
     Range(const Range& other); // Copy constructor
     ~Range() = default; // Destructor
 
-    int getStart() const;
-    int getEnd() const;
+    int64_t getStart() const;
+    int64_t getEnd() const;
 
-    void setStart(int start);
-    void setEnd(int end);
+    void setStart(int64_t start);
+    void setEnd(int64_t end);
 
-    bool contains(int index) const;
+    bool contains(int64_t index) const;
 
     bool operator==(const Range& other) const;
     bool operator!=(const Range& other) const;
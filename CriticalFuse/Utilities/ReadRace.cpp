@@ -0,0 +1,119 @@
+#include "ReadRace.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <sys/uio.h>    // For preadv2
+#include <unistd.h>     // For pread, close
+
+namespace {
+
+// Reads still running in all races
+std::mutex runningMutex;
+size_t runningReads = 0;
+
+bool readAll(int fd, char* buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytesRead = pread(fd, buffer + done, size - done, offset + done);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return false;
+        }
+        done += bytesRead;
+    }
+    return true;
+}
+
+} // namespace
+
+struct ReadRace::State {
+    size_t size;
+    off_t offset;
+    std::mutex mutex;
+    std::condition_variable answered;
+    std::vector<std::unique_ptr<char[]>> buffers; // one per read, in start order
+    int winner = -1;
+    size_t pending = 0; // reads still running
+};
+
+ReadRace::ReadRace(size_t size, off_t offset) : state(std::make_shared<State>()) {
+    state->size = size;
+    state->offset = offset;
+}
+
+bool ReadRace::readCached(int fd, char* buffer, size_t size, off_t offset) {
+#ifdef RWF_NOWAIT
+    struct iovec cached = {buffer, size};
+    return preadv2(fd, &cached, 1, offset, RWF_NOWAIT) == static_cast<ssize_t>(size);
+#else
+    (void) fd; (void) buffer; (void) size; (void) offset;
+    return false;
+#endif
+}
+
+void ReadRace::start(int fd, Finished finished) {
+    size_t index;
+    char* buffer;
+    {
+        std::lock_guard<std::mutex> lock(state->mutex);
+        index = state->buffers.size();
+        state->buffers.emplace_back(new char[state->size]);
+        buffer = state->buffers.back().get();
+        state->pending++;
+    }
+    {
+        std::lock_guard<std::mutex> lock(runningMutex);
+        runningReads++;
+    }
+    std::thread([race = state, index, buffer, fd, finished]() {
+        auto start = std::chrono::steady_clock::now();
+        bool ok = readAll(fd, buffer, race->size, race->offset);
+        close(fd);
+        if (finished) {
+            finished(ok, std::chrono::steady_clock::now() - start);
+        }
+        {
+            std::lock_guard<std::mutex> lock(race->mutex);
+            race->pending--;
+            if (ok && race->winner < 0) {
+                race->winner = static_cast<int>(index);
+            }
+            race->answered.notify_all();
+        }
+        std::lock_guard<std::mutex> lock(runningMutex);
+        runningReads--;
+    }).detach();
+}
+
+bool ReadRace::wait(std::chrono::nanoseconds timeout) {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->answered.wait_for(lock, timeout, [this]() { return state->winner >= 0 || state->pending == 0; });
+    return state->winner >= 0;
+}
+
+bool ReadRace::wait() {
+    std::unique_lock<std::mutex> lock(state->mutex);
+    state->answered.wait(lock, [this]() { return state->winner >= 0 || state->pending == 0; });
+    return state->winner >= 0;
+}
+
+int ReadRace::winner() const {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    return state->winner;
+}
+
+void ReadRace::copyAnswer(char* buffer) const {
+    std::lock_guard<std::mutex> lock(state->mutex);
+    std::memcpy(buffer, state->buffers[state->winner].get(), state->size);
+}
+
+size_t ReadRace::running() {
+    std::lock_guard<std::mutex> lock(runningMutex);
+    return runningReads;
+}
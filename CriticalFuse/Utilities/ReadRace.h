@@ -0,0 +1,73 @@
+#ifndef READ_RACE_H
+#define READ_RACE_H
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <sys/types.h>  // For off_t
+
+/**
+ * One range read from one or more files at once, each on a thread of its own into a private
+ * buffer, so the caller can wait for the first full answer with a deadline and walk away from
+ * reads that are too slow. Abandoned reads finish on their own and their answers are dropped.
+ */
+class ReadRace {
+public:
+    // Reads of all races allowed to run at once. Past it callers read synchronously instead of
+    // starting more threads, which storage that stopped answering would pile up without limit.
+    static constexpr size_t MAX_RUNNING = 64;
+
+    // Called on the reading thread once a read finished, with whether it read the whole range
+    using Finished = std::function<void(bool ok, std::chrono::nanoseconds latency)>;
+
+    ReadRace(size_t size, off_t offset);
+
+    /**
+     * @brief Reads the range into buffer if the page cache holds all of it, without blocking
+     * on the disk (RWF_NOWAIT).
+     *
+     * @return true if it did, false if the range has to come from the disk
+     */
+    static bool readCached(int fd, char* buffer, size_t size, off_t offset);
+
+    /**
+     * @brief Starts reading the range from fd, which the read takes ownership of.
+     */
+    void start(int fd, Finished finished = nullptr);
+
+    /**
+     * @brief Waits until a read answered in full, every read started so far failed, or the
+     * timeout passed.
+     *
+     * @return true if an answer is there, false otherwise
+     */
+    bool wait(std::chrono::nanoseconds timeout);
+
+    /**
+     * @brief Like wait, without a timeout.
+     */
+    bool wait();
+
+    /**
+     * @brief Index (in start order) of the read that answered first, -1 if none did yet.
+     */
+    int winner() const;
+
+    /**
+     * @brief Copies the first answer into buffer. Only valid after wait returned true.
+     */
+    void copyAnswer(char* buffer) const;
+
+    /**
+     * @brief Number of reads of all races still running, abandoned ones included.
+     */
+    static size_t running();
+
+private:
+    struct State;
+
+    std::shared_ptr<State> state;
+};
+
+#endif // READ_RACE_H
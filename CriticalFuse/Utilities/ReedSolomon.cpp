@@ -0,0 +1,253 @@
+#include "ReedSolomon.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+#define GF_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+const unsigned FIELD_POLYNOMIAL = 0x11D; // x^8 + x^4 + x^3 + x^2 + 1
+
+// Logarithms and products in GF(2^8). low[c] and high[c] hold the products of c with the 16
+// values of a low and of a high nibble, for the PSHUFB kernels.
+struct GfTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t product[256][256];
+    alignas(16) uint8_t low[256][16];
+    alignas(16) uint8_t high[256][16];
+
+    GfTables() {
+        unsigned value = 1;
+        for (unsigned i = 0; i < 255; ++i) {
+            exp[i] = exp[i + 255] = static_cast<uint8_t>(value);
+            log[value] = static_cast<uint8_t>(i);
+            value <<= 1;
+            if (value & 0x100) {
+                value ^= FIELD_POLYNOMIAL;
+            }
+        }
+        exp[510] = exp[511] = exp[0];
+        log[0] = 0; // never used, zero has no logarithm
+
+        for (unsigned a = 0; a < 256; ++a) {
+            for (unsigned b = 0; b < 256; ++b) {
+                product[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+            }
+            for (unsigned nibble = 0; nibble < 16; ++nibble) {
+                low[a][nibble] = product[a][nibble];
+                high[a][nibble] = product[a][nibble << 4];
+            }
+        }
+    }
+
+    uint8_t inverse(uint8_t a) const {
+        return exp[255 - log[a]];
+    }
+};
+
+const GfTables gf;
+
+void gfMulAddTable(uint8_t* dst, const uint8_t* src, uint8_t coefficient, size_t size) {
+    const uint8_t* row = gf.product[coefficient];
+    for (size_t i = 0; i < size; ++i) {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+#ifdef GF_X86
+
+// Each byte is split into its nibbles, which look up their products in the 16-byte tables of
+// the coefficient; the two products XORed together are the product of the byte.
+__attribute__((target("ssse3")))
+void gfMulAddSsse3(uint8_t* dst, const uint8_t* src, uint8_t coefficient, size_t size) {
+    const __m128i low = _mm_load_si128(reinterpret_cast<const __m128i*>(gf.low[coefficient]));
+    const __m128i high = _mm_load_si128(reinterpret_cast<const __m128i*>(gf.high[coefficient]));
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low, _mm_and_si128(bytes, mask)),
+                                        _mm_shuffle_epi8(high, _mm_and_si128(_mm_srli_epi64(bytes, 4), mask)));
+        __m128i* out = reinterpret_cast<__m128i*>(dst + i);
+        _mm_storeu_si128(out, _mm_xor_si128(_mm_loadu_si128(out), product));
+    }
+    gfMulAddTable(dst + i, src + i, coefficient, size - i);
+}
+
+__attribute__((target("avx2")))
+void gfMulAddAvx2(uint8_t* dst, const uint8_t* src, uint8_t coefficient, size_t size) {
+    // VPSHUFB looks up within each 128-bit lane, so both lanes get the same tables
+    const __m256i low = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(gf.low[coefficient])));
+    const __m256i high = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(gf.high[coefficient])));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low, _mm256_and_si256(bytes, mask)),
+                                           _mm256_shuffle_epi8(high, _mm256_and_si256(_mm256_srli_epi64(bytes, 4), mask)));
+        __m256i* out = reinterpret_cast<__m256i*>(dst + i);
+        _mm256_storeu_si256(out, _mm256_xor_si256(_mm256_loadu_si256(out), product));
+    }
+    gfMulAddTable(dst + i, src + i, coefficient, size - i);
+}
+
+#endif // GF_X86
+
+GfMulAddFunction selectGfMulAdd() {
+#ifdef GF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return gfMulAddAvx2;
+    }
+    if (__builtin_cpu_supports("ssse3")) {
+        return gfMulAddSsse3;
+    }
+#endif
+    return gfMulAddTable;
+}
+
+// Inverts the n x n matrix in place with Gauss-Jordan elimination, false if it is singular
+bool invert(std::vector<uint8_t>& matrix, unsigned n) {
+    std::vector<uint8_t> inverse(n * n, 0);
+    for (unsigned i = 0; i < n; ++i) {
+        inverse[i * n + i] = 1;
+    }
+    for (unsigned column = 0; column < n; ++column) {
+        unsigned pivot = column;
+        while (pivot < n && matrix[pivot * n + column] == 0) {
+            pivot++;
+        }
+        if (pivot == n) {
+            return false;
+        }
+        for (unsigned j = 0; j < n; ++j) {
+            std::swap(matrix[pivot * n + j], matrix[column * n + j]);
+            std::swap(inverse[pivot * n + j], inverse[column * n + j]);
+        }
+        uint8_t scale = gf.inverse(matrix[column * n + column]);
+        for (unsigned j = 0; j < n; ++j) {
+            matrix[column * n + j] = gf.product[scale][matrix[column * n + j]];
+            inverse[column * n + j] = gf.product[scale][inverse[column * n + j]];
+        }
+        for (unsigned row = 0; row < n; ++row) {
+            uint8_t factor = matrix[row * n + column];
+            if (row == column || factor == 0) {
+                continue;
+            }
+            for (unsigned j = 0; j < n; ++j) {
+                matrix[row * n + j] ^= gf.product[factor][matrix[column * n + j]];
+                inverse[row * n + j] ^= gf.product[factor][inverse[column * n + j]];
+            }
+        }
+    }
+    matrix.swap(inverse);
+    return true;
+}
+
+} // namespace
+
+void gfMulAdd(uint8_t* dst, const uint8_t* src, uint8_t coefficient, size_t size) {
+    static const GfMulAddFunction compute = selectGfMulAdd();
+    compute(dst, src, coefficient, size);
+}
+
+std::vector<GfMulAddImpl> availableGfMulAdd() {
+    std::vector<GfMulAddImpl> implementations = {{"table", gfMulAddTable}};
+#ifdef GF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3")) {
+        implementations.push_back({"ssse3", gfMulAddSsse3});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        implementations.push_back({"avx2", gfMulAddAvx2});
+    }
+#endif
+    return implementations;
+}
+
+ReedSolomon::ReedSolomon(unsigned dataShards, unsigned parityShards, GfMulAddFunction mulAdd)
+    : dataCount(dataShards), parityCount(parityShards), cauchy(parityShards * dataShards),
+      mulAdd(mulAdd ? mulAdd : gfMulAdd) {
+    // 1 / (x_r + y_j) with x_r = dataShards + r and y_j = j, distinct while the shards fit the field
+    for (unsigned r = 0; r < parityShards; ++r) {
+        for (unsigned j = 0; j < dataShards; ++j) {
+            cauchy[r * dataShards + j] = gf.inverse(static_cast<uint8_t>((dataShards + r) ^ j));
+        }
+    }
+}
+
+unsigned ReedSolomon::dataShards() const {
+    return dataCount;
+}
+
+unsigned ReedSolomon::parityShards() const {
+    return parityCount;
+}
+
+void ReedSolomon::encode(const uint8_t* const* data, uint8_t* const* parity, size_t size) const {
+    for (unsigned r = 0; r < parityCount; ++r) {
+        std::memset(parity[r], 0, size);
+        for (unsigned j = 0; j < dataCount; ++j) {
+            mulAdd(parity[r], data[j], cauchy[r * dataCount + j], size);
+        }
+    }
+}
+
+bool ReedSolomon::reconstruct(uint8_t* const* shards, const std::vector<unsigned>& erased, size_t size) const {
+    std::vector<bool> lost(dataCount + parityCount, false);
+    std::vector<unsigned> lostData;
+    for (unsigned index : erased) {
+        if (index < dataCount + parityCount && !lost[index]) {
+            lost[index] = true;
+            if (index < dataCount) {
+                lostData.push_back(index);
+            }
+        }
+    }
+    if (lostData.empty()) {
+        return true;
+    }
+    std::vector<unsigned> rows;
+    for (unsigned r = 0; r < parityCount && rows.size() < lostData.size(); ++r) {
+        if (!lost[dataCount + r]) {
+            rows.push_back(r);
+        }
+    }
+    if (rows.size() < lostData.size()) {
+        return false;
+    }
+
+    // Each parity row, minus what the surviving data contributes to it, is a combination of
+    // the lost data shards only; the inverse of those coefficients recovers them
+    unsigned n = static_cast<unsigned>(lostData.size());
+    std::vector<uint8_t> matrix(n * n);
+    std::vector<uint8_t> syndromes(n * size);
+    for (unsigned i = 0; i < n; ++i) {
+        const uint8_t* row = &cauchy[rows[i] * dataCount];
+        uint8_t* syndrome = &syndromes[i * size];
+        std::memcpy(syndrome, shards[dataCount + rows[i]], size);
+        for (unsigned j = 0; j < dataCount; ++j) {
+            if (!lost[j]) {
+                mulAdd(syndrome, shards[j], row[j], size);
+            }
+        }
+        for (unsigned j = 0; j < n; ++j) {
+            matrix[i * n + j] = row[lostData[j]];
+        }
+    }
+    if (!invert(matrix, n)) {
+        return false;
+    }
+    for (unsigned j = 0; j < n; ++j) {
+        uint8_t* shard = shards[lostData[j]];
+        std::memset(shard, 0, size);
+        for (unsigned i = 0; i < n; ++i) {
+            mulAdd(shard, &syndromes[i * size], matrix[j * n + i], size);
+        }
+    }
+    return true;
+}
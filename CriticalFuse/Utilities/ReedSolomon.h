@@ -0,0 +1,73 @@
+#ifndef REED_SOLOMON_H
+#define REED_SOLOMON_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Multiplies size bytes of src by coefficient in GF(2^8) and adds (XORs) them to dst.
+ *
+ * Uses PSHUFB lookups of the products of both nibbles, 32 bytes at a time with AVX2 or 16 with
+ * SSSE3 when the CPU supports them, chosen once at startup; a 64 KiB product table otherwise.
+ */
+void gfMulAdd(uint8_t* dst, const uint8_t* src, uint8_t coefficient, size_t size);
+
+typedef void (*GfMulAddFunction)(uint8_t* dst, const uint8_t* src, uint8_t coefficient, size_t size);
+
+struct GfMulAddImpl {
+    const char* name;
+    GfMulAddFunction compute;
+};
+
+/**
+ * @brief All implementations of gfMulAdd this CPU can run, table-driven first.
+ * Used to benchmark and cross-check them.
+ */
+std::vector<GfMulAddImpl> availableGfMulAdd();
+
+/**
+ * Systematic Reed-Solomon code over GF(2^8): dataShards equally sized shards get parityShards
+ * parity shards, and any dataShards of the dataShards + parityShards shards rebuild the rest.
+ *
+ * The parity rows are a Cauchy matrix, so every square submatrix of the generator is
+ * invertible and decoding never depends on which shards were lost.
+ */
+class ReedSolomon {
+public:
+    static const unsigned MAX_SHARDS = 256; // dataShards + parityShards
+
+    /**
+     * @param mulAdd the GF(2^8) kernel to use, the one gfMulAdd dispatches to by default
+     */
+    ReedSolomon(unsigned dataShards, unsigned parityShards, GfMulAddFunction mulAdd = nullptr);
+
+    unsigned dataShards() const;
+    unsigned parityShards() const;
+
+    /**
+     * @brief Computes the parity shards of data.
+     *
+     * @param data dataShards pointers to size bytes each
+     * @param parity parityShards pointers to size bytes each, overwritten
+     */
+    void encode(const uint8_t* const* data, uint8_t* const* parity, size_t size) const;
+
+    /**
+     * @brief Rebuilds the erased data shards from the shards that are left.
+     *
+     * @param shards dataShards data shards followed by parityShards parity shards, size bytes each
+     * @param erased indices into shards of the ones that are lost; erased data shards are
+     * overwritten, erased parity shards are not used
+     * @return true if successful, false if fewer parity shards are left than data shards are lost
+     */
+    bool reconstruct(uint8_t* const* shards, const std::vector<unsigned>& erased, size_t size) const;
+
+private:
+    unsigned dataCount;
+    unsigned parityCount;
+    std::vector<uint8_t> cauchy; // parityCount x dataCount, row-major
+    GfMulAddFunction mulAdd;
+};
+
+#endif // REED_SOLOMON_H
@@ -0,0 +1,252 @@
+#include "ReplicaSet.h"
+#include "Metrics.h"
+#include "ReadRace.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>      // For open
+#include <sys/stat.h>   // For mkdir, fstat
+#include <unistd.h>     // For pread, pwrite, copy_file_range, ftruncate, dup
+
+namespace {
+
+const size_t COPY_BLOCK = 1024 * 1024;
+
+bool readAll(int fd, char* buffer, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytesRead = pread(fd, buffer + done, size - done, offset + done);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return false;
+        }
+        done += bytesRead;
+    }
+    return true;
+}
+
+// Copies [from, to) of in to the same offsets of out, in the kernel where it can
+bool copyRange(int in, int out, uint64_t from, uint64_t to) {
+    while (from < to) {
+        loff_t inOffset = from;
+        loff_t outOffset = from;
+        ssize_t copied = copy_file_range(in, &inOffset, out, &outOffset, to - from, 0);
+        if (copied < 0 && errno == EINTR) {
+            continue;
+        }
+        if (copied <= 0) {
+            break;
+        }
+        from += copied;
+    }
+
+    // Across file systems older kernels refuse, and the rest is copied by hand
+    std::vector<char> block;
+    while (from < to) {
+        block.resize(std::min<uint64_t>(COPY_BLOCK, to - from));
+        if (!readAll(in, block.data(), block.size(), from)) {
+            return false;
+        }
+        for (size_t written = 0; written < block.size();) {
+            ssize_t res = pwrite(out, block.data() + written, block.size() - written, from + written);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res < 0) {
+                return false;
+            }
+            written += res;
+        }
+        from += block.size();
+    }
+    return true;
+}
+
+// Creates the directories leading to path
+bool makeParents(const std::string& path) {
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1)) {
+        std::string dir = path.substr(0, slash);
+        if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace
+
+ReplicaSet::ReplicaSet(const std::string& primaryRoot, const std::vector<std::string>& replicaRoots,
+                       unsigned percentile, std::chrono::microseconds initialDeadline)
+    : primaryRoot(primaryRoot), replicaRoots(replicaRoots), percentile(std::min(percentile, 100u)),
+      initialDeadline(initialDeadline), window(std::make_shared<LatencyWindow>()) {}
+
+bool ReplicaSet::open() {
+    // Resolved once, the daemon may change its working directory
+    for (std::string& root : replicaRoots) {
+        char resolved[PATH_MAX];
+        if (!makeParents(root + "/") || realpath(root.c_str(), resolved) == nullptr) {
+            std::perror(("Failed to create replica root " + root).c_str());
+            return false;
+        }
+        root = resolved;
+    }
+    return true;
+}
+
+size_t ReplicaSet::count() const {
+    return replicaRoots.size();
+}
+
+std::string ReplicaSet::replicaPath(std::string_view path, size_t replica) const {
+    if (path.compare(0, primaryRoot.size(), primaryRoot) != 0) {
+        return std::string();
+    }
+    return replicaRoots[replica] + std::string(path.substr(primaryRoot.size()));
+}
+
+bool ReplicaSet::mirror(int fd, const std::string& path, uint64_t from, uint64_t to, uint64_t length) const {
+    bool ok = true;
+    to = std::min(to, length);
+    for (size_t replica = 0; replica < replicaRoots.size(); ++replica) {
+        std::string copyPath = replicaPath(path, replica);
+        if (copyPath.empty() || !makeParents(copyPath)) {
+            std::perror(("Failed to create replica of " + path).c_str());
+            ok = false;
+            continue;
+        }
+        int out = ::open(copyPath.c_str(), O_WRONLY | O_CREAT, 0644);
+        struct stat st;
+        if (out < 0 || fstat(out, &st) == -1) {
+            std::perror(("Failed to open " + copyPath).c_str());
+            if (out >= 0) close(out);
+            ok = false;
+            continue;
+        }
+        // A new replica, or one an earlier failure left short, gets everything
+        uint64_t copyFrom = static_cast<uint64_t>(st.st_size) < from ? 0 : from;
+        if (!copyRange(fd, out, copyFrom, to) || ftruncate(out, length) == -1) {
+            std::perror(("Failed to write " + copyPath).c_str());
+            ok = false;
+        }
+        close(out);
+    }
+    return ok;
+}
+
+void ReplicaSet::remove(const std::string& path) const {
+    for (size_t replica = 0; replica < replicaRoots.size(); ++replica) {
+        std::string copyPath = replicaPath(path, replica);
+        if (!copyPath.empty()) {
+            unlink(copyPath.c_str());
+        }
+    }
+}
+
+void ReplicaSet::rename(const std::string& from, const std::string& to) const {
+    for (size_t replica = 0; replica < replicaRoots.size(); ++replica) {
+        std::string fromCopy = replicaPath(from, replica);
+        std::string toCopy = replicaPath(to, replica);
+        if (!fromCopy.empty() && !toCopy.empty() && makeParents(toCopy)) {
+            ::rename(fromCopy.c_str(), toCopy.c_str());
+        }
+    }
+}
+
+std::chrono::nanoseconds ReplicaSet::deadline() const {
+    uint64_t timed = window->timedReads.load(std::memory_order_relaxed);
+    if (timed < MIN_SAMPLES) {
+        return initialDeadline;
+    }
+    size_t samples = std::min<uint64_t>(timed, LATENCY_SAMPLES);
+    uint64_t recent[LATENCY_SAMPLES];
+    for (size_t i = 0; i < samples; ++i) {
+        recent[i] = window->latencies[i].load(std::memory_order_relaxed);
+    }
+    size_t rank = std::min(samples - 1, samples * percentile / 100);
+    std::nth_element(recent, recent + rank, recent + samples);
+    return std::chrono::nanoseconds(recent[rank]);
+}
+
+void ReplicaSet::LatencyWindow::record(std::chrono::nanoseconds latency) {
+    uint64_t slot = timedReads.fetch_add(1, std::memory_order_relaxed) % LATENCY_SAMPLES;
+    latencies[slot].store(latency.count(), std::memory_order_relaxed);
+}
+
+bool ReplicaSet::read(int fd, std::string_view path, char* buffer, size_t size, off_t offset) {
+    // Cached data cannot be slow, only reads that would go to the disk are hedged
+    if (ReadRace::readCached(fd, buffer, size, offset)) {
+        return true;
+    }
+
+    // Storage that stopped answering has already left this many reads behind
+    if (ReadRace::running() >= ReadRace::MAX_RUNNING) {
+        return readInOrder(fd, path, buffer, size, offset);
+    }
+
+    ReadRace race(size, offset);
+    int primaryFd = dup(fd); // the caller may close fd while the read is still running
+    if (primaryFd >= 0) {
+        // Only the primary's latencies set the deadline, however late they finish
+        race.start(primaryFd, [window = window](bool ok, std::chrono::nanoseconds latency) {
+            if (ok) {
+                window->record(latency);
+            }
+        });
+    }
+
+    // Past each deadline, or once all reads so far failed, the next replica is asked as well
+    bool answered = false;
+    for (size_t next = 0; next < replicaRoots.size(); ++next) {
+        answered = race.wait(deadline());
+        if (answered) {
+            break;
+        }
+        std::string copyPath = replicaPath(path, next);
+        int replicaFd = copyPath.empty() ? -1 : ::open(copyPath.c_str(), O_RDONLY);
+        if (replicaFd >= 0) {
+            race.start(replicaFd);
+            getMetrics().hedgedReads++;
+        }
+    }
+    if (!answered && !race.wait()) {
+        std::cerr << "No copy of " << path << " could be read at offset " << offset << std::endl;
+        errno = EIO;
+        return false;
+    }
+    // Reads are numbered in start order, the primary is 0 if it could be started
+    if (race.winner() > 0 || primaryFd < 0) {
+        getMetrics().hedgeWins++;
+    }
+    race.copyAnswer(buffer);
+    return true;
+}
+
+bool ReplicaSet::readInOrder(int fd, std::string_view path, char* buffer, size_t size, off_t offset) {
+    if (readAll(fd, buffer, size, offset)) {
+        return true;
+    }
+    for (size_t replica = 0; replica < replicaRoots.size(); ++replica) {
+        std::string copyPath = replicaPath(path, replica);
+        int replicaFd = copyPath.empty() ? -1 : ::open(copyPath.c_str(), O_RDONLY);
+        if (replicaFd < 0) {
+            continue;
+        }
+        getMetrics().hedgedReads++;
+        bool ok = readAll(replicaFd, buffer, size, offset);
+        close(replicaFd);
+        if (ok) {
+            getMetrics().hedgeWins++;
+            return true;
+        }
+    }
+    std::cerr << "No copy of " << path << " could be read at offset " << offset << std::endl;
+    errno = EIO;
+    return false;
+}
@@ -0,0 +1,110 @@
+#ifndef REPLICA_SET_H
+#define REPLICA_SET_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <sys/types.h>  // For off_t
+
+/**
+ * Copies of backing files kept under other roots, ideally on other disks, and hedged reads
+ * across them.
+ *
+ * A file at <primaryRoot>/<path> has its replicas at <replicaRoot>/<path>, one per replica
+ * root. A read goes to the primary first; a read the page cache cannot serve right away is
+ * timed against a deadline, the configured percentile of recent uncached reads, and once the
+ * deadline passes (or the read fails) the same range is requested from the next replica and
+ * whichever answer comes first is used. Late reads finish on their own threads into private
+ * buffers and are discarded. Once ReadRace::MAX_RUNNING reads are running, reads go to the
+ * copies one after the other on the caller's thread instead.
+ *
+ * Replicas are plain copies and are not synced: callers check what they read (the .crit
+ * checksums do) and go back to the primary if a replica is stale.
+ */
+class ReplicaSet {
+public:
+    /**
+     * @param primaryRoot backing directory the primary files live in
+     * @param replicaRoots one directory per replica
+     * @param percentile percentile of recent uncached read latencies used as hedging deadline
+     * @param initialDeadline deadline until enough reads were timed
+     */
+    ReplicaSet(const std::string& primaryRoot, const std::vector<std::string>& replicaRoots, unsigned percentile,
+               std::chrono::microseconds initialDeadline);
+    ReplicaSet(const ReplicaSet&) = delete;
+    ReplicaSet& operator=(const ReplicaSet&) = delete;
+
+    /**
+     * @brief Creates the replica roots and resolves them to absolute paths.
+     * @return true if successful, false otherwise
+     */
+    bool open();
+
+    /**
+     * @brief Number of replicas each file has, besides the primary.
+     */
+    size_t count() const;
+
+    /**
+     * @brief Copies [from, to) of the primary file at path into every replica and sets their
+     * length. Replicas that do not exist yet are copied whole.
+     *
+     * @param fd the primary file, open for reading
+     * @return true if every replica was written, false otherwise
+     */
+    bool mirror(int fd, const std::string& path, uint64_t from, uint64_t to, uint64_t length) const;
+
+    /**
+     * @brief Removes the replicas of path.
+     */
+    void remove(const std::string& path) const;
+
+    /**
+     * @brief Renames the replicas of from to to.
+     */
+    void rename(const std::string& from, const std::string& to) const;
+
+    /**
+     * @brief Reads exactly size bytes at offset of the file at path, hedging to the replicas
+     * if the primary is slow or fails. Counted in Metrics::hedgedReads and Metrics::hedgeWins.
+     *
+     * @param fd the primary file, open for reading
+     * @return true if one of the copies answered in full, false otherwise
+     */
+    bool read(int fd, std::string_view path, char* buffer, size_t size, off_t offset);
+
+    /**
+     * @brief Current hedging deadline.
+     */
+    std::chrono::nanoseconds deadline() const;
+
+private:
+    static constexpr size_t LATENCY_SAMPLES = 256; // most recent uncached primary reads
+    static constexpr size_t MIN_SAMPLES = 32;      // before this many, initialDeadline applies
+
+    // Shared with the reads still running, which may finish after the set is gone
+    struct LatencyWindow {
+        std::atomic<uint64_t> latencies[LATENCY_SAMPLES] = {};
+        std::atomic<uint64_t> timedReads{0};
+
+        void record(std::chrono::nanoseconds latency);
+    };
+
+    std::string primaryRoot;
+    std::vector<std::string> replicaRoots;
+    unsigned percentile;
+    std::chrono::nanoseconds initialDeadline;
+    std::shared_ptr<LatencyWindow> window;
+
+    // Where the copy of path under primaryRoot lives for replica, empty if path is elsewhere
+    std::string replicaPath(std::string_view path, size_t replica) const;
+    // Reads the copies one after the other until one answers in full
+    bool readInOrder(int fd, std::string_view path, char* buffer, size_t size, off_t offset);
+};
+
+#endif // REPLICA_SET_H
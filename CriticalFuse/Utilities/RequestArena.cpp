@@ -0,0 +1,61 @@
+#include "RequestArena.h"
+#include "Metrics.h"
+
+#include <vector>
+
+namespace {
+
+// Enough for the mapping and handler of a file with a few thousand extents
+const size_t ARENA_BUFFER_SIZE = 256 * 1024;
+
+// Heap memory the arenas fall back to once their buffer is used up, counted in the metrics
+class OverflowResource : public std::pmr::memory_resource {
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        getMetrics().arenaOverflowBytes += bytes;
+        return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+    }
+
+    void do_deallocate(void* p, size_t bytes, size_t alignment) override {
+        std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+struct ThreadArena {
+    std::vector<char> buffer;
+    OverflowResource overflow;
+    std::pmr::monotonic_buffer_resource arena;
+    unsigned depth = 0; // nested scopes, e.g. copy_file_range running read and write
+
+    ThreadArena() : buffer(ARENA_BUFFER_SIZE), arena(buffer.data(), buffer.size(), &overflow) {}
+};
+
+ThreadArena& threadArena() {
+    thread_local ThreadArena arena;
+    return arena;
+}
+
+} // namespace
+
+RequestScope::RequestScope() {
+    threadArena().depth++;
+}
+
+RequestScope::~RequestScope() {
+    ThreadArena& arena = threadArena();
+    if (--arena.depth == 0) {
+        arena.arena.release(); // back to the start of the buffer
+    }
+}
+
+std::pmr::memory_resource* requestResource() {
+    ThreadArena& arena = threadArena();
+    if (arena.depth == 0) {
+        return std::pmr::new_delete_resource();
+    }
+    return &arena.arena;
+}
@@ -0,0 +1,60 @@
+#ifndef REQUEST_ARENA_H
+#define REQUEST_ARENA_H
+
+#include <memory_resource>
+#include <memory>
+#include <new>
+#include <utility>
+
+/**
+ * Per-thread scratch memory for the duration of one FUSE request.
+ *
+ * Each thread owns a monotonic arena over a buffer it keeps for its lifetime. Allocations made
+ * through requestResource() while a RequestScope is active come from that arena and are all
+ * released together when the outermost scope ends, so a request that fits in the buffer makes
+ * no heap allocations. Outside a scope requestResource() is the regular heap, which keeps
+ * standalone users (HandlerTest, background threads) unaffected.
+ *
+ * Nothing allocated from the arena may outlive the scope it was allocated in.
+ */
+class RequestScope {
+public:
+    RequestScope();
+    ~RequestScope();
+    RequestScope(const RequestScope&) = delete;
+    RequestScope& operator=(const RequestScope&) = delete;
+};
+
+/**
+ * @brief The memory resource for request-local allocations on this thread.
+ */
+std::pmr::memory_resource* requestResource();
+
+// Destroys an object created by makeRequestObject and returns its memory to the resource it came from
+struct RequestObjectDeleter {
+    std::pmr::memory_resource* resource = nullptr;
+    size_t size = 0;
+    size_t alignment = 0;
+
+    template <typename T>
+    void operator()(T* object) const {
+        object->~T();
+        resource->deallocate(const_cast<void*>(static_cast<const void*>(object)), size, alignment);
+    }
+};
+
+template <typename T>
+using RequestPtr = std::unique_ptr<T, RequestObjectDeleter>;
+
+/**
+ * @brief Constructs a T in request-local memory.
+ */
+template <typename T, typename... Args>
+RequestPtr<T> makeRequestObject(Args&&... args) {
+    std::pmr::memory_resource* resource = requestResource();
+    void* memory = resource->allocate(sizeof(T), alignof(T));
+    T* object = new (memory) T(std::forward<Args>(args)...);
+    return RequestPtr<T>(object, RequestObjectDeleter{resource, sizeof(T), alignof(T)});
+}
+
+#endif // REQUEST_ARENA_H
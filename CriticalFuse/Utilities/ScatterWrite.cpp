@@ -0,0 +1,34 @@
+#include "ScatterWrite.h"
+
+#include <algorithm>
+#include <climits>
+
+bool pwritevAll(int fd, std::vector<struct iovec> iov, off_t offset) {
+    size_t index = 0;
+    while (index < iov.size()) {
+        int count = static_cast<int>(std::min<size_t>(iov.size() - index, IOV_MAX));
+        ssize_t written = pwritev(fd, &iov[index], count, offset);
+        if (written < 0) {
+            return false;
+        }
+        offset += written;
+        size_t remaining = static_cast<size_t>(written);
+        while (index < iov.size() && remaining >= iov[index].iov_len) {
+            remaining -= iov[index].iov_len;
+            index++;
+        }
+        if (remaining > 0) {
+            iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + remaining;
+            iov[index].iov_len -= remaining;
+        }
+    }
+    return true;
+}
+
+size_t iovecLength(const std::vector<struct iovec>& iov) {
+    size_t length = 0;
+    for (const struct iovec& piece : iov) {
+        length += piece.iov_len;
+    }
+    return length;
+}
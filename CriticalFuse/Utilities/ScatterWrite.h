@@ -0,0 +1,25 @@
+#ifndef SCATTER_WRITE_H
+#define SCATTER_WRITE_H
+
+#include <vector>
+#include <cstddef>
+#include <sys/types.h>  // For off_t
+#include <sys/uio.h>    // For struct iovec
+
+/**
+ * @brief Writes every byte described by iov to fd at offset with pwritev, at most IOV_MAX
+ * entries per call, resuming after short writes.
+ *
+ * @param fd file to write to
+ * @param iov the pieces to write, in order
+ * @param offset file offset of the first byte
+ * @return true if everything was written, false on an I/O error (errno is set)
+ */
+bool pwritevAll(int fd, std::vector<struct iovec> iov, off_t offset);
+
+/**
+ * @brief Total number of bytes described by iov.
+ */
+size_t iovecLength(const std::vector<struct iovec>& iov);
+
+#endif // SCATTER_WRITE_H
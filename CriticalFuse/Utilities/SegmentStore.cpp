@@ -0,0 +1,522 @@
+#include "SegmentStore.h"
+#include "ScatterWrite.h"
+
+#include <charconv>
+#include <iostream>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>      // For open
+#include <unistd.h>     // For pread, close, unlink
+#include <dirent.h>     // For opendir, readdir
+#include <sys/stat.h>   // For mkdir, fstat
+
+SegmentStore::Segment::~Segment() {
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+SegmentStore::SegmentStore(const std::string& rootDir, size_t smallFileThreshold, size_t maxSegmentSize)
+    : rootDir(rootDir), segmentDir(rootDir + "/.segments"),
+      smallFileThreshold(smallFileThreshold), maxSegmentSize(maxSegmentSize) {}
+
+SegmentStore::~SegmentStore() {
+    stopCompactor();
+    if (indexFd >= 0) {
+        close(indexFd);
+    }
+}
+
+std::string SegmentStore::segmentPath(uint32_t id) const {
+    return segmentDir + "/seg-" + std::to_string(id);
+}
+
+bool SegmentStore::keyFor(const std::string& basePath, std::string& key) const {
+    if (basePath.size() <= rootDir.size() || basePath.compare(0, rootDir.size(), rootDir) != 0 ||
+        basePath[rootDir.size()] != '/') {
+        return false;
+    }
+    key = basePath.substr(rootDir.size());
+    return true;
+}
+
+bool SegmentStore::open() {
+    std::lock_guard<std::mutex> lock(mutex);
+
+    if (mkdir(segmentDir.c_str(), 0755) == -1 && errno != EEXIST) {
+        std::perror("Failed to create segment directory");
+        return false;
+    }
+
+    // Replay the index journal
+    std::string indexPath = segmentDir + "/index";
+    std::ifstream inFile(indexPath);
+    std::string line;
+    while (std::getline(inFile, line)) {
+        std::istringstream iss(line);
+        std::string op;
+        iss >> op;
+        if (op == "PUT") {
+            Entry entry;
+            std::string key;
+            if (!(iss >> entry.segment >> entry.offset >> entry.critLength >> entry.noncritLength)) {
+                std::cerr << "Malformed segment index line: " << line << std::endl;
+                continue;
+            }
+            iss.get(); // separator before the key
+            std::getline(iss, key);
+            index[key] = entry;
+        } else if (op == "DEL") {
+            std::string key;
+            iss.get();
+            std::getline(iss, key);
+            index.erase(key);
+        }
+        journalLines++;
+    }
+    inFile.close();
+
+    // Open every segment file that is still on disk
+    DIR* dp = opendir(segmentDir.c_str());
+    if (!dp) {
+        std::perror("Failed to open segment directory");
+        return false;
+    }
+    struct dirent* de;
+    while ((de = readdir(dp)) != NULL) {
+        if (strncmp(de->d_name, "seg-", 4) != 0) {
+            continue;
+        }
+        // Anything but seg-<id> is not ours, e.g. a file left by an editor
+        const char* digits = de->d_name + 4;
+        const char* digitsEnd = digits + strlen(digits);
+        uint32_t id = 0;
+        auto parsed = std::from_chars(digits, digitsEnd, id);
+        if (digits == digitsEnd || parsed.ec != std::errc() || parsed.ptr != digitsEnd) {
+            std::cerr << "Skipping unexpected file " << de->d_name << " in segment directory" << std::endl;
+            continue;
+        }
+        if (!openSegment(id, false)) {
+            closedir(dp);
+            return false;
+        }
+    }
+    closedir(dp);
+
+    // Account live bytes; entries pointing at missing segments are lost
+    for (auto it = index.begin(); it != index.end();) {
+        auto seg = segments.find(it->second.segment);
+        if (seg == segments.end()) {
+            std::cerr << "Segment " << it->second.segment << " missing for " << it->first << std::endl;
+            it = index.erase(it);
+            continue;
+        }
+        seg->second->liveBytes += it->second.critLength + it->second.noncritLength;
+        ++it;
+    }
+
+    // Continue appending to the newest segment if it still has room
+    if (!segments.empty() && segments.rbegin()->second->size < maxSegmentSize) {
+        activeSegment = segments.rbegin()->first;
+    } else {
+        uint32_t next = segments.empty() ? 1 : segments.rbegin()->first + 1;
+        if (!openSegment(next, true)) {
+            return false;
+        }
+        activeSegment = next;
+    }
+
+    // Sealed segments without live data can go right away
+    for (auto it = segments.begin(); it != segments.end();) {
+        if (it->first != activeSegment && it->second->liveBytes == 0) {
+            unlink(segmentPath(it->first).c_str());
+            it = segments.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    indexFd = ::open(indexPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (indexFd < 0) {
+        std::perror("Failed to open segment index");
+        return false;
+    }
+    return true;
+}
+
+bool SegmentStore::openSegment(uint32_t id, bool create) {
+    std::string path = segmentPath(id);
+    int fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (fd < 0) {
+        std::perror("Failed to open segment");
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        std::perror("fstat failed on segment");
+        close(fd);
+        return false;
+    }
+    auto segment = std::make_shared<Segment>();
+    segment->fd = fd;
+    segment->size = st.st_size;
+    segments[id] = segment;
+    return true;
+}
+
+bool SegmentStore::rollActiveSegment() {
+    uint32_t next = activeSegment + 1;
+    if (!openSegment(next, true)) {
+        return false;
+    }
+    activeSegment = next;
+    compactorWake.notify_one(); // a segment was sealed, it may be worth compacting
+    return true;
+}
+
+bool SegmentStore::accepts(size_t logicalSize) const {
+    return logicalSize <= smallFileThreshold;
+}
+
+void SegmentStore::journal(const std::string& line) {
+    if (write(indexFd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+        std::perror("Failed to append to segment index");
+    }
+    journalLines++;
+}
+
+void SegmentStore::dropEntry(const std::string& key) {
+    auto it = index.find(key);
+    if (it == index.end()) {
+        return;
+    }
+    auto seg = segments.find(it->second.segment);
+    if (seg != segments.end()) {
+        seg->second->liveBytes -= it->second.critLength + it->second.noncritLength;
+    }
+    index.erase(it);
+}
+
+bool SegmentStore::appendEntry(const std::vector<struct iovec>& crit, const std::vector<struct iovec>& noncrit, Entry& entry) {
+    uint64_t critLen = iovecLength(crit);
+    uint64_t noncritLen = iovecLength(noncrit);
+    if (segments[activeSegment]->size + critLen + noncritLen > maxSegmentSize &&
+        segments[activeSegment]->size > 0) {
+        if (!rollActiveSegment()) {
+            return false;
+        }
+    }
+    Segment& segment = *segments[activeSegment];
+
+    // The crit pieces immediately followed by the noncrit pieces
+    std::vector<struct iovec> iov(crit);
+    iov.insert(iov.end(), noncrit.begin(), noncrit.end());
+    if (!pwritevAll(segment.fd, std::move(iov), segment.size)) {
+        std::perror("Failed to append to segment");
+        return false;
+    }
+
+    entry.segment = activeSegment;
+    entry.offset = segment.size;
+    entry.critLength = critLen;
+    entry.noncritLength = noncritLen;
+    segment.size += critLen + noncritLen;
+    segment.liveBytes += critLen + noncritLen;
+    return true;
+}
+
+bool SegmentStore::put(const std::string& basePath, const std::vector<struct iovec>& critData, const std::vector<struct iovec>& noncritData) {
+    std::string key;
+    if (!keyFor(basePath, key)) {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    Entry entry;
+    if (!appendEntry(critData, noncritData, entry)) {
+        return false;
+    }
+    dropEntry(key);
+    index[key] = entry;
+
+    std::ostringstream line;
+    line << "PUT " << entry.segment << ' ' << entry.offset << ' ' << entry.critLength << ' '
+         << entry.noncritLength << ' ' << key << '\n';
+    journal(line.str());
+    return true;
+}
+
+bool SegmentStore::get(const std::string& basePath, std::vector<char>& critData, std::vector<char>& noncritData) {
+    std::string key;
+    if (!keyFor(basePath, key)) {
+        return false;
+    }
+
+    Entry entry;
+    std::shared_ptr<Segment> segment;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return false;
+        }
+        entry = it->second;
+        segment = segments[entry.segment];
+    }
+
+    // Segments are append-only, so the entry stays valid even if the compactor moves it meanwhile
+    critData.resize(entry.critLength);
+    noncritData.resize(entry.noncritLength);
+    struct iovec iov[2];
+    iov[0].iov_base = critData.data();
+    iov[0].iov_len = entry.critLength;
+    iov[1].iov_base = noncritData.data();
+    iov[1].iov_len = entry.noncritLength;
+
+    ssize_t bytesRead = preadv(segment->fd, iov, 2, entry.offset);
+    if (bytesRead < 0 || static_cast<uint64_t>(bytesRead) != entry.critLength + entry.noncritLength) {
+        std::cerr << "Incomplete read from segment " << entry.segment << " for " << key << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool SegmentStore::sync(const std::string& basePath) {
+    std::string key;
+    if (!keyFor(basePath, key)) {
+        return true;
+    }
+
+    std::shared_ptr<Segment> segment;
+    int fd;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it == index.end()) {
+            return true;
+        }
+        segment = segments[it->second.segment];
+        fd = indexFd;
+    }
+    if (fdatasync(segment->fd) == -1 || fdatasync(fd) == -1) {
+        std::perror("fdatasync failed on segment store");
+        return false;
+    }
+    return true;
+}
+
+bool SegmentStore::contains(const std::string& basePath) {
+    std::string key;
+    if (!keyFor(basePath, key)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    return index.count(key) != 0;
+}
+
+void SegmentStore::remove(const std::string& basePath) {
+    std::string key;
+    if (!keyFor(basePath, key)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (index.count(key) == 0) {
+        return;
+    }
+    dropEntry(key);
+    journal("DEL " + key + "\n");
+}
+
+void SegmentStore::rename(const std::string& fromBasePath, const std::string& toBasePath) {
+    std::string fromKey, toKey;
+    if (!keyFor(fromBasePath, fromKey) || !keyFor(toBasePath, toKey)) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(fromKey);
+    if (it == index.end()) {
+        return;
+    }
+    Entry entry = it->second;
+    index.erase(it);
+    dropEntry(toKey); // rename replaces the target
+    index[toKey] = entry;
+
+    std::ostringstream line;
+    line << "PUT " << entry.segment << ' ' << entry.offset << ' ' << entry.critLength << ' '
+         << entry.noncritLength << ' ' << toKey << '\n' << "DEL " << fromKey << '\n';
+    journal(line.str());
+    journalLines++;
+}
+
+size_t SegmentStore::compact(double minLiveRatio) {
+    std::vector<uint32_t> candidates;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& [id, segment] : segments) {
+            if (id != activeSegment && segment->size > 0 &&
+                static_cast<double>(segment->liveBytes) < minLiveRatio * static_cast<double>(segment->size)) {
+                candidates.push_back(id);
+            }
+        }
+    }
+
+    size_t reclaimed = 0;
+    for (uint32_t id : candidates) {
+        std::vector<std::pair<std::string, Entry>> live;
+        std::shared_ptr<Segment> segment;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            segment = segments[id];
+            for (const auto& [key, entry] : index) {
+                if (entry.segment == id) {
+                    live.emplace_back(key, entry);
+                }
+            }
+        }
+
+        // Copy outside the lock, then only repoint entries nobody overwrote in the meantime
+        std::vector<char> data;
+        std::set<uint32_t> targets; // segments the live entries were copied into
+        for (const auto& [key, entry] : live) {
+            data.resize(entry.critLength + entry.noncritLength);
+            ssize_t bytesRead = pread(segment->fd, data.data(), data.size(), entry.offset);
+            if (bytesRead < 0 || static_cast<size_t>(bytesRead) != data.size()) {
+                std::cerr << "Compactor failed to read " << key << " from segment " << id << std::endl;
+                continue;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = index.find(key);
+            if (it == index.end() || it->second.segment != id || it->second.offset != entry.offset) {
+                continue;
+            }
+            Entry moved;
+            if (!appendEntry({{data.data(), entry.critLength}}, {{data.data() + entry.critLength, entry.noncritLength}}, moved)) {
+                continue;
+            }
+            dropEntry(key);
+            index[key] = moved;
+            targets.insert(moved.segment);
+
+            std::ostringstream line;
+            line << "PUT " << moved.segment << ' ' << moved.offset << ' ' << moved.critLength << ' '
+                 << moved.noncritLength << ' ' << key << '\n';
+            journal(line.str());
+        }
+
+        // The copies and their journal lines have to be durable before the originals go,
+        // or a crash could keep the unlink and lose both
+        std::vector<std::shared_ptr<Segment>> copies;
+        int fd;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (segments[id]->liveBytes != 0) {
+                continue;
+            }
+            for (uint32_t target : targets) {
+                auto copy = segments.find(target);
+                if (copy != segments.end()) {
+                    copies.push_back(copy->second);
+                }
+            }
+            fd = indexFd;
+        }
+        bool synced = true;
+        for (const auto& copy : copies) {
+            synced = synced && fdatasync(copy->fd) == 0;
+        }
+        if (!synced || fdatasync(fd) == -1) {
+            std::perror("fdatasync failed on segment store, keeping compacted segment");
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (segments[id]->liveBytes == 0) {
+            // Readers still holding the segment keep its fd alive until they finish
+            segments.erase(id);
+            unlink(segmentPath(id).c_str());
+            reclaimed++;
+        }
+    }
+
+    if (reclaimed > 0) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (journalLines > 2 * index.size() + 1024) {
+            rewriteIndex();
+        }
+    }
+    return reclaimed;
+}
+
+bool SegmentStore::rewriteIndex() {
+    std::string indexPath = segmentDir + "/index";
+    std::string tmpPath = indexPath + ".tmp";
+    {
+        std::ofstream outFile(tmpPath, std::ios::trunc);
+        if (!outFile.is_open()) {
+            std::cerr << "Failed to open file for writing: " << tmpPath << std::endl;
+            return false;
+        }
+        for (const auto& [key, entry] : index) {
+            outFile << "PUT " << entry.segment << ' ' << entry.offset << ' ' << entry.critLength << ' '
+                    << entry.noncritLength << ' ' << key << '\n';
+        }
+    }
+    // The new index has to be on disk before it replaces the journal it was built from
+    int tmpFd = ::open(tmpPath.c_str(), O_RDONLY);
+    if (tmpFd < 0 || fdatasync(tmpFd) == -1) {
+        std::perror("Failed to sync new segment index");
+        if (tmpFd >= 0) close(tmpFd);
+        return false;
+    }
+    close(tmpFd);
+    if (::rename(tmpPath.c_str(), indexPath.c_str()) == -1) {
+        std::perror("Failed to replace segment index");
+        return false;
+    }
+    int fd = ::open(indexPath.c_str(), O_WRONLY | O_APPEND);
+    if (fd < 0) {
+        std::perror("Failed to reopen segment index");
+        return false;
+    }
+    close(indexFd);
+    indexFd = fd;
+    journalLines = index.size();
+    return true;
+}
+
+void SegmentStore::startCompactor(unsigned intervalSeconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (compactor.joinable()) {
+        return;
+    }
+    stopping = false;
+    compactor = std::thread([this, intervalSeconds]() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopping) {
+            compactorWake.wait_for(lock, std::chrono::seconds(intervalSeconds));
+            if (stopping) {
+                break;
+            }
+            lock.unlock();
+            compact();
+            lock.lock();
+        }
+    });
+}
+
+void SegmentStore::stopCompactor() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    compactorWake.notify_all();
+    if (compactor.joinable()) {
+        compactor.join();
+    }
+}
@@ -0,0 +1,127 @@
+#ifndef SEGMENT_STORE_H
+#define SEGMENT_STORE_H
+
+#include <string>
+#include <map>
+#include <unordered_map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <sys/uio.h>    // For struct iovec
+
+/**
+ * Packs the .crit and .noncrit streams of small files into shared append-only segment files.
+ *
+ * Everything lives under <root>/.segments:
+ *   seg-<id>  append-only data; each entry is the crit bytes immediately followed by the noncrit bytes
+ *   index     text journal of "PUT <segment> <offset> <critLen> <noncritLen> <key>" and "DEL <key>" lines
+ *
+ * Keys are the file's base path relative to the root, so a packed file keeps its .mapping
+ * in the backing directory and only its streams move into a segment.
+ * A background compactor copies the live entries out of segments that are mostly dead
+ * (deleted or overwritten entries) and removes them.
+ */
+class SegmentStore {
+public:
+    struct Entry {
+        uint32_t segment = 0;
+        uint64_t offset = 0;
+        uint64_t critLength = 0;
+        uint64_t noncritLength = 0;
+    };
+
+    /**
+     * @param rootDir backing directory the store keys are relative to
+     * @param smallFileThreshold files whose logical size is at most this many bytes are packed
+     * @param maxSegmentSize size after which the active segment is sealed and a new one started
+     */
+    SegmentStore(const std::string& rootDir, size_t smallFileThreshold, size_t maxSegmentSize = 64 * 1024 * 1024);
+    SegmentStore(const SegmentStore&) = delete;
+    SegmentStore& operator=(const SegmentStore&) = delete;
+    ~SegmentStore();
+
+    /**
+     * @brief Loads the index journal and opens the active segment.
+     * @return true if successful, false otherwise
+     */
+    bool open();
+
+    /**
+     * @brief Starts / stops the background compactor thread.
+     */
+    void startCompactor(unsigned intervalSeconds = 30);
+    void stopCompactor();
+
+    /**
+     * @brief Whether a file of the given logical size should be packed.
+     */
+    bool accepts(size_t logicalSize) const;
+
+    /**
+     * @brief Appends the streams of basePath to the active segment and points the index at them.
+     * Any previous entry for basePath becomes dead space.
+     * Each stream is given as the list of pieces it consists of, in order.
+     */
+    bool put(const std::string& basePath, const std::vector<struct iovec>& critData, const std::vector<struct iovec>& noncritData);
+
+    /**
+     * @brief Reads both streams of basePath.
+     * @return false if basePath is not packed or the read failed
+     */
+    bool get(const std::string& basePath, std::vector<char>& critData, std::vector<char>& noncritData);
+
+    /**
+     * @brief Makes the entry of basePath and the index durable.
+     * @return true if successful or basePath is not packed, false otherwise
+     */
+    bool sync(const std::string& basePath);
+
+    bool contains(const std::string& basePath);
+    void remove(const std::string& basePath);
+    void rename(const std::string& fromBasePath, const std::string& toBasePath);
+
+    /**
+     * @brief Moves the live entries out of sealed segments whose live ratio dropped below minLiveRatio.
+     * @return number of segments reclaimed
+     */
+    size_t compact(double minLiveRatio = 0.5);
+
+private:
+    struct Segment {
+        int fd = -1;
+        uint64_t size = 0;      // bytes appended so far
+        uint64_t liveBytes = 0; // bytes still referenced by the index
+        ~Segment();
+    };
+
+    std::string rootDir;
+    std::string segmentDir;
+    size_t smallFileThreshold;
+    size_t maxSegmentSize;
+
+    std::mutex mutex;
+    std::unordered_map<std::string, Entry> index;
+    std::map<uint32_t, std::shared_ptr<Segment>> segments;
+    uint32_t activeSegment = 0;
+    int indexFd = -1;
+    size_t journalLines = 0;
+
+    std::thread compactor;
+    std::condition_variable compactorWake;
+    bool stopping = false;
+
+    bool keyFor(const std::string& basePath, std::string& key) const;
+    std::string segmentPath(uint32_t id) const;
+    bool openSegment(uint32_t id, bool create);
+    bool rollActiveSegment();
+    bool appendEntry(const std::vector<struct iovec>& crit, const std::vector<struct iovec>& noncrit, Entry& entry);
+    void journal(const std::string& line);
+    void dropEntry(const std::string& key);
+    bool rewriteIndex();
+};
+
+#endif // SEGMENT_STORE_H
@@ -0,0 +1,6 @@
+#include "StorageContext.h"
+
+StorageContext& getStorageContext() {
+    static StorageContext context;
+    return context;
+}
@@ -0,0 +1,46 @@
+#ifndef STORAGE_CONTEXT_H
+#define STORAGE_CONTEXT_H
+
+#include <cstddef>
+
+class SegmentStore;
+class IntentLog;
+class ThreadPool;
+class TemplateStore;
+class ReplicaSet;
+struct MountKey;
+
+enum class DurabilityPolicy {
+    STRICT = 0,         // every stream is synced
+    RELAXED_NONCRIT = 1 // .noncrit streams may be lost on a crash, .crit and .mapping are always synced
+};
+
+enum class NoncritCodec {
+    NONE = 0, // .noncrit streams are stored as they are
+    LZ4 = 1,
+    ZSTD = 2
+};
+
+/**
+ * Mount-wide storage services shared by every file handler.
+ * CriticalFUSE fills this in at startup; standalone users (e.g. HandlerTest) leave it
+ * empty and get plain per-file .crit/.noncrit streams.
+ */
+struct StorageContext {
+    SegmentStore* segmentStore = nullptr; // packs the streams of small files, nullptr if disabled
+    IntentLog* intentLog = nullptr;       // write-ahead log for stream updates, nullptr if disabled
+    ThreadPool* workers = nullptr;        // splits, writes and reads large files in parallel, nullptr to stay on the caller
+    size_t mappingIndexThreshold = 0;     // mappings with this many extents are saved as a paged index, 0 keeps text
+    TemplateStore* templateStore = nullptr; // shares the extent lists of identical layouts, nullptr if disabled
+    unsigned parityShards = 0;            // Reed-Solomon parity blocks per stripe of .crit, 0 disables the .parity sidecar
+    unsigned parityStripe = 8;            // .crit blocks per parity stripe
+    ReplicaSet* replicas = nullptr;       // copies of .crit streams under other roots, hedged reads; nullptr if disabled
+    unsigned noncritBudgetUs = 0;         // .noncrit reads of a readFile slower than this, or failing, read as zeros; 0 disables
+    const MountKey* critKey = nullptr;    // encrypts the .crit streams of files written from now on (see BlockCipher.h), nullptr if disabled
+    NoncritCodec noncritCodec = NoncritCodec::NONE; // compresses the .noncrit streams of files written from now on (see BlockCompressor.h)
+    DurabilityPolicy durability = DurabilityPolicy::STRICT;
+};
+
+StorageContext& getStorageContext();
+
+#endif // STORAGE_CONTEXT_H
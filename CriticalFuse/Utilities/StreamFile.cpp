@@ -0,0 +1,121 @@
+#include "StreamFile.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>     // For pread, pwrite
+
+StreamFile::StreamFile(int fd, uint64_t heldEnd) : fd(fd), heldEnd(heldEnd) {}
+
+bool StreamFile::read(char* buffer, size_t size, uint64_t offset) const {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t bytesRead = pread(fd, buffer + done, size - done, offset + done);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead < 0) {
+            std::perror("Failed to read stream file");
+            return false;
+        }
+        if (bytesRead == 0) {
+            break; // the rest has to be held
+        }
+        done += bytesRead;
+    }
+    std::fill(buffer + done, buffer + size, 0);
+
+    // Held writes win over the file; past its end they have to cover every byte
+    uint64_t end = offset + size;
+    uint64_t covered = offset + done;
+    auto it = held.upper_bound(offset);
+    if (it != held.begin()) {
+        --it;
+    }
+    for (; it != held.end() && it->first < end; ++it) {
+        uint64_t start = std::max(offset, it->first);
+        uint64_t stop = std::min<uint64_t>(end, it->first + it->second.size());
+        if (start >= stop) {
+            continue;
+        }
+        std::memcpy(buffer + (start - offset), it->second.data() + (start - it->first), stop - start);
+        if (start <= covered) {
+            covered = std::max(covered, stop);
+        }
+    }
+    if (covered < end) {
+        std::cerr << "Stream file ends at " << covered << ", before the " << size << " bytes read at " << offset
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool StreamFile::write(const char* data, size_t size, uint64_t offset) {
+    if (offset < heldEnd) {
+        size_t heldSize = static_cast<size_t>(std::min<uint64_t>(size, heldEnd - offset));
+        hold(data, heldSize, offset);
+        data += heldSize;
+        size -= heldSize;
+        offset += heldSize;
+    }
+    size_t written = 0;
+    while (written < size) {
+        ssize_t result = pwrite(fd, data + written, size - written, offset + written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result < 0) {
+            std::perror("Failed to write stream file");
+            return false;
+        }
+        written += result;
+    }
+    return true;
+}
+
+bool StreamFile::flush() {
+    for (const auto& [offset, bytes] : held) {
+        size_t written = 0;
+        while (written < bytes.size()) {
+            ssize_t result = pwrite(fd, bytes.data() + written, bytes.size() - written, offset + written);
+            if (result < 0 && errno == EINTR) {
+                continue;
+            }
+            if (result < 0) {
+                std::perror("Failed to write held bytes to stream file");
+                return false;
+            }
+            written += result;
+        }
+    }
+    held.clear();
+    return true;
+}
+
+void StreamFile::hold(const char* data, size_t size, uint64_t offset) {
+    if (size == 0) {
+        return;
+    }
+    // Merge with every held write it overlaps or touches
+    uint64_t start = offset;
+    uint64_t end = offset + size;
+    auto first = held.upper_bound(offset);
+    if (first != held.begin() && std::prev(first)->first + std::prev(first)->second.size() >= offset) {
+        --first;
+    }
+    auto last = first;
+    for (; last != held.end() && last->first <= end; ++last) {
+        start = std::min(start, last->first);
+        end = std::max<uint64_t>(end, last->first + last->second.size());
+    }
+    std::string bytes(end - start, '\0');
+    for (auto it = first; it != last; ++it) {
+        bytes.replace(it->first - start, it->second.size(), it->second);
+    }
+    bytes.replace(offset - start, size, data, size);
+    held.erase(first, last);
+    held.emplace(start, std::move(bytes));
+}
@@ -0,0 +1,58 @@
+#ifndef STREAM_FILE_H
+#define STREAM_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+/**
+ * A .crit or .noncrit stream file as the block codecs (BlockCipher, BlockCompressor,
+ * BlockChecksums) read and write it.
+ *
+ * Writes below heldEnd are held in memory instead of going to the file, and reads see them
+ * laid over the file. A tail rewrite holds the bytes the old mapping still refers to, so the
+ * old content stays readable until the new mapping is saved; the intent log holds every write
+ * and logs them as patches. Writes at or past heldEnd go straight to the file.
+ */
+class StreamFile {
+public:
+    // Holds every write, nothing reaches the file before flush
+    static const uint64_t HOLD_ALL = UINT64_MAX;
+
+    explicit StreamFile(int fd, uint64_t heldEnd = 0);
+    StreamFile(const StreamFile&) = delete;
+    StreamFile& operator=(const StreamFile&) = delete;
+
+    /**
+     * @brief Reads size bytes at offset, held writes laid over the file.
+     * @return false on an I/O error or if the file and the held writes end before offset + size
+     */
+    bool read(char* buffer, size_t size, uint64_t offset) const;
+
+    /**
+     * @brief Writes size bytes at offset, holding the part below heldEnd.
+     * @return false on an I/O error
+     */
+    bool write(const char* data, size_t size, uint64_t offset);
+
+    /**
+     * @brief Writes the held bytes to the file and stops holding them.
+     * @return false on an I/O error
+     */
+    bool flush();
+
+    // Held writes by offset; overlapping and adjacent writes are merged
+    const std::map<uint64_t, std::string>& heldWrites() const { return held; }
+
+    int descriptor() const { return fd; }
+
+private:
+    int fd;
+    uint64_t heldEnd;
+    std::map<uint64_t, std::string> held;
+
+    void hold(const char* data, size_t size, uint64_t offset);
+};
+
+#endif // STREAM_FILE_H
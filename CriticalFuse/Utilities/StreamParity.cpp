@@ -0,0 +1,245 @@
+#include "StreamParity.h"
+#include "Crc32c.h"
+#include "ReedSolomon.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>      // For open
+#include <unistd.h>     // For pread, pwrite, ftruncate
+
+namespace {
+
+const char MAGIC[8] = {'C', 'F', 'P', 'A', 'R', 'I', 'T', 'Y'};
+const size_t BLOCK_SIZE = BlockChecksums::BLOCK_SIZE;
+
+// Stripes read and encoded at a time when updating the parity
+const uint64_t UPDATE_STRIPES = 16;
+
+struct ParityHeader {
+    char magic[8];
+    uint32_t dataShards;
+    uint32_t parityShards;
+    uint32_t blockSize;
+    uint32_t reserved;
+    uint64_t streamLength;
+    uint32_t checksum; // CRC32C of the fields before it
+    uint32_t padding;
+};
+
+uint32_t headerChecksum(const ParityHeader& header) {
+    return crc32c(0, &header, offsetof(ParityHeader, checksum));
+}
+
+bool readHeader(int fd, ParityHeader& header) {
+    if (pread(fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+        return false;
+    }
+    return std::memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0 && header.checksum == headerChecksum(header) &&
+           header.blockSize == BLOCK_SIZE && header.dataShards > 0 && header.parityShards > 0 &&
+           header.dataShards + header.parityShards <= ReedSolomon::MAX_SHARDS;
+}
+
+bool writeAll(int fd, const void* data, size_t size, uint64_t offset) {
+    const char* bytes = static_cast<const char*>(data);
+    size_t written = 0;
+    while (written < size) {
+        ssize_t res = pwrite(fd, bytes + written, size - written, offset + written);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res < 0) {
+            return false;
+        }
+        written += res;
+    }
+    return true;
+}
+
+// Reads [offset, offset + size) of a stream of the given length, zeros past its end
+bool readStream(int fd, uint8_t* buffer, size_t size, uint64_t offset, uint64_t length) {
+    size_t available = offset < length ? static_cast<size_t>(std::min<uint64_t>(size, length - offset)) : 0;
+    std::memset(buffer + available, 0, size - available);
+    size_t done = 0;
+    while (done < available) {
+        ssize_t bytesRead = pread(fd, buffer + done, available - done, offset + done);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return false;
+        }
+        done += bytesRead;
+    }
+    return true;
+}
+
+} // namespace
+
+StreamParity::~StreamParity() {
+    if (fd >= 0) close(fd);
+}
+
+bool StreamParity::update(int streamFd, const std::string& parityPath, uint64_t from, uint64_t to, uint64_t length,
+                          unsigned dataShards, unsigned parityShards) {
+    if (dataShards == 0 || parityShards == 0) {
+        if (unlink(parityPath.c_str()) == -1 && errno != ENOENT) {
+            std::perror(("Failed to remove " + parityPath).c_str());
+            return false;
+        }
+        return true;
+    }
+    if (dataShards + parityShards > ReedSolomon::MAX_SHARDS) {
+        std::cerr << "Too many parity shards: " << dataShards << "+" << parityShards << std::endl;
+        return false;
+    }
+
+    int parityFd = ::open(parityPath.c_str(), O_RDWR | O_CREAT, 0644);
+    if (parityFd < 0) {
+        std::perror(("Failed to open " + parityPath).c_str());
+        return false;
+    }
+    ParityHeader header;
+    if (!readHeader(parityFd, header) || header.dataShards != dataShards || header.parityShards != parityShards) {
+        from = 0;
+        to = length;
+    } else if (header.streamLength != length) {
+        from = std::min(from, header.streamLength);
+        to = length;
+    }
+    to = std::min(to, length);
+
+    // Invalid until the parity matches the stream again
+    ParityHeader invalid = {};
+    bool ok = writeAll(parityFd, &invalid, sizeof(invalid), 0);
+
+    uint64_t stripeBytes = static_cast<uint64_t>(dataShards) * BLOCK_SIZE;
+    uint64_t stripes = (length + stripeBytes - 1) / stripeBytes;
+    uint64_t first = from / stripeBytes;
+    uint64_t last = from < to ? (to + stripeBytes - 1) / stripeBytes : first;
+    ReedSolomon code(dataShards, parityShards);
+    std::vector<uint8_t> data(std::min(UPDATE_STRIPES, last - first) * stripeBytes);
+    std::vector<uint8_t> parity(std::min(UPDATE_STRIPES, last - first) * parityShards * BLOCK_SIZE);
+    std::vector<const uint8_t*> dataPointers(dataShards);
+    std::vector<uint8_t*> parityPointers(parityShards);
+    for (uint64_t stripe = first; ok && stripe < last; stripe += UPDATE_STRIPES) {
+        uint64_t count = std::min(UPDATE_STRIPES, last - stripe);
+        if (!readStream(streamFd, data.data(), count * stripeBytes, stripe * stripeBytes, length)) {
+            std::perror("Failed to read stream for parity");
+            ok = false;
+            break;
+        }
+        for (uint64_t s = 0; s < count; ++s) {
+            for (unsigned j = 0; j < dataShards; ++j) {
+                dataPointers[j] = &data[(s * dataShards + j) * BLOCK_SIZE];
+            }
+            for (unsigned r = 0; r < parityShards; ++r) {
+                parityPointers[r] = &parity[(s * parityShards + r) * BLOCK_SIZE];
+            }
+            code.encode(dataPointers.data(), parityPointers.data(), BLOCK_SIZE);
+        }
+        if (!writeAll(parityFd, parity.data(), count * parityShards * BLOCK_SIZE,
+                      HEADER_SIZE + stripe * parityShards * BLOCK_SIZE)) {
+            std::perror(("Failed to write " + parityPath).c_str());
+            ok = false;
+        }
+    }
+    if (ok && ftruncate(parityFd, HEADER_SIZE + stripes * parityShards * BLOCK_SIZE) == -1) {
+        std::perror(("Failed to trim " + parityPath).c_str());
+        ok = false;
+    }
+
+    if (ok) {
+        header = {};
+        std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.dataShards = dataShards;
+        header.parityShards = parityShards;
+        header.blockSize = BLOCK_SIZE;
+        header.streamLength = length;
+        header.checksum = headerChecksum(header);
+        ok = writeAll(parityFd, &header, sizeof(header), 0);
+    }
+    close(parityFd);
+    return ok;
+}
+
+bool StreamParity::open(const char* parityPath) {
+    fd = ::open(parityPath, O_RDONLY);
+    ParityHeader header;
+    if (fd < 0 || !readHeader(fd, header)) {
+        return false;
+    }
+    dataShards = header.dataShards;
+    parityShards = header.parityShards;
+    streamLength = header.streamLength;
+    return true;
+}
+
+bool StreamParity::recover(int streamFd, const BlockChecksums& checksums, uint64_t index, char* out) const {
+    if (fd < 0 || parityShards == 0 || checksums.blockSize() != BLOCK_SIZE ||
+        checksums.streamLength() != streamLength || index * BLOCK_SIZE >= streamLength) {
+        return false;
+    }
+
+    // The whole stripe: data blocks past the end of the stream are the zeros they were encoded as
+    uint64_t stripe = index / dataShards;
+    unsigned total = dataShards + parityShards;
+    std::vector<uint8_t> shards(total * BLOCK_SIZE);
+    std::vector<uint8_t*> pointers(total);
+    std::vector<unsigned> lost;
+    auto blockLength = [this](uint64_t offset) {
+        return static_cast<size_t>(std::min<uint64_t>(BLOCK_SIZE, streamLength - offset));
+    };
+    for (unsigned j = 0; j < total; ++j) {
+        pointers[j] = &shards[j * BLOCK_SIZE];
+    }
+    for (unsigned j = 0; j < dataShards; ++j) {
+        uint64_t offset = (stripe * dataShards + j) * BLOCK_SIZE;
+        if (!readStream(streamFd, pointers[j], BLOCK_SIZE, offset, streamLength) ||
+            (offset < streamLength && !checksums.verify(offset, reinterpret_cast<char*>(pointers[j]), blockLength(offset)))) {
+            lost.push_back(j);
+        }
+    }
+    for (unsigned r = 0; r < parityShards; ++r) {
+        uint64_t offset = HEADER_SIZE + (stripe * parityShards + r) * BLOCK_SIZE;
+        if (!readStream(fd, pointers[dataShards + r], BLOCK_SIZE, offset, UINT64_MAX)) {
+            lost.push_back(dataShards + r);
+        }
+    }
+
+    // Parity blocks have no checksums: a corrupted one rebuilds blocks that fail theirs, so
+    // while spares are left each one is also left out in turn
+    ReedSolomon code(dataShards, parityShards);
+    for (int skipped = -1; skipped < static_cast<int>(parityShards); ++skipped) {
+        std::vector<unsigned> erased = lost;
+        if (skipped >= 0) {
+            unsigned shard = dataShards + skipped;
+            if (std::find(lost.begin(), lost.end(), shard) != lost.end()) {
+                continue;
+            }
+            erased.push_back(shard);
+        }
+        if (!code.reconstruct(pointers.data(), erased, BLOCK_SIZE)) {
+            continue;
+        }
+        bool verified = true;
+        for (unsigned j : erased) {
+            uint64_t offset = (stripe * dataShards + j) * BLOCK_SIZE;
+            if (j < dataShards && offset < streamLength &&
+                !checksums.verify(offset, reinterpret_cast<char*>(pointers[j]), blockLength(offset))) {
+                verified = false;
+                break;
+            }
+        }
+        if (verified) {
+            uint64_t offset = index * BLOCK_SIZE;
+            std::memcpy(out, pointers[index % dataShards], blockLength(offset));
+            return true;
+        }
+    }
+    return false;
+}
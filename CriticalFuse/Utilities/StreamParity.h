@@ -0,0 +1,68 @@
+#ifndef STREAM_PARITY_H
+#define STREAM_PARITY_H
+
+#include "BlockChecksums.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Reed-Solomon parity of a stream file, kept in a sidecar next to it (<base>.parity).
+ *
+ * The stream is cut into stripes of dataShards blocks of BlockChecksums::BLOCK_SIZE, each
+ * stripe gets parityShards parity blocks, and any parityShards blocks of a stripe that cannot
+ * be read or fail their checksums are rebuilt from the rest. The sidecar starts with a header
+ * recording the layout and the length of the stream its parity was computed for; the header
+ * is invalidated while the parity is being updated, so a crash mid-update leaves a sidecar
+ * that is ignored rather than one that rebuilds garbage.
+ */
+class StreamParity {
+public:
+    static const size_t HEADER_SIZE = 4096; // parity blocks start page aligned after it
+
+    StreamParity() = default;
+    StreamParity(const StreamParity&) = delete;
+    StreamParity& operator=(const StreamParity&) = delete;
+    ~StreamParity();
+
+    /**
+     * @brief Recomputes the parity of the stripes overlapping [from, to) of the stream after
+     * it was changed in place or grew to length. Stripes past the old length are always
+     * recomputed, and all of them if the sidecar is missing or has another layout. With no
+     * parity shards the sidecar is removed.
+     *
+     * @param fd the stream file, open for reading
+     * @return true if successful, false otherwise
+     */
+    static bool update(int fd, const std::string& parityPath, uint64_t from, uint64_t to, uint64_t length,
+                       unsigned dataShards, unsigned parityShards);
+
+    /**
+     * @brief Opens a sidecar and reads its header.
+     *
+     * @return true if it exists and is valid, false otherwise
+     */
+    bool open(const char* parityPath);
+
+    /**
+     * @brief Rebuilds block index of the stream from the other blocks of its stripe and the
+     * parity. Blocks that fail checksums are treated as lost, and so is each parity block in
+     * turn while spares are left, until the rebuilt block matches its checksum.
+     *
+     * @param fd the stream file, open for reading
+     * @param checksums the checksums of the stream, which must match the length the parity
+     * was computed for
+     * @param out receives the block, up to the end of the stream
+     * @return true if the block was rebuilt and verified, false otherwise
+     */
+    bool recover(int fd, const BlockChecksums& checksums, uint64_t index, char* out) const;
+
+private:
+    int fd = -1;
+    unsigned dataShards = 0;
+    unsigned parityShards = 0;
+    uint64_t streamLength = 0;
+};
+
+#endif // STREAM_PARITY_H
@@ -0,0 +1,32 @@
+#include "SyncCoalescer.h"
+
+bool SyncCoalescer::sync(const std::string& key, const std::function<bool()>& syncFn) {
+    std::unique_lock<std::mutex> lock(mutex);
+    State& state = states[key];
+    state.waiters++;
+
+    // A sync already running may have started before our writes, so we need the next one
+    uint64_t target = state.started + 1;
+    while (state.completed < target) {
+        if (state.running) {
+            finished.wait(lock);
+            continue;
+        }
+
+        state.running = true;
+        uint64_t generation = ++state.started;
+        lock.unlock();
+        bool result = syncFn();
+        lock.lock();
+        state.completed = generation;
+        state.lastResult = result;
+        state.running = false;
+        finished.notify_all();
+    }
+
+    bool result = state.lastResult;
+    if (--state.waiters == 0) {
+        states.erase(key);
+    }
+    return result;
+}
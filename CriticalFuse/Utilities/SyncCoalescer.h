@@ -0,0 +1,47 @@
+#ifndef SYNC_COALESCER_H
+#define SYNC_COALESCER_H
+
+#include <string>
+#include <unordered_map>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+/**
+ * Coalesces concurrent sync requests on the same key.
+ *
+ * A caller needs a sync that starts after it arrived. Callers that arrive while a sync of the
+ * key is already running wait for it to finish and then share a single follow-up sync, so N
+ * concurrent fsyncs of one file cost at most two rounds of syncing instead of N.
+ */
+class SyncCoalescer {
+public:
+    SyncCoalescer() = default;
+    SyncCoalescer(const SyncCoalescer&) = delete;
+    SyncCoalescer& operator=(const SyncCoalescer&) = delete;
+
+    /**
+     * @brief Runs syncFn for key, or waits for a run that started after this call and shares its result.
+     *
+     * @param key identifies what is being synced (e.g. the backing base path)
+     * @param syncFn performs the sync, returns true on success
+     * @return bool result of the sync that covered this call
+     */
+    bool sync(const std::string& key, const std::function<bool()>& syncFn);
+
+private:
+    struct State {
+        uint64_t started = 0;   // generations started so far
+        uint64_t completed = 0; // last generation that finished
+        bool running = false;
+        bool lastResult = true;
+        unsigned waiters = 0;
+    };
+
+    std::mutex mutex;
+    std::condition_variable finished;
+    std::unordered_map<std::string, State> states;
+};
+
+#endif // SYNC_COALESCER_H
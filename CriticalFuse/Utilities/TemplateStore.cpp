@@ -0,0 +1,111 @@
+#include "TemplateStore.h"
+
+#include <iostream>
+#include <cstdio>
+#include <cerrno>
+#include <fcntl.h>      // For open
+#include <unistd.h>     // For write, fsync, close
+#include <sys/stat.h>   // For mkdir, fstat
+#include <sys/syscall.h>
+
+TemplateStore::TemplateStore(const std::string& rootDir) : templateDir(rootDir + "/.templates") {}
+
+bool TemplateStore::open() {
+    if (mkdir(templateDir.c_str(), 0755) == -1 && errno != EEXIST) {
+        std::perror("Failed to create template directory");
+        return false;
+    }
+    return true;
+}
+
+uint64_t TemplateStore::templateId(std::string_view contents) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : contents) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+std::string TemplateStore::templatePath(uint64_t id) const {
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(id));
+    return templateDir + "/" + name;
+}
+
+bool TemplateStore::put(std::string_view contents, uint64_t& id) {
+    id = templateId(contents);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (known.count(id)) {
+            return true;
+        }
+    }
+
+    // Written by an earlier run (or a concurrent put): reuse it only if it really is the same list
+    std::string path = templatePath(id);
+    std::string existing;
+    if (get(id, existing)) {
+        if (existing != contents) {
+            std::cerr << "Template id collision for " << path << std::endl;
+            return false;
+        }
+    } else {
+        // Written under a private name and renamed in, so readers never see a partial template
+        std::string tempPath = path + ".tmp" + std::to_string(syscall(SYS_gettid));
+        int fd = ::open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            std::perror("Failed to create template");
+            return false;
+        }
+        size_t written = 0;
+        while (written < contents.size()) {
+            ssize_t res = write(fd, contents.data() + written, contents.size() - written);
+            if (res < 0 && errno == EINTR) {
+                continue;
+            }
+            if (res <= 0) {
+                break;
+            }
+            written += res;
+        }
+        // The mapping files referring to it may be synced right after, so it has to be durable first
+        bool ok = written == contents.size() && fsync(fd) == 0;
+        close(fd);
+        if (!ok || rename(tempPath.c_str(), path.c_str()) == -1) {
+            std::perror("Failed to write template");
+            unlink(tempPath.c_str());
+            return false;
+        }
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    known.insert(id);
+    return true;
+}
+
+bool TemplateStore::get(uint64_t id, std::string& contents) const {
+    int fd = ::open(templatePath(id).c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    contents.resize(st.st_size);
+    size_t loaded = 0;
+    while (loaded < contents.size()) {
+        ssize_t res = pread(fd, &contents[loaded], contents.size() - loaded, loaded);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            break;
+        }
+        loaded += res;
+    }
+    close(fd);
+    return loaded == contents.size();
+}
@@ -0,0 +1,63 @@
+#ifndef TEMPLATE_STORE_H
+#define TEMPLATE_STORE_H
+
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <mutex>
+#include <cstdint>
+
+/**
+ * Content-addressed store for the extent lists of mappings that many files share, e.g. every
+ * BMP a camera writes at one resolution.
+ *
+ * Each distinct list is written once to <root>/.templates/<id>, where id is the 64-bit FNV-1a
+ * hash of its bytes in hex, and mapping files refer to it by id instead of repeating it.
+ * Templates are immutable and never removed; only handlers whose layouts repeat across files
+ * use them, so their number follows the number of distinct layouts.
+ */
+class TemplateStore {
+public:
+    /**
+     * @param rootDir backing directory the .templates directory is created in
+     */
+    explicit TemplateStore(const std::string& rootDir);
+    TemplateStore(const TemplateStore&) = delete;
+    TemplateStore& operator=(const TemplateStore&) = delete;
+
+    /**
+     * @brief Creates the template directory.
+     * @return true if successful, false otherwise
+     */
+    bool open();
+
+    /**
+     * @brief Stores contents (durably) unless an identical template exists already.
+     *
+     * @param contents the extent lines
+     * @param id set to the template's id
+     * @return false if writing failed or another template has the same id
+     */
+    bool put(std::string_view contents, uint64_t& id);
+
+    /**
+     * @brief Reads the template with the given id.
+     * @return true if successful, false otherwise
+     */
+    bool get(uint64_t id, std::string& contents) const;
+
+    /**
+     * @brief Hash templates are named by.
+     */
+    static uint64_t templateId(std::string_view contents);
+
+private:
+    std::string templateDir;
+
+    std::mutex mutex;
+    std::unordered_set<uint64_t> known; // ids written or verified since open
+
+    std::string templatePath(uint64_t id) const;
+};
+
+#endif // TEMPLATE_STORE_H
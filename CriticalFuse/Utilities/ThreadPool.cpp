@@ -0,0 +1,77 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+ThreadPool::ThreadPool(unsigned workerCount) {
+    for (unsigned i = 0; i < workerCount; ++i) {
+        workers.emplace_back([this]() { workerMain(); });
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    work.notify_all();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+unsigned ThreadPool::concurrency() const {
+    return static_cast<unsigned>(workers.size()) + 1;
+}
+
+size_t ThreadPool::claim(Loop& loop) {
+    size_t index = loop.next++;
+    if (loop.next == loop.count) {
+        loops.erase(std::find(loops.begin(), loops.end(), &loop));
+    }
+    return index;
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 0) {
+        return;
+    }
+    if (count == 1 || workers.empty()) {
+        for (size_t i = 0; i < count; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    Loop loop{&task, count};
+    std::unique_lock<std::mutex> lock(mutex);
+    loops.push_back(&loop);
+    work.notify_all();
+
+    while (loop.next < loop.count) {
+        size_t index = claim(loop);
+        lock.unlock();
+        task(index);
+        lock.lock();
+        loop.finished++;
+    }
+    // The loop lives on this stack, so wait for the iterations the workers took
+    progress.wait(lock, [&loop]() { return loop.finished == loop.count; });
+}
+
+void ThreadPool::workerMain() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        work.wait(lock, [this]() { return stopping || !loops.empty(); });
+        if (loops.empty()) {
+            return; // stopping
+        }
+        Loop& loop = *loops.front();
+        size_t index = claim(loop);
+        lock.unlock();
+        (*loop.task)(index);
+        lock.lock();
+        if (++loop.finished == loop.count) {
+            progress.notify_all();
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstddef>
+
+/**
+ * Fixed set of worker threads that run the pieces of a parallel loop.
+ *
+ * The thread calling parallelFor works on its own loop too, so concurrent callers (one per
+ * FUSE request) always make progress even when every worker is busy with someone else's loop.
+ */
+class ThreadPool {
+public:
+    /**
+     * @param workerCount number of threads besides the callers, 0 runs every loop inline
+     */
+    explicit ThreadPool(unsigned workerCount);
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool(); // waits for the workers to finish their current task
+
+    /**
+     * @brief Number of threads a loop can run on, the caller included.
+     */
+    unsigned concurrency() const;
+
+    /**
+     * @brief Runs task(0) ... task(count - 1), possibly concurrently, and returns once all of them finished.
+     *
+     * @param count number of iterations
+     * @param task the loop body, called with the iteration index
+     */
+    void parallelFor(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    struct Loop {
+        const std::function<void(size_t)>* task;
+        size_t count;
+        size_t next = 0;     // next iteration to hand out
+        size_t finished = 0; // iterations completed
+    };
+
+    std::mutex mutex;
+    std::condition_variable work;     // a loop was queued or the pool is stopping
+    std::condition_variable progress; // an iteration finished
+    std::deque<Loop*> loops;          // loops with iterations left to hand out
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    // Hands out the next iteration of loop and drops it from the queue once all are handed out
+    size_t claim(Loop& loop);
+    void workerMain();
+};
+
+#endif // THREAD_POOL_H
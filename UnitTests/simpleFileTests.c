@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // fallocate, copy_file_range, SEEK_DATA
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,6 +11,11 @@
 #define MOUNT_DIR "./mnt"
 #define TEST_FILE MOUNT_DIR "/testfile.txt"
 #define TEST_TEXT "Hello, FUSE!"
+#define SPLIT_FILE MOUNT_DIR "/split.txt"
+#define PLAIN_FILE MOUNT_DIR "/plainfile"
+#define CLONE_FILE MOUNT_DIR "/clone.txt"
+#define COPY_FILE MOUNT_DIR "/copy.txt"
+#define COPY_SIZE (256 * 1024)
 
 void test_create_write_read() {
     int fd = open(TEST_FILE, O_CREAT | O_WRONLY, 0644);
@@ -50,11 +56,159 @@ void test_mkdir_rmdir() {
     printf("[PASS] mkdir, rmdir\n");
 }
 
+void read_back(const char *path, const char *expected, size_t size) {
+    char *buf = malloc(size + 1);
+    assert(buf);
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    size_t done = 0;
+    ssize_t n;
+    while ((n = pread(fd, buf + done, size + 1 - done, done)) > 0) {
+        done += n;
+    }
+    assert(n == 0 && done == size);
+    assert(memcmp(buf, expected, size) == 0);
+    close(fd);
+    free(buf);
+}
+
+void test_fsync_flush() {
+    // A split file (.txt) has its streams synced, a plain one its backing file
+    const char *paths[] = {SPLIT_FILE, PLAIN_FILE};
+    for (int i = 0; i < 2; ++i) {
+        int fd = open(paths[i], O_CREAT | O_RDWR, 0644);
+        assert(fd >= 0);
+        assert(write(fd, TEST_TEXT, strlen(TEST_TEXT)) == (ssize_t)strlen(TEST_TEXT));
+        assert(fsync(fd) == 0);
+        assert(fdatasync(fd) == 0);
+        // flush runs on every close of a descriptor, the file stays open through the first
+        int copy = dup(fd);
+        assert(copy >= 0 && close(copy) == 0);
+        assert(fsync(fd) == 0);
+        assert(close(fd) == 0);
+        read_back(paths[i], TEST_TEXT, strlen(TEST_TEXT));
+        assert(unlink(paths[i]) == 0);
+    }
+    printf("[PASS] fsync, fdatasync, flush\n");
+}
+
+void test_fallocate() {
+    // Allocating past the end of a split file grows it with zeros, KEEP_SIZE only reserves room
+    char expected[8192] = {0};
+    memcpy(expected, TEST_TEXT, strlen(TEST_TEXT));
+    int fd = open(SPLIT_FILE, O_CREAT | O_RDWR, 0644);
+    assert(fd >= 0);
+    assert(write(fd, TEST_TEXT, strlen(TEST_TEXT)) == (ssize_t)strlen(TEST_TEXT));
+    assert(fallocate(fd, 0, 0, sizeof(expected)) == 0);
+    struct stat st;
+    assert(fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(expected));
+    assert(fallocate(fd, FALLOC_FL_KEEP_SIZE, sizeof(expected), 65536) == 0);
+    assert(fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(expected));
+
+    // Punching holes would shift bytes between the streams of a split file
+    assert(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, 4096) == -1 && errno == EOPNOTSUPP);
+    close(fd);
+    read_back(SPLIT_FILE, expected, sizeof(expected));
+    assert(unlink(SPLIT_FILE) == 0);
+
+    // A plain file gets every mode from its backing file
+    memset(expected, 'x', sizeof(expected));
+    fd = open(PLAIN_FILE, O_CREAT | O_RDWR, 0644);
+    assert(fd >= 0);
+    assert(write(fd, expected, sizeof(expected)) == (ssize_t)sizeof(expected));
+    assert(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, 4096) == 0);
+    assert(fallocate(fd, FALLOC_FL_KEEP_SIZE, sizeof(expected), 65536) == 0);
+    assert(fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(expected));
+    close(fd);
+    memset(expected, 0, 4096);
+    read_back(PLAIN_FILE, expected, sizeof(expected));
+    assert(unlink(PLAIN_FILE) == 0);
+    printf("[PASS] fallocate, KEEP_SIZE, PUNCH_HOLE\n");
+}
+
+// Copies size bytes from offset in of one file to offset out of another, in as many calls as it takes
+void copy_range(const char *from, off_t in, const char *to, off_t out, size_t size) {
+    int fdIn = open(from, O_RDONLY);
+    int fdOut = open(to, O_CREAT | O_WRONLY, 0644);
+    assert(fdIn >= 0 && fdOut >= 0);
+    while (size > 0) {
+        ssize_t copied = copy_file_range(fdIn, &in, fdOut, &out, size, 0);
+        assert(copied > 0);
+        size -= copied;
+    }
+    close(fdIn);
+    close(fdOut);
+}
+
+void test_copy_file_range() {
+    char *data = malloc(COPY_SIZE);
+    assert(data);
+    for (size_t i = 0; i < COPY_SIZE; ++i) {
+        data[i] = 'a' + (i * 7 + i / 4096) % 26;
+    }
+    int fd = open(SPLIT_FILE, O_CREAT | O_WRONLY, 0644);
+    assert(fd >= 0);
+    assert(write(fd, data, COPY_SIZE) == COPY_SIZE);
+    close(fd);
+
+    // The whole file into a new one of the same type clones the streams
+    copy_range(SPLIT_FILE, 0, CLONE_FILE, 0, COPY_SIZE);
+    read_back(CLONE_FILE, data, COPY_SIZE);
+
+    // From an offset it is read and split again, chunk by chunk
+    copy_range(SPLIT_FILE, 100, COPY_FILE, 0, COPY_SIZE - 100);
+    read_back(COPY_FILE, data + 100, COPY_SIZE - 100);
+
+    assert(unlink(SPLIT_FILE) == 0);
+    assert(unlink(CLONE_FILE) == 0);
+    assert(unlink(COPY_FILE) == 0);
+    free(data);
+    printf("[PASS] copy_file_range, cloned and chunked\n");
+}
+
+void test_seek_data_hole() {
+    // Zero blocks of a split file are holes in its mapping: data, two hole blocks, data
+    char data[4 * 4096] = {0};
+    memset(data, 'a', 4096);
+    memset(data + 3 * 4096, 'b', 4096);
+    int fd = open(SPLIT_FILE, O_CREAT | O_RDWR, 0644);
+    assert(fd >= 0);
+    assert(write(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+    assert(lseek(fd, 0, SEEK_DATA) == 0);
+    assert(lseek(fd, 0, SEEK_HOLE) == 4096);
+    assert(lseek(fd, 4096, SEEK_DATA) == 3 * 4096);
+    assert(lseek(fd, 5000, SEEK_DATA) == 3 * 4096);
+    assert(lseek(fd, 5000, SEEK_HOLE) == 5000);
+    // The end of the file counts as a hole, past it there is nothing to seek to
+    assert(lseek(fd, 3 * 4096, SEEK_HOLE) == sizeof(data));
+    assert(lseek(fd, sizeof(data), SEEK_DATA) == -1 && errno == ENXIO);
+    close(fd);
+    read_back(SPLIT_FILE, data, sizeof(data));
+    assert(unlink(SPLIT_FILE) == 0);
+
+    // A file that starts with a hole: SEEK_DATA lands on its first stored byte
+    memset(data, 0, sizeof(data));
+    memset(data + 2 * 4096, 'c', 2 * 4096);
+    fd = open(SPLIT_FILE, O_CREAT | O_RDWR, 0644);
+    assert(fd >= 0);
+    assert(write(fd, data, sizeof(data)) == (ssize_t)sizeof(data));
+    assert(lseek(fd, 0, SEEK_DATA) == 2 * 4096);
+    assert(lseek(fd, 0, SEEK_HOLE) == 0);
+    close(fd);
+    read_back(SPLIT_FILE, data, sizeof(data));
+    assert(unlink(SPLIT_FILE) == 0);
+    printf("[PASS] SEEK_DATA, SEEK_HOLE\n");
+}
+
 int main() {
     printf("Running FUSE functional tests on mount: %s\n", MOUNT_DIR);
     test_create_write_read();
     test_unlink();
     test_mkdir_rmdir();
+    test_fsync_flush();
+    test_fallocate();
+    test_copy_file_range();
+    test_seek_data_hole();
     printf("All tests passed!\n");
     return 0;
 }